@@ -56,6 +56,7 @@
 #include "openmm/PeriodicTorsionForce.h"
 #include "openmm/RBTorsionForce.h"
 #include "openmm/NonbondedForce.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/System.h"
 #include "openmm/VariableLangevinIntegrator.h"
 #include "openmm/VariableVerletIntegrator.h"
@@ -67,6 +68,8 @@
 
 namespace OpenMM {
 
+class ThreadPool;
+
 /**
  * This kernel is invoked at the beginning and end of force and energy computations.  It gives the
  * Platform a chance to clear buffers and do other initialization at the beginning, and to do any
@@ -110,6 +113,26 @@ public:
      * energy directly, <i>or</i> add it to an internal buffer so that it will be included here.
      */
     virtual double finishComputation(ContextImpl& context, bool includeForce, bool includeEnergy, int groups, bool& valid) = 0;
+    /**
+     * Set whether subsequent force computations should also compute the virial tensor.  Platforms that
+     * cannot compute it throw an exception if include is true.
+     *
+     * @param include       true if the virial should be computed
+     */
+    virtual void setIncludeVirial(bool include) {
+        if (include)
+            throw OpenMMException("This platform does not support computing the virial");
+    }
+    /**
+     * Get the virial tensor computed by the most recent force computation.  This is only valid if
+     * setIncludeVirial(true) was called before it.
+     *
+     * @param context       the context in which to execute this kernel
+     * @param virial        on exit, this contains the three rows of the virial tensor
+     */
+    virtual void getVirial(ContextImpl& context, Vec3* virial) {
+        throw OpenMMException("This platform does not support computing the virial");
+    }
 };
 
 /**
@@ -1230,6 +1253,45 @@ public:
      * @param alpha        the Ewald blending parameter
      */
     virtual void initialize(int gridx, int gridy, int gridz, int numParticles, double alpha) = 0;
+    /**
+     * Request that the kernel perform its calculations on an existing ThreadPool, rather than
+     * creating its own threads.  If used, this must be called before initialize().  Implementations
+     * that do not use a ThreadPool may ignore it.
+     *
+     * @param threads   the ThreadPool to use
+     */
+    virtual void setThreadPool(ThreadPool& threads) {
+    }
+    /**
+     * Set the order of the B-splines used to interpolate charges onto the grid.  If used, this must be
+     * called before initialize().  The default is 5, and implementations that support no other
+     * order throw an exception if asked for one.
+     *
+     * @param order    the interpolation order
+     */
+    virtual void setInterpolationOrder(int order) {
+        if (order != 5)
+            throw OpenMMException("This implementation of PME only supports interpolation order 5");
+    }
+    /**
+     * Set whether subsequent computations should also compute the reciprocal space contribution to the
+     * virial tensor.  Implementations that cannot compute it throw an exception if include is true.
+     *
+     * @param include    true if the virial should be computed
+     */
+    virtual void setIncludeVirial(bool include) {
+        if (include)
+            throw OpenMMException("This implementation of PME does not support computing the virial");
+    }
+    /**
+     * Get the reciprocal space contribution to the virial tensor from the most recent computation.  This
+     * is only valid after finishComputation() has been called with the virial enabled.
+     *
+     * @param virial     on exit, this contains the three rows of the virial tensor
+     */
+    virtual void getVirial(Vec3* virial) {
+        throw OpenMMException("This implementation of PME does not support computing the virial");
+    }
     /**
      * Begin computing the force and energy.
      *
@@ -58,7 +58,7 @@ public:
      * This is an enumeration of the types of data which may be stored in a State.  When you create
      * a State, use these values to specify which data types it should contain.
      */
-    enum DataType {Positions=1, Velocities=2, Forces=4, Energy=8, Parameters=16};
+    enum DataType {Positions=1, Velocities=2, Forces=4, Energy=8, Parameters=16, Virial=32};
     /**
      * Construct an empty State containing no data.  This exists so State objects can be used in STL containers.
      */
@@ -104,6 +104,18 @@ public:
      * Get the volume of the periodic box (measured in nm^3).
      */
     double getPeriodicBoxVolume() const;
+    /**
+     * Get the virial tensor W = sum(r<sub>i</sub> f<sub>i</sub><sup>T</sup>) of the potential energy (measured in kJ/mol),
+     * with periodic interactions summed over pairs of particles so it is independent of where particles
+     * lie in the box.  Each component is W<sub>ij</sub> = -dU/d&epsilon;<sub>ij</sub> where &epsilon; is a strain applied to
+     * the box and particle positions.  The pressure tensor is (sum(m v v<sup>T</sup>) + W)/V.  Contributions from
+     * constraint forces are not included.  If this State does not contain the virial, this will throw an exception.
+     *
+     * @param x      on exit, this contains the first row of the virial tensor
+     * @param y      on exit, this contains the second row of the virial tensor
+     * @param z      on exit, this contains the third row of the virial tensor
+     */
+    void getVirial(Vec3& x, Vec3& y, Vec3& z) const;
     /**
      * Get a map containing the values of all parameters.  If this State does not contain parameters, this will throw an exception.
      */
@@ -120,12 +132,14 @@ private:
     void setParameters(const std::map<std::string, double>& params);
     void setEnergy(double ke, double pe);
     void setPeriodicBoxVectors(const Vec3& a, const Vec3& b, const Vec3& c);
+    void setVirial(const Vec3& x, const Vec3& y, const Vec3& z);
     int types;
     double time, ke, pe;
     std::vector<Vec3> positions;
     std::vector<Vec3> velocities;
     std::vector<Vec3> forces;
     Vec3 periodicBoxVectors[3];
+    Vec3 virial[3];
     std::map<std::string, double> parameters;
 };
 
@@ -144,6 +158,7 @@ public:
     void setParameters(const std::map<std::string, double>& params);
     void setEnergy(double ke, double pe);
     void setPeriodicBoxVectors(const Vec3& a, const Vec3& b, const Vec3& c);
+    void setVirial(const Vec3& x, const Vec3& y, const Vec3& z);
 private:
     State state;
 };
@@ -188,9 +188,11 @@ public:
      * @param includeEnergy  true if the energy should be calculated
      * @param groups         a set of bit flags for which force groups to include.  Group i will be included
      *                       if (groups&(1<<i)) != 0.  The default value includes all groups.
+     * @param virial         if not NULL, the virial tensor is also computed and stored in this array of three rows.
+     *                       This requires forces to be computed, so includeForces is ignored.
      * @return the potential energy of the system, or 0 if includeEnergy is false
      */
-    double calcForcesAndEnergy(bool includeForces, bool includeEnergy, int groups=0xFFFFFFFF);
+    double calcForcesAndEnergy(bool includeForces, bool includeEnergy, int groups=0xFFFFFFFF, Vec3* virial=NULL);
     /**
      * Get the set of force group flags that were passed to the most recent call to calcForcesAndEnergy().
      */
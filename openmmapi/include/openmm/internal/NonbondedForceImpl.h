@@ -71,9 +71,17 @@ public:
     static void calcEwaldParameters(const System& system, const NonbondedForce& force, double& alpha, int& kmaxx, int& kmaxy, int& kmaxz);
     /**
      * This is a utility routine that calculates the values to use for alpha and grid size when using
-     * Particle Mesh Ewald.
+     * Particle Mesh Ewald.  The grid size depends on the order of the B-splines used to interpolate
+     * charges onto it: higher orders are more accurate, so they can achieve the same error with a
+     * coarser grid.
      */
-    static void calcPMEParameters(const System& system, const NonbondedForce& force, double& alpha, int& xsize, int& ysize, int& zsize);
+    static void calcPMEParameters(const System& system, const NonbondedForce& force, double& alpha, int& xsize, int& ysize, int& zsize, int order=5);
+    /**
+     * This is a utility routine that calculates the values to use for alpha and grid size when using
+     * Particle Mesh Ewald with a specified cutoff, error tolerance, and periodic box.  It ignores any
+     * parameters that have been set explicitly on a NonbondedForce.
+     */
+    static void calcPMEParameters(double cutoff, double tolerance, const Vec3* boxVectors, int order, double& alpha, int& xsize, int& ysize, int& zsize);
     /**
      * Compute the coefficient which, when divided by the periodic box volume, gives the
      * long range dispersion correction to the energy.
@@ -48,10 +48,24 @@ namespace OpenMM {
  * next syncThreads(), and the final call waits until they exit from the Task's execute() method.
  * After calling waitForThreads() to block at a synchronization point, the parent thread should
  * call resumeThreads() to instruct the worker threads to resume.
+ *
+ * Alternatively, call parallelFor() to process a range of indices in chunks.  Each thread starts with
+ * a contiguous share of the chunks, and once it finishes them it steals chunks from the other threads.
+ * This keeps all threads busy when the cost of different chunks varies.
+ *
+ * By default, a thread waiting at a synchronization point blocks immediately.  When tasks are very
+ * short, the time needed to wake the threads up again can exceed the time spent doing work.  Calling
+ * setSpinCount() makes waiting threads poll for a limited time before they block, which reduces the
+ * latency at the cost of keeping the cores busy while waiting.
+ *
+ * A ThreadPool may be shared by several parent threads.  execute() blocks until any Task started
+ * by another parent thread has finished, so Tasks from different parent threads take turns using
+ * the worker threads.
  */
 class OPENMM_EXPORT ThreadPool {
 public:
     class Task;
+    class RangeTask;
     class ThreadData;
     /**
      * Create a ThreadPool.
@@ -66,7 +80,26 @@ public:
      */
     int getNumThreads() const;
     /**
-     * Execute a Task in parallel on the worker threads.
+     * Get the number of times a waiting thread polls before it blocks.
+     */
+    int getSpinCount() const;
+    /**
+     * Set the number of times a waiting thread polls to see whether it may continue before it blocks.
+     * If this is 0 (the default), threads block immediately.  This must only be called when no Task
+     * is running.
+     */
+    void setSpinCount(int count);
+    /**
+     * Restrict each worker thread to run on a single logical CPU core.  Thread i is pinned to
+     * cores[i%cores.size()].  This is only supported on Linux.
+     *
+     * @param cores  the indices of the cores to pin the threads to
+     * @return true if the affinity was set successfully, false if it could not be set
+     */
+    bool setAffinity(const std::vector<int>& cores);
+    /**
+     * Execute a Task in parallel on the worker threads.  If another thread is currently running a Task,
+     * this blocks until it has finished.
      */
     void execute(Task& task);
     /**
@@ -83,13 +116,37 @@ public:
      * Instruct the threads to resume running after blocking at a synchronization point.
      */
     void resumeThreads();
+    /**
+     * Execute a RangeTask in parallel over the indices from start to end (exclusive), and block until
+     * it has finished.  The range is divided into chunks of chunkSize indices, and the task is invoked
+     * once for each chunk.  This must not be called by the worker threads.
+     *
+     * @param task       the task to execute
+     * @param start      the first index to process
+     * @param end        the index after the last one to process
+     * @param chunkSize  the number of indices in each chunk
+     */
+    void parallelFor(RangeTask& task, int start, int end, int chunkSize=1);
 private:
-    bool isDeleted;
-    int numThreads, waitCount;
+    class ParallelForTask;
+    /**
+     * Wait until no other thread is using the pool, and take ownership of it.  This does nothing if the
+     * calling thread already owns it.
+     */
+    void acquire();
+    /**
+     * Get the next chunk for a thread to process during parallelFor(), first from its own share and
+     * then by stealing from the end of other threads' shares.  Returns false when none are left.
+     */
+    bool takeChunk(int threadIndex, int& chunk);
+    bool isDeleted, isRunning;
+    int numThreads, spinCount;
+    volatile int waitCount, generation;
     std::vector<pthread_t> thread;
     std::vector<ThreadData*> threadData;
+    pthread_t runningThread;
     pthread_cond_t startCondition, endCondition;
-    pthread_mutex_t lock;
+    pthread_mutex_t lock, executeLock;
 };
 
 /**
@@ -106,6 +163,22 @@ public:
     virtual void execute(ThreadPool& pool, int threadIndex) = 0;
 };
 
+/**
+ * This defines a task that processes a range of indices.  It is executed by parallelFor().
+ */
+class OPENMM_EXPORT ThreadPool::RangeTask {
+public:
+    /**
+     * Process one chunk of the range.
+     * 
+     * @param pool         the ThreadPool being used to execute the task
+     * @param threadIndex  the index of the thread invoking this method
+     * @param start        the first index to process
+     * @param end          the index after the last one to process
+     */
+    virtual void execute(ThreadPool& pool, int threadIndex, int start, int end) = 0;
+};
+
 } // namespace OpenMM
 
 #endif // OPENMM_THREAD_POOL_H_
@@ -84,8 +84,12 @@ State Context::getState(int types, bool enforcePeriodicBox, int groups) const {
     builder.setPeriodicBoxVectors(periodicBoxSize[0], periodicBoxSize[1], periodicBoxSize[2]);
     bool includeForces = types&State::Forces;
     bool includeEnergy = types&State::Energy;
-    if (includeForces || includeEnergy) {
-        double energy = impl->calcForcesAndEnergy(includeForces || includeEnergy, includeEnergy, groups);
+    bool includeVirial = types&State::Virial;
+    if (includeForces || includeEnergy || includeVirial) {
+        Vec3 virial[3];
+        double energy = impl->calcForcesAndEnergy(includeForces || includeEnergy, includeEnergy, groups, includeVirial ? virial : NULL);
+        if (includeVirial)
+            builder.setVirial(virial[0], virial[1], virial[2]);
         if (includeEnergy)
             builder.setEnergy(impl->calcKineticEnergy(), energy);
         if (includeForces) {
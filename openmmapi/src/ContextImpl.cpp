@@ -255,20 +255,36 @@ void ContextImpl::computeVirtualSites() {
     virtualSitesKernel.getAs<VirtualSitesKernel>().computePositions(*this);
 }
 
-double ContextImpl::calcForcesAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+double ContextImpl::calcForcesAndEnergy(bool includeForces, bool includeEnergy, int groups, Vec3* virial) {
     if (!hasSetPositions)
         throw OpenMMException("Particle positions have not been set");
     lastForceGroups = groups;
     CalcForcesAndEnergyKernel& kernel = initializeForcesKernel.getAs<CalcForcesAndEnergyKernel>();
-    while (true) {
-        double energy = 0.0;
-        kernel.beginComputation(*this, includeForces, includeEnergy, groups);
-        for (int i = 0; i < (int) forceImpls.size(); ++i)
-            energy += forceImpls[i]->calcForcesAndEnergy(*this, includeForces, includeEnergy, groups);
-        bool valid = true;
-        energy += kernel.finishComputation(*this, includeForces, includeEnergy, groups, valid);
-        if (valid)
-            return energy;
+    if (virial != NULL) {
+        kernel.setIncludeVirial(true);
+        includeForces = true;
+    }
+    try {
+        while (true) {
+            double energy = 0.0;
+            kernel.beginComputation(*this, includeForces, includeEnergy, groups);
+            for (int i = 0; i < (int) forceImpls.size(); ++i)
+                energy += forceImpls[i]->calcForcesAndEnergy(*this, includeForces, includeEnergy, groups);
+            bool valid = true;
+            energy += kernel.finishComputation(*this, includeForces, includeEnergy, groups, valid);
+            if (valid) {
+                if (virial != NULL) {
+                    kernel.getVirial(*this, virial);
+                    kernel.setIncludeVirial(false);
+                }
+                return energy;
+            }
+        }
+    }
+    catch (...) {
+        if (virial != NULL)
+            kernel.setIncludeVirial(false);
+        throw;
     }
 }
 
@@ -151,22 +151,26 @@ void NonbondedForceImpl::calcEwaldParameters(const System& system, const Nonbond
         kmaxz++;
 }
 
-void NonbondedForceImpl::calcPMEParameters(const System& system, const NonbondedForce& force, double& alpha, int& xsize, int& ysize, int& zsize) {
+void NonbondedForceImpl::calcPMEParameters(const System& system, const NonbondedForce& force, double& alpha, int& xsize, int& ysize, int& zsize, int order) {
     force.getPMEParameters(alpha, xsize, ysize, zsize);
     if (alpha == 0.0) {
         Vec3 boxVectors[3];
         system.getDefaultPeriodicBoxVectors(boxVectors[0], boxVectors[1], boxVectors[2]);
-        double tol = force.getEwaldErrorTolerance();
-        alpha = (1.0/force.getCutoffDistance())*std::sqrt(-log(2.0*tol));
-        xsize = (int) ceil(2*alpha*boxVectors[0][0]/(3*pow(tol, 0.2)));
-        ysize = (int) ceil(2*alpha*boxVectors[1][1]/(3*pow(tol, 0.2)));
-        zsize = (int) ceil(2*alpha*boxVectors[2][2]/(3*pow(tol, 0.2)));
-        xsize = max(xsize, 5);
-        ysize = max(ysize, 5);
-        zsize = max(zsize, 5);
+        calcPMEParameters(force.getCutoffDistance(), force.getEwaldErrorTolerance(), boxVectors, order, alpha, xsize, ysize, zsize);
     }
 }
 
+void NonbondedForceImpl::calcPMEParameters(double cutoff, double tolerance, const Vec3* boxVectors, int order, double& alpha, int& xsize, int& ysize, int& zsize) {
+    alpha = (1.0/cutoff)*std::sqrt(-log(2.0*tolerance));
+    double root = pow(tolerance, 1.0/order);
+    xsize = (int) ceil(2*alpha*boxVectors[0][0]/(3*root));
+    ysize = (int) ceil(2*alpha*boxVectors[1][1]/(3*root));
+    zsize = (int) ceil(2*alpha*boxVectors[2][2]/(3*root));
+    xsize = max(xsize, order);
+    ysize = max(ysize, order);
+    zsize = max(zsize, order);
+}
+
 int NonbondedForceImpl::findZero(const NonbondedForceImpl::ErrorFunction& f, int initialGuess) {
     int arg = initialGuess;
     double value = f.getValue(arg);
@@ -71,6 +71,13 @@ void State::getPeriodicBoxVectors(Vec3& a, Vec3& b, Vec3& c) const {
 double State::getPeriodicBoxVolume() const {
     return periodicBoxVectors[0].dot(periodicBoxVectors[1].cross(periodicBoxVectors[2]));
 }
+void State::getVirial(Vec3& x, Vec3& y, Vec3& z) const {
+    if ((types&Virial) == 0)
+        throw OpenMMException("Invoked getVirial() on a State which does not contain the virial.");
+    x = virial[0];
+    y = virial[1];
+    z = virial[2];
+}
 const map<string, double>& State::getParameters() const {
     if ((types&Parameters) == 0)
         throw OpenMMException("Invoked getParameters() on a State which does not contain parameters.");
@@ -115,6 +122,13 @@ void State::setPeriodicBoxVectors(const Vec3& a, const Vec3& b, const Vec3& c) {
     periodicBoxVectors[2] = c;
 }
 
+void State::setVirial(const Vec3& x, const Vec3& y, const Vec3& z) {
+    virial[0] = x;
+    virial[1] = y;
+    virial[2] = z;
+    types |= Virial;
+}
+
 State::StateBuilder::StateBuilder(double time) : state(time) {
 }
 
@@ -145,3 +159,7 @@ void State::StateBuilder::setEnergy(double ke, double pe) {
 void State::StateBuilder::setPeriodicBoxVectors(const Vec3& a, const Vec3& b, const Vec3& c) {
     state.setPeriodicBoxVectors(a, b, c);
 }
+
+void State::StateBuilder::setVirial(const Vec3& x, const Vec3& y, const Vec3& z) {
+    state.setVirial(x, y, z);
+}
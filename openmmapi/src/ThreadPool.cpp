@@ -31,19 +31,97 @@
 
 #include "openmm/internal/ThreadPool.h"
 #include "openmm/internal/hardware.h"
+#include <algorithm>
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <sched.h>
+#endif
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+    #include <emmintrin.h>
+    #define SPIN_PAUSE() _mm_pause()
+#else
+    #define SPIN_PAUSE()
+#endif
 
 using namespace std;
 
 namespace OpenMM {
 
+/**
+ * Read a value that is being modified by another thread.  Once the new value is seen, all writes
+ * the other thread made before calling storeRelease() are visible too.
+ */
+static inline int loadAcquire(const volatile int& value) {
+#ifdef _MSC_VER
+    // Volatile accesses have acquire and release semantics in Visual Studio.
+    return value;
+#else
+    return __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/**
+ * This is called on each iteration of a polling loop.  It mostly just pauses briefly, but periodically
+ * yields the processor so that polling does not starve other threads when there are more threads than cores.
+ */
+static inline void spinPause(int iteration) {
+    if ((iteration&63) == 63) {
+#ifdef _WIN32
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+    }
+    else
+        SPIN_PAUSE();
+}
+
+/**
+ * Modify a value that other threads may read with loadAcquire().
+ */
+static inline void storeRelease(volatile int& value, int newValue) {
+#ifdef _MSC_VER
+    value = newValue;
+#else
+    __atomic_store_n(&value, newValue, __ATOMIC_RELEASE);
+#endif
+}
+
 class ThreadPool::ThreadData {
 public:
-    ThreadData(ThreadPool& owner, int index) : owner(owner), index(index), isDeleted(false) {
+    ThreadData(ThreadPool& owner, int index) : owner(owner), index(index), isDeleted(false), isFinished(true) {
+        pthread_mutex_init(&chunkLock, NULL);
+    }
+    ~ThreadData() {
+        pthread_mutex_destroy(&chunkLock);
     }
     ThreadPool& owner;
     int index;
-    bool isDeleted;
+    bool isDeleted, isFinished;
     Task* currentTask;
+    // The chunks of the current parallelFor() that have not been processed yet.  The thread takes
+    // them from the front, and other threads steal them from the back.
+    int firstChunk, endChunk;
+    pthread_mutex_t chunkLock;
+};
+
+class ThreadPool::ParallelForTask : public ThreadPool::Task {
+public:
+    ParallelForTask(RangeTask& task, int start, int end, int chunkSize) : task(task), start(start), end(end), chunkSize(chunkSize) {
+    }
+    void execute(ThreadPool& pool, int threadIndex) {
+        int chunk;
+        while (pool.takeChunk(threadIndex, chunk)) {
+            int chunkStart = start+chunk*chunkSize;
+            task.execute(pool, threadIndex, chunkStart, min(chunkStart+chunkSize, end));
+        }
+    }
+    RangeTask& task;
+    int start, end, chunkSize;
 };
 
 static void* threadBody(void* args) {
@@ -55,6 +133,7 @@ static void* threadBody(void* args) {
         if (data.isDeleted)
             break;
         data.currentTask->execute(data.owner, data.index);
+        data.isFinished = true;
     }
     delete &data;
     return 0;
@@ -64,9 +143,13 @@ ThreadPool::ThreadPool(int numThreads) {
     if (numThreads <= 0)
         numThreads = getNumProcessors();
     this->numThreads = numThreads;
+    spinCount = 0;
+    generation = 0;
+    isRunning = false;
     pthread_cond_init(&startCondition, NULL);
     pthread_cond_init(&endCondition, NULL);
     pthread_mutex_init(&lock, NULL);
+    pthread_mutex_init(&executeLock, NULL);
     thread.resize(numThreads);
     pthread_mutex_lock(&lock);
     waitCount = 0;
@@ -84,12 +167,11 @@ ThreadPool::ThreadPool(int numThreads) {
 ThreadPool::~ThreadPool() {
     for (int i = 0; i < (int) threadData.size(); i++)
         threadData[i]->isDeleted = true;
-    pthread_mutex_lock(&lock);
-    pthread_cond_broadcast(&startCondition);
-    pthread_mutex_unlock(&lock);
+    resumeThreads();
     for (int i = 0; i < (int) thread.size(); i++)
         pthread_join(thread[i], NULL);
     pthread_mutex_destroy(&lock);
+    pthread_mutex_destroy(&executeLock);
     pthread_cond_destroy(&startCondition);
     pthread_cond_destroy(&endCondition);
 }
@@ -98,32 +180,159 @@ int ThreadPool::getNumThreads() const {
     return numThreads;
 }
 
+int ThreadPool::getSpinCount() const {
+    return spinCount;
+}
+
+void ThreadPool::setSpinCount(int count) {
+    spinCount = max(0, count);
+}
+
+bool ThreadPool::setAffinity(const vector<int>& cores) {
+    if (cores.size() == 0)
+        return false;
+#if defined(__linux__) && defined(__GLIBC__)
+    for (int i = 0; i < numThreads; i++) {
+        int core = cores[i%cores.size()];
+        if (core < 0 || core >= CPU_SETSIZE)
+            return false;
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(core, &cpuSet);
+        if (pthread_setaffinity_np(thread[i], sizeof(cpuSet), &cpuSet) != 0)
+            return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
 void ThreadPool::execute(Task& task) {
-    for (int i = 0; i < (int) threadData.size(); i++)
+    acquire();
+    for (int i = 0; i < (int) threadData.size(); i++) {
         threadData[i]->currentTask = &task;
+        threadData[i]->isFinished = false;
+    }
     resumeThreads();
 }
 
+void ThreadPool::acquire() {
+    // Wait until the pool is not being used by any other thread.  The lock is held until waitForThreads()
+    // finds that all threads have finished the task.  Some callers invoke execute() again in the middle of a
+    // Task to resume the threads, in which case this thread already holds it.
+    
+    pthread_mutex_lock(&lock);
+    bool ownsPool = (isRunning && pthread_equal(runningThread, pthread_self()));
+    pthread_mutex_unlock(&lock);
+    if (!ownsPool) {
+        pthread_mutex_lock(&executeLock);
+        pthread_mutex_lock(&lock);
+        isRunning = true;
+        runningThread = pthread_self();
+        pthread_mutex_unlock(&lock);
+    }
+}
+
 void ThreadPool::syncThreads() {
     pthread_mutex_lock(&lock);
-    waitCount++;
+    int currentGeneration = generation;
+    storeRelease(waitCount, waitCount+1);
     pthread_cond_signal(&endCondition);
-    pthread_cond_wait(&startCondition, &lock);
+    
+    // If requested, poll for a while before blocking.
+    
+    if (spinCount > 0) {
+        pthread_mutex_unlock(&lock);
+        for (int i = 0; i < spinCount; i++) {
+            if (loadAcquire(generation) != currentGeneration)
+                return;
+            spinPause(i);
+        }
+        pthread_mutex_lock(&lock);
+    }
+    while (generation == currentGeneration)
+        pthread_cond_wait(&startCondition, &lock);
     pthread_mutex_unlock(&lock);
 }
 
 void ThreadPool::waitForThreads() {
+    bool finished = false;
+    for (int i = 0; i < spinCount && !finished; i++) {
+        if (loadAcquire(waitCount) >= numThreads)
+            finished = true;
+        else
+            spinPause(i);
+    }
+    if (!finished) {
+        pthread_mutex_lock(&lock);
+        while (waitCount < numThreads)
+            pthread_cond_wait(&endCondition, &lock);
+        pthread_mutex_unlock(&lock);
+    }
+    
+    // If the threads have completed the task, let other threads use the pool.
+    
+    for (int i = 0; i < numThreads; i++)
+        if (!threadData[i]->isFinished)
+            return;
     pthread_mutex_lock(&lock);
-    while (waitCount < numThreads)
-        pthread_cond_wait(&endCondition, &lock);
+    bool ownsPool = isRunning;
+    isRunning = false;
     pthread_mutex_unlock(&lock);
+    if (ownsPool)
+        pthread_mutex_unlock(&executeLock);
 }
 
 void ThreadPool::resumeThreads() {
     pthread_mutex_lock(&lock);
     waitCount = 0;
+    storeRelease(generation, generation+1);
     pthread_cond_broadcast(&startCondition);
     pthread_mutex_unlock(&lock);
 }
 
+void ThreadPool::parallelFor(RangeTask& task, int start, int end, int chunkSize) {
+    if (end <= start)
+        return;
+    if (chunkSize < 1)
+        chunkSize = 1;
+    int numChunks = (end-start+chunkSize-1)/chunkSize;
+    acquire();
+    for (int i = 0; i < numThreads; i++) {
+        threadData[i]->firstChunk = (int) ((i*(long long) numChunks)/numThreads);
+        threadData[i]->endChunk = (int) (((i+1)*(long long) numChunks)/numThreads);
+    }
+    ParallelForTask parallelTask(task, start, end, chunkSize);
+    execute(parallelTask);
+    waitForThreads();
+}
+
+bool ThreadPool::takeChunk(int threadIndex, int& chunk) {
+    // First look in this thread's own share.
+    
+    ThreadData& data = *threadData[threadIndex];
+    pthread_mutex_lock(&data.chunkLock);
+    bool found = (data.firstChunk < data.endChunk);
+    if (found)
+        chunk = data.firstChunk++;
+    pthread_mutex_unlock(&data.chunkLock);
+    if (found)
+        return true;
+    
+    // Try to steal a chunk from another thread, taking the one it would process last.
+    
+    for (int i = 1; i < numThreads; i++) {
+        ThreadData& victim = *threadData[(threadIndex+i)%numThreads];
+        pthread_mutex_lock(&victim.chunkLock);
+        found = (victim.firstChunk < victim.endChunk);
+        if (found)
+            chunk = --victim.endChunk;
+        pthread_mutex_unlock(&victim.chunkLock);
+        if (found)
+            return true;
+    }
+    return false;
+}
+
 } // namespace OpenMM
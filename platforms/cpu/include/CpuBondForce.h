@@ -57,11 +57,32 @@ public:
      */
     void calculateForce(std::vector<OpenMM::RealVec>& atomCoordinates, RealOpenMM** parameters, std::vector<OpenMM::RealVec>& forces, 
             RealOpenMM* totalEnergy, ReferenceBondIxn& referenceBondIxn);
+    /**
+     * Compute the forces from all bonds, using a different ReferenceBondIxn for each thread.  This is needed
+     * when the ReferenceBondIxn is not thread safe, for example because it evaluates Lepton expressions.
+     * The first element is also used for computing any bonds that could not be assigned to a thread.
+     */
+    void calculateForce(std::vector<OpenMM::RealVec>& atomCoordinates, RealOpenMM** parameters, std::vector<OpenMM::RealVec>& forces, 
+            RealOpenMM* totalEnergy, std::vector<ReferenceBondIxn*>& threadBondIxn);
     /**
      * This routine contains the code executed by each thread.
      */
     void threadComputeForce(ThreadPool& threads, int threadIndex, std::vector<OpenMM::RealVec>& atomCoordinates, RealOpenMM** parameters,
             std::vector<OpenMM::RealVec>& forces, RealOpenMM* totalEnergy, ReferenceBondIxn& referenceBondIxn);
+    /**
+     * Get the bonds that have been assigned to each thread.  No two threads share an atom, so
+     * the bonds in different lists may safely be processed in parallel.
+     */
+    const std::vector<std::vector<int> >& getThreadBonds() const {
+        return threadBonds;
+    }
+    /**
+     * Get the bonds that could not be assigned to any thread.  These must be processed
+     * serially after all threads have finished.
+     */
+    const std::vector<int>& getExtraBonds() const {
+        return extraBonds;
+    }
 private:
     bool canAssignBond(int bond, int thread, std::vector<int>& atomThread);
     void assignBond(int bond, int thread, std::vector<int>& atomThread, std::vector<int>& bondThread, std::vector<std::set<int> >& atomBonds, std::list<int>& candidateBonds);
@@ -0,0 +1,99 @@
+#ifndef OPENMM_CPUCCMA_H_
+#define OPENMM_CPUCCMA_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "ReferenceCCMAAlgorithm.h"
+#include "windowsExportCpu.h"
+#include "openmm/System.h"
+#include "openmm/internal/ThreadPool.h"
+#include <vector>
+
+namespace OpenMM {
+
+/**
+ * This class executes the CCMA algorithm in parallel.  It uses the constraint matrix computed
+ * by a ReferenceCCMAAlgorithm, and splits every stage of each iteration across threads: computing
+ * the constraint deltas, multiplying by the matrix, and applying the corrections to atoms.  The
+ * corrections are gathered separately for each atom, so threads never write to the same atom.
+ */
+class OPENMM_EXPORT_CPU CpuCCMA : public ReferenceConstraintAlgorithm {
+public:
+    class ComputeDeltasTask;
+    class MultiplyTask;
+    class UpdateAtomsTask;
+    CpuCCMA(const System& system, const ReferenceCCMAAlgorithm& ccma, ThreadPool& threads);
+    /**
+     * Apply the constraint algorithm.
+     * 
+     * @param atomCoordinates  the original atom coordinates
+     * @param atomCoordinatesP the new atom coordinates
+     * @param inverseMasses    1/mass
+     * @param tolerance        the constraint tolerance
+     */
+    void apply(std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& atomCoordinatesP, std::vector<RealOpenMM>& inverseMasses, RealOpenMM tolerance);
+    /**
+     * Apply the constraint algorithm to velocities.
+     * 
+     * @param atomCoordinates  the atom coordinates
+     * @param atomCoordinatesP the velocities to modify
+     * @param inverseMasses    1/mass
+     * @param tolerance        the constraint tolerance
+     */
+    void applyToVelocities(std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& velocities, std::vector<RealOpenMM>& inverseMasses, RealOpenMM tolerance);
+private:
+    void applyConstraints(std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& atomCoordinatesP, std::vector<RealOpenMM>& inverseMasses,
+            bool constrainingVelocities, RealOpenMM tolerance);
+    void threadComputeDeltas(int threadIndex, bool computeDirections);
+    void threadMultiply(int threadIndex);
+    void threadUpdateAtoms(int threadIndex);
+    ThreadPool& threads;
+    int numConstraints, maxIterations;
+    bool hasInitializedMasses;
+    std::vector<int> atom1, atom2;
+    std::vector<RealOpenMM> distance, reducedMasses, d_ij2, constraintDelta, tempDelta;
+    std::vector<OpenMM::RealVec> r_ij;
+    std::vector<int> matrixRowStart, matrixColIndex;
+    std::vector<RealOpenMM> matrixValue;
+    std::vector<int> constrainedAtoms, atomConstraintStart, atomConstraints;
+    std::vector<int> constraintBlockStart, atomBlockStart, threadConverged;
+    // The following variables are used to make information accessible to the individual threads.
+    OpenMM::RealVec* atomCoordinates;
+    OpenMM::RealVec* atomCoordinatesP;
+    RealOpenMM* inverseMasses;
+    bool constrainingVelocities;
+    RealOpenMM tolerance;
+};
+
+} // namespace OpenMM
+
+#endif /*OPENMM_CPUCCMA_H_*/
@@ -0,0 +1,99 @@
+#ifndef OPENMM_CPUCMAPTORSIONFORCE_H_
+#define OPENMM_CPUCMAPTORSIONFORCE_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuBondForce.h"
+#include "RealVec.h"
+#include "windowsExportCpu.h"
+#include "openmm/internal/ThreadPool.h"
+#include <vector>
+
+namespace OpenMM {
+
+/**
+ * This class computes CMAPTorsionForce in parallel.  Torsion pairs are divided between threads with CpuBondForce,
+ * then each thread processes its torsion pairs four at a time with SIMD instructions.  The bicubic spline
+ * coefficients for every patch of every map are computed once and stored in single precision, with the
+ * 16 coefficients of each patch stored contiguously so they can be loaded with four vector loads.
+ */
+class OPENMM_EXPORT_CPU CpuCMAPTorsionForce {
+public:
+    class ComputeForceTask;
+    CpuCMAPTorsionForce();
+    /**
+     * Analyze the set of torsion pairs and decide which to compute with each thread.
+     *
+     * @param numAtoms       the number of atoms in the system
+     * @param numTorsions    the number of torsion pairs
+     * @param torsionAtoms   the indices of the eight atoms in each torsion pair
+     * @param threads        the ThreadPool to use for the computation
+     */
+    void initialize(int numAtoms, int numTorsions, int** torsionAtoms, ThreadPool& threads);
+    /**
+     * Set the spline coefficients for all maps.
+     *
+     * @param coeff   coeff[i][j] contains the 16 coefficients for patch j of map i, as computed by
+     *                CMAPTorsionForceImpl::calcMapDerivatives()
+     */
+    void setMaps(const std::vector<std::vector<std::vector<double> > >& coeff);
+    /**
+     * Set which map a torsion pair uses.
+     *
+     * @param torsion  the index of the torsion pair
+     * @param map      the index of the map it uses
+     */
+    void setTorsionMap(int torsion, int map);
+    /**
+     * Compute the forces from all torsion pairs.
+     *
+     * @param atomCoordinates  the atom positions
+     * @param forces           forces are added to this
+     * @param totalEnergy      if not NULL, the energy is added to this
+     */
+    void calculateForce(std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& forces, RealOpenMM* totalEnergy);
+    /**
+     * This routine contains the code executed by each thread.
+     */
+    void threadComputeForce(int threadIndex, std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& forces, double* energy);
+private:
+    void computeTorsions(int start, int end, std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& forces, double* energy);
+    CpuBondForce bondForce;
+    ThreadPool* threads;
+    std::vector<int> blockStart, torsionIndex, torsionAtoms, torsionMap, mapSize, mapOffset;
+    std::vector<float> coefficients;
+    std::vector<double> threadEnergy;
+};
+
+} // namespace OpenMM
+
+#endif /*OPENMM_CPUCMAPTORSIONFORCE_H_*/
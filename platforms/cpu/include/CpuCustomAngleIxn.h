@@ -0,0 +1,91 @@
+#ifndef OPENMM_CPUCUSTOMANGLEIXN_H_
+#define OPENMM_CPUCUSTOMANGLEIXN_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CompiledExpressionSet.h"
+#include "ReferenceBondIxn.h"
+#include "windowsExportCpu.h"
+#include "lepton/CompiledExpression.h"
+#include <string>
+#include <vector>
+
+namespace OpenMM {
+
+/**
+ * This class computes a single CustomAngleForce interaction.  Unlike ReferenceCustomAngleIxn, it is intended to
+ * be created once and reused: each thread gets its own instance so the CompiledExpressions are never shared.
+ * The energy and its derivative share a CompiledExpressionSet, so every variable is set only once per
+ * interaction, and the energy expression is skipped entirely when the energy is not needed.
+ */
+class OPENMM_EXPORT_CPU CpuCustomAngleIxn : public ReferenceBondIxn {
+public:
+    /**
+     * Create a CpuCustomAngleIxn.
+     *
+     * @param energyExpression      the expression for the energy
+     * @param forceExpression       the derivative of the energy with respect to theta
+     * @param parameterNames        the names of the per-angle parameters
+     * @param globalParameterNames  the names of the global parameters
+     */
+    CpuCustomAngleIxn(const Lepton::CompiledExpression& energyExpression, const Lepton::CompiledExpression& forceExpression,
+            const std::vector<std::string>& parameterNames, const std::vector<std::string>& globalParameterNames);
+    /**
+     * Set the value of a global parameter.
+     *
+     * @param index   the index of the parameter within the globalParameterNames passed to the constructor
+     * @param value   the value to set it to
+     */
+    void setGlobalParameter(int index, double value);
+    /**
+     * Calculate the interaction for one angle.
+     *
+     * @param atomIndices      the indices of the three atoms in the angle
+     * @param atomCoordinates  atom coordinates
+     * @param parameters       the per-angle parameter values
+     * @param forces           force array (forces added)
+     * @param totalEnergy      if not null, the energy will be added to this
+     */
+    void calculateBondIxn(int* atomIndices, std::vector<OpenMM::RealVec>& atomCoordinates,
+                          RealOpenMM* parameters, std::vector<OpenMM::RealVec>& forces,
+                          RealOpenMM* totalEnergy) const;
+private:
+    Lepton::CompiledExpression energyExpression;
+    Lepton::CompiledExpression forceExpression;
+    mutable CompiledExpressionSet expressionSet;
+    std::vector<int> paramIndex, globalParamIndex;
+    int thetaIndex;
+};
+
+} // namespace OpenMM
+
+#endif /*OPENMM_CPUCUSTOMANGLEIXN_H_*/
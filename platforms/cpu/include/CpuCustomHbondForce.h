@@ -0,0 +1,203 @@
+#ifndef OPENMM_CPU_CUSTOM_HBOND_FORCE_H__
+#define OPENMM_CPU_CUSTOM_HBOND_FORCE_H__
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "AlignedArray.h"
+#include "CpuNeighborList.h"
+#include "CompiledExpressionSet.h"
+#include "ReferenceForce.h"
+#include "RealVec.h"
+#include "openmm/CustomHbondForce.h"
+#include "openmm/internal/ThreadPool.h"
+#include "lepton/CompiledExpression.h"
+#include "lepton/ParsedExpression.h"
+#include <map>
+#include <set>
+#include <vector>
+
+namespace OpenMM {
+
+/**
+ * This class computes CustomHbondForce in parallel.  Donors are divided dynamically between threads.
+ * When a cutoff is used, a CpuNeighborList built over the primary donor and acceptor atoms identifies
+ * which acceptors are close enough to each donor, so only those pairs are evaluated.
+ */
+class CpuCustomHbondForce {
+private:
+
+    class DistanceTermInfo;
+    class AngleTermInfo;
+    class DihedralTermInfo;
+    class ComputeForceTask;
+    class ThreadData;
+    int numDonors, numAcceptors;
+    bool useCutoff, usePeriodic, triclinic;
+    RealOpenMM cutoffDistance;
+    RealVec periodicBoxVectors[3];
+    CpuNeighborList* neighborList;
+    ThreadPool& threads;
+    std::vector<std::vector<int> > donorAtoms, acceptorAtoms;
+    std::vector<std::set<int> > exclusions;
+    std::vector<std::set<int> > groupExclusions;
+    AlignedArray<float> groupPositions;
+    std::vector<std::vector<int> > donorNeighbors;
+    std::vector<ThreadData*> threadData;
+    // The following variables are used to make information accessible to the individual threads.
+    std::vector<RealVec>* atomCoordinates;
+    RealOpenMM** donorParameters;
+    RealOpenMM** acceptorParameters;
+    const std::map<std::string, double>* globalParameters;
+    std::vector<AlignedArray<float> >* threadForce;
+    bool includeForces, includeEnergy;
+    void* atomicCounter;
+
+    void threadComputeForce(ThreadPool& threads, int threadIndex);
+
+    /**
+     * Find the acceptors within the cutoff distance of each donor.
+     */
+    void findNeighbors(std::vector<RealVec>& atomCoordinates);
+
+    /**---------------------------------------------------------------------------------------
+
+       Calculate custom interaction between a donor and an acceptor
+
+       @param donor            the index of the donor
+       @param acceptor         the index of the acceptor
+       @param forces           force array (forces added)
+       @param data             the workspace for the current thread
+
+       --------------------------------------------------------------------------------------- */
+
+    void calculateOneIxn(int donor, int acceptor, float* forces, ThreadData& data);
+
+    void computeDelta(int atom1, int atom2, RealOpenMM* delta) const;
+
+    static RealOpenMM computeAngle(RealOpenMM* vec1, RealOpenMM* vec2);
+
+public:
+    CpuCustomHbondForce(const OpenMM::CustomHbondForce& force, ThreadPool& threads);
+
+    ~CpuCustomHbondForce();
+
+    /**
+     * Set the force to use periodic boundary conditions.  This requires that a cutoff has
+     * already been set, and the smallest side of the periodic box is at least twice the cutoff
+     * distance.
+     *
+     * @param periodicBoxVectors    the vectors defining the periodic box
+     */
+    void setPeriodic(RealVec* periodicBoxVectors);
+
+    /**
+     * Get the list of atoms for each donor group.
+     */
+    const std::vector<std::vector<int> >& getDonorAtoms() const {
+        return donorAtoms;
+    }
+
+    /**
+     * Get the list of atoms for each acceptor group.
+     */
+    const std::vector<std::vector<int> >& getAcceptorAtoms() const {
+        return acceptorAtoms;
+    }
+
+    /**
+     * Calculate the interaction.
+     *
+     * @param atomCoordinates    atom coordinates
+     * @param donorParameters    donor parameters values       donorParameters[donorIndex][parameterIndex]
+     * @param acceptorParameters acceptor parameters values    acceptorParameters[acceptorIndex][parameterIndex]
+     * @param globalParameters   the values of global parameters
+     * @param threadForce        the collection of arrays for each thread to add forces to
+     * @param includeForces      whether to compute forces
+     * @param includeEnergy      whether to compute energy
+     * @param energy             the total energy is added to this
+     */
+    void calculateIxn(std::vector<RealVec>& atomCoordinates, RealOpenMM** donorParameters, RealOpenMM** acceptorParameters,
+                      const std::map<std::string, double>& globalParameters, std::vector<AlignedArray<float> >& threadForce,
+                      bool includeForces, bool includeEnergy, double& energy);
+};
+
+class CpuCustomHbondForce::DistanceTermInfo {
+public:
+    std::string name;
+    int p1, p2, variableIndex;
+    Lepton::CompiledExpression forceExpression;
+    RealOpenMM delta[ReferenceForce::LastDeltaRIndex];
+    DistanceTermInfo(const std::string& name, const std::vector<int>& atoms, const Lepton::CompiledExpression& forceExpression, ThreadData& data);
+};
+
+class CpuCustomHbondForce::AngleTermInfo {
+public:
+    std::string name;
+    int p1, p2, p3, variableIndex;
+    Lepton::CompiledExpression forceExpression;
+    RealOpenMM delta1[ReferenceForce::LastDeltaRIndex];
+    RealOpenMM delta2[ReferenceForce::LastDeltaRIndex];
+    AngleTermInfo(const std::string& name, const std::vector<int>& atoms, const Lepton::CompiledExpression& forceExpression, ThreadData& data);
+};
+
+class CpuCustomHbondForce::DihedralTermInfo {
+public:
+    std::string name;
+    int p1, p2, p3, p4, variableIndex;
+    Lepton::CompiledExpression forceExpression;
+    RealOpenMM delta1[ReferenceForce::LastDeltaRIndex];
+    RealOpenMM delta2[ReferenceForce::LastDeltaRIndex];
+    RealOpenMM delta3[ReferenceForce::LastDeltaRIndex];
+    RealOpenMM cross1[3];
+    RealOpenMM cross2[3];
+    DihedralTermInfo(const std::string& name, const std::vector<int>& atoms, const Lepton::CompiledExpression& forceExpression, ThreadData& data);
+};
+
+/**
+ * Each thread has its own copy of the compiled expressions, since they cannot be evaluated by multiple threads at once.
+ */
+class CpuCustomHbondForce::ThreadData {
+public:
+    CompiledExpressionSet expressionSet;
+    Lepton::CompiledExpression energyExpression;
+    std::vector<int> donorParamIndex, acceptorParamIndex;
+    std::vector<DistanceTermInfo> distanceTerms;
+    std::vector<AngleTermInfo> angleTerms;
+    std::vector<DihedralTermInfo> dihedralTerms;
+    double energy;
+    ThreadData(const CustomHbondForce& force, Lepton::ParsedExpression& energyExpr,
+            std::map<std::string, std::vector<int> >& distances, std::map<std::string, std::vector<int> >& angles, std::map<std::string, std::vector<int> >& dihedrals);
+};
+
+} // namespace OpenMM
+
+#endif // OPENMM_CPU_CUSTOM_HBOND_FORCE_H__
@@ -56,7 +56,7 @@ private:
     float recipBoxSize[3];
     RealVec periodicBoxVectors[3];
     AlignedArray<fvec4> periodicBoxVec4;
-    CpuNeighborList* neighborList;
+    const CpuNeighborList* neighborList;
     ThreadPool& threads;
     std::vector<std::set<int> > exclusions;
     std::vector<int> particleTypes;
@@ -132,8 +132,16 @@ public:
      * Set the force to use a cutoff.
      * 
      * @param distance   the cutoff distance
+     * @param neighbors  the neighbor list to use.  It may include pairs beyond the cutoff.
      */
-    void setUseCutoff(RealOpenMM distance);
+    void setUseCutoff(RealOpenMM distance, const CpuNeighborList& neighbors);
+
+    /**
+     * Get the exclusions, which the neighbor list must be built with.
+     */
+    const std::vector<std::set<int> >& getExclusions() const {
+        return exclusions;
+    }
 
     /**
      * Set the force to use periodic boundary conditions.  This requires that a cutoff has
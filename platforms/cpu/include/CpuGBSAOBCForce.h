@@ -26,6 +26,7 @@
 #define OPENMM_CPU_GBSAOBC_FORCE_H__
 
 #include "AlignedArray.h"
+#include "CpuNeighborList.h"
 #include "openmm/internal/ThreadPool.h"
 #include "openmm/internal/vectorize.h"
 #include <set>
@@ -38,13 +39,15 @@ class CpuGBSAOBCForce {
 public:
     class ComputeTask;
     CpuGBSAOBCForce();
+    virtual ~CpuGBSAOBCForce();
 
     /**
      * Set the force to use a cutoff.
      * 
      * @param distance    the cutoff distance
+     * @param neighbors   the neighbor list to use
      */
-    void setUseCutoff(float distance);
+    void setUseCutoff(float distance, const CpuNeighborList& neighbors);
 
     /**
      * 
@@ -97,14 +100,17 @@ public:
      */
     void threadComputeForce(ThreadPool& threads, int threadIndex);
 
-private:
+protected:
     bool cutoff;
     bool periodic;
     float periodicBoxSize[3];
     float cutoffDistance, soluteDielectric, solventDielectric, surfaceAreaFactor;
+    const CpuNeighborList* neighborList;
     std::vector<std::pair<float, float> > particleParams;        
     AlignedArray<float> bornRadii;
     std::vector<AlignedArray<float> > threadBornForces;
+    std::vector<AlignedArray<float> > threadBornSums;
+    AlignedArray<float> combinedBornForces;
     AlignedArray<float> obcChain;
     std::vector<double> threadEnergy;
     std::vector<float> logTable;
@@ -119,6 +125,55 @@ private:
     static const float TABLE_MIN;
     static const float TABLE_MAX;
 
+    /**
+     * Compute the forces using the neighbor list.  This is called by threadComputeForce() when a
+     * cutoff is in use.
+     */
+    void threadComputeNeighborListForce(ThreadPool& threads, int threadIndex);
+
+    /**
+     * Compute the Born radius and OBC chain rule factor of an atom from its summed descreening integral.
+     */
+    void computeBornRadius(int atom, float sum);
+
+    /**
+     * Add the contributions of all neighbors of an atom block to the descreening integrals of the block
+     * atoms and the neighbors.
+     *
+     * @param blockIndex    the index of the atom block
+     * @param bornSum       descreening integrals (values added)
+     */
+    virtual void calculateBlockBornSum(int blockIndex, float* bornSum, const fvec4& boxSize, const fvec4& invBoxSize);
+
+    /**
+     * Compute the Born energy and its direct forces for all neighbors of an atom block.
+     *
+     * @param blockIndex    the index of the atom block
+     * @param forces        force array (forces added)
+     * @param bornForces    derivatives of the energy with respect to Born radii (values added)
+     * @param energy        total energy (value added)
+     * @param preFactor     the dielectric prefactor for the Born energy
+     */
+    virtual void calculateBlockEnergy(int blockIndex, float* forces, float* bornForces, double& energy, float preFactor, const fvec4& boxSize, const fvec4& invBoxSize);
+
+    /**
+     * Apply the chain rule through the Born radii for all neighbors of an atom block.
+     *
+     * @param blockIndex    the index of the atom block
+     * @param forces        force array (forces added)
+     */
+    virtual void calculateBlockChainRule(int blockIndex, float* forces, const fvec4& boxSize, const fvec4& invBoxSize);
+
+    /**
+     * Compute the descreening integral of atom J's scaled sphere over atom I, for a collection of atom pairs.
+     */
+    fvec4 computeBornSumTerm(const fvec4& r, const fvec4& rInverse, const fvec4& offsetRadiusI, const fvec4& scaledRadiusJ, const ivec4& include);
+
+    /**
+     * Compute the derivative of computeBornSumTerm() with respect to r, divided by r, for a collection of atom pairs.
+     */
+    fvec4 computeChainRuleTerm(const fvec4& r, const fvec4& rInverse, const fvec4& offsetRadiusI, const fvec4& scaledRadiusJ, const ivec4& include);
+
     /**
      * Compute the displacement and squared distance between a collection of points, optionally using
      * periodic boundary conditions.
@@ -0,0 +1,83 @@
+/* Portions copyright (c) 2006-2015 Stanford University and Simbios.
+ * Contributors: Pande Group
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef OPENMM_CPU_GBSAOBC_FORCE_VEC8_H__
+#define OPENMM_CPU_GBSAOBC_FORCE_VEC8_H__
+
+#include "CpuGBSAOBCForce.h"
+
+#ifdef __AVX__
+
+#include "openmm/internal/vectorize8.h"
+
+// ---------------------------------------------------------------------------------------
+
+namespace OpenMM {
+
+/**
+ * This class evaluates the neighbor list based inner loops of CpuGBSAOBCForce with 8 wide
+ * AVX vectors.  It must be used with a CpuNeighborList whose block size is 8.
+ */
+class CpuGBSAOBCForceVec8 : public CpuGBSAOBCForce {
+public:
+    CpuGBSAOBCForceVec8();
+
+protected:
+    void calculateBlockBornSum(int blockIndex, float* bornSum, const fvec4& boxSize, const fvec4& invBoxSize);
+    void calculateBlockEnergy(int blockIndex, float* forces, float* bornForces, double& energy, float preFactor, const fvec4& boxSize, const fvec4& invBoxSize);
+    void calculateBlockChainRule(int blockIndex, float* forces, const fvec4& boxSize, const fvec4& invBoxSize);
+
+    /**
+     * Load the positions of the atoms in a block.
+     */
+    void loadBlockPositions(const int* blockAtom, fvec8& x, fvec8& y, fvec8& z, fvec8& q) const;
+
+    /**
+     * Compute the descreening integral of atom J's scaled sphere over atom I, for a collection of atom pairs.
+     */
+    fvec8 computeBornSumTerm(const fvec8& r, const fvec8& rInverse, const fvec8& offsetRadiusI, const fvec8& scaledRadiusJ, const ivec8& include);
+
+    /**
+     * Compute the derivative of computeBornSumTerm() with respect to r, divided by r, for a collection of atom pairs.
+     */
+    fvec8 computeChainRuleTerm(const fvec8& r, const fvec8& rInverse, const fvec8& offsetRadiusI, const fvec8& scaledRadiusJ, const ivec8& include);
+
+    /**
+     * Compute the displacement and squared distance between a collection of points, optionally using
+     * periodic boundary conditions.
+     */
+    void getDeltaR(const fvec4& posI, const fvec8& x, const fvec8& y, const fvec8& z, fvec8& dx, fvec8& dy, fvec8& dz, fvec8& r2, const fvec4& boxSize, const fvec4& invBoxSize) const;
+
+    /**
+     * Evaluate log(x) using a lookup table for speed.
+     */
+    fvec8 fastLog(const fvec8& x);
+};
+
+} // namespace OpenMM
+
+// ---------------------------------------------------------------------------------------
+
+#endif // __AVX__
+
+#endif // OPENMM_CPU_GBSAOBC_FORCE_VEC8_H__
@@ -0,0 +1,91 @@
+#ifndef OPENMM_CPUHARMONICANGLEFORCE_H_
+#define OPENMM_CPUHARMONICANGLEFORCE_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuBondForce.h"
+#include "RealVec.h"
+#include "windowsExportCpu.h"
+#include "openmm/internal/ThreadPool.h"
+#include <vector>
+
+namespace OpenMM {
+
+/**
+ * This class computes HarmonicAngleForce in parallel.  Angles are divided between threads with CpuBondForce,
+ * then each thread processes its angles four at a time with SIMD instructions.
+ */
+class OPENMM_EXPORT_CPU CpuHarmonicAngleForce {
+public:
+    class ComputeForceTask;
+    CpuHarmonicAngleForce();
+    /**
+     * Analyze the set of angles and decide which to compute with each thread.
+     *
+     * @param numAtoms    the number of atoms in the system
+     * @param numAngles   the number of angles
+     * @param angleAtoms  the indices of the three atoms in each angle
+     * @param threads     the ThreadPool to use for the computation
+     */
+    void initialize(int numAtoms, int numAngles, int** angleAtoms, ThreadPool& threads);
+    /**
+     * Set the parameters for an angle.
+     *
+     * @param angle  the index of the angle
+     * @param theta  the equilibrium angle, measured in radians
+     * @param k      the force constant
+     */
+    void setAngleParameters(int angle, RealOpenMM theta, RealOpenMM k);
+    /**
+     * Compute the forces from all angles.
+     *
+     * @param atomCoordinates  the atom positions
+     * @param forces           forces are added to this
+     * @param totalEnergy      if not NULL, the energy is added to this
+     */
+    void calculateForce(std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& forces, RealOpenMM* totalEnergy);
+    /**
+     * This routine contains the code executed by each thread.
+     */
+    void threadComputeForce(int threadIndex, std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& forces, double* energy);
+private:
+    void computeAngles(int start, int end, std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& forces, double* energy);
+    CpuBondForce bondForce;
+    ThreadPool* threads;
+    std::vector<int> blockStart, angleIndex, atom1, atom2, atom3;
+    std::vector<float> theta, k;
+    std::vector<double> threadEnergy;
+};
+
+} // namespace OpenMM
+
+#endif /*OPENMM_CPUHARMONICANGLEFORCE_H_*/
@@ -33,14 +33,23 @@
  * -------------------------------------------------------------------------- */
 
 #include "CpuBondForce.h"
+#include "CpuBrownianDynamics.h"
+#include "CpuCMAPTorsionForce.h"
+#include "CpuCustomAngleIxn.h"
+#include "CpuCustomBondIxn.h"
 #include "CpuCustomGBForce.h"
+#include "CpuCustomHbondForce.h"
 #include "CpuCustomManyParticleForce.h"
 #include "CpuCustomNonbondedForce.h"
+#include "CpuCustomTorsionIxn.h"
 #include "CpuGBSAOBCForce.h"
+#include "CpuHarmonicAngleForce.h"
+#include "CpuHarmonicBondForce.h"
 #include "CpuLangevinDynamics.h"
-#include "CpuNeighborList.h"
+#include "CpuSharedNeighborList.h"
 #include "CpuNonbondedForce.h"
 #include "CpuPlatform.h"
+#include "CpuVerletDynamics.h"
 #include "openmm/kernels.h"
 #include "openmm/System.h"
 
@@ -87,9 +96,126 @@ public:
      * energy directly, <i>or</i> add it to an internal buffer so that it will be included here.
      */
     double finishComputation(ContextImpl& context, bool includeForce, bool includeEnergy, int groups, bool& valid);
+    /**
+     * Set whether subsequent force computations should also compute the virial tensor.  This throws an
+     * exception if the System contains any force whose contribution to the virial cannot be computed.
+     *
+     * @param include       true if the virial should be computed
+     */
+    void setIncludeVirial(bool include);
+    /**
+     * Get the virial tensor computed by the most recent force computation.
+     *
+     * @param context       the context in which to execute this kernel
+     * @param virial        on exit, this contains the three rows of the virial tensor
+     */
+    void getVirial(ContextImpl& context, Vec3* virial);
 private:
     CpuPlatform::PlatformData& data;
     Kernel referenceKernel;
+    bool supportsVirial;
+    std::vector<int> virtualSites;
+};
+
+/**
+ * This kernel recomputes the positions of virtual sites.
+ */
+class CpuVirtualSitesKernel : public VirtualSitesKernel {
+public:
+    CpuVirtualSitesKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) : VirtualSitesKernel(name, platform), data(data) {
+    }
+    /**
+     * Initialize the kernel.
+     *
+     * @param system     the System this kernel will be applied to
+     */
+    void initialize(const System& system);
+    /**
+     * Compute the virtual site locations.
+     *
+     * @param context    the context in which to execute this kernel
+     */
+    void computePositions(ContextImpl& context);
+private:
+    CpuPlatform::PlatformData& data;
+};
+
+/**
+ * This kernel is invoked by HarmonicBondForce to calculate the forces acting on the system and the energy of the system.
+ */
+class CpuCalcHarmonicBondForceKernel : public CalcHarmonicBondForceKernel {
+public:
+    CpuCalcHarmonicBondForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
+            CalcHarmonicBondForceKernel(name, platform), data(data), bondIndexArray(NULL) {
+    }
+    ~CpuCalcHarmonicBondForceKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param force      the HarmonicBondForce this kernel will be used for
+     */
+    void initialize(const System& system, const HarmonicBondForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the HarmonicBondForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const HarmonicBondForce& force);
+private:
+    CpuPlatform::PlatformData& data;
+    int numBonds;
+    int **bondIndexArray;
+    CpuHarmonicBondForce bondForce;
+};
+
+/**
+ * This kernel is invoked by HarmonicAngleForce to calculate the forces acting on the system and the energy of the system.
+ */
+class CpuCalcHarmonicAngleForceKernel : public CalcHarmonicAngleForceKernel {
+public:
+    CpuCalcHarmonicAngleForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
+            CalcHarmonicAngleForceKernel(name, platform), data(data), angleIndexArray(NULL) {
+    }
+    ~CpuCalcHarmonicAngleForceKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param force      the HarmonicAngleForce this kernel will be used for
+     */
+    void initialize(const System& system, const HarmonicAngleForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the HarmonicAngleForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const HarmonicAngleForce& force);
+private:
+    CpuPlatform::PlatformData& data;
+    int numAngles;
+    int **angleIndexArray;
+    CpuHarmonicAngleForce angleForce;
 };
 
 /**
@@ -172,6 +298,173 @@ private:
     CpuBondForce bondForce;
 };
 
+/**
+ * This kernel is invoked by CMAPTorsionForce to calculate the forces acting on the system and the energy of the system.
+ */
+class CpuCalcCMAPTorsionForceKernel : public CalcCMAPTorsionForceKernel {
+public:
+    CpuCalcCMAPTorsionForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
+            CalcCMAPTorsionForceKernel(name, platform), data(data), torsionIndexArray(NULL) {
+    }
+    ~CpuCalcCMAPTorsionForceKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param force      the CMAPTorsionForce this kernel will be used for
+     */
+    void initialize(const System& system, const CMAPTorsionForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the CMAPTorsionForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const CMAPTorsionForce& force);
+private:
+    void computeMapCoefficients(const CMAPTorsionForce& force);
+    CpuPlatform::PlatformData& data;
+    int numTorsions;
+    std::vector<int> mapSizes;
+    int **torsionIndexArray;
+    CpuCMAPTorsionForce torsionForce;
+};
+
+/**
+ * This kernel is invoked by CustomBondForce to calculate the forces acting on the system and the energy of the system.
+ */
+class CpuCalcCustomBondForceKernel : public CalcCustomBondForceKernel {
+public:
+    CpuCalcCustomBondForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
+            CalcCustomBondForceKernel(name, platform), data(data), bondIndexArray(NULL), bondParamArray(NULL) {
+    }
+    ~CpuCalcCustomBondForceKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param force      the CustomBondForce this kernel will be used for
+     */
+    void initialize(const System& system, const CustomBondForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the CustomBondForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const CustomBondForce& force);
+private:
+    CpuPlatform::PlatformData& data;
+    int numBonds;
+    int **bondIndexArray;
+    RealOpenMM **bondParamArray;
+    std::vector<std::string> globalParameterNames;
+    std::vector<CpuCustomBondIxn*> ixn;
+    CpuBondForce bondForce;
+};
+
+/**
+ * This kernel is invoked by CustomAngleForce to calculate the forces acting on the system and the energy of the system.
+ */
+class CpuCalcCustomAngleForceKernel : public CalcCustomAngleForceKernel {
+public:
+    CpuCalcCustomAngleForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
+            CalcCustomAngleForceKernel(name, platform), data(data), angleIndexArray(NULL), angleParamArray(NULL) {
+    }
+    ~CpuCalcCustomAngleForceKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param force      the CustomAngleForce this kernel will be used for
+     */
+    void initialize(const System& system, const CustomAngleForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the CustomAngleForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const CustomAngleForce& force);
+private:
+    CpuPlatform::PlatformData& data;
+    int numAngles;
+    int **angleIndexArray;
+    RealOpenMM **angleParamArray;
+    std::vector<std::string> globalParameterNames;
+    std::vector<CpuCustomAngleIxn*> ixn;
+    CpuBondForce bondForce;
+};
+
+/**
+ * This kernel is invoked by CustomTorsionForce to calculate the forces acting on the system and the energy of the system.
+ */
+class CpuCalcCustomTorsionForceKernel : public CalcCustomTorsionForceKernel {
+public:
+    CpuCalcCustomTorsionForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
+            CalcCustomTorsionForceKernel(name, platform), data(data), torsionIndexArray(NULL), torsionParamArray(NULL) {
+    }
+    ~CpuCalcCustomTorsionForceKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param force      the CustomTorsionForce this kernel will be used for
+     */
+    void initialize(const System& system, const CustomTorsionForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the CustomTorsionForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const CustomTorsionForce& force);
+private:
+    CpuPlatform::PlatformData& data;
+    int numTorsions;
+    int **torsionIndexArray;
+    RealOpenMM **torsionParamArray;
+    std::vector<std::string> globalParameterNames;
+    std::vector<CpuCustomTorsionIxn*> ixn;
+    CpuBondForce bondForce;
+};
+
 /**
  * This kernel is invoked by NonbondedForce to calculate the forces acting on the system.
  */
@@ -206,18 +499,30 @@ public:
     void copyParametersToContext(ContextImpl& context, const NonbondedForce& force);
 private:
     class PmeIO;
+    /**
+     * Create the kernel for computing the reciprocal space part of PME, if the platform supports one.
+     */
+    void createPmeKernel(ContextImpl& context);
+    /**
+     * Time a set of candidate PME parameters that all give the requested accuracy, and switch to the fastest one.
+     */
+    void tunePmeParameters(ContextImpl& context);
+    /**
+     * Record the PME parameters currently in use so they can be queried with the CpuPmeParameters property.
+     */
+    void reportPmeParameters();
     CpuPlatform::PlatformData& data;
-    int numParticles, num14;
+    int numParticles, num14, pmeOrder;
     int **bonded14IndexArray;
     double **bonded14ParamArray;
     double nonbondedCutoff, switchingDistance, rfDielectric, ewaldAlpha, ewaldSelfEnergy, dispersionCoefficient;
+    double ewaldErrorTolerance, sumSquaredCharges;
     int kmax[3], gridSize[3];
-    bool useSwitchingFunction, useOptimizedPme, hasInitializedPme;
+    bool useSwitchingFunction, useOptimizedPme, hasInitializedPme, tunePme, canTuneCutoff;
     std::vector<std::set<int> > exclusions;
     std::vector<std::pair<float, float> > particleParams;
-    std::vector<RealVec> lastPositions;
     NonbondedMethod nonbondedMethod;
-    CpuNeighborList* neighborList;
+    CpuSharedNeighborList* neighborList;
     CpuNonbondedForce* nonbonded;
     Kernel optimizedPme;
 };
@@ -264,7 +569,7 @@ private:
     std::vector<std::string> parameterNames, globalParameterNames;
     std::vector<std::pair<std::set<int>, std::set<int> > > interactionGroups;
     NonbondedMethod nonbondedMethod;
-    CpuNeighborList* neighborList;
+    CpuSharedNeighborList* neighborList;
     CpuCustomNonbondedForce* nonbonded;
 };
 
@@ -273,9 +578,7 @@ private:
  */
 class CpuCalcGBSAOBCForceKernel : public CalcGBSAOBCForceKernel {
 public:
-    CpuCalcGBSAOBCForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) : CalcGBSAOBCForceKernel(name, platform),
-            data(data) {
-    }
+    CpuCalcGBSAOBCForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data);
     ~CpuCalcGBSAOBCForceKernel();
     /**
      * Initialize the kernel.
@@ -303,7 +606,11 @@ public:
 private:
     CpuPlatform::PlatformData& data;
     std::vector<std::pair<float, float> > particleParams;
-    CpuGBSAOBCForce obc;
+    std::vector<std::set<int> > noExclusions;
+    GBSAOBCForce::NonbondedMethod nonbondedMethod;
+    float nonbondedCutoff;
+    CpuSharedNeighborList* neighborList;
+    CpuGBSAOBCForce* obc;
 };
 
 /**
@@ -312,7 +619,7 @@ private:
 class CpuCalcCustomGBForceKernel : public CalcCustomGBForceKernel {
 public:
     CpuCalcCustomGBForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
-            CalcCustomGBForceKernel(name, platform), data(data) {
+            CalcCustomGBForceKernel(name, platform), data(data), neighborList(NULL) {
     }
     ~CpuCalcCustomGBForceKernel();
     /**
@@ -350,7 +657,49 @@ private:
     std::vector<OpenMM::CustomGBForce::ComputationType> valueTypes;
     std::vector<OpenMM::CustomGBForce::ComputationType> energyTypes;
     NonbondedMethod nonbondedMethod;
-    CpuNeighborList* neighborList;
+    CpuSharedNeighborList* neighborList;
+};
+
+/**
+ * This kernel is invoked by CustomHbondForce to calculate the forces acting on the system.
+ */
+class CpuCalcCustomHbondForceKernel : public CalcCustomHbondForceKernel {
+public:
+    CpuCalcCustomHbondForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) : CalcCustomHbondForceKernel(name, platform),
+            data(data), donorParamArray(NULL), acceptorParamArray(NULL), ixn(NULL) {
+    }
+    ~CpuCalcCustomHbondForceKernel();
+    /**
+     * Initialize the kernel.
+     *
+     * @param system     the System this kernel will be applied to
+     * @param force      the CustomHbondForce this kernel will be used for
+     */
+    void initialize(const System& system, const CustomHbondForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the CustomHbondForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const CustomHbondForce& force);
+private:
+    CpuPlatform::PlatformData& data;
+    int numDonors, numAcceptors;
+    RealOpenMM cutoffDistance;
+    RealOpenMM **donorParamArray, **acceptorParamArray;
+    CpuCustomHbondForce* ixn;
+    std::vector<std::string> globalParameterNames;
+    NonbondedMethod nonbondedMethod;
 };
 
 /**
@@ -359,7 +708,7 @@ private:
 class CpuCalcCustomManyParticleForceKernel : public CalcCustomManyParticleForceKernel {
 public:
     CpuCalcCustomManyParticleForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) : CalcCustomManyParticleForceKernel(name, platform),
-            data(data), ixn(NULL) {
+            data(data), ixn(NULL), neighborList(NULL) {
     }
     ~CpuCalcCustomManyParticleForceKernel();
     /**
@@ -393,6 +742,44 @@ private:
     CpuCustomManyParticleForce* ixn;
     std::vector<std::string> globalParameterNames;
     NonbondedMethod nonbondedMethod;
+    CpuSharedNeighborList* neighborList;
+};
+
+/**
+ * This kernel is invoked by VerletIntegrator to take one time step.
+ */
+class CpuIntegrateVerletStepKernel : public IntegrateVerletStepKernel {
+public:
+    CpuIntegrateVerletStepKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) : IntegrateVerletStepKernel(name, platform),
+            data(data), dynamics(NULL) {
+    }
+    ~CpuIntegrateVerletStepKernel();
+    /**
+     * Initialize the kernel, setting up the particle masses.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param integrator the VerletIntegrator this kernel will be used for
+     */
+    void initialize(const System& system, const VerletIntegrator& integrator);
+    /**
+     * Execute the kernel.
+     * 
+     * @param context    the context in which to execute this kernel
+     * @param integrator the VerletIntegrator this kernel is being used for
+     */
+    void execute(ContextImpl& context, const VerletIntegrator& integrator);
+    /**
+     * Compute the kinetic energy.
+     * 
+     * @param context    the context in which to execute this kernel
+     * @param integrator the VerletIntegrator this kernel is being used for
+     */
+    double computeKineticEnergy(ContextImpl& context, const VerletIntegrator& integrator);
+private:
+    CpuPlatform::PlatformData& data;
+    CpuVerletDynamics* dynamics;
+    std::vector<RealOpenMM> masses;
+    double prevStepSize;
 };
 
 /**
@@ -432,6 +819,43 @@ private:
     double prevTemp, prevFriction, prevStepSize;
 };
 
+/**
+ * This kernel is invoked by BrownianIntegrator to take one time step.
+ */
+class CpuIntegrateBrownianStepKernel : public IntegrateBrownianStepKernel {
+public:
+    CpuIntegrateBrownianStepKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) : IntegrateBrownianStepKernel(name, platform),
+            data(data), dynamics(NULL) {
+    }
+    ~CpuIntegrateBrownianStepKernel();
+    /**
+     * Initialize the kernel, setting up the particle masses.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param integrator the BrownianIntegrator this kernel will be used for
+     */
+    void initialize(const System& system, const BrownianIntegrator& integrator);
+    /**
+     * Execute the kernel.
+     * 
+     * @param context    the context in which to execute this kernel
+     * @param integrator the BrownianIntegrator this kernel is being used for
+     */
+    void execute(ContextImpl& context, const BrownianIntegrator& integrator);
+    /**
+     * Compute the kinetic energy.
+     * 
+     * @param context    the context in which to execute this kernel
+     * @param integrator the BrownianIntegrator this kernel is being used for
+     */
+    double computeKineticEnergy(ContextImpl& context, const BrownianIntegrator& integrator);
+private:
+    CpuPlatform::PlatformData& data;
+    CpuBrownianDynamics* dynamics;
+    std::vector<RealOpenMM> masses;
+    double prevTemp, prevFriction, prevStepSize;
+};
+
 } // namespace OpenMM
 
 #endif /*OPENMM_CPUKERNELS_H_*/
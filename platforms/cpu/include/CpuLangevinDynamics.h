@@ -28,6 +28,7 @@
 
 #include "ReferenceStochasticDynamics.h"
 #include "CpuRandom.h"
+#include "CpuVirtualSites.h"
 #include "openmm/internal/ThreadPool.h"
 #include "sfmt/SFMT.h"
 
@@ -45,9 +46,10 @@ public:
      * @param tau            viscosity
      * @param temperature    temperature
      * @param threads        thread pool for parallelizing computation
+     * @param vsites         computes the positions of virtual sites
      * @param random         random number generator
      */
-    CpuLangevinDynamics(int numberOfAtoms, RealOpenMM deltaT, RealOpenMM tau, RealOpenMM temperature, OpenMM::ThreadPool& threads, OpenMM::CpuRandom& random);
+    CpuLangevinDynamics(int numberOfAtoms, RealOpenMM deltaT, RealOpenMM tau, RealOpenMM temperature, OpenMM::ThreadPool& threads, OpenMM::CpuVirtualSites& vsites, OpenMM::CpuRandom& random);
 
     /**
      * Destructor.
@@ -80,10 +82,19 @@ public:
     void updatePart2(int numberOfAtoms, std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& velocities,
                      std::vector<OpenMM::RealVec>& forces, std::vector<RealOpenMM>& inverseMasses, std::vector<OpenMM::RealVec>& xPrime);
 
+    /**
+     * Compute the positions of all virtual sites.
+     * 
+     * @param system              the System being integrated
+     * @param atomCoordinates     atom coordinates
+     */
+    void computeVirtualSites(const OpenMM::System& system, std::vector<OpenMM::RealVec>& atomCoordinates);
+
 private:
     void threadUpdate1(int threadIndex);
     void threadUpdate2(int threadIndex);
     OpenMM::ThreadPool& threads;
+    OpenMM::CpuVirtualSites& vsites;
     OpenMM::CpuRandom& random;
     std::vector<OpenMM_SFMT::SFMT> threadRandom;
     // The following variables are used to make information accessible to the individual threads.
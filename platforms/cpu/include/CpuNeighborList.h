@@ -45,28 +45,67 @@ namespace OpenMM {
 class OPENMM_EXPORT_CPU CpuNeighborList {
 public:
     class ThreadTask;
+    class BlockTask;
     class Voxels;
+    /**
+     * The number of atoms in each cluster of neighbors.  Clusters are formed from consecutive atoms
+     * in the sorted order, so their positions can be loaded together.
+     */
+    static const int ClusterSize = 4;
     CpuNeighborList(int blockSize);
     void computeNeighborList(int numAtoms, const AlignedArray<float>& atomLocations, const std::vector<std::set<int> >& exclusions,
             const RealVec* periodicBoxVectors, bool usePeriodic, float maxDistance, ThreadPool& threads);
+    int getBlockSize() const;
     int getNumBlocks() const;
     const std::vector<int>& getSortedAtoms() const;
     const std::vector<int>& getBlockNeighbors(int blockIndex) const;
     const std::vector<char>& getBlockExclusions(int blockIndex) const;
     /**
-     * This routine contains the code executed by each thread.
+     * Get whether the neighbors of each block are also grouped into clusters.
+     */
+    bool getUseClusters() const;
+    /**
+     * Set whether the neighbors of each block should also be grouped into clusters.  This takes effect the
+     * next time the neighbor list is computed.
+     */
+    void setUseClusters(bool use);
+    /**
+     * Get the clusters that contain neighbors of a block.  Cluster c consists of the atoms with sorted
+     * indices ClusterSize*c through ClusterSize*c+ClusterSize-1.  This is only available if clusters are enabled.
+     */
+    const std::vector<int>& getBlockClusters(int blockIndex) const;
+    /**
+     * Get the exclusion masks for the clusters returned by getBlockClusters().  There are ClusterSize
+     * elements for each cluster, one for each of its atoms.  Atoms that are not neighbors of the block
+     * are marked as excluded from every atom in it.
+     */
+    const std::vector<char>& getBlockClusterExclusions(int blockIndex) const;
+    /**
+     * This routine contains the code executed by each thread to sort the atoms along the Hilbert curve
+     * and build the voxel hash.  The master thread combines the results of each stage.
+     */
+    void threadBuildVoxels(ThreadPool& threads, int threadIndex);
+    /**
+     * Find the neighbors of a range of blocks.  The number of neighbors varies between blocks, so this
+     * is run with ThreadPool::parallelFor() to balance the load between threads.
      */
-    void threadComputeNeighborList(ThreadPool& threads, int threadIndex);
+    void computeBlockNeighbors(int startBlock, int endBlock);
     void runThread(int index);
 private:
     int blockSize;
-    std::vector<int> sortedAtoms;
+    bool useClusters;
+    std::vector<int> sortedAtoms, atomSortedIndex;
     std::vector<float> sortedPositions;
     std::vector<std::vector<int> > blockNeighbors;
     std::vector<std::vector<char> > blockExclusions;
+    std::vector<std::vector<int> > blockClusters;
+    std::vector<std::vector<char> > blockClusterExclusions;
     // The following variables are used to make information accessible to the individual threads.
     float minx, maxx, miny, maxy, minz, maxz;
-    std::vector<std::pair<int, int> > atomBins;
+    std::vector<std::pair<int, int> > atomBins, sortedAtomBins;
+    std::vector<int> atomVoxel, voxelStart, threadCounts;
+    std::vector<std::pair<float, int> > voxelItems;
+    std::vector<float> threadBounds;
     Voxels* voxels;
     const std::vector<std::set<int> >* exclusions;
     const float* atomLocations;
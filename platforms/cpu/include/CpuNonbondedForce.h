@@ -40,6 +40,7 @@ namespace OpenMM {
 class CpuNonbondedForce {
     public:
         class ComputeDirectTask;
+        class SortAtomsTask;
 
       /**---------------------------------------------------------------------------------------
       
@@ -109,10 +110,11 @@ class CpuNonbondedForce {
       
          @param alpha    the Ewald separation parameter
          @param gridSize the dimensions of the mesh
+         @param order    the B-spline interpolation order
       
          --------------------------------------------------------------------------------------- */
       
-      void setUsePME(float alpha, int meshSize[3]);
+      void setUsePME(float alpha, int meshSize[3], int order=5);
 
       /**---------------------------------------------------------------------------------------
       
@@ -126,12 +128,13 @@ class CpuNonbondedForce {
                                  exclusions[atomIndex] contains the list of exclusions for that atom
          @param forces           force array (forces added)
          @param totalEnergy      total energy
+         @param virial           the nine components of the virial tensor (added), or NULL
             
          --------------------------------------------------------------------------------------- */
           
       void calculateReciprocalIxn(int numberOfAtoms, float* posq, const std::vector<RealVec>& atomCoordinates,
                             const std::vector<std::pair<float, float> >& atomParameters, const std::vector<std::set<int> >& exclusions,
-                            std::vector<RealVec>& forces, double* totalEnergy) const;
+                            std::vector<RealVec>& forces, double* totalEnergy, double* virial) const;
       
       /**---------------------------------------------------------------------------------------
       
@@ -145,17 +148,25 @@ class CpuNonbondedForce {
                                  exclusions[atomIndex] contains the list of exclusions for that atom
          @param forces           force array (forces added)
          @param totalEnergy      total energy
+         @param virial           the nine components of the virial tensor (added), or NULL
          @param threads          the thread pool to use
       
          --------------------------------------------------------------------------------------- */
           
       void calculateDirectIxn(int numberOfAtoms, float* posq, const std::vector<RealVec>& atomCoordinates, const std::vector<std::pair<float, float> >& atomParameters,
-            const std::vector<std::set<int> >& exclusions, std::vector<AlignedArray<float> >& threadForce, double* totalEnergy, ThreadPool& threads);
+            const std::vector<std::set<int> >& exclusions, std::vector<AlignedArray<float> >& threadForce, double* totalEnergy, double* virial, ThreadPool& threads);
 
     /**
-     * This routine contains the code executed by each thread.
+     * Compute the direct space interactions for a range of atom blocks, or of atoms if no neighbor list
+     * is being used.  This is executed by the threads with ThreadPool::parallelFor().
      */
-    void threadComputeDirect(ThreadPool& threads, int threadIndex);
+    void computeDirectRange(int threadIndex, int start, int end);
+
+    /**
+     * Copy the positions, charges, and parameters of a range of atoms into sortedPosq and sortedParameters,
+     * in the order given by the neighbor list.  This is executed by the threads with ThreadPool::parallelFor().
+     */
+    void sortAtomRange(int start, int end);
 
 protected:
         bool cutoff;
@@ -173,10 +184,10 @@ protected:
         float krf, crf;
         float alphaEwald;
         int numRx, numRy, numRz;
-        int meshDim[3];
+        int meshDim[3], pmeOrder;
         std::vector<float> erfcTable, ewaldScaleTable;
         float ewaldDX, ewaldDXInv, erfcDXInv;
-        std::vector<double> threadEnergy;
+        std::vector<double> threadEnergy, threadVirial;
         // The following variables are used to make information accessible to the individual threads.
         int numberOfAtoms;
         float* posq;
@@ -184,8 +195,11 @@ protected:
         std::pair<float, float> const* atomParameters;        
         std::set<int> const* exclusions;
         std::vector<AlignedArray<float> >* threadForce;
-        bool includeEnergy;
-        void* atomicCounter;
+        bool includeEnergy, includeVirial;
+        // When the neighbor list has clusters, the atom data is also stored in sorted order so the atoms of
+        // each block and each cluster can be loaded from consecutive memory.
+        AlignedArray<float> sortedPosq;
+        std::vector<std::pair<float, float> > sortedParameters;
 
         static const float TWO_OVER_SQRT_PI;
         static const int NUM_TABLE_POINTS;
@@ -198,10 +212,11 @@ protected:
          @param atom2            the index of the second atom
          @param forces           force array (forces added)
          @param totalEnergy      total energy
+         @param virial           virial (xx, yy, zz, xy, xz, yz components added), or NULL
             
          --------------------------------------------------------------------------------------- */
           
-      void calculateOneIxn(int atom1, int atom2, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
+      void calculateOneIxn(int atom1, int atom2, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize);
             
       /**---------------------------------------------------------------------------------------
       
@@ -210,10 +225,11 @@ protected:
          @param blockIndex       the index of the atom block
          @param forces           force array (forces added)
          @param totalEnergy      total energy
+         @param virial           virial (xx, yy, zz, xy, xz, yz components added), or NULL
             
          --------------------------------------------------------------------------------------- */
           
-      virtual void calculateBlockIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) = 0;
+      virtual void calculateBlockIxn(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize) = 0;
             
       /**---------------------------------------------------------------------------------------
       
@@ -222,10 +238,11 @@ protected:
          @param blockIndex       the index of the atom block
          @param forces           force array (forces added)
          @param totalEnergy      total energy
+         @param virial           virial (xx, yy, zz, xy, xz, yz components added), or NULL
             
          --------------------------------------------------------------------------------------- */
           
-      virtual void calculateBlockEwaldIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) = 0;
+      virtual void calculateBlockEwaldIxn(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize) = 0;
 
       /**
        * Compute the displacement and squared distance between two points, optionally using
@@ -233,6 +250,12 @@ protected:
        */
       void getDeltaR(const fvec4& posI, const fvec4& posJ, fvec4& deltaR, float& r2, bool periodic, const fvec4& boxSize, const fvec4& invBoxSize) const;
 
+      /**
+       * Add the virial of a pair interaction, whose force on the first atom is deltaR*dEdR, to the
+       * six independent components (xx, yy, zz, xy, xz, yz) of a virial tensor.
+       */
+      static void addPairVirial(double* virial, const fvec4& deltaR, float dEdR);
+
       /**
        * Create a lookup table for the scale factor used with Ewald and PME.
        */
@@ -47,16 +47,17 @@ protected:
          @param blockIndex       the index of the atom block
          @param forces           force array (forces added)
          @param totalEnergy      total energy
+         @param virial           virial (xx, yy, zz, xy, xz, yz components added), or NULL
             
          --------------------------------------------------------------------------------------- */
           
-      void calculateBlockIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
+      void calculateBlockIxn(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize);
       
       /**
        * Templatized implementation of calculateBlockIxn.
        */
       template <int PERIODIC_TYPE>
-      void calculateBlockIxnImpl(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter);
+      void calculateBlockIxnImpl(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter);
             
       /**---------------------------------------------------------------------------------------
       
@@ -65,16 +66,17 @@ protected:
          @param blockIndex       the index of the atom block
          @param forces           force array (forces added)
          @param totalEnergy      total energy
+         @param virial           virial (xx, yy, zz, xy, xz, yz components added), or NULL
             
          --------------------------------------------------------------------------------------- */
           
-      void calculateBlockEwaldIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
+      void calculateBlockEwaldIxn(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize);
 
       /**
        * Templatized implementation of calculateBlockEwaldIxn.
        */
       template <int PERIODIC_TYPE>
-      void calculateBlockEwaldIxnImpl(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter);
+      void calculateBlockEwaldIxnImpl(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter);
 
       /**
        * Compute the displacement and squared distance between a collection of points, optionally using
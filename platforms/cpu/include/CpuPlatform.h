@@ -34,6 +34,8 @@
 
 #include "AlignedArray.h"
 #include "CpuRandom.h"
+#include "CpuSharedNeighborList.h"
+#include "CpuVirtualSites.h"
 #include "ReferencePlatform.h"
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/internal/ThreadPool.h"
@@ -67,6 +69,98 @@ public:
         static const std::string key = "CpuThreads";
         return key;
     }
+    /**
+     * This is the name of the parameter for selecting how many of the threads to dedicate to the reciprocal
+     * space part of PME.  If this is greater than 0, those threads compute reciprocal space concurrently with
+     * the direct space calculation, which is done by the remaining threads.
+     */
+    static const std::string& CpuPmeThreads() {
+        static const std::string key = "CpuPmeThreads";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for selecting the order of the B-splines used by PME, which may be
+     * from 4 to 8.  The grid size is chosen to match it.
+     */
+    static const std::string& CpuPmeOrder() {
+        static const std::string key = "CpuPmeOrder";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for enabling automatic tuning of the PME parameters.  If it is "true",
+     * the first force evaluation times several combinations of cutoff, Ewald alpha, grid size, and interpolation
+     * order that give the same accuracy, and the fastest one is used from then on.
+     */
+    static const std::string& CpuPmeTuning() {
+        static const std::string key = "CpuPmeTuning";
+        return key;
+    }
+    /**
+     * This is the name of a read-only property that reports the PME parameters in use (cutoff, alpha, grid size,
+     * and order).  They may be set explicitly on the NonbondedForce and CpuPmeOrder to reuse them without tuning again.
+     */
+    static const std::string& CpuPmeParameters() {
+        static const std::string key = "CpuPmeParameters";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for selecting how threads wait for each other.  If it is "true", a
+     * thread that reaches a synchronization point polls for a short time before blocking.  This reduces the
+     * synchronization overhead for small systems, but keeps the cores busy while threads wait.
+     */
+    static const std::string& CpuSpinWait() {
+        static const std::string key = "CpuSpinWait";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for pinning threads to specific cores.  It is a comma separated list of
+     * core indices and ranges, such as "0-15,32-47".  The threads are assigned to the listed cores in order.  If
+     * it is empty (the default), the operating system is free to move threads between cores.
+     */
+    static const std::string& CpuAffinity() {
+        static const std::string key = "CpuAffinity";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for selecting where memory is placed on machines with multiple NUMA nodes.
+     * If it is "local", each thread's working buffers are allocated and first written by that thread, so the
+     * operating system places them on the thread's own node.  If it is "default", no special placement is done.
+     */
+    static const std::string& CpuNumaPolicy() {
+        static const std::string key = "CpuNumaPolicy";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for sharing threads between Contexts.  If it is "true", the Context uses a
+     * pool of threads shared by all Contexts in the process that have this property set and the same number of
+     * threads.  The Contexts take turns using the threads, so many Contexts can be run at once from different
+     * threads without creating more threads than there are cores.
+     */
+    static const std::string& CpuSharedThreads() {
+        static const std::string key = "CpuSharedThreads";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for enabling adaptive tuning of the neighbor list padding.  If it is "true",
+     * the distance beyond the cutoff included in neighbor lists is adjusted each time a list is rebuilt, based on
+     * how long the previous list lasted and how much time was spent building it and computing interactions.
+     */
+    static const std::string& CpuAdaptivePadding() {
+        static const std::string key = "CpuAdaptivePadding";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for selecting how often neighbor lists should be rebuilt when
+     * CpuAdaptivePadding is enabled.  If it is greater than 0, the padding is tuned so lists are rebuilt about
+     * once every that many force evaluations.  This equals the number of steps only for integrators that
+     * evaluate forces once per step, with no other evaluations such as barostat moves or getState() calls.
+     * If it is 0 (the default), the padding is tuned to minimize the total time, counting only the time
+     * spent by NonbondedForce.
+     */
+    static const std::string& CpuTargetRebuildInterval() {
+        static const std::string key = "CpuTargetRebuildInterval";
+        return key;
+    }
     /**
      * We cannot use the standard mechanism for platform data, because that is already used by the superclass.
      * Instead, we maintain a table of ContextImpls to PlatformDatas.
@@ -79,13 +173,32 @@ private:
 
 class CpuPlatform::PlatformData {
 public:
-    PlatformData(int numParticles, int numThreads);
+    PlatformData(int numParticles, int numThreads, int numPmeThreads, int pmeOrder, bool tunePme, bool spinWait,
+            const std::string& affinity, bool numaLocal, bool sharedThreads, bool adaptivePadding, int targetRebuildInterval);
+    ~PlatformData();
+    /**
+     * Get a neighbor list for a force to use.  If another force in the Context has already requested one with
+     * the same requirements, the same list is returned, so it is only built once for all of them.  Each call
+     * must be balanced by a call to releaseNeighborList().  If adaptive padding is enabled, the padding is only
+     * the initial value.
+     */
+    CpuSharedNeighborList* requestNeighborList(int blockSize, double cutoff, double padding, bool periodic, const std::vector<std::set<int> >& exclusions);
+    /**
+     * Release a neighbor list returned by requestNeighborList().  It is deleted once no force is using it.
+     */
+    void releaseNeighborList(CpuSharedNeighborList* neighborList);
     AlignedArray<float> posq;
     std::vector<AlignedArray<float> > threadForce;
-    ThreadPool threads;
-    bool isPeriodic;
+    ThreadPool& threads;
+    ThreadPool* pmeThreads;
+    int pmeOrder;
+    int computation, targetRebuildInterval;
+    bool tunePme, isPeriodic, includeVirial, sharedThreads, adaptivePadding;
+    double virial[9];
     CpuRandom random;
+    CpuVirtualSites vsites;
     std::map<std::string, std::string> propertyValues;
+    std::vector<std::pair<CpuSharedNeighborList*, int> > neighborLists;
 };
 
 } // namespace OpenMM
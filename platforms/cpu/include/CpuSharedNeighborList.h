@@ -0,0 +1,168 @@
+#ifndef OPENMM_CPU_SHARED_NEIGHBOR_LIST_H_
+#define OPENMM_CPU_SHARED_NEIGHBOR_LIST_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2016 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "AlignedArray.h"
+#include "CpuNeighborList.h"
+#include "RealVec.h"
+#include "windowsExportCpu.h"
+#include "openmm/internal/ThreadPool.h"
+#include <set>
+#include <vector>
+
+namespace OpenMM {
+
+/**
+ * This class holds a CpuNeighborList that may be used by several forces in the same Context.  The list is built
+ * with a padding beyond the cutoff, and is only rebuilt when particles have moved far enough that some pair
+ * inside the cutoff might be missing from it.  Forces that use the list must check the cutoff themselves.
+ * 
+ * Instances are created by CpuPlatform::PlatformData::requestNeighborList(), which returns an existing list
+ * whenever the block size, cutoff, padding, periodicity, and exclusions all match.
+ * 
+ * The padding may optionally be tuned as the simulation runs.  A larger padding makes the list last longer
+ * but contain more pairs, so each time the list is rebuilt the padding is adjusted based on how long the
+ * previous one lasted, how long it took to build, and how long forces spent computing interactions with it.
+ */
+class OPENMM_EXPORT_CPU CpuSharedNeighborList {
+public:
+    class CheckTask;
+    class SavePositionsTask;
+    CpuSharedNeighborList(int blockSize, double cutoff, double padding, bool periodic, const std::vector<std::set<int> >& exclusions);
+    /**
+     * Get whether this list can be used by a force with the specified requirements.
+     */
+    bool isCompatible(int blockSize, double cutoff, double padding, bool periodic, const std::vector<std::set<int> >& exclusions) const;
+    /**
+     * Rebuild the neighbor list if it is no longer valid for the current positions.  Only the first call for
+     * each force evaluation checks the positions, so every force using the list may call this.
+     * 
+     * @param computation   an index that identifies the current force evaluation
+     * @param posq          the positions and charges of the particles in single precision
+     * @param positions     the positions of the particles in double precision
+     * @param boxVectors    the current periodic box vectors
+     * @param threads       the thread pool to use for building the list
+     */
+    void update(int computation, const AlignedArray<float>& posq, const std::vector<RealVec>& positions, const RealVec* boxVectors, ThreadPool& threads);
+    /**
+     * Force the list to be rebuilt the next time update() is called.
+     */
+    void invalidate();
+    /**
+     * Request that the neighbors also be grouped into clusters.  Forces that do not use them simply
+     * ignore them, so this does not affect whether the list can be shared.
+     */
+    void requestClusters();
+    /**
+     * Enable tuning of the padding.  If targetInterval is greater than 0, the padding is adjusted so the list is
+     * rebuilt about once every targetInterval force evaluations.  Otherwise it is chosen to minimize the total
+     * time spent building the list and computing interactions, as reported with recordInteractionTime().
+     */
+    void setAdaptivePadding(int targetInterval);
+    /**
+     * Record how long a force spent computing interactions with the list during the current force evaluation,
+     * in microseconds.  This is used for tuning the padding.
+     */
+    void recordInteractionTime(long long time);
+    /**
+     * Get the padding the list is currently built with.  This may differ from the one it was created with
+     * if adaptive tuning is enabled.
+     */
+    double getPadding() const {
+        return padding;
+    }
+    const CpuNeighborList& getNeighborList() const {
+        return neighborList;
+    }
+    double getCutoff() const {
+        return cutoff;
+    }
+    /**
+     * Get the number of times the positions have been checked to see whether the list needs to be rebuilt.
+     */
+    long long getNumChecks() const {
+        return numChecks;
+    }
+    /**
+     * Get the number of times the list has been rebuilt.
+     */
+    long long getNumRebuilds() const {
+        return numRebuilds;
+    }
+    /**
+     * Get the average number of checks between rebuilds.  This is the number of steps the padding lasts
+     * when the list is checked once per step.
+     */
+    double getAverageRebuildInterval() const {
+        return (numRebuilds == 0 ? 0.0 : numChecks/(double) numRebuilds);
+    }
+    /**
+     * This routine contains the code executed by each thread to find the particles in its range that have
+     * moved since the list was built.
+     */
+    void threadCheckDisplacements(int threadIndex, int numThreads);
+    /**
+     * Record the positions of a range of particles as the ones the list was built for.  This is executed by
+     * the threads with ThreadPool::parallelFor().
+     */
+    void savePositions(int start, int end);
+private:
+    bool needsRebuild(const std::vector<RealVec>& positions, const RealVec* boxVectors, ThreadPool& threads);
+    bool findMissingPair(const RealVec* boxVectors);
+    void tunePadding(const RealVec* boxVectors);
+    CpuNeighborList neighborList;
+    int blockSize, lastComputation;
+    double cutoff, padding, initialPadding;
+    bool periodic;
+    std::vector<std::set<int> > exclusions;
+    std::vector<RealVec> lastPositions;
+    RealVec lastBoxVectors[3];
+    long long numChecks, numRebuilds;
+    // Statistics used for tuning the padding.
+    bool adaptive;
+    int targetInterval;
+    long long checksAtLastRebuild, lastBuildTime, intervalInteractionTime;
+    // Scratch space for checking whether the list is still valid.  It is kept between calls so the check
+    // does not need to allocate memory.
+    std::vector<std::vector<int> > threadMoved;
+    std::vector<int> threadTooFar, moved, movedCell, cellStart, cellMoved;
+    // The following variables are used to make information accessible to the individual threads.
+    const RealVec* positions;
+    RealVec boxVectors[3];
+    double scale, closeCutoff2, farCutoff2;
+    int maxNumMoved;
+};
+
+} // namespace OpenMM
+
+#endif // OPENMM_CPU_SHARED_NEIGHBOR_LIST_H_
@@ -0,0 +1,94 @@
+#ifndef OPENMM_CPU_VIRTUAL_SITES_H_
+#define OPENMM_CPU_VIRTUAL_SITES_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "RealVec.h"
+#include "windowsExportCpu.h"
+#include "openmm/System.h"
+#include "openmm/internal/ThreadPool.h"
+#include <vector>
+
+namespace OpenMM {
+
+/**
+ * This class computes the positions of virtual sites and distributes the forces on them in parallel.
+ * Sites are divided into groups that share parent atoms, and each group is assigned to a single thread
+ * so that no two threads ever write to the same atom.  Within each thread, sites of each common type
+ * (TwoParticleAverageSite, ThreeParticleAverageSite, and OutOfPlaneSite) are stored as separate
+ * structure-of-arrays batches.  Any other sites, as well as sites that depend on other virtual sites,
+ * are handled serially by ReferenceVirtualSites.
+ */
+class OPENMM_EXPORT_CPU CpuVirtualSites {
+public:
+    class ComputePositionsTask;
+    class DistributeForcesTask;
+    CpuVirtualSites();
+    /**
+     * Initialize the object.
+     *
+     * @param system    the System whose virtual sites should be computed
+     * @param threads   the thread pool to use for parallelizing computation
+     */
+    void initialize(const System& system, ThreadPool& threads);
+    /**
+     * Compute the positions of all virtual sites.
+     */
+    void computePositions(std::vector<OpenMM::RealVec>& atomCoordinates);
+    /**
+     * Distribute forces from virtual sites to the atoms they are based on.
+     */
+    void distributeForces(const std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& forces);
+private:
+    /**
+     * This holds the virtual sites processed by one thread.
+     */
+    class ThreadSites {
+    public:
+        std::vector<int> twoSite, twoAtom1, twoAtom2;
+        std::vector<double> twoWeight1, twoWeight2;
+        std::vector<int> threeSite, threeAtom1, threeAtom2, threeAtom3;
+        std::vector<double> threeWeight1, threeWeight2, threeWeight3;
+        std::vector<int> outOfPlaneSite, outOfPlaneAtom1, outOfPlaneAtom2, outOfPlaneAtom3;
+        std::vector<double> outOfPlaneWeight12, outOfPlaneWeight13, outOfPlaneWeightCross;
+    };
+    void threadComputePositions(int threadIndex, std::vector<OpenMM::RealVec>& atomCoordinates);
+    void threadDistributeForces(int threadIndex, const std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& forces);
+    const System* system;
+    ThreadPool* threads;
+    std::vector<ThreadSites> threadSites;
+    std::vector<int> serialSites;
+};
+
+} // namespace OpenMM
+
+#endif /*OPENMM_CPU_VIRTUAL_SITES_H_*/
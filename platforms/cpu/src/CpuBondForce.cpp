@@ -38,12 +38,12 @@ using namespace std;
 class CpuBondForce::ComputeForceTask : public ThreadPool::Task {
 public:
     ComputeForceTask(CpuBondForce& owner, vector<RealVec>& atomCoordinates, RealOpenMM** parameters, vector<RealVec>& forces, 
-        vector<RealOpenMM>& threadEnergy, RealOpenMM* totalEnergy, ReferenceBondIxn& referenceBondIxn) : owner(owner), atomCoordinates(atomCoordinates),
-        parameters(parameters), forces(forces), threadEnergy(threadEnergy), totalEnergy(totalEnergy), referenceBondIxn(referenceBondIxn) {
+        vector<RealOpenMM>& threadEnergy, RealOpenMM* totalEnergy, vector<ReferenceBondIxn*>& threadBondIxn) : owner(owner), atomCoordinates(atomCoordinates),
+        parameters(parameters), forces(forces), threadEnergy(threadEnergy), totalEnergy(totalEnergy), threadBondIxn(threadBondIxn) {
     }
     void execute(ThreadPool& threads, int threadIndex) {
         RealOpenMM* energy = (totalEnergy == NULL ? NULL : &threadEnergy[threadIndex]);
-        owner.threadComputeForce(threads, threadIndex, atomCoordinates, parameters, forces, energy, referenceBondIxn);
+        owner.threadComputeForce(threads, threadIndex, atomCoordinates, parameters, forces, energy, *threadBondIxn[threadIndex]);
     }
     CpuBondForce& owner;
     vector<RealVec>& atomCoordinates;
@@ -51,7 +51,7 @@ public:
     vector<RealVec>& forces;
     vector<RealOpenMM>& threadEnergy;
     RealOpenMM* totalEnergy;
-    ReferenceBondIxn& referenceBondIxn;
+    vector<ReferenceBondIxn*>& threadBondIxn;
 };
 
 CpuBondForce::CpuBondForce() {
@@ -185,10 +185,16 @@ void CpuBondForce::assignBond(int bond, int thread, vector<int>& atomThread, vec
 
 void CpuBondForce::calculateForce(vector<RealVec>& atomCoordinates, RealOpenMM** parameters, vector<RealVec>& forces, 
         RealOpenMM* totalEnergy, ReferenceBondIxn& referenceBondIxn) {
+    vector<ReferenceBondIxn*> threadBondIxn(threads->getNumThreads(), &referenceBondIxn);
+    calculateForce(atomCoordinates, parameters, forces, totalEnergy, threadBondIxn);
+}
+
+void CpuBondForce::calculateForce(vector<RealVec>& atomCoordinates, RealOpenMM** parameters, vector<RealVec>& forces, 
+        RealOpenMM* totalEnergy, vector<ReferenceBondIxn*>& threadBondIxn) {
     // Have the worker threads compute their forces.
     
     vector<RealOpenMM> threadEnergy(threads->getNumThreads(), 0);
-    ComputeForceTask task(*this, atomCoordinates, parameters, forces, threadEnergy, totalEnergy, referenceBondIxn);
+    ComputeForceTask task(*this, atomCoordinates, parameters, forces, threadEnergy, totalEnergy, threadBondIxn);
     threads->execute(task);
     threads->waitForThreads();
     
@@ -196,7 +202,7 @@ void CpuBondForce::calculateForce(vector<RealVec>& atomCoordinates, RealOpenMM**
     
     for (int i = 0; i < extraBonds.size(); i++) {
         int bond = extraBonds[i];
-        referenceBondIxn.calculateBondIxn(bondAtoms[bond], atomCoordinates, parameters[bond], forces, totalEnergy);
+        threadBondIxn[0]->calculateBondIxn(bondAtoms[bond], atomCoordinates, parameters[bond], forces, totalEnergy);
     }
 
     // Compute the total energy.
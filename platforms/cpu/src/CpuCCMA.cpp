@@ -0,0 +1,235 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuCCMA.h"
+
+using namespace OpenMM;
+using namespace std;
+
+class CpuCCMA::ComputeDeltasTask : public ThreadPool::Task {
+public:
+    ComputeDeltasTask(CpuCCMA& owner, bool computeDirections) : owner(owner), computeDirections(computeDirections) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        owner.threadComputeDeltas(threadIndex, computeDirections);
+    }
+    CpuCCMA& owner;
+    bool computeDirections;
+};
+
+class CpuCCMA::MultiplyTask : public ThreadPool::Task {
+public:
+    MultiplyTask(CpuCCMA& owner) : owner(owner) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        owner.threadMultiply(threadIndex);
+    }
+    CpuCCMA& owner;
+};
+
+class CpuCCMA::UpdateAtomsTask : public ThreadPool::Task {
+public:
+    UpdateAtomsTask(CpuCCMA& owner) : owner(owner) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        owner.threadUpdateAtoms(threadIndex);
+    }
+    CpuCCMA& owner;
+};
+
+CpuCCMA::CpuCCMA(const System& system, const ReferenceCCMAAlgorithm& ccma, ThreadPool& threads) : threads(threads), hasInitializedMasses(false) {
+    numConstraints = ccma.getNumberOfConstraints();
+    maxIterations = ccma.getMaximumNumberOfIterations();
+    atom1.resize(numConstraints);
+    atom2.resize(numConstraints);
+    distance.resize(numConstraints);
+    for (int i = 0; i < numConstraints; i++)
+        ccma.getConstraintParameters(i, atom1[i], atom2[i], distance[i]);
+    reducedMasses.resize(numConstraints);
+    d_ij2.resize(numConstraints);
+    constraintDelta.resize(numConstraints);
+    tempDelta.resize(numConstraints);
+    r_ij.resize(numConstraints);
+
+    // Store the matrix in compressed sparse row format.
+
+    const vector<vector<pair<int, RealOpenMM> > >& matrix = ccma.getMatrix();
+    for (int i = 0; i < (int) matrix.size(); i++) {
+        matrixRowStart.push_back(matrixValue.size());
+        for (int j = 0; j < (int) matrix[i].size(); j++) {
+            matrixColIndex.push_back(matrix[i][j].first);
+            matrixValue.push_back(matrix[i][j].second);
+        }
+    }
+    matrixRowStart.push_back(matrixValue.size());
+
+    // Record the constraints each atom is involved in.  A constraint is stored as its index if the
+    // atom is the first one in it, or as -1-index if it is the second one.
+
+    int numAtoms = system.getNumParticles();
+    vector<vector<int> > atomConstraintList(numAtoms);
+    for (int i = 0; i < numConstraints; i++) {
+        atomConstraintList[atom1[i]].push_back(i);
+        atomConstraintList[atom2[i]].push_back(-1-i);
+    }
+    for (int i = 0; i < numAtoms; i++) {
+        if (atomConstraintList[i].size() > 0) {
+            constrainedAtoms.push_back(i);
+            atomConstraintStart.push_back(atomConstraints.size());
+            atomConstraints.insert(atomConstraints.end(), atomConstraintList[i].begin(), atomConstraintList[i].end());
+        }
+    }
+    atomConstraintStart.push_back(atomConstraints.size());
+
+    // Divide the constraints and atoms between threads.
+
+    int numThreads = threads.getNumThreads();
+    int numConstrainedAtoms = constrainedAtoms.size();
+    for (int i = 0; i <= numThreads; i++) {
+        constraintBlockStart.push_back(i*numConstraints/numThreads);
+        atomBlockStart.push_back(i*numConstrainedAtoms/numThreads);
+    }
+    threadConverged.resize(numThreads);
+}
+
+void CpuCCMA::apply(vector<OpenMM::RealVec>& atomCoordinates, vector<OpenMM::RealVec>& atomCoordinatesP, vector<RealOpenMM>& inverseMasses, RealOpenMM tolerance) {
+    applyConstraints(atomCoordinates, atomCoordinatesP, inverseMasses, false, tolerance);
+}
+
+void CpuCCMA::applyToVelocities(vector<OpenMM::RealVec>& atomCoordinates, vector<OpenMM::RealVec>& velocities, vector<RealOpenMM>& inverseMasses, RealOpenMM tolerance) {
+    applyConstraints(atomCoordinates, velocities, inverseMasses, true, tolerance);
+}
+
+void CpuCCMA::applyConstraints(vector<RealVec>& atomCoordinates, vector<RealVec>& atomCoordinatesP, vector<RealOpenMM>& inverseMasses,
+            bool constrainingVelocities, RealOpenMM tolerance) {
+    if (numConstraints == 0)
+        return;
+
+    // Calculate reduced masses on the first pass.
+
+    if (!hasInitializedMasses) {
+        hasInitializedMasses = true;
+        for (int i = 0; i < numConstraints; i++)
+           reducedMasses[i] = 0.5/(inverseMasses[atom1[i]] + inverseMasses[atom2[i]]);
+    }
+
+    // Record the parameters for the threads.
+
+    this->atomCoordinates = &atomCoordinates[0];
+    this->atomCoordinatesP = &atomCoordinatesP[0];
+    this->inverseMasses = &inverseMasses[0];
+    this->constrainingVelocities = constrainingVelocities;
+    this->tolerance = tolerance;
+
+    // Iterate until all constraints have converged.
+
+    int numThreads = threads.getNumThreads();
+    for (int iteration = 0; iteration < maxIterations; iteration++) {
+        ComputeDeltasTask deltasTask(*this, iteration == 0);
+        threads.execute(deltasTask);
+        threads.waitForThreads();
+        int numberConverged = 0;
+        for (int i = 0; i < numThreads; i++)
+            numberConverged += threadConverged[i];
+        if (numberConverged == numConstraints)
+            break;
+        if (matrixValue.size() > 0) {
+            MultiplyTask multiplyTask(*this);
+            threads.execute(multiplyTask);
+            threads.waitForThreads();
+            constraintDelta.swap(tempDelta);
+        }
+        UpdateAtomsTask updateTask(*this);
+        threads.execute(updateTask);
+        threads.waitForThreads();
+    }
+}
+
+void CpuCCMA::threadComputeDeltas(int threadIndex, bool computeDirections) {
+    int start = constraintBlockStart[threadIndex];
+    int end = constraintBlockStart[threadIndex+1];
+    if (computeDirections) {
+        for (int i = start; i < end; i++) {
+            r_ij[i] = atomCoordinates[atom1[i]]-atomCoordinates[atom2[i]];
+            d_ij2[i] = r_ij[i].dot(r_ij[i]);
+        }
+    }
+    RealOpenMM lowerTol = 1-2*tolerance+tolerance*tolerance;
+    RealOpenMM upperTol = 1+2*tolerance+tolerance*tolerance;
+    int numberConverged = 0;
+    for (int i = start; i < end; i++) {
+        RealVec rp_ij = atomCoordinatesP[atom1[i]]-atomCoordinatesP[atom2[i]];
+        if (constrainingVelocities) {
+            RealOpenMM rrpr = rp_ij.dot(r_ij[i]);
+            constraintDelta[i] = -2*reducedMasses[i]*rrpr/d_ij2[i];
+            if (fabs(constraintDelta[i]) <= tolerance)
+                numberConverged++;
+        }
+        else {
+            RealOpenMM rp2 = rp_ij.dot(rp_ij);
+            RealOpenMM dist2 = distance[i]*distance[i];
+            RealOpenMM diff = dist2-rp2;
+            RealOpenMM rrpr = rp_ij.dot(r_ij[i]);
+            constraintDelta[i] = reducedMasses[i]*diff/rrpr;
+            if (rp2 >= lowerTol*dist2 && rp2 <= upperTol*dist2)
+                numberConverged++;
+        }
+    }
+    threadConverged[threadIndex] = numberConverged;
+}
+
+void CpuCCMA::threadMultiply(int threadIndex) {
+    int start = constraintBlockStart[threadIndex];
+    int end = constraintBlockStart[threadIndex+1];
+    for (int i = start; i < end; i++) {
+        RealOpenMM sum = 0.0;
+        for (int j = matrixRowStart[i]; j < matrixRowStart[i+1]; j++)
+            sum += matrixValue[j]*constraintDelta[matrixColIndex[j]];
+        tempDelta[i] = sum;
+    }
+}
+
+void CpuCCMA::threadUpdateAtoms(int threadIndex) {
+    int start = atomBlockStart[threadIndex];
+    int end = atomBlockStart[threadIndex+1];
+    for (int i = start; i < end; i++) {
+        int atom = constrainedAtoms[i];
+        RealVec dr;
+        for (int j = atomConstraintStart[i]; j < atomConstraintStart[i+1]; j++) {
+            int constraint = atomConstraints[j];
+            if (constraint >= 0)
+                dr += r_ij[constraint]*constraintDelta[constraint];
+            else
+                dr -= r_ij[-1-constraint]*constraintDelta[-1-constraint];
+        }
+        atomCoordinatesP[atom] += dr*inverseMasses[atom];
+    }
+}
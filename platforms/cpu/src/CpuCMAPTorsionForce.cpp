@@ -0,0 +1,304 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuCMAPTorsionForce.h"
+#include "SimTKOpenMMRealType.h"
+#include "openmm/internal/vectorize.h"
+#include <cmath>
+
+using namespace OpenMM;
+using namespace std;
+
+class CpuCMAPTorsionForce::ComputeForceTask : public ThreadPool::Task {
+public:
+    ComputeForceTask(CpuCMAPTorsionForce& owner, vector<RealVec>& atomCoordinates, vector<RealVec>& forces, bool includeEnergy) :
+            owner(owner), atomCoordinates(atomCoordinates), forces(forces), includeEnergy(includeEnergy) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        double* energy = (includeEnergy ? &owner.threadEnergy[threadIndex] : NULL);
+        owner.threadComputeForce(threadIndex, atomCoordinates, forces, energy);
+    }
+    CpuCMAPTorsionForce& owner;
+    vector<RealVec>& atomCoordinates;
+    vector<RealVec>& forces;
+    bool includeEnergy;
+};
+
+/**
+ * Compute the cross product of two vectors stored as separate x, y, and z components.
+ */
+static inline void crossProduct(const fvec4* a, const fvec4* b, fvec4* result) {
+    result[0] = a[1]*b[2] - a[2]*b[1];
+    result[1] = a[2]*b[0] - a[0]*b[2];
+    result[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+static inline fvec4 dotProduct(const fvec4* a, const fvec4* b) {
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+/**
+ * Compute four dihedral angles in the range [0, 2*pi), along with the two cross products that
+ * are needed later to compute the forces.
+ */
+static void computeDihedrals(const fvec4* v1, const fvec4* v2, const fvec4* v3, fvec4* cp0, fvec4* cp1, float* angle) {
+    crossProduct(v1, v2, cp0);
+    crossProduct(v2, v3, cp1);
+    fvec4 cp2[3];
+    crossProduct(cp0, cp1, cp2);
+    float sinValues[4], cosValues[4], signValues[4];
+    sqrt(dotProduct(cp2, cp2)).store(sinValues);
+    dotProduct(cp0, cp1).store(cosValues);
+    dotProduct(v1, cp1).store(signValues);
+    for (int j = 0; j < 4; j++) {
+        float theta = atan2f(signValues[j] < 0.0f ? -sinValues[j] : sinValues[j], cosValues[j]);
+        angle[j] = (theta < 0.0f ? theta+(float) (2*M_PI) : theta);
+    }
+}
+
+/**
+ * Given the derivative of the energy with respect to four dihedral angles, compute the forces on the
+ * first and last atoms of each one (f0 and f3), and the shared term (s) that is applied to the middle atoms.
+ */
+static void computeDihedralForces(fvec4 dEdAngle, const fvec4* v1, const fvec4* v2, const fvec4* v3, const fvec4* cp0, const fvec4* cp1,
+            fvec4* f0, fvec4* f3, fvec4* s) {
+    fvec4 r2 = dotProduct(v2, v2);
+    fvec4 normBC = sqrt(r2);
+    fvec4 factor0 = -dEdAngle*normBC/dotProduct(cp0, cp0);
+    fvec4 factor3 = dEdAngle*normBC/dotProduct(cp1, cp1);
+    fvec4 factor1 = dotProduct(v1, v2)/r2;
+    fvec4 factor2 = dotProduct(v3, v2)/r2;
+    for (int k = 0; k < 3; k++) {
+        f0[k] = factor0*cp0[k];
+        f3[k] = factor3*cp1[k];
+        s[k] = factor1*f0[k] - factor2*f3[k];
+    }
+}
+
+CpuCMAPTorsionForce::CpuCMAPTorsionForce() {
+}
+
+void CpuCMAPTorsionForce::initialize(int numAtoms, int numTorsions, int** torsionAtoms, ThreadPool& threads) {
+    this->threads = &threads;
+    bondForce.initialize(numAtoms, numTorsions, 8, torsionAtoms, threads);
+
+    // Store the torsions in the order they will be processed: first the torsions for each thread,
+    // then the extra torsions that must be computed serially.
+
+    const vector<vector<int> >& threadBonds = bondForce.getThreadBonds();
+    const vector<int>& extraBonds = bondForce.getExtraBonds();
+    int numThreads = threads.getNumThreads();
+    vector<int> order;
+    for (int i = 0; i < numThreads; i++) {
+        blockStart.push_back(order.size());
+        order.insert(order.end(), threadBonds[i].begin(), threadBonds[i].end());
+    }
+    blockStart.push_back(order.size());
+    order.insert(order.end(), extraBonds.begin(), extraBonds.end());
+    blockStart.push_back(order.size());
+    torsionIndex.resize(numTorsions);
+    this->torsionAtoms.resize(8*numTorsions);
+    torsionMap.resize(numTorsions, 0);
+    for (int i = 0; i < numTorsions; i++) {
+        int torsion = order[i];
+        torsionIndex[torsion] = i;
+        for (int j = 0; j < 8; j++)
+            this->torsionAtoms[8*i+j] = torsionAtoms[torsion][j];
+    }
+    threadEnergy.resize(numThreads);
+}
+
+void CpuCMAPTorsionForce::setMaps(const vector<vector<vector<double> > >& coeff) {
+    int numMaps = coeff.size();
+    mapSize.resize(numMaps);
+    mapOffset.resize(numMaps);
+    int numPatches = 0;
+    for (int i = 0; i < numMaps; i++) {
+        mapSize[i] = (int) floor(sqrt((double) coeff[i].size())+0.5);
+        mapOffset[i] = numPatches;
+        numPatches += coeff[i].size();
+    }
+    coefficients.resize(16*numPatches);
+    for (int i = 0; i < numMaps; i++)
+        for (int j = 0; j < (int) coeff[i].size(); j++)
+            for (int k = 0; k < 16; k++)
+                coefficients[16*(mapOffset[i]+j)+k] = (float) coeff[i][j][k];
+}
+
+void CpuCMAPTorsionForce::setTorsionMap(int torsion, int map) {
+    torsionMap[torsionIndex[torsion]] = map;
+}
+
+void CpuCMAPTorsionForce::calculateForce(vector<RealVec>& atomCoordinates, vector<RealVec>& forces, RealOpenMM* totalEnergy) {
+    // Have the worker threads compute their forces.
+
+    int numThreads = threads->getNumThreads();
+    for (int i = 0; i < numThreads; i++)
+        threadEnergy[i] = 0;
+    ComputeForceTask task(*this, atomCoordinates, forces, totalEnergy != NULL);
+    threads->execute(task);
+    threads->waitForThreads();
+
+    // Compute any "extra" torsions.
+
+    double energy = 0;
+    computeTorsions(blockStart[numThreads], blockStart[numThreads+1], atomCoordinates, forces, totalEnergy == NULL ? NULL : &energy);
+
+    // Compute the total energy.
+
+    if (totalEnergy != NULL) {
+        for (int i = 0; i < numThreads; i++)
+            energy += threadEnergy[i];
+        *totalEnergy += energy;
+    }
+}
+
+void CpuCMAPTorsionForce::threadComputeForce(int threadIndex, vector<RealVec>& atomCoordinates, vector<RealVec>& forces, double* energy) {
+    computeTorsions(blockStart[threadIndex], blockStart[threadIndex+1], atomCoordinates, forces, energy);
+}
+
+void CpuCMAPTorsionForce::computeTorsions(int start, int end, vector<RealVec>& atomCoordinates, vector<RealVec>& forces, double* energy) {
+    fvec4 energyAccum(0.0f);
+    float delta[2][3][3][4], angle[2][4], da[4], db[4], scale[4], weight[4];
+    int patch[4];
+    for (int base = start; base < end; base += 4) {
+        // Load the displacements for the next four torsion pairs.  For each of the two torsions,
+        // delta[t][0] is from atom 2 to atom 1, delta[t][1] from atom 2 to atom 3, and delta[t][2]
+        // from atom 4 to atom 3.  Unused lanes get orthogonal unit vectors so the geometry is well
+        // defined, and a weight of zero so they contribute nothing.
+
+        int numInBlock = min(4, end-base);
+        for (int j = 0; j < 4; j++) {
+            if (j < numInBlock) {
+                const int* atoms = &torsionAtoms[8*(base+j)];
+                for (int t = 0; t < 2; t++) {
+                    const int* a = atoms+4*t;
+                    RealVec v1 = atomCoordinates[a[0]]-atomCoordinates[a[1]];
+                    RealVec v2 = atomCoordinates[a[2]]-atomCoordinates[a[1]];
+                    RealVec v3 = atomCoordinates[a[2]]-atomCoordinates[a[3]];
+                    for (int k = 0; k < 3; k++) {
+                        delta[t][0][k][j] = (float) v1[k];
+                        delta[t][1][k][j] = (float) v2[k];
+                        delta[t][2][k][j] = (float) v3[k];
+                    }
+                }
+                weight[j] = 1.0f;
+            }
+            else {
+                for (int t = 0; t < 2; t++)
+                    for (int v = 0; v < 3; v++)
+                        for (int k = 0; k < 3; k++)
+                            delta[t][v][k][j] = (v == k ? 1.0f : 0.0f);
+                weight[j] = 0.0f;
+            }
+        }
+
+        // Compute the two dihedral angles.
+
+        fvec4 v[2][3][3], cp0[2][3], cp1[2][3];
+        for (int t = 0; t < 2; t++) {
+            for (int i = 0; i < 3; i++)
+                for (int k = 0; k < 3; k++)
+                    v[t][i][k] = fvec4(delta[t][i][k]);
+            computeDihedrals(v[t][0], v[t][1], v[t][2], cp0[t], cp1[t], angle[t]);
+        }
+
+        // Identify which patch each torsion pair is in.
+
+        for (int j = 0; j < 4; j++) {
+            int map = (j < numInBlock ? torsionMap[base+j] : 0);
+            int size = mapSize[map];
+            scale[j] = (float) (size/(2*M_PI));
+            float a = angle[0][j]*scale[j];
+            float b = angle[1][j]*scale[j];
+            int s = min((int) a, size-1);
+            int t = min((int) b, size-1);
+            da[j] = a-s;
+            db[j] = b-t;
+            patch[j] = mapOffset[map]+s+size*t;
+        }
+
+        // Load the coefficients.  Each patch is stored as 16 consecutive values, so load four at a time
+        // and transpose to get each coefficient for all four torsion pairs in one vector.
+
+        fvec4 c[16];
+        for (int r = 0; r < 4; r++) {
+            fvec4 c0(&coefficients[16*patch[0]+4*r]);
+            fvec4 c1(&coefficients[16*patch[1]+4*r]);
+            fvec4 c2(&coefficients[16*patch[2]+4*r]);
+            fvec4 c3(&coefficients[16*patch[3]+4*r]);
+            transpose(c0, c1, c2, c3);
+            c[4*r] = c0;
+            c[4*r+1] = c1;
+            c[4*r+2] = c2;
+            c[4*r+3] = c3;
+        }
+
+        // Evaluate the spline to determine the energy and gradients.
+
+        fvec4 x(da), y(db), e(0.0f), dEdA(0.0f), dEdB(0.0f);
+        for (int i = 3; i >= 0; i--) {
+            e = x*e + ((c[i*4+3]*y + c[i*4+2])*y + c[i*4+1])*y + c[i*4+0];
+            dEdA = y*dEdA + (3.0f*c[i+3*4]*x + 2.0f*c[i+2*4])*x + c[i+1*4];
+            dEdB = x*dEdB + (3.0f*c[i*4+3]*y + 2.0f*c[i*4+2])*y + c[i*4+1];
+        }
+        fvec4 w(weight);
+        if (energy != NULL)
+            energyAccum += w*e;
+        fvec4 gradScale = w*fvec4(scale);
+        dEdA = dEdA*gradScale;
+        dEdB = dEdB*gradScale;
+
+        // Apply the forces to the atoms of each torsion.
+
+        for (int t = 0; t < 2; t++) {
+            fvec4 f0[3], f3[3], s[3];
+            computeDihedralForces(t == 0 ? dEdA : dEdB, v[t][0], v[t][1], v[t][2], cp0[t], cp1[t], f0, f3, s);
+            for (int k = 0; k < 3; k++) {
+                f0[k].store(delta[t][0][k]);
+                f3[k].store(delta[t][1][k]);
+                s[k].store(delta[t][2][k]);
+            }
+            for (int j = 0; j < numInBlock; j++) {
+                const int* a = &torsionAtoms[8*(base+j)+4*t];
+                RealVec force0(delta[t][0][0][j], delta[t][0][1][j], delta[t][0][2][j]);
+                RealVec force3(delta[t][1][0][j], delta[t][1][1][j], delta[t][1][2][j]);
+                RealVec shared(delta[t][2][0][j], delta[t][2][1][j], delta[t][2][2][j]);
+                forces[a[0]] += force0;
+                forces[a[1]] -= force0-shared;
+                forces[a[2]] -= force3+shared;
+                forces[a[3]] += force3;
+            }
+        }
+    }
+    if (energy != NULL)
+        *energy += energyAccum[0]+energyAccum[1]+energyAccum[2]+energyAccum[3];
+}
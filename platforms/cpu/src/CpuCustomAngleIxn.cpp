@@ -0,0 +1,103 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuCustomAngleIxn.h"
+#include "ReferenceForce.h"
+#include "SimTKOpenMMRealType.h"
+#include "SimTKOpenMMUtilities.h"
+
+using namespace OpenMM;
+using namespace std;
+
+CpuCustomAngleIxn::CpuCustomAngleIxn(const Lepton::CompiledExpression& energyExpression, const Lepton::CompiledExpression& forceExpression,
+        const vector<string>& parameterNames, const vector<string>& globalParameterNames) :
+        energyExpression(energyExpression), forceExpression(forceExpression) {
+    expressionSet.registerExpression(this->energyExpression);
+    expressionSet.registerExpression(this->forceExpression);
+    thetaIndex = expressionSet.getVariableIndex("theta");
+    for (int i = 0; i < (int) parameterNames.size(); i++)
+        paramIndex.push_back(expressionSet.getVariableIndex(parameterNames[i]));
+    for (int i = 0; i < (int) globalParameterNames.size(); i++)
+        globalParamIndex.push_back(expressionSet.getVariableIndex(globalParameterNames[i]));
+}
+
+void CpuCustomAngleIxn::setGlobalParameter(int index, double value) {
+    expressionSet.setVariable(globalParamIndex[index], value);
+}
+
+void CpuCustomAngleIxn::calculateBondIxn(int* atomIndices, vector<RealVec>& atomCoordinates, RealOpenMM* parameters,
+            vector<RealVec>& forces, RealOpenMM* totalEnergy) const {
+    for (int i = 0; i < (int) paramIndex.size(); i++)
+        expressionSet.setVariable(paramIndex[i], parameters[i]);
+
+    // Compute the angle between the three atoms.
+
+    int atomAIndex = atomIndices[0];
+    int atomBIndex = atomIndices[1];
+    int atomCIndex = atomIndices[2];
+    RealOpenMM deltaR[2][ReferenceForce::LastDeltaRIndex];
+    ReferenceForce::getDeltaR(atomCoordinates[atomAIndex], atomCoordinates[atomBIndex], deltaR[0]);
+    ReferenceForce::getDeltaR(atomCoordinates[atomCIndex], atomCoordinates[atomBIndex], deltaR[1]);
+    RealOpenMM pVector[3];
+    SimTKOpenMMUtilities::crossProductVector3(deltaR[0], deltaR[1], pVector);
+    RealOpenMM rp = SQRT(DOT3(pVector, pVector));
+    if (rp < 1.0e-06)
+        rp = (RealOpenMM) 1.0e-06;
+    RealOpenMM dot = DOT3(deltaR[0], deltaR[1]);
+    RealOpenMM cosine = dot/SQRT((deltaR[0][ReferenceForce::R2Index]*deltaR[1][ReferenceForce::R2Index]));
+    RealOpenMM angle;
+    if (cosine >= 1)
+        angle = 0;
+    else if (cosine <= -1)
+        angle = PI_M;
+    else
+        angle = ACOS(cosine);
+    expressionSet.setVariable(thetaIndex, angle);
+
+    // Compute the force and energy, and apply them to the atoms.
+
+    RealOpenMM dEdR = (RealOpenMM) forceExpression.evaluate();
+    RealOpenMM termA =  dEdR/(deltaR[0][ReferenceForce::R2Index]*rp);
+    RealOpenMM termC = -dEdR/(deltaR[1][ReferenceForce::R2Index]*rp);
+    RealOpenMM deltaCrossP[3][3];
+    SimTKOpenMMUtilities::crossProductVector3(deltaR[0], pVector, deltaCrossP[0]);
+    SimTKOpenMMUtilities::crossProductVector3(deltaR[1], pVector, deltaCrossP[2]);
+    for (int i = 0; i < 3; i++) {
+        deltaCrossP[0][i] *= termA;
+        deltaCrossP[2][i] *= termC;
+        deltaCrossP[1][i] = -(deltaCrossP[0][i]+deltaCrossP[2][i]);
+    }
+    for (int j = 0; j < 3; j++)
+        for (int i = 0; i < 3; i++)
+            forces[atomIndices[j]][i] += deltaCrossP[j][i];
+    if (totalEnergy != NULL)
+        *totalEnergy += (RealOpenMM) energyExpression.evaluate();
+}
@@ -0,0 +1,77 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuCustomBondIxn.h"
+#include "ReferenceForce.h"
+
+using namespace OpenMM;
+using namespace std;
+
+CpuCustomBondIxn::CpuCustomBondIxn(const Lepton::CompiledExpression& energyExpression, const Lepton::CompiledExpression& forceExpression,
+        const vector<string>& parameterNames, const vector<string>& globalParameterNames) :
+        energyExpression(energyExpression), forceExpression(forceExpression) {
+    expressionSet.registerExpression(this->energyExpression);
+    expressionSet.registerExpression(this->forceExpression);
+    rIndex = expressionSet.getVariableIndex("r");
+    for (int i = 0; i < (int) parameterNames.size(); i++)
+        paramIndex.push_back(expressionSet.getVariableIndex(parameterNames[i]));
+    for (int i = 0; i < (int) globalParameterNames.size(); i++)
+        globalParamIndex.push_back(expressionSet.getVariableIndex(globalParameterNames[i]));
+}
+
+void CpuCustomBondIxn::setGlobalParameter(int index, double value) {
+    expressionSet.setVariable(globalParamIndex[index], value);
+}
+
+void CpuCustomBondIxn::calculateBondIxn(int* atomIndices, vector<RealVec>& atomCoordinates, RealOpenMM* parameters,
+            vector<RealVec>& forces, RealOpenMM* totalEnergy) const {
+    for (int i = 0; i < (int) paramIndex.size(); i++)
+        expressionSet.setVariable(paramIndex[i], parameters[i]);
+
+    // Compute the distance between the two atoms.
+
+    int atomAIndex = atomIndices[0];
+    int atomBIndex = atomIndices[1];
+    RealOpenMM deltaR[ReferenceForce::LastDeltaRIndex];
+    ReferenceForce::getDeltaR(atomCoordinates[atomAIndex], atomCoordinates[atomBIndex], deltaR);
+    RealOpenMM r = deltaR[ReferenceForce::RIndex];
+    expressionSet.setVariable(rIndex, r);
+
+    // Compute the force and energy, and apply them to the atoms.
+
+    RealOpenMM dEdR = (RealOpenMM) forceExpression.evaluate();
+    dEdR = (r > 0 ? dEdR/r : 0);
+    RealVec force(dEdR*deltaR[ReferenceForce::XIndex], dEdR*deltaR[ReferenceForce::YIndex], dEdR*deltaR[ReferenceForce::ZIndex]);
+    forces[atomAIndex] += force;
+    forces[atomBIndex] -= force;
+    if (totalEnergy != NULL)
+        *totalEnergy += (RealOpenMM) energyExpression.evaluate();
+}
@@ -290,16 +290,17 @@ void CpuCustomGBForce::calculateParticlePairValue(int index, ThreadData& data, i
     if (cutoff) {
         // Loop over all pairs in the neighbor list.
 
+        int blockSize = neighborList->getBlockSize();
         while (true) {
             int blockIndex = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
             if (blockIndex >= neighborList->getNumBlocks())
                 break;
-            const int* blockAtom = &neighborList->getSortedAtoms()[4*blockIndex];
+            const int* blockAtom = &neighborList->getSortedAtoms()[blockSize*blockIndex];
             const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
             const vector<char>& blockExclusions = neighborList->getBlockExclusions(blockIndex);
             for (int i = 0; i < (int) neighbors.size(); i++) {
                 int first = neighbors[i];
-                for (int k = 0; k < 4; k++) {
+                for (int k = 0; k < blockSize; k++) {
                     if ((blockExclusions[i] & (1<<k)) == 0) {
                         int second = blockAtom[k];
                         if (useExclusions && exclusions[first].find(second) != exclusions[first].end())
@@ -375,16 +376,17 @@ void CpuCustomGBForce::calculateParticlePairEnergyTerm(int index, ThreadData& da
     if (cutoff) {
         // Loop over all pairs in the neighbor list.
 
+        int blockSize = neighborList->getBlockSize();
         while (true) {
             int blockIndex = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
             if (blockIndex >= neighborList->getNumBlocks())
                 break;
-            const int* blockAtom = &neighborList->getSortedAtoms()[4*blockIndex];
+            const int* blockAtom = &neighborList->getSortedAtoms()[blockSize*blockIndex];
             const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
             const vector<char>& blockExclusions = neighborList->getBlockExclusions(blockIndex);
             for (int i = 0; i < (int) neighbors.size(); i++) {
                 int first = neighbors[i];
-                for (int k = 0; k < 4; k++) {
+                for (int k = 0; k < blockSize; k++) {
                     if ((blockExclusions[i] & (1<<k)) == 0) {
                         int second = blockAtom[k];
                         if (useExclusions && exclusions[first].find(second) != exclusions[first].end())
@@ -456,16 +458,17 @@ void CpuCustomGBForce::calculateChainRuleForces(ThreadData& data, int numAtoms,
     if (cutoff) {
         // Loop over all pairs in the neighbor list.
 
+        int blockSize = neighborList->getBlockSize();
         while (true) {
             int blockIndex = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
             if (blockIndex >= neighborList->getNumBlocks())
                 break;
-            const int* blockAtom = &neighborList->getSortedAtoms()[4*blockIndex];
+            const int* blockAtom = &neighborList->getSortedAtoms()[blockSize*blockIndex];
             const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
             const vector<char>& blockExclusions = neighborList->getBlockExclusions(blockIndex);
             for (int i = 0; i < (int) neighbors.size(); i++) {
                 int first = neighbors[i];
-                for (int k = 0; k < 4; k++) {
+                for (int k = 0; k < blockSize; k++) {
                     if ((blockExclusions[i] & (1<<k)) == 0) {
                         int second = blockAtom[k];
                         bool isExcluded = (exclusions[first].find(second) != exclusions[first].end());
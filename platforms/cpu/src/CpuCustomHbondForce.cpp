@@ -0,0 +1,438 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuCustomHbondForce.h"
+#include "ReferenceBondIxn.h"
+#include "ReferenceTabulatedFunction.h"
+#include "SimTKOpenMMUtilities.h"
+#include "openmm/internal/CustomHbondForceImpl.h"
+#include "lepton/CustomFunction.h"
+#include "gmx_atomic.h"
+#include <cmath>
+
+using namespace OpenMM;
+using namespace std;
+
+class CpuCustomHbondForce::ComputeForceTask : public ThreadPool::Task {
+public:
+    ComputeForceTask(CpuCustomHbondForce& owner) : owner(owner) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        owner.threadComputeForce(threads, threadIndex);
+    }
+    CpuCustomHbondForce& owner;
+};
+
+CpuCustomHbondForce::CpuCustomHbondForce(const CustomHbondForce& force, ThreadPool& threads) :
+            threads(threads), useCutoff(false), usePeriodic(false), neighborList(NULL) {
+    numDonors = force.getNumDonors();
+    numAcceptors = force.getNumAcceptors();
+    donorAtoms.resize(numDonors);
+    for (int i = 0; i < numDonors; i++) {
+        vector<double> parameters;
+        int d1, d2, d3;
+        force.getDonorParameters(i, d1, d2, d3, parameters);
+        donorAtoms[i].push_back(d1);
+        donorAtoms[i].push_back(d2);
+        donorAtoms[i].push_back(d3);
+    }
+    acceptorAtoms.resize(numAcceptors);
+    for (int i = 0; i < numAcceptors; i++) {
+        vector<double> parameters;
+        int a1, a2, a3;
+        force.getAcceptorParameters(i, a1, a2, a3, parameters);
+        acceptorAtoms[i].push_back(a1);
+        acceptorAtoms[i].push_back(a2);
+        acceptorAtoms[i].push_back(a3);
+    }
+
+    // Record exclusions.  The neighbor list is built over groups, with acceptors first followed
+    // by donors, so the exclusions are also recorded in that form.
+
+    exclusions.resize(numDonors);
+    groupExclusions.resize(numAcceptors+numDonors);
+    for (int i = 0; i < force.getNumExclusions(); i++) {
+        int donor, acceptor;
+        force.getExclusionParticles(i, donor, acceptor);
+        exclusions[donor].insert(acceptor);
+        groupExclusions[acceptor].insert(numAcceptors+donor);
+        groupExclusions[numAcceptors+donor].insert(acceptor);
+    }
+
+    // Create custom functions for the tabulated functions.
+
+    map<string, Lepton::CustomFunction*> functions;
+    for (int i = 0; i < force.getNumFunctions(); i++)
+        functions[force.getTabulatedFunctionName(i)] = createReferenceTabulatedFunction(force.getTabulatedFunction(i));
+
+    // Parse the expression and create the objects used to calculate the interaction.
+
+    map<string, vector<int> > distances;
+    map<string, vector<int> > angles;
+    map<string, vector<int> > dihedrals;
+    Lepton::ParsedExpression energyExpr = CustomHbondForceImpl::prepareExpression(force, functions, distances, angles, dihedrals);
+    for (int i = 0; i < threads.getNumThreads(); i++)
+        threadData.push_back(new ThreadData(force, energyExpr, distances, angles, dihedrals));
+    if (force.getNonbondedMethod() != CustomHbondForce::NoCutoff) {
+        useCutoff = true;
+        cutoffDistance = force.getCutoffDistance();
+        neighborList = new CpuNeighborList(4);
+    }
+
+    // Delete the custom functions.
+
+    for (map<string, Lepton::CustomFunction*>::iterator iter = functions.begin(); iter != functions.end(); iter++)
+        delete iter->second;
+}
+
+CpuCustomHbondForce::~CpuCustomHbondForce() {
+    if (neighborList != NULL)
+        delete neighborList;
+    for (int i = 0; i < (int) threadData.size(); i++)
+        delete threadData[i];
+}
+
+void CpuCustomHbondForce::setPeriodic(RealVec* periodicBoxVectors) {
+    assert(useCutoff);
+    assert(periodicBoxVectors[0][0] >= 2.0*cutoffDistance);
+    assert(periodicBoxVectors[1][1] >= 2.0*cutoffDistance);
+    assert(periodicBoxVectors[2][2] >= 2.0*cutoffDistance);
+    usePeriodic = true;
+    this->periodicBoxVectors[0] = periodicBoxVectors[0];
+    this->periodicBoxVectors[1] = periodicBoxVectors[1];
+    this->periodicBoxVectors[2] = periodicBoxVectors[2];
+    triclinic = (periodicBoxVectors[0][1] != 0.0 || periodicBoxVectors[0][2] != 0.0 ||
+                 periodicBoxVectors[1][0] != 0.0 || periodicBoxVectors[1][2] != 0.0 ||
+                 periodicBoxVectors[2][0] != 0.0 || periodicBoxVectors[2][1] != 0.0);
+}
+
+void CpuCustomHbondForce::calculateIxn(vector<RealVec>& atomCoordinates, RealOpenMM** donorParameters, RealOpenMM** acceptorParameters,
+                                       const map<string, double>& globalParameters, vector<AlignedArray<float> >& threadForce,
+                                       bool includeForces, bool includeEnergy, double& energy) {
+    if (numDonors == 0 || numAcceptors == 0)
+        return;
+
+    // Record the parameters for the threads.
+
+    this->atomCoordinates = &atomCoordinates;
+    this->donorParameters = donorParameters;
+    this->acceptorParameters = acceptorParameters;
+    this->globalParameters = &globalParameters;
+    this->threadForce = &threadForce;
+    this->includeForces = includeForces;
+    this->includeEnergy = includeEnergy;
+    gmx_atomic_t counter;
+    gmx_atomic_set(&counter, 0);
+    this->atomicCounter = &counter;
+    if (useCutoff)
+        findNeighbors(atomCoordinates);
+
+    // Signal the threads to start running and wait for them to finish.
+
+    ComputeForceTask task(*this);
+    threads.execute(task);
+    threads.waitForThreads();
+
+    // Combine the energies from all the threads.
+
+    if (includeEnergy) {
+        int numThreads = threads.getNumThreads();
+        for (int i = 0; i < numThreads; i++)
+            energy += threadData[i]->energy;
+    }
+}
+
+void CpuCustomHbondForce::findNeighbors(vector<RealVec>& atomCoordinates) {
+    // Record the position of the primary atom in each group, wrapped into the periodic box if necessary.
+
+    int numGroups = numAcceptors+numDonors;
+    groupPositions.resize(4*numGroups);
+    RealVec invBoxSize;
+    if (usePeriodic)
+        invBoxSize = RealVec(1/periodicBoxVectors[0][0], 1/periodicBoxVectors[1][1], 1/periodicBoxVectors[2][2]);
+    for (int i = 0; i < numGroups; i++) {
+        RealVec pos = atomCoordinates[i < numAcceptors ? acceptorAtoms[i][0] : donorAtoms[i-numAcceptors][0]];
+        if (usePeriodic) {
+            if (triclinic) {
+                pos -= periodicBoxVectors[2]*floor(pos[2]*invBoxSize[2]);
+                pos -= periodicBoxVectors[1]*floor(pos[1]*invBoxSize[1]);
+                pos -= periodicBoxVectors[0]*floor(pos[0]*invBoxSize[0]);
+            }
+            else {
+                for (int j = 0; j < 3; j++)
+                    pos[j] -= floor(pos[j]*invBoxSize[j])*periodicBoxVectors[j][j];
+            }
+        }
+        groupPositions[4*i] = (float) pos[0];
+        groupPositions[4*i+1] = (float) pos[1];
+        groupPositions[4*i+2] = (float) pos[2];
+        groupPositions[4*i+3] = 0.0f;
+    }
+
+    // Construct a neighbor list.  We use CpuNeighborList to do this, then copy the donor-acceptor
+    // pairs into a list of acceptors for each donor.  Each pair appears only once in the neighbor
+    // list, with either the donor or the acceptor in the block.
+
+    neighborList->computeNeighborList(numGroups, groupPositions, groupExclusions, periodicBoxVectors, usePeriodic, cutoffDistance, threads);
+    donorNeighbors.resize(numDonors);
+    for (int i = 0; i < numDonors; i++)
+        donorNeighbors[i].clear();
+    const vector<int>& sortedAtoms = neighborList->getSortedAtoms();
+    for (int blockIndex = 0; blockIndex < neighborList->getNumBlocks(); blockIndex++) {
+        const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
+        const vector<char>& blockExclusions = neighborList->getBlockExclusions(blockIndex);
+        int numNeighbors = neighbors.size();
+        for (int i = 0; i < 4; i++) {
+            int g1 = sortedAtoms[4*blockIndex+i];
+            for (int j = 0; j < numNeighbors; j++) {
+                if ((blockExclusions[j] & (1<<i)) != 0)
+                    continue;
+                int g2 = neighbors[j];
+                if (g1 < numAcceptors && g2 >= numAcceptors)
+                    donorNeighbors[g2-numAcceptors].push_back(g1);
+                else if (g1 >= numAcceptors && g2 < numAcceptors)
+                    donorNeighbors[g1-numAcceptors].push_back(g2);
+            }
+        }
+    }
+}
+
+void CpuCustomHbondForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
+    float* forces = &(*threadForce)[threadIndex][0];
+    ThreadData& data = *threadData[threadIndex];
+    data.energy = 0;
+    for (map<string, double>::const_iterator iter = globalParameters->begin(); iter != globalParameters->end(); ++iter)
+        data.expressionSet.setVariable(data.expressionSet.getVariableIndex(iter->first), iter->second);
+    while (true) {
+        int donor = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
+        if (donor >= numDonors)
+            break;
+        for (int j = 0; j < (int) data.donorParamIndex.size(); j++)
+            data.expressionSet.setVariable(data.donorParamIndex[j], donorParameters[donor][j]);
+        if (useCutoff) {
+            // Loop over acceptors from the neighbor list.  Exclusions have already been removed.
+
+            const vector<int>& neighbors = donorNeighbors[donor];
+            for (int i = 0; i < (int) neighbors.size(); i++)
+                calculateOneIxn(donor, neighbors[i], forces, data);
+        }
+        else {
+            // Loop over all acceptors.
+
+            const set<int>& excluded = exclusions[donor];
+            for (int acceptor = 0; acceptor < numAcceptors; acceptor++)
+                if (excluded.find(acceptor) == excluded.end())
+                    calculateOneIxn(donor, acceptor, forces, data);
+        }
+    }
+}
+
+void CpuCustomHbondForce::calculateOneIxn(int donor, int acceptor, float* forces, ThreadData& data) {
+    int atoms[6];
+    atoms[0] = acceptorAtoms[acceptor][0];
+    atoms[1] = acceptorAtoms[acceptor][1];
+    atoms[2] = acceptorAtoms[acceptor][2];
+    atoms[3] = donorAtoms[donor][0];
+    atoms[4] = donorAtoms[donor][1];
+    atoms[5] = donorAtoms[donor][2];
+
+    // Compute the distance between the primary donor and acceptor atoms, and compare to the cutoff.
+
+    if (useCutoff) {
+        RealOpenMM delta[ReferenceForce::LastDeltaRIndex];
+        computeDelta(atoms[0], atoms[3], delta);
+        if (delta[ReferenceForce::RIndex] >= cutoffDistance)
+            return;
+    }
+    for (int j = 0; j < (int) data.acceptorParamIndex.size(); j++)
+        data.expressionSet.setVariable(data.acceptorParamIndex[j], acceptorParameters[acceptor][j]);
+
+    // Compute all of the variables the energy can depend on.
+
+    for (int i = 0; i < (int) data.distanceTerms.size(); i++) {
+        DistanceTermInfo& term = data.distanceTerms[i];
+        computeDelta(atoms[term.p1], atoms[term.p2], term.delta);
+        data.expressionSet.setVariable(term.variableIndex, term.delta[ReferenceForce::RIndex]);
+    }
+    for (int i = 0; i < (int) data.angleTerms.size(); i++) {
+        AngleTermInfo& term = data.angleTerms[i];
+        computeDelta(atoms[term.p1], atoms[term.p2], term.delta1);
+        computeDelta(atoms[term.p3], atoms[term.p2], term.delta2);
+        data.expressionSet.setVariable(term.variableIndex, computeAngle(term.delta1, term.delta2));
+    }
+    for (int i = 0; i < (int) data.dihedralTerms.size(); i++) {
+        DihedralTermInfo& term = data.dihedralTerms[i];
+        computeDelta(atoms[term.p2], atoms[term.p1], term.delta1);
+        computeDelta(atoms[term.p2], atoms[term.p3], term.delta2);
+        computeDelta(atoms[term.p4], atoms[term.p3], term.delta3);
+        RealOpenMM dotDihedral, signOfDihedral;
+        RealOpenMM* crossProduct[] = {term.cross1, term.cross2};
+        data.expressionSet.setVariable(term.variableIndex, ReferenceBondIxn::getDihedralAngleBetweenThreeVectors(term.delta1, term.delta2, term.delta3,
+                crossProduct, &dotDihedral, term.delta1, &signOfDihedral, 1));
+    }
+
+    // Apply forces based on distances.
+
+    if (includeForces) {
+        for (int i = 0; i < (int) data.distanceTerms.size(); i++) {
+            DistanceTermInfo& term = data.distanceTerms[i];
+            RealOpenMM dEdR = (RealOpenMM) (term.forceExpression.evaluate()/(term.delta[ReferenceForce::RIndex]));
+            for (int j = 0; j < 3; j++) {
+               RealOpenMM force = -dEdR*term.delta[j];
+               forces[4*atoms[term.p1]+j] -= force;
+               forces[4*atoms[term.p2]+j] += force;
+            }
+        }
+
+        // Apply forces based on angles.
+
+        for (int i = 0; i < (int) data.angleTerms.size(); i++) {
+            AngleTermInfo& term = data.angleTerms[i];
+            RealOpenMM dEdTheta = (RealOpenMM) term.forceExpression.evaluate();
+            RealOpenMM thetaCross[ReferenceForce::LastDeltaRIndex];
+            SimTKOpenMMUtilities::crossProductVector3(term.delta1, term.delta2, thetaCross);
+            RealOpenMM lengthThetaCross = SQRT(DOT3(thetaCross, thetaCross));
+            if (lengthThetaCross < 1.0e-06)
+                lengthThetaCross = (RealOpenMM) 1.0e-06;
+            RealOpenMM termA = dEdTheta/(term.delta1[ReferenceForce::R2Index]*lengthThetaCross);
+            RealOpenMM termC = -dEdTheta/(term.delta2[ReferenceForce::R2Index]*lengthThetaCross);
+            RealOpenMM deltaCrossP[3][3];
+            SimTKOpenMMUtilities::crossProductVector3(term.delta1, thetaCross, deltaCrossP[0]);
+            SimTKOpenMMUtilities::crossProductVector3(term.delta2, thetaCross, deltaCrossP[2]);
+            for (int j = 0; j < 3; j++) {
+                deltaCrossP[0][j] *= termA;
+                deltaCrossP[2][j] *= termC;
+                deltaCrossP[1][j] = -(deltaCrossP[0][j]+deltaCrossP[2][j]);
+            }
+            for (int j = 0; j < 3; j++) {
+                forces[4*atoms[term.p1]+j] += deltaCrossP[0][j];
+                forces[4*atoms[term.p2]+j] += deltaCrossP[1][j];
+                forces[4*atoms[term.p3]+j] += deltaCrossP[2][j];
+            }
+        }
+
+        // Apply forces based on dihedrals.
+
+        for (int i = 0; i < (int) data.dihedralTerms.size(); i++) {
+            DihedralTermInfo& term = data.dihedralTerms[i];
+            RealOpenMM dEdTheta = (RealOpenMM) term.forceExpression.evaluate();
+            RealOpenMM internalF[4][3];
+            RealOpenMM forceFactors[4];
+            RealOpenMM normCross1 = DOT3(term.cross1, term.cross1);
+            RealOpenMM normBC = term.delta2[ReferenceForce::RIndex];
+            forceFactors[0] = (-dEdTheta*normBC)/normCross1;
+            RealOpenMM normCross2 = DOT3(term.cross2, term.cross2);
+            forceFactors[3] = (dEdTheta*normBC)/normCross2;
+            forceFactors[1] = DOT3(term.delta1, term.delta2);
+            forceFactors[1] /= term.delta2[ReferenceForce::R2Index];
+            forceFactors[2] = DOT3(term.delta3, term.delta2);
+            forceFactors[2] /= term.delta2[ReferenceForce::R2Index];
+            for (int j = 0; j < 3; j++) {
+                internalF[0][j] = forceFactors[0]*term.cross1[j];
+                internalF[3][j] = forceFactors[3]*term.cross2[j];
+                RealOpenMM s = forceFactors[1]*internalF[0][j] - forceFactors[2]*internalF[3][j];
+                internalF[1][j] = internalF[0][j] - s;
+                internalF[2][j] = internalF[3][j] + s;
+            }
+            for (int j = 0; j < 3; j++) {
+                forces[4*atoms[term.p1]+j] += internalF[0][j];
+                forces[4*atoms[term.p2]+j] -= internalF[1][j];
+                forces[4*atoms[term.p3]+j] -= internalF[2][j];
+                forces[4*atoms[term.p4]+j] += internalF[3][j];
+            }
+        }
+    }
+
+    // Add the energy
+
+    if (includeEnergy)
+        data.energy += data.energyExpression.evaluate();
+}
+
+void CpuCustomHbondForce::computeDelta(int atom1, int atom2, RealOpenMM* delta) const {
+    if (usePeriodic)
+        ReferenceForce::getDeltaRPeriodic((*atomCoordinates)[atom1], (*atomCoordinates)[atom2], periodicBoxVectors, delta);
+    else
+        ReferenceForce::getDeltaR((*atomCoordinates)[atom1], (*atomCoordinates)[atom2], delta);
+}
+
+RealOpenMM CpuCustomHbondForce::computeAngle(RealOpenMM* vec1, RealOpenMM* vec2) {
+    RealOpenMM dot = DOT3(vec1, vec2);
+    RealOpenMM cosine = dot/SQRT((vec1[ReferenceForce::R2Index]*vec2[ReferenceForce::R2Index]));
+    RealOpenMM angle;
+    if (cosine >= 1)
+        angle = 0;
+    else if (cosine <= -1)
+        angle = PI_M;
+    else
+        angle = ACOS(cosine);
+    return angle;
+}
+
+CpuCustomHbondForce::DistanceTermInfo::DistanceTermInfo(const string& name, const vector<int>& atoms, const Lepton::CompiledExpression& forceExpression, ThreadData& data) :
+        name(name), p1(atoms[0]), p2(atoms[1]), forceExpression(forceExpression) {
+    variableIndex = data.expressionSet.getVariableIndex(name);
+}
+
+CpuCustomHbondForce::AngleTermInfo::AngleTermInfo(const string& name, const vector<int>& atoms, const Lepton::CompiledExpression& forceExpression, ThreadData& data) :
+        name(name), p1(atoms[0]), p2(atoms[1]), p3(atoms[2]), forceExpression(forceExpression) {
+    variableIndex = data.expressionSet.getVariableIndex(name);
+}
+
+CpuCustomHbondForce::DihedralTermInfo::DihedralTermInfo(const string& name, const vector<int>& atoms, const Lepton::CompiledExpression& forceExpression, ThreadData& data) :
+        name(name), p1(atoms[0]), p2(atoms[1]), p3(atoms[2]), p4(atoms[3]), forceExpression(forceExpression) {
+    variableIndex = data.expressionSet.getVariableIndex(name);
+}
+
+CpuCustomHbondForce::ThreadData::ThreadData(const CustomHbondForce& force, Lepton::ParsedExpression& energyExpr,
+            map<string, vector<int> >& distances, map<string, vector<int> >& angles, map<string, vector<int> >& dihedrals) {
+    energyExpression = energyExpr.createCompiledExpression();
+    expressionSet.registerExpression(energyExpression);
+
+    // Differentiate the energy to get expressions for the force.
+
+    for (map<string, vector<int> >::const_iterator iter = distances.begin(); iter != distances.end(); ++iter)
+        distanceTerms.push_back(CpuCustomHbondForce::DistanceTermInfo(iter->first, iter->second, energyExpr.differentiate(iter->first).optimize().createCompiledExpression(), *this));
+    for (map<string, vector<int> >::const_iterator iter = angles.begin(); iter != angles.end(); ++iter)
+        angleTerms.push_back(CpuCustomHbondForce::AngleTermInfo(iter->first, iter->second, energyExpr.differentiate(iter->first).optimize().createCompiledExpression(), *this));
+    for (map<string, vector<int> >::const_iterator iter = dihedrals.begin(); iter != dihedrals.end(); ++iter)
+        dihedralTerms.push_back(CpuCustomHbondForce::DihedralTermInfo(iter->first, iter->second, energyExpr.differentiate(iter->first).optimize().createCompiledExpression(), *this));
+    for (int i = 0; i < distanceTerms.size(); i++)
+        expressionSet.registerExpression(distanceTerms[i].forceExpression);
+    for (int i = 0; i < angleTerms.size(); i++)
+        expressionSet.registerExpression(angleTerms[i].forceExpression);
+    for (int i = 0; i < dihedralTerms.size(); i++)
+        expressionSet.registerExpression(dihedralTerms[i].forceExpression);
+    for (int i = 0; i < force.getNumPerDonorParameters(); i++)
+        donorParamIndex.push_back(expressionSet.getVariableIndex(force.getPerDonorParameterName(i)));
+    for (int i = 0; i < force.getNumPerAcceptorParameters(); i++)
+        acceptorParamIndex.push_back(expressionSet.getVariableIndex(force.getPerAcceptorParameterName(i)));
+}
@@ -22,6 +22,7 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <algorithm>
 #include <string.h>
 #include <sstream>
 #include <utility>
@@ -68,8 +69,10 @@ CpuCustomManyParticleForce::CpuCustomManyParticleForce(const CustomManyParticleF
     Lepton::ParsedExpression energyExpr = CustomManyParticleForceImpl::prepareExpression(force, functions, distances, angles, dihedrals);
     for (int i = 0; i < threads.getNumThreads(); i++)
         threadData.push_back(new ThreadData(force, energyExpr, distances, angles, dihedrals));
-    if (force.getNonbondedMethod() != CustomManyParticleForce::NoCutoff)
-        setUseCutoff(force.getCutoffDistance());
+    if (force.getNonbondedMethod() != CustomManyParticleForce::NoCutoff) {
+        useCutoff = true;
+        cutoffDistance = force.getCutoffDistance();
+    }
 
     // Delete the custom functions.
 
@@ -92,8 +95,6 @@ CpuCustomManyParticleForce::CpuCustomManyParticleForce(const CustomManyParticleF
 }
 
 CpuCustomManyParticleForce::~CpuCustomManyParticleForce() {
-    if (neighborList != NULL)
-        delete neighborList;
     for (int i = 0; i < (int) threadData.size(); i++)
         delete threadData[i];
 }
@@ -113,26 +114,29 @@ void CpuCustomManyParticleForce::calculateIxn(AlignedArray<float>& posq, RealOpe
     gmx_atomic_set(&counter, 0);
     this->atomicCounter = &counter;
     if (useCutoff) {
-        // Construct a neighbor list.  We use CpuNeighborList to do this, but then copy the result
-        // into a new data structure.  This is needed because in UniqueCentralParticle mode, the
-        // the neighbor list needs to include symmetric pairs.
+        // Copy the neighbor list into a new data structure.  This is needed because in UniqueCentralParticle
+        // mode, the neighbor list needs to include symmetric pairs.  Otherwise each pair is recorded for
+        // the lower index particle, so every set is found starting from its lowest index member.
         
         particleNeighbors.resize(numParticles);
         for (int i = 0; i < numParticles; i++)
             particleNeighbors[i].clear();
-        neighborList->computeNeighborList(numParticles, posq, exclusions, periodicBoxVectors, usePeriodic, cutoffDistance, threads);
+        int blockSize = neighborList->getBlockSize();
         for (int blockIndex = 0; blockIndex < neighborList->getNumBlocks(); blockIndex++) {
             const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
             const vector<char>& exclusions = neighborList->getBlockExclusions(blockIndex);
             int numNeighbors = neighbors.size();
-            for (int i = 0; i < 4; i++) {
-                int p1 = neighborList->getSortedAtoms()[4*blockIndex+i];
+            for (int i = 0; i < blockSize; i++) {
+                int p1 = neighborList->getSortedAtoms()[blockSize*blockIndex+i];
                 for (int j = 0; j < numNeighbors; j++) {
                     if ((exclusions[j] & (1<<i)) == 0) {
                         int p2 = neighbors[j];
-                        particleNeighbors[p1].push_back(p2);
-                        if (centralParticleMode)
+                        if (centralParticleMode) {
+                            particleNeighbors[p1].push_back(p2);
                             particleNeighbors[p2].push_back(p1);
+                        }
+                        else
+                            particleNeighbors[min(p1, p2)].push_back(max(p1, p2));
                     }
                 }
             }
@@ -191,11 +195,10 @@ void CpuCustomManyParticleForce::threadComputeForce(ThreadPool& threads, int thr
     }
 }
 
-void CpuCustomManyParticleForce::setUseCutoff(RealOpenMM distance) {
+void CpuCustomManyParticleForce::setUseCutoff(RealOpenMM distance, const CpuNeighborList& neighbors) {
     useCutoff = true;
     cutoffDistance = distance;
-    if (neighborList == NULL)
-        neighborList = new CpuNeighborList(4);
+    neighborList = &neighbors;
 }
 
 void CpuCustomManyParticleForce::setPeriodic(RealVec* periodicBoxVectors) {
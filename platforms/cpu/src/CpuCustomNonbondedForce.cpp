@@ -186,11 +186,12 @@ void CpuCustomNonbondedForce::threadComputeForce(ThreadPool& threads, int thread
     else if (cutoff) {
         // We are using a cutoff, so get the interactions from the neighbor list.
 
+        int blockSize = neighborList->getBlockSize();
         while (true) {
             int blockIndex = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
             if (blockIndex >= neighborList->getNumBlocks())
                 break;
-            const int* blockAtom = &neighborList->getSortedAtoms()[4*blockIndex];
+            const int* blockAtom = &neighborList->getSortedAtoms()[blockSize*blockIndex];
             const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
             const vector<char>& exclusions = neighborList->getBlockExclusions(blockIndex);
             for (int i = 0; i < (int) neighbors.size(); i++) {
@@ -199,7 +200,7 @@ void CpuCustomNonbondedForce::threadComputeForce(ThreadPool& threads, int thread
                     ReferenceForce::setVariable(data.energyParticleParams[j*2], atomParameters[first][j]);
                     ReferenceForce::setVariable(data.forceParticleParams[j*2], atomParameters[first][j]);
                 }
-                for (int k = 0; k < 4; k++) {
+                for (int k = 0; k < blockSize; k++) {
                     if ((exclusions[i] & (1<<k)) == 0) {
                         int second = blockAtom[k];
                         for (int j = 0; j < (int) paramNames.size(); j++) {
@@ -0,0 +1,106 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuCustomTorsionIxn.h"
+#include "ReferenceForce.h"
+#include "SimTKOpenMMRealType.h"
+
+using namespace OpenMM;
+using namespace std;
+
+CpuCustomTorsionIxn::CpuCustomTorsionIxn(const Lepton::CompiledExpression& energyExpression, const Lepton::CompiledExpression& forceExpression,
+        const vector<string>& parameterNames, const vector<string>& globalParameterNames) :
+        energyExpression(energyExpression), forceExpression(forceExpression) {
+    expressionSet.registerExpression(this->energyExpression);
+    expressionSet.registerExpression(this->forceExpression);
+    thetaIndex = expressionSet.getVariableIndex("theta");
+    for (int i = 0; i < (int) parameterNames.size(); i++)
+        paramIndex.push_back(expressionSet.getVariableIndex(parameterNames[i]));
+    for (int i = 0; i < (int) globalParameterNames.size(); i++)
+        globalParamIndex.push_back(expressionSet.getVariableIndex(globalParameterNames[i]));
+}
+
+void CpuCustomTorsionIxn::setGlobalParameter(int index, double value) {
+    expressionSet.setVariable(globalParamIndex[index], value);
+}
+
+void CpuCustomTorsionIxn::calculateBondIxn(int* atomIndices, vector<RealVec>& atomCoordinates, RealOpenMM* parameters,
+            vector<RealVec>& forces, RealOpenMM* totalEnergy) const {
+    for (int i = 0; i < (int) paramIndex.size(); i++)
+        expressionSet.setVariable(paramIndex[i], parameters[i]);
+
+    // Compute the dihedral angle.
+
+    int atomAIndex = atomIndices[0];
+    int atomBIndex = atomIndices[1];
+    int atomCIndex = atomIndices[2];
+    int atomDIndex = atomIndices[3];
+    RealOpenMM deltaR[3][ReferenceForce::LastDeltaRIndex];
+    ReferenceForce::getDeltaR(atomCoordinates[atomBIndex], atomCoordinates[atomAIndex], deltaR[0]);
+    ReferenceForce::getDeltaR(atomCoordinates[atomBIndex], atomCoordinates[atomCIndex], deltaR[1]);
+    ReferenceForce::getDeltaR(atomCoordinates[atomDIndex], atomCoordinates[atomCIndex], deltaR[2]);
+    RealOpenMM crossProductMemory[6];
+    RealOpenMM* crossProduct[2];
+    crossProduct[0] = crossProductMemory;
+    crossProduct[1] = crossProductMemory+3;
+    RealOpenMM dotDihedral;
+    RealOpenMM signOfAngle;
+    RealOpenMM angle = getDihedralAngleBetweenThreeVectors(deltaR[0], deltaR[1], deltaR[2], crossProduct, &dotDihedral, deltaR[0], &signOfAngle, 1);
+    expressionSet.setVariable(thetaIndex, angle);
+
+    // Compute the force and energy, and apply them to the atoms.
+
+    RealOpenMM dEdAngle = (RealOpenMM) forceExpression.evaluate();
+    RealOpenMM normCross1 = DOT3(crossProduct[0], crossProduct[0]);
+    RealOpenMM normCross2 = DOT3(crossProduct[1], crossProduct[1]);
+    RealOpenMM normBC = deltaR[1][ReferenceForce::RIndex];
+    RealOpenMM forceFactors[4];
+    forceFactors[0] = (-dEdAngle*normBC)/normCross1;
+    forceFactors[1] = DOT3(deltaR[0], deltaR[1])/deltaR[1][ReferenceForce::R2Index];
+    forceFactors[2] = DOT3(deltaR[2], deltaR[1])/deltaR[1][ReferenceForce::R2Index];
+    forceFactors[3] = (dEdAngle*normBC)/normCross2;
+    RealOpenMM internalF[4][3];
+    for (int i = 0; i < 3; i++) {
+        internalF[0][i] = forceFactors[0]*crossProduct[0][i];
+        internalF[3][i] = forceFactors[3]*crossProduct[1][i];
+        RealOpenMM s = forceFactors[1]*internalF[0][i] - forceFactors[2]*internalF[3][i];
+        internalF[1][i] = internalF[0][i] - s;
+        internalF[2][i] = internalF[3][i] + s;
+    }
+    for (int i = 0; i < 3; i++) {
+        forces[atomAIndex][i] += internalF[0][i];
+        forces[atomBIndex][i] -= internalF[1][i];
+        forces[atomCIndex][i] -= internalF[2][i];
+        forces[atomDIndex][i] += internalF[3][i];
+    }
+    if (totalEnergy != NULL)
+        *totalEnergy += (RealOpenMM) energyExpression.evaluate();
+}
@@ -47,7 +47,7 @@ public:
     CpuGBSAOBCForce& owner;
 };
 
-CpuGBSAOBCForce::CpuGBSAOBCForce() : cutoff(false), periodic(false) {
+CpuGBSAOBCForce::CpuGBSAOBCForce() : cutoff(false), periodic(false), neighborList(NULL) {
     logDX = (TABLE_MAX-TABLE_MIN)/NUM_TABLE_POINTS;
     logDXInv = 1.0f/logDX;
     logTable.resize(NUM_TABLE_POINTS+4);
@@ -57,9 +57,13 @@ CpuGBSAOBCForce::CpuGBSAOBCForce() : cutoff(false), periodic(false) {
     }
 }
 
-void CpuGBSAOBCForce::setUseCutoff(float distance) {
+CpuGBSAOBCForce::~CpuGBSAOBCForce() {
+}
+
+void CpuGBSAOBCForce::setUseCutoff(float distance, const CpuNeighborList& neighbors) {
     cutoff = true;
     cutoffDistance = distance;
+    neighborList = &neighbors;
 }
 
 void CpuGBSAOBCForce::setPeriodic(float* periodicBoxSize) {
@@ -89,6 +93,7 @@ void CpuGBSAOBCForce::setParticleParameters(const std::vector<std::pair<float, f
     particleParams = params;
     bornRadii.resize(params.size()+3);
     obcChain.resize(params.size()+3);
+    combinedBornForces.resize(params.size()+3);
 }
 
 void CpuGBSAOBCForce::computeForce(const AlignedArray<float>& posq, vector<AlignedArray<float> >& threadForce, double* totalEnergy, ThreadPool& threads) {
@@ -102,6 +107,11 @@ void CpuGBSAOBCForce::computeForce(const AlignedArray<float>& posq, vector<Align
     threadBornForces.resize(numThreads);
     for (int i = 0; i < numThreads; i++)
         threadBornForces[i].resize(particleParams.size()+3);
+    if (cutoff) {
+        threadBornSums.resize(numThreads);
+        for (int i = 0; i < numThreads; i++)
+            threadBornSums[i].resize(particleParams.size());
+    }
     gmx_atomic_t counter;
     this->atomicCounter = &counter;
     
@@ -117,6 +127,11 @@ void CpuGBSAOBCForce::computeForce(const AlignedArray<float>& posq, vector<Align
     gmx_atomic_set(&counter, 0);
     threads.resumeThreads();
     threads.waitForThreads(); // First loop
+    if (cutoff) {
+        gmx_atomic_set(&counter, 0);
+        threads.resumeThreads();
+        threads.waitForThreads(); // Combine the Born forces from all threads
+    }
     gmx_atomic_set(&counter, 0);
     threads.resumeThreads();
     threads.waitForThreads(); // Second loop
@@ -132,12 +147,13 @@ void CpuGBSAOBCForce::computeForce(const AlignedArray<float>& posq, vector<Align
 }
 
 void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
+    if (cutoff) {
+        threadComputeNeighborListForce(threads, threadIndex);
+        return;
+    }
     int numParticles = particleParams.size();
     int numThreads = threads.getNumThreads();
     const float dielectricOffset = 0.009;
-    const float alphaObc = 1.0f;
-    const float betaObc = 0.8f;
-    const float gammaObc = 4.85f;
     fvec4 boxSize(periodicBoxSize[0], periodicBoxSize[1], periodicBoxSize[2], 0);
     fvec4 invBoxSize((1/periodicBoxSize[0]), (1/periodicBoxSize[1]), (1/periodicBoxSize[2]), 0);
     int start = (threadIndex*numParticles)/numThreads;
@@ -173,13 +189,10 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
             fvec4 dx, dy, dz, r2;
             getDeltaR(posJ, x, y, z, dx, dy, dz, r2, periodic, boxSize, invBoxSize);
             ivec4 include = mask & (blockAtomIndex != ivec4(atomJ));
-            if (cutoff)
-                include = include & (r2 < cutoffDistance*cutoffDistance);
             if (!any(include))
                 continue;
             fvec4 r = sqrt(r2);
             float scaledRadiusJ = particleParams[atomJ].second;
-            float scaledRadiusJ2 = scaledRadiusJ*scaledRadiusJ;
             fvec4 rScaledRadiusJ = r + scaledRadiusJ;
             include = include & (offsetRadiusI < rScaledRadiusJ);
             fvec4 l_ij = 1.0f/max(offsetRadiusI, abs(r-scaledRadiusJ));
@@ -187,7 +200,6 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
             fvec4 l_ij2 = l_ij*l_ij;
             fvec4 u_ij2 = u_ij*u_ij;
             fvec4 rInverse = 1.0f/r;
-            fvec4 r2Inverse = rInverse*rInverse;
             fvec4 logRatio = fastLog(u_ij/l_ij);
             fvec4 term = l_ij - u_ij + 0.25f*r*(u_ij2 - l_ij2) + (0.5f*rInverse*logRatio) + (0.25f*scaledRadiusJ*scaledRadiusJ*rInverse)*(l_ij2 - u_ij2);
             for (int j = 0; j < 4; j++) {
@@ -198,17 +210,8 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
                 }
             }
         }
-        for (int i = 0; i < numInBlock; i++) {
-            int atomIndex = blockStart+i;
-            sum[i] *= 0.5f*atomRadius[i];
-            float sum2 = sum[i]*sum[i];
-            float sum3 = sum[i]*sum2;
-            float tanhSum = tanh(alphaObc*sum[i] - betaObc*sum2 + gammaObc*sum3);
-            float radiusI = atomRadius[i] + dielectricOffset;
-            bornRadii[atomIndex] = 1.0f/(1.0f/atomRadius[i] - tanhSum/radiusI);
-            obcChain[atomIndex] = atomRadius[i]*(alphaObc - 2.0f*betaObc*sum[i] + 3.0f*gammaObc*sum2);
-            obcChain[atomIndex] = (1.0f - tanhSum*tanhSum)*obcChain[atomIndex]/radiusI;
-        }
+        for (int i = 0; i < numInBlock; i++)
+            computeBornRadius(blockStart+i, sum[i]);
     }
     threads.syncThreads();
 
@@ -272,8 +275,6 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
             fvec4 dx, dy, dz, r2;
             getDeltaR(posJ, x, y, z, dx, dy, dz, r2, periodic, boxSize, invBoxSize);
             ivec4 include = mask & (blockAtomIndex <= ivec4(atomJ));
-            if (cutoff)
-                include = include & (r2 < cutoffDistance*cutoffDistance);
             if (!any(include))
                 continue;
             fvec4 r = sqrt(r2);
@@ -301,8 +302,6 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
             atomForce[2] += dot4(fz, one);
             ivec4 atomJMask = include & (blockAtomIndex != ivec4(atomJ));
             fvec4 termEnergy = blend(0.0f, Gpol, include);
-            if (cutoff)
-                termEnergy -= blend(0.0f, partialChargeI*posJ[3]/cutoffDistance, atomJMask);
             termEnergy *= blend(0.5f, 1.0f, atomJMask);
             energy += dot4(termEnergy, one);
             bornForces[atomJ] += dot4(blend(0.0f, dGpol_dalpha2_ij, atomJMask), radii);
@@ -356,8 +355,6 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
             fvec4 dx, dy, dz, r2;
             getDeltaR(posJ, x, y, z, dx, dy, dz, r2, periodic, boxSize, invBoxSize);
             ivec4 include = mask & (blockAtomIndex != ivec4(atomJ));
-            if (cutoff)
-                include = include & (r2 < cutoffDistance*cutoffDistance);
             if (!any(include))
                 continue;
             fvec4 r = sqrt(r2);
@@ -397,6 +394,284 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
     threadEnergy[threadIndex] = energy;
 }
 
+void CpuGBSAOBCForce::threadComputeNeighborListForce(ThreadPool& threads, int threadIndex) {
+    int numParticles = particleParams.size();
+    int numThreads = threads.getNumThreads();
+    int numBlocks = neighborList->getNumBlocks();
+    const float dielectricOffset = 0.009;
+    const float probeRadius = 0.14f;
+    fvec4 boxSize(periodicBoxSize[0], periodicBoxSize[1], periodicBoxSize[2], 0);
+    fvec4 invBoxSize((1/periodicBoxSize[0]), (1/periodicBoxSize[1]), (1/periodicBoxSize[2]), 0);
+    float preFactor;
+    if (soluteDielectric != 0.0f && solventDielectric != 0.0f)
+        preFactor = ONE_4PI_EPS0*((1.0f/solventDielectric) - (1.0f/soluteDielectric));
+    else
+        preFactor = 0.0f;
+
+    // Sum the descreening integrals over all pairs in the neighbor list.
+
+    AlignedArray<float>& bornSum = threadBornSums[threadIndex];
+    for (int i = 0; i < numParticles; i++)
+        bornSum[i] = 0.0f;
+    while (true) {
+        int blockIndex = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
+        if (blockIndex >= numBlocks)
+            break;
+        calculateBlockBornSum(blockIndex, &bornSum[0], boxSize, invBoxSize);
+    }
+    threads.syncThreads();
+
+    // Combine the sums from all threads to compute the Born radii, then compute the ACE surface area
+    // term and the self energy of each atom.
+
+    double energy = 0.0;
+    AlignedArray<float>& bornForces = threadBornForces[threadIndex];
+    for (int i = 0; i < numParticles; i++)
+        bornForces[i] = 0.0f;
+    while (true) {
+        int atomI = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
+        if (atomI >= numParticles)
+            break;
+        float sum = 0.0f;
+        for (int i = 0; i < numThreads; i++)
+            sum += threadBornSums[i][atomI];
+        computeBornRadius(atomI, sum);
+        if (bornRadii[atomI] > 0) {
+            float radiusI = particleParams[atomI].first + dielectricOffset;
+            float r = radiusI + probeRadius;
+            float ratio6 = powf(radiusI/bornRadii[atomI], 6.0f);
+            float saTerm = surfaceAreaFactor*r*r*ratio6;
+            energy += saTerm;
+            bornForces[atomI] = -6.0f*saTerm/bornRadii[atomI]; 
+        }
+        float charge = posq[4*atomI+3];
+        float selfEnergy = preFactor*charge*charge/bornRadii[atomI];
+        energy += 0.5f*selfEnergy;
+        bornForces[atomI] -= 0.5f*selfEnergy/bornRadii[atomI];
+    }
+    threads.syncThreads();
+
+    // First loop of Born energy computation.
+
+    float* forces = &(*threadForce)[threadIndex][0];
+    while (true) {
+        int blockIndex = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
+        if (blockIndex >= numBlocks)
+            break;
+        calculateBlockEnergy(blockIndex, forces, &bornForces[0], energy, preFactor, boxSize, invBoxSize);
+    }
+    threads.syncThreads();
+
+    // Combine the Born forces from all threads.
+
+    while (true) {
+        int blockStart = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 4);
+        if (blockStart >= numParticles)
+            break;
+        fvec4 bornForce(0.0f);
+        for (int i = 0; i < numThreads; i++)
+            bornForce += fvec4(&threadBornForces[i][blockStart]);
+        fvec4 radii(&bornRadii[blockStart]);
+        bornForce *= radii*radii*fvec4(&obcChain[blockStart]);
+        bornForce.store(&combinedBornForces[blockStart]);
+    }
+    threads.syncThreads();
+
+    // Second loop of Born energy computation.
+
+    while (true) {
+        int blockIndex = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
+        if (blockIndex >= numBlocks)
+            break;
+        calculateBlockChainRule(blockIndex, forces, boxSize, invBoxSize);
+    }
+    threadEnergy[threadIndex] = energy;
+}
+
+void CpuGBSAOBCForce::computeBornRadius(int atom, float sum) {
+    const float dielectricOffset = 0.009;
+    const float alphaObc = 1.0f;
+    const float betaObc = 0.8f;
+    const float gammaObc = 4.85f;
+    float offsetRadius = particleParams[atom].first;
+    sum *= 0.5f*offsetRadius;
+    float sum2 = sum*sum;
+    float sum3 = sum*sum2;
+    float tanhSum = tanh(alphaObc*sum - betaObc*sum2 + gammaObc*sum3);
+    float radiusI = offsetRadius + dielectricOffset;
+    bornRadii[atom] = 1.0f/(1.0f/offsetRadius - tanhSum/radiusI);
+    obcChain[atom] = offsetRadius*(alphaObc - 2.0f*betaObc*sum + 3.0f*gammaObc*sum2);
+    obcChain[atom] = (1.0f - tanhSum*tanhSum)*obcChain[atom]/radiusI;
+}
+
+void CpuGBSAOBCForce::calculateBlockBornSum(int blockIndex, float* bornSum, const fvec4& boxSize, const fvec4& invBoxSize) {
+    // Load the positions and parameters of the atoms in the block.
+
+    const int* blockAtom = &neighborList->getSortedAtoms()[4*blockIndex];
+    fvec4 blockAtomX(posq+4*blockAtom[0]), blockAtomY(posq+4*blockAtom[1]), blockAtomZ(posq+4*blockAtom[2]), blockAtomQ(posq+4*blockAtom[3]);
+    transpose(blockAtomX, blockAtomY, blockAtomZ, blockAtomQ);
+    fvec4 blockOffsetRadius(particleParams[blockAtom[0]].first, particleParams[blockAtom[1]].first, particleParams[blockAtom[2]].first, particleParams[blockAtom[3]].first);
+    fvec4 blockScaledRadius(particleParams[blockAtom[0]].second, particleParams[blockAtom[1]].second, particleParams[blockAtom[2]].second, particleParams[blockAtom[3]].second);
+    fvec4 blockSum(0.0f);
+    fvec4 one(1.0f);
+
+    // Loop over neighbors for this block.
+
+    const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
+    const vector<char>& exclusions = neighborList->getBlockExclusions(blockIndex);
+    for (int i = 0; i < (int) neighbors.size(); i++) {
+        int atom = neighbors[i];
+        fvec4 dx, dy, dz, r2;
+        getDeltaR(fvec4(posq+4*atom), blockAtomX, blockAtomY, blockAtomZ, dx, dy, dz, r2, periodic, boxSize, invBoxSize);
+        char excl = exclusions[i];
+        ivec4 include(excl&1 ? 0 : -1, excl&2 ? 0 : -1, excl&4 ? 0 : -1, excl&8 ? 0 : -1);
+        include = include & (r2 < cutoffDistance*cutoffDistance);
+        if (!any(include))
+            continue;
+        fvec4 r = sqrt(r2);
+        fvec4 rInverse = 1.0f/r;
+        blockSum += computeBornSumTerm(r, rInverse, blockOffsetRadius, particleParams[atom].second, include);
+        bornSum[atom] += dot4(computeBornSumTerm(r, rInverse, particleParams[atom].first, blockScaledRadius, include), one);
+    }
+    for (int i = 0; i < 4; i++)
+        bornSum[blockAtom[i]] += blockSum[i];
+}
+
+void CpuGBSAOBCForce::calculateBlockEnergy(int blockIndex, float* forces, float* bornForces, double& energy, float preFactor, const fvec4& boxSize, const fvec4& invBoxSize) {
+    // Load the positions and parameters of the atoms in the block.
+
+    const int* blockAtom = &neighborList->getSortedAtoms()[4*blockIndex];
+    fvec4 blockAtomX(posq+4*blockAtom[0]), blockAtomY(posq+4*blockAtom[1]), blockAtomZ(posq+4*blockAtom[2]), blockAtomCharge(posq+4*blockAtom[3]);
+    transpose(blockAtomX, blockAtomY, blockAtomZ, blockAtomCharge);
+    blockAtomCharge *= preFactor;
+    fvec4 blockRadii(bornRadii[blockAtom[0]], bornRadii[blockAtom[1]], bornRadii[blockAtom[2]], bornRadii[blockAtom[3]]);
+    fvec4 blockAtomForceX(0.0f), blockAtomForceY(0.0f), blockAtomForceZ(0.0f), blockAtomBornForce(0.0f);
+    fvec4 one(1.0f);
+
+    // Loop over neighbors for this block.
+
+    const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
+    const vector<char>& exclusions = neighborList->getBlockExclusions(blockIndex);
+    for (int i = 0; i < (int) neighbors.size(); i++) {
+        int atom = neighbors[i];
+        fvec4 posJ(posq+4*atom);
+        fvec4 dx, dy, dz, r2;
+        getDeltaR(posJ, blockAtomX, blockAtomY, blockAtomZ, dx, dy, dz, r2, periodic, boxSize, invBoxSize);
+        char excl = exclusions[i];
+        ivec4 include(excl&1 ? 0 : -1, excl&2 ? 0 : -1, excl&4 ? 0 : -1, excl&8 ? 0 : -1);
+        include = include & (r2 < cutoffDistance*cutoffDistance);
+        if (!any(include))
+            continue;
+        float radiusJ = bornRadii[atom];
+        fvec4 alpha2_ij = blockRadii*radiusJ;
+        fvec4 D_ij = r2/(4.0f*alpha2_ij);
+        fvec4 expTerm(expf(-D_ij[0]), expf(-D_ij[1]), expf(-D_ij[2]), expf(-D_ij[3]));
+        fvec4 denominator2 = r2 + alpha2_ij*expTerm;
+        fvec4 denominator = sqrt(denominator2);
+        fvec4 chargeProd = blockAtomCharge*posJ[3];
+        fvec4 Gpol = chargeProd/denominator;
+        fvec4 dGpol_dr = -Gpol*(1.0f - 0.25f*expTerm)/denominator2;
+        fvec4 dGpol_dalpha2_ij = -0.5f*Gpol*expTerm*(1.0f + D_ij)/denominator2;
+        dGpol_dr = blend(0.0f, dGpol_dr, include);
+        dGpol_dalpha2_ij = blend(0.0f, dGpol_dalpha2_ij, include);
+        fvec4 fx = dx*dGpol_dr;
+        fvec4 fy = dy*dGpol_dr;
+        fvec4 fz = dz*dGpol_dr;
+        blockAtomForceX -= fx;
+        blockAtomForceY -= fy;
+        blockAtomForceZ -= fz;
+        float* atomForce = forces+4*atom;
+        atomForce[0] += dot4(fx, one);
+        atomForce[1] += dot4(fy, one);
+        atomForce[2] += dot4(fz, one);
+        blockAtomBornForce += dGpol_dalpha2_ij*radiusJ;
+        bornForces[atom] += dot4(dGpol_dalpha2_ij, blockRadii);
+        energy += dot4(blend(0.0f, Gpol-chargeProd/cutoffDistance, include), one);
+    }
+
+    // Record the forces on the block atoms.
+
+    fvec4 f[4] = {blockAtomForceX, blockAtomForceY, blockAtomForceZ, 0.0f};
+    transpose(f[0], f[1], f[2], f[3]);
+    for (int i = 0; i < 4; i++) {
+        (fvec4(forces+4*blockAtom[i])+f[i]).store(forces+4*blockAtom[i]);
+        bornForces[blockAtom[i]] += blockAtomBornForce[i];
+    }
+}
+
+void CpuGBSAOBCForce::calculateBlockChainRule(int blockIndex, float* forces, const fvec4& boxSize, const fvec4& invBoxSize) {
+    // Load the positions and parameters of the atoms in the block.
+
+    const int* blockAtom = &neighborList->getSortedAtoms()[4*blockIndex];
+    fvec4 blockAtomX(posq+4*blockAtom[0]), blockAtomY(posq+4*blockAtom[1]), blockAtomZ(posq+4*blockAtom[2]), blockAtomQ(posq+4*blockAtom[3]);
+    transpose(blockAtomX, blockAtomY, blockAtomZ, blockAtomQ);
+    fvec4 blockOffsetRadius(particleParams[blockAtom[0]].first, particleParams[blockAtom[1]].first, particleParams[blockAtom[2]].first, particleParams[blockAtom[3]].first);
+    fvec4 blockScaledRadius(particleParams[blockAtom[0]].second, particleParams[blockAtom[1]].second, particleParams[blockAtom[2]].second, particleParams[blockAtom[3]].second);
+    fvec4 blockBornForce(combinedBornForces[blockAtom[0]], combinedBornForces[blockAtom[1]], combinedBornForces[blockAtom[2]], combinedBornForces[blockAtom[3]]);
+    fvec4 blockAtomForceX(0.0f), blockAtomForceY(0.0f), blockAtomForceZ(0.0f);
+    fvec4 one(1.0f);
+
+    // Loop over neighbors for this block.
+
+    const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
+    const vector<char>& exclusions = neighborList->getBlockExclusions(blockIndex);
+    for (int i = 0; i < (int) neighbors.size(); i++) {
+        int atom = neighbors[i];
+        fvec4 dx, dy, dz, r2;
+        getDeltaR(fvec4(posq+4*atom), blockAtomX, blockAtomY, blockAtomZ, dx, dy, dz, r2, periodic, boxSize, invBoxSize);
+        char excl = exclusions[i];
+        ivec4 include(excl&1 ? 0 : -1, excl&2 ? 0 : -1, excl&4 ? 0 : -1, excl&8 ? 0 : -1);
+        include = include & (r2 < cutoffDistance*cutoffDistance);
+        if (!any(include))
+            continue;
+        fvec4 r = sqrt(r2);
+        fvec4 rInverse = 1.0f/r;
+        fvec4 de = blockBornForce*computeChainRuleTerm(r, rInverse, blockOffsetRadius, particleParams[atom].second, include);
+        de += combinedBornForces[atom]*computeChainRuleTerm(r, rInverse, particleParams[atom].first, blockScaledRadius, include);
+        fvec4 fx = dx*de;
+        fvec4 fy = dy*de;
+        fvec4 fz = dz*de;
+        blockAtomForceX += fx;
+        blockAtomForceY += fy;
+        blockAtomForceZ += fz;
+        float* atomForce = forces+4*atom;
+        atomForce[0] -= dot4(fx, one);
+        atomForce[1] -= dot4(fy, one);
+        atomForce[2] -= dot4(fz, one);
+    }
+
+    // Record the forces on the block atoms.
+
+    fvec4 f[4] = {blockAtomForceX, blockAtomForceY, blockAtomForceZ, 0.0f};
+    transpose(f[0], f[1], f[2], f[3]);
+    for (int i = 0; i < 4; i++)
+        (fvec4(forces+4*blockAtom[i])+f[i]).store(forces+4*blockAtom[i]);
+}
+
+fvec4 CpuGBSAOBCForce::computeBornSumTerm(const fvec4& r, const fvec4& rInverse, const fvec4& offsetRadiusI, const fvec4& scaledRadiusJ, const ivec4& include) {
+    fvec4 rScaledRadiusJ = r + scaledRadiusJ;
+    fvec4 l_ij = 1.0f/max(offsetRadiusI, abs(r-scaledRadiusJ));
+    fvec4 u_ij = 1.0f/rScaledRadiusJ;
+    fvec4 l_ij2 = l_ij*l_ij;
+    fvec4 u_ij2 = u_ij*u_ij;
+    fvec4 logRatio = fastLog(u_ij/l_ij);
+    fvec4 term = l_ij - u_ij + 0.25f*r*(u_ij2 - l_ij2) + (0.5f*rInverse*logRatio) + (0.25f*scaledRadiusJ*scaledRadiusJ*rInverse)*(l_ij2 - u_ij2);
+    term += blend(0.0f, 2.0f*(1.0f/offsetRadiusI-l_ij), offsetRadiusI < scaledRadiusJ-r);
+    return blend(0.0f, term, include & (offsetRadiusI < rScaledRadiusJ));
+}
+
+fvec4 CpuGBSAOBCForce::computeChainRuleTerm(const fvec4& r, const fvec4& rInverse, const fvec4& offsetRadiusI, const fvec4& scaledRadiusJ, const ivec4& include) {
+    fvec4 rScaledRadiusJ = r + scaledRadiusJ;
+    fvec4 l_ij = 1.0f/max(offsetRadiusI, abs(r-scaledRadiusJ));
+    fvec4 u_ij = 1.0f/rScaledRadiusJ;
+    fvec4 l_ij2 = l_ij*l_ij;
+    fvec4 u_ij2 = u_ij*u_ij;
+    fvec4 r2Inverse = rInverse*rInverse;
+    fvec4 logRatio = fastLog(u_ij/l_ij);
+    fvec4 t3 = 0.125f*(1.0f + scaledRadiusJ*scaledRadiusJ*r2Inverse)*(l_ij2 - u_ij2) + 0.25f*logRatio*r2Inverse;
+    return blend(0.0f, t3*rInverse, include & (offsetRadiusI < rScaledRadiusJ));
+}
+
 void CpuGBSAOBCForce::getDeltaR(const fvec4& posI, const fvec4& x, const fvec4& y, const fvec4& z, fvec4& dx, fvec4& dy, fvec4& dz, fvec4& r2, bool periodic, const fvec4& boxSize, const fvec4& invBoxSize) const {
     dx = x-posI[0];
     dy = y-posI[1];
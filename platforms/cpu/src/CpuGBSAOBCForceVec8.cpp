@@ -0,0 +1,267 @@
+/* Portions copyright (c) 2006-2015 Stanford University and Simbios.
+ * Contributors: Pande Group
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "CpuGBSAOBCForceVec8.h"
+#include "openmm/OpenMMException.h"
+#include <cmath>
+
+using namespace std;
+using namespace OpenMM;
+
+#ifdef _MSC_VER
+    // Workaround for a compiler bug in Visual Studio 10. Hopefully we can remove this
+    // once we move to a later version.
+    #undef __AVX__
+#endif
+
+#ifndef __AVX__
+CpuGBSAOBCForce* createCpuGBSAOBCForceVec8() {
+    throw OpenMMException("Internal error: OpenMM was compiled without AVX support");
+}
+#else
+/**
+ * Factory method to create a CpuGBSAOBCForceVec8.
+ */
+CpuGBSAOBCForce* createCpuGBSAOBCForceVec8() {
+    return new CpuGBSAOBCForceVec8();
+}
+
+CpuGBSAOBCForceVec8::CpuGBSAOBCForceVec8() {
+}
+
+static inline ivec8 getIncludeMask(char excl) {
+    if (excl == 0)
+        return ivec8(-1);
+    return ivec8(excl&1 ? 0 : -1, excl&2 ? 0 : -1, excl&4 ? 0 : -1, excl&8 ? 0 : -1, excl&16 ? 0 : -1, excl&32 ? 0 : -1, excl&64 ? 0 : -1, excl&128 ? 0 : -1);
+}
+
+void CpuGBSAOBCForceVec8::loadBlockPositions(const int* blockAtom, fvec8& x, fvec8& y, fvec8& z, fvec8& q) const {
+    fvec4 p[8];
+    for (int i = 0; i < 8; i++)
+        p[i] = fvec4(posq+4*blockAtom[i]);
+    transpose(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], x, y, z, q);
+}
+
+void CpuGBSAOBCForceVec8::calculateBlockBornSum(int blockIndex, float* bornSum, const fvec4& boxSize, const fvec4& invBoxSize) {
+    // Load the positions and parameters of the atoms in the block.
+
+    const int* blockAtom = &neighborList->getSortedAtoms()[8*blockIndex];
+    fvec8 blockAtomX, blockAtomY, blockAtomZ, blockAtomQ;
+    loadBlockPositions(blockAtom, blockAtomX, blockAtomY, blockAtomZ, blockAtomQ);
+    float offsetRadius[8], scaledRadius[8];
+    for (int i = 0; i < 8; i++) {
+        offsetRadius[i] = particleParams[blockAtom[i]].first;
+        scaledRadius[i] = particleParams[blockAtom[i]].second;
+    }
+    fvec8 blockOffsetRadius(offsetRadius);
+    fvec8 blockScaledRadius(scaledRadius);
+    fvec8 blockSum(0.0f);
+    fvec8 one(1.0f);
+
+    // Loop over neighbors for this block.
+
+    const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
+    const vector<char>& exclusions = neighborList->getBlockExclusions(blockIndex);
+    for (int i = 0; i < (int) neighbors.size(); i++) {
+        int atom = neighbors[i];
+        fvec8 dx, dy, dz, r2;
+        getDeltaR(fvec4(posq+4*atom), blockAtomX, blockAtomY, blockAtomZ, dx, dy, dz, r2, boxSize, invBoxSize);
+        ivec8 include = getIncludeMask(exclusions[i]) & (r2 < cutoffDistance*cutoffDistance);
+        if (!any(include))
+            continue;
+        fvec8 r = sqrt(r2);
+        fvec8 rInverse = 1.0f/r;
+        blockSum += computeBornSumTerm(r, rInverse, blockOffsetRadius, particleParams[atom].second, include);
+        bornSum[atom] += dot8(computeBornSumTerm(r, rInverse, particleParams[atom].first, blockScaledRadius, include), one);
+    }
+    float sum[8];
+    blockSum.store(sum);
+    for (int i = 0; i < 8; i++)
+        bornSum[blockAtom[i]] += sum[i];
+}
+
+void CpuGBSAOBCForceVec8::calculateBlockEnergy(int blockIndex, float* forces, float* bornForces, double& energy, float preFactor, const fvec4& boxSize, const fvec4& invBoxSize) {
+    // Load the positions and parameters of the atoms in the block.
+
+    const int* blockAtom = &neighborList->getSortedAtoms()[8*blockIndex];
+    fvec8 blockAtomX, blockAtomY, blockAtomZ, blockAtomCharge;
+    loadBlockPositions(blockAtom, blockAtomX, blockAtomY, blockAtomZ, blockAtomCharge);
+    blockAtomCharge *= preFactor;
+    float radii[8];
+    for (int i = 0; i < 8; i++)
+        radii[i] = bornRadii[blockAtom[i]];
+    fvec8 blockRadii(radii);
+    fvec8 blockAtomForceX(0.0f), blockAtomForceY(0.0f), blockAtomForceZ(0.0f), blockAtomBornForce(0.0f);
+    fvec8 one(1.0f);
+
+    // Loop over neighbors for this block.
+
+    const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
+    const vector<char>& exclusions = neighborList->getBlockExclusions(blockIndex);
+    for (int i = 0; i < (int) neighbors.size(); i++) {
+        int atom = neighbors[i];
+        fvec4 posJ(posq+4*atom);
+        fvec8 dx, dy, dz, r2;
+        getDeltaR(posJ, blockAtomX, blockAtomY, blockAtomZ, dx, dy, dz, r2, boxSize, invBoxSize);
+        ivec8 include = getIncludeMask(exclusions[i]) & (r2 < cutoffDistance*cutoffDistance);
+        if (!any(include))
+            continue;
+        float radiusJ = bornRadii[atom];
+        fvec8 alpha2_ij = blockRadii*radiusJ;
+        fvec8 D_ij = r2/(4.0f*alpha2_ij);
+        float d[8];
+        D_ij.store(d);
+        fvec8 expTerm(expf(-d[0]), expf(-d[1]), expf(-d[2]), expf(-d[3]), expf(-d[4]), expf(-d[5]), expf(-d[6]), expf(-d[7]));
+        fvec8 denominator2 = r2 + alpha2_ij*expTerm;
+        fvec8 denominator = sqrt(denominator2);
+        fvec8 chargeProd = blockAtomCharge*posJ[3];
+        fvec8 Gpol = chargeProd/denominator;
+        fvec8 dGpol_dr = -Gpol*(1.0f - 0.25f*expTerm)/denominator2;
+        fvec8 dGpol_dalpha2_ij = -0.5f*Gpol*expTerm*(1.0f + D_ij)/denominator2;
+        dGpol_dr = blend(0.0f, dGpol_dr, include);
+        dGpol_dalpha2_ij = blend(0.0f, dGpol_dalpha2_ij, include);
+        fvec8 fx = dx*dGpol_dr;
+        fvec8 fy = dy*dGpol_dr;
+        fvec8 fz = dz*dGpol_dr;
+        blockAtomForceX -= fx;
+        blockAtomForceY -= fy;
+        blockAtomForceZ -= fz;
+        float* atomForce = forces+4*atom;
+        atomForce[0] += dot8(fx, one);
+        atomForce[1] += dot8(fy, one);
+        atomForce[2] += dot8(fz, one);
+        blockAtomBornForce += dGpol_dalpha2_ij*radiusJ;
+        bornForces[atom] += dot8(dGpol_dalpha2_ij, blockRadii);
+        energy += dot8(blend(0.0f, Gpol-chargeProd/cutoffDistance, include), one);
+    }
+
+    // Record the forces on the block atoms.
+
+    fvec4 f[8];
+    transpose(blockAtomForceX, blockAtomForceY, blockAtomForceZ, 0.0f, f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7]);
+    float bornForce[8];
+    blockAtomBornForce.store(bornForce);
+    for (int i = 0; i < 8; i++) {
+        (fvec4(forces+4*blockAtom[i])+f[i]).store(forces+4*blockAtom[i]);
+        bornForces[blockAtom[i]] += bornForce[i];
+    }
+}
+
+void CpuGBSAOBCForceVec8::calculateBlockChainRule(int blockIndex, float* forces, const fvec4& boxSize, const fvec4& invBoxSize) {
+    // Load the positions and parameters of the atoms in the block.
+
+    const int* blockAtom = &neighborList->getSortedAtoms()[8*blockIndex];
+    fvec8 blockAtomX, blockAtomY, blockAtomZ, blockAtomQ;
+    loadBlockPositions(blockAtom, blockAtomX, blockAtomY, blockAtomZ, blockAtomQ);
+    float offsetRadius[8], scaledRadius[8], bornForce[8];
+    for (int i = 0; i < 8; i++) {
+        offsetRadius[i] = particleParams[blockAtom[i]].first;
+        scaledRadius[i] = particleParams[blockAtom[i]].second;
+        bornForce[i] = combinedBornForces[blockAtom[i]];
+    }
+    fvec8 blockOffsetRadius(offsetRadius);
+    fvec8 blockScaledRadius(scaledRadius);
+    fvec8 blockBornForce(bornForce);
+    fvec8 blockAtomForceX(0.0f), blockAtomForceY(0.0f), blockAtomForceZ(0.0f);
+    fvec8 one(1.0f);
+
+    // Loop over neighbors for this block.
+
+    const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
+    const vector<char>& exclusions = neighborList->getBlockExclusions(blockIndex);
+    for (int i = 0; i < (int) neighbors.size(); i++) {
+        int atom = neighbors[i];
+        fvec8 dx, dy, dz, r2;
+        getDeltaR(fvec4(posq+4*atom), blockAtomX, blockAtomY, blockAtomZ, dx, dy, dz, r2, boxSize, invBoxSize);
+        ivec8 include = getIncludeMask(exclusions[i]) & (r2 < cutoffDistance*cutoffDistance);
+        if (!any(include))
+            continue;
+        fvec8 r = sqrt(r2);
+        fvec8 rInverse = 1.0f/r;
+        fvec8 de = blockBornForce*computeChainRuleTerm(r, rInverse, blockOffsetRadius, particleParams[atom].second, include);
+        de += combinedBornForces[atom]*computeChainRuleTerm(r, rInverse, particleParams[atom].first, blockScaledRadius, include);
+        fvec8 fx = dx*de;
+        fvec8 fy = dy*de;
+        fvec8 fz = dz*de;
+        blockAtomForceX += fx;
+        blockAtomForceY += fy;
+        blockAtomForceZ += fz;
+        float* atomForce = forces+4*atom;
+        atomForce[0] -= dot8(fx, one);
+        atomForce[1] -= dot8(fy, one);
+        atomForce[2] -= dot8(fz, one);
+    }
+
+    // Record the forces on the block atoms.
+
+    fvec4 f[8];
+    transpose(blockAtomForceX, blockAtomForceY, blockAtomForceZ, 0.0f, f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7]);
+    for (int i = 0; i < 8; i++)
+        (fvec4(forces+4*blockAtom[i])+f[i]).store(forces+4*blockAtom[i]);
+}
+
+fvec8 CpuGBSAOBCForceVec8::computeBornSumTerm(const fvec8& r, const fvec8& rInverse, const fvec8& offsetRadiusI, const fvec8& scaledRadiusJ, const ivec8& include) {
+    fvec8 rScaledRadiusJ = r + scaledRadiusJ;
+    fvec8 l_ij = 1.0f/max(offsetRadiusI, abs(r-scaledRadiusJ));
+    fvec8 u_ij = 1.0f/rScaledRadiusJ;
+    fvec8 l_ij2 = l_ij*l_ij;
+    fvec8 u_ij2 = u_ij*u_ij;
+    fvec8 logRatio = fastLog(u_ij/l_ij);
+    fvec8 term = l_ij - u_ij + 0.25f*r*(u_ij2 - l_ij2) + (0.5f*rInverse*logRatio) + (0.25f*scaledRadiusJ*scaledRadiusJ*rInverse)*(l_ij2 - u_ij2);
+    term += blend(0.0f, 2.0f*(1.0f/offsetRadiusI-l_ij), offsetRadiusI < scaledRadiusJ-r);
+    return blend(0.0f, term, include & (offsetRadiusI < rScaledRadiusJ));
+}
+
+fvec8 CpuGBSAOBCForceVec8::computeChainRuleTerm(const fvec8& r, const fvec8& rInverse, const fvec8& offsetRadiusI, const fvec8& scaledRadiusJ, const ivec8& include) {
+    fvec8 rScaledRadiusJ = r + scaledRadiusJ;
+    fvec8 l_ij = 1.0f/max(offsetRadiusI, abs(r-scaledRadiusJ));
+    fvec8 u_ij = 1.0f/rScaledRadiusJ;
+    fvec8 l_ij2 = l_ij*l_ij;
+    fvec8 u_ij2 = u_ij*u_ij;
+    fvec8 r2Inverse = rInverse*rInverse;
+    fvec8 logRatio = fastLog(u_ij/l_ij);
+    fvec8 t3 = 0.125f*(1.0f + scaledRadiusJ*scaledRadiusJ*r2Inverse)*(l_ij2 - u_ij2) + 0.25f*logRatio*r2Inverse;
+    return blend(0.0f, t3*rInverse, include & (offsetRadiusI < rScaledRadiusJ));
+}
+
+void CpuGBSAOBCForceVec8::getDeltaR(const fvec4& posI, const fvec8& x, const fvec8& y, const fvec8& z, fvec8& dx, fvec8& dy, fvec8& dz, fvec8& r2, const fvec4& boxSize, const fvec4& invBoxSize) const {
+    dx = x-posI[0];
+    dy = y-posI[1];
+    dz = z-posI[2];
+    if (periodic) {
+        dx -= round(dx*invBoxSize[0])*boxSize[0];
+        dy -= round(dy*invBoxSize[1])*boxSize[1];
+        dz -= round(dz*invBoxSize[2])*boxSize[2];
+    }
+    r2 = dx*dx + dy*dy + dz*dz;
+}
+
+fvec8 CpuGBSAOBCForceVec8::fastLog(const fvec8& x) {
+    // Evaluate each half with the four component table lookup.
+
+    fvec4 lower = CpuGBSAOBCForce::fastLog(x.lowerVec());
+    fvec4 upper = CpuGBSAOBCForce::fastLog(x.upperVec());
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lower), upper, 1);
+}
+
+#endif
@@ -0,0 +1,205 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuHarmonicAngleForce.h"
+#include "openmm/internal/vectorize.h"
+#include <cmath>
+
+using namespace OpenMM;
+using namespace std;
+
+class CpuHarmonicAngleForce::ComputeForceTask : public ThreadPool::Task {
+public:
+    ComputeForceTask(CpuHarmonicAngleForce& owner, vector<RealVec>& atomCoordinates, vector<RealVec>& forces, bool includeEnergy) :
+            owner(owner), atomCoordinates(atomCoordinates), forces(forces), includeEnergy(includeEnergy) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        double* energy = (includeEnergy ? &owner.threadEnergy[threadIndex] : NULL);
+        owner.threadComputeForce(threadIndex, atomCoordinates, forces, energy);
+    }
+    CpuHarmonicAngleForce& owner;
+    vector<RealVec>& atomCoordinates;
+    vector<RealVec>& forces;
+    bool includeEnergy;
+};
+
+CpuHarmonicAngleForce::CpuHarmonicAngleForce() {
+}
+
+void CpuHarmonicAngleForce::initialize(int numAtoms, int numAngles, int** angleAtoms, ThreadPool& threads) {
+    this->threads = &threads;
+    bondForce.initialize(numAtoms, numAngles, 3, angleAtoms, threads);
+
+    // Store the angles in the order they will be processed: first the angles for each thread,
+    // then the extra angles that must be computed serially.
+
+    const vector<vector<int> >& threadAngles = bondForce.getThreadBonds();
+    const vector<int>& extraAngles = bondForce.getExtraBonds();
+    int numThreads = threads.getNumThreads();
+    vector<int> order;
+    for (int i = 0; i < numThreads; i++) {
+        blockStart.push_back(order.size());
+        order.insert(order.end(), threadAngles[i].begin(), threadAngles[i].end());
+    }
+    blockStart.push_back(order.size());
+    order.insert(order.end(), extraAngles.begin(), extraAngles.end());
+    blockStart.push_back(order.size());
+    angleIndex.resize(numAngles);
+    atom1.resize(numAngles);
+    atom2.resize(numAngles);
+    atom3.resize(numAngles);
+    theta.resize(numAngles, 0.0f);
+    k.resize(numAngles, 0.0f);
+    for (int i = 0; i < numAngles; i++) {
+        int angle = order[i];
+        angleIndex[angle] = i;
+        atom1[i] = angleAtoms[angle][0];
+        atom2[i] = angleAtoms[angle][1];
+        atom3[i] = angleAtoms[angle][2];
+    }
+    threadEnergy.resize(numThreads);
+}
+
+void CpuHarmonicAngleForce::setAngleParameters(int angle, RealOpenMM theta, RealOpenMM k) {
+    int index = angleIndex[angle];
+    this->theta[index] = (float) theta;
+    this->k[index] = (float) k;
+}
+
+void CpuHarmonicAngleForce::calculateForce(vector<RealVec>& atomCoordinates, vector<RealVec>& forces, RealOpenMM* totalEnergy) {
+    // Have the worker threads compute their forces.
+
+    int numThreads = threads->getNumThreads();
+    for (int i = 0; i < numThreads; i++)
+        threadEnergy[i] = 0;
+    ComputeForceTask task(*this, atomCoordinates, forces, totalEnergy != NULL);
+    threads->execute(task);
+    threads->waitForThreads();
+
+    // Compute any "extra" angles.
+
+    double energy = 0;
+    computeAngles(blockStart[numThreads], blockStart[numThreads+1], atomCoordinates, forces, totalEnergy == NULL ? NULL : &energy);
+
+    // Compute the total energy.
+
+    if (totalEnergy != NULL) {
+        for (int i = 0; i < numThreads; i++)
+            energy += threadEnergy[i];
+        *totalEnergy += energy;
+    }
+}
+
+void CpuHarmonicAngleForce::threadComputeForce(int threadIndex, vector<RealVec>& atomCoordinates, vector<RealVec>& forces, double* energy) {
+    computeAngles(blockStart[threadIndex], blockStart[threadIndex+1], atomCoordinates, forces, energy);
+}
+
+void CpuHarmonicAngleForce::computeAngles(int start, int end, vector<RealVec>& atomCoordinates, vector<RealVec>& forces, double* energy) {
+    fvec4 energyAccum(0.0f);
+    float x0[4], y0[4], z0[4], x1[4], y1[4], z1[4], theta0[4], ka[4], angle[4];
+    for (int base = start; base < end; base += 4) {
+        // Load the displacements and parameters for the next four angles.  Unused lanes get
+        // a force constant of zero so they contribute nothing.
+
+        int numInBlock = min(4, end-base);
+        for (int j = 0; j < 4; j++) {
+            if (j < numInBlock) {
+                int i = base+j;
+                RealVec delta0 = atomCoordinates[atom2[i]]-atomCoordinates[atom1[i]];
+                RealVec delta1 = atomCoordinates[atom2[i]]-atomCoordinates[atom3[i]];
+                x0[j] = (float) delta0[0];
+                y0[j] = (float) delta0[1];
+                z0[j] = (float) delta0[2];
+                x1[j] = (float) delta1[0];
+                y1[j] = (float) delta1[1];
+                z1[j] = (float) delta1[2];
+                theta0[j] = theta[i];
+                ka[j] = k[i];
+            }
+            else {
+                x0[j] = y1[j] = 1.0f;
+                y0[j] = z0[j] = x1[j] = z1[j] = 0.0f;
+                theta0[j] = ka[j] = 0.0f;
+            }
+        }
+        fvec4 dx0(x0), dy0(y0), dz0(z0), dx1(x1), dy1(y1), dz1(z1), angleTheta(theta0), angleK(ka);
+
+        // Compute the angle.  Using atan2() of the cross and dot products is more accurate than
+        // acos() of the cosine when the angle is close to 0 or 180 degrees.
+
+        fvec4 px = dy0*dz1 - dz0*dy1;
+        fvec4 py = dz0*dx1 - dx0*dz1;
+        fvec4 pz = dx0*dy1 - dy0*dx1;
+        fvec4 rp = sqrt(px*px + py*py + pz*pz);
+        fvec4 dot = dx0*dx1 + dy0*dy1 + dz0*dz1;
+        fvec4 r2_0 = dx0*dx0 + dy0*dy0 + dz0*dz0;
+        fvec4 r2_1 = dx1*dx1 + dy1*dy1 + dz1*dz1;
+        float sinValues[4], cosValues[4];
+        rp.store(sinValues);
+        dot.store(cosValues);
+        for (int j = 0; j < 4; j++)
+            angle[j] = atan2f(sinValues[j], cosValues[j]);
+
+        // Compute the energy and forces.
+
+        fvec4 deltaIdeal = fvec4(angle)-angleTheta;
+        fvec4 dEdR = angleK*deltaIdeal;
+        if (energy != NULL)
+            energyAccum += 0.5f*dEdR*deltaIdeal;
+        rp = max(rp, fvec4(1.0e-6f));
+        fvec4 termA = dEdR/(r2_0*rp);
+        fvec4 termC = -dEdR/(r2_1*rp);
+        fvec4 fax = (dy0*pz - dz0*py)*termA;
+        fvec4 fay = (dz0*px - dx0*pz)*termA;
+        fvec4 faz = (dx0*py - dy0*px)*termA;
+        fvec4 fcx = (dy1*pz - dz1*py)*termC;
+        fvec4 fcy = (dz1*px - dx1*pz)*termC;
+        fvec4 fcz = (dx1*py - dy1*px)*termC;
+        fax.store(x0);
+        fay.store(y0);
+        faz.store(z0);
+        fcx.store(x1);
+        fcy.store(y1);
+        fcz.store(z1);
+
+        // Accumulate the forces.
+
+        for (int j = 0; j < numInBlock; j++) {
+            RealVec fa(x0[j], y0[j], z0[j]);
+            RealVec fc(x1[j], y1[j], z1[j]);
+            forces[atom1[base+j]] += fa;
+            forces[atom2[base+j]] -= fa+fc;
+            forces[atom3[base+j]] += fc;
+        }
+    }
+    if (energy != NULL)
+        *energy += energyAccum[0]+energyAccum[1]+energyAccum[2]+energyAccum[3];
+}
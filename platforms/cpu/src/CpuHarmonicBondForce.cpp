@@ -0,0 +1,170 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuHarmonicBondForce.h"
+#include "openmm/internal/vectorize.h"
+
+using namespace OpenMM;
+using namespace std;
+
+class CpuHarmonicBondForce::ComputeForceTask : public ThreadPool::Task {
+public:
+    ComputeForceTask(CpuHarmonicBondForce& owner, vector<RealVec>& atomCoordinates, vector<RealVec>& forces, bool includeEnergy) :
+            owner(owner), atomCoordinates(atomCoordinates), forces(forces), includeEnergy(includeEnergy) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        double* energy = (includeEnergy ? &owner.threadEnergy[threadIndex] : NULL);
+        owner.threadComputeForce(threadIndex, atomCoordinates, forces, energy);
+    }
+    CpuHarmonicBondForce& owner;
+    vector<RealVec>& atomCoordinates;
+    vector<RealVec>& forces;
+    bool includeEnergy;
+};
+
+CpuHarmonicBondForce::CpuHarmonicBondForce() {
+}
+
+void CpuHarmonicBondForce::initialize(int numAtoms, int numBonds, int** bondAtoms, ThreadPool& threads) {
+    this->threads = &threads;
+    bondForce.initialize(numAtoms, numBonds, 2, bondAtoms, threads);
+
+    // Store the bonds in the order they will be processed: first the bonds for each thread,
+    // then the extra bonds that must be computed serially.
+
+    const vector<vector<int> >& threadBonds = bondForce.getThreadBonds();
+    const vector<int>& extraBonds = bondForce.getExtraBonds();
+    int numThreads = threads.getNumThreads();
+    vector<int> order;
+    for (int i = 0; i < numThreads; i++) {
+        blockStart.push_back(order.size());
+        order.insert(order.end(), threadBonds[i].begin(), threadBonds[i].end());
+    }
+    blockStart.push_back(order.size());
+    order.insert(order.end(), extraBonds.begin(), extraBonds.end());
+    blockStart.push_back(order.size());
+    bondIndex.resize(numBonds);
+    atom1.resize(numBonds);
+    atom2.resize(numBonds);
+    length.resize(numBonds, 0.0f);
+    k.resize(numBonds, 0.0f);
+    for (int i = 0; i < numBonds; i++) {
+        int bond = order[i];
+        bondIndex[bond] = i;
+        atom1[i] = bondAtoms[bond][0];
+        atom2[i] = bondAtoms[bond][1];
+    }
+    threadEnergy.resize(numThreads);
+}
+
+void CpuHarmonicBondForce::setBondParameters(int bond, RealOpenMM length, RealOpenMM k) {
+    int index = bondIndex[bond];
+    this->length[index] = (float) length;
+    this->k[index] = (float) k;
+}
+
+void CpuHarmonicBondForce::calculateForce(vector<RealVec>& atomCoordinates, vector<RealVec>& forces, RealOpenMM* totalEnergy) {
+    // Have the worker threads compute their forces.
+
+    int numThreads = threads->getNumThreads();
+    for (int i = 0; i < numThreads; i++)
+        threadEnergy[i] = 0;
+    ComputeForceTask task(*this, atomCoordinates, forces, totalEnergy != NULL);
+    threads->execute(task);
+    threads->waitForThreads();
+
+    // Compute any "extra" bonds.
+
+    double energy = 0;
+    computeBonds(blockStart[numThreads], blockStart[numThreads+1], atomCoordinates, forces, totalEnergy == NULL ? NULL : &energy);
+
+    // Compute the total energy.
+
+    if (totalEnergy != NULL) {
+        for (int i = 0; i < numThreads; i++)
+            energy += threadEnergy[i];
+        *totalEnergy += energy;
+    }
+}
+
+void CpuHarmonicBondForce::threadComputeForce(int threadIndex, vector<RealVec>& atomCoordinates, vector<RealVec>& forces, double* energy) {
+    computeBonds(blockStart[threadIndex], blockStart[threadIndex+1], atomCoordinates, forces, energy);
+}
+
+void CpuHarmonicBondForce::computeBonds(int start, int end, vector<RealVec>& atomCoordinates, vector<RealVec>& forces, double* energy) {
+    fvec4 energyAccum(0.0f);
+    float dx[4], dy[4], dz[4], r0[4], kb[4];
+    for (int base = start; base < end; base += 4) {
+        // Load the displacements and parameters for the next four bonds.  Differences are computed
+        // in double precision to avoid losing accuracy for atoms far from the origin.  Unused lanes
+        // get a force constant of zero so they contribute nothing.
+
+        int numInBlock = min(4, end-base);
+        for (int j = 0; j < 4; j++) {
+            if (j < numInBlock) {
+                int i = base+j;
+                RealVec delta = atomCoordinates[atom2[i]]-atomCoordinates[atom1[i]];
+                dx[j] = (float) delta[0];
+                dy[j] = (float) delta[1];
+                dz[j] = (float) delta[2];
+                r0[j] = length[i];
+                kb[j] = k[i];
+            }
+            else {
+                dx[j] = 1.0f;
+                dy[j] = dz[j] = 0.0f;
+                r0[j] = kb[j] = 0.0f;
+            }
+        }
+        fvec4 x(dx), y(dy), z(dz), bondLength(r0), bondK(kb);
+
+        // Compute the energy and forces.
+
+        fvec4 r = sqrt(x*x + y*y + z*z);
+        fvec4 deltaIdeal = r-bondLength;
+        fvec4 dEdR = blend(fvec4(0.0f), bondK*deltaIdeal/r, r > fvec4(0.0f));
+        if (energy != NULL)
+            energyAccum += 0.5f*bondK*deltaIdeal*deltaIdeal;
+        (dEdR*x).store(dx);
+        (dEdR*y).store(dy);
+        (dEdR*z).store(dz);
+
+        // Accumulate the forces.
+
+        for (int j = 0; j < numInBlock; j++) {
+            RealVec f(dx[j], dy[j], dz[j]);
+            forces[atom1[base+j]] += f;
+            forces[atom2[base+j]] -= f;
+        }
+    }
+    if (energy != NULL)
+        *energy += energyAccum[0]+energyAccum[1]+energyAccum[2]+energyAccum[3];
+}
@@ -39,7 +39,10 @@
 #include "ReferenceRbDihedralBond.h"
 #include "ReferenceTabulatedFunction.h"
 #include "openmm/Context.h"
+#include "openmm/MonteCarloAnisotropicBarostat.h"
+#include "openmm/MonteCarloMembraneBarostat.h"
 #include "openmm/OpenMMException.h"
+#include "openmm/internal/CMAPTorsionForceImpl.h"
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/internal/CustomNonbondedForceImpl.h"
 #include "openmm/internal/NonbondedForceImpl.h"
@@ -49,6 +52,7 @@
 #include "lepton/CustomFunction.h"
 #include "lepton/Parser.h"
 #include "lepton/ParsedExpression.h"
+#include <sstream>
 
 using namespace OpenMM;
 using namespace std;
@@ -83,6 +87,16 @@ static ReferenceConstraints& extractConstraints(ContextImpl& context) {
     return *(ReferenceConstraints*) data->constraints;
 }
 
+/**
+ * Add scale*sum(r f^T) over all particles to a virial tensor.
+ */
+static void addPositionForceVirial(const vector<RealVec>& posData, const vector<RealVec>& forceData, double scale, double* virial) {
+    for (int i = 0; i < (int) posData.size(); i++)
+        for (int j = 0; j < 3; j++)
+            for (int k = 0; k < 3; k++)
+                virial[3*j+k] += scale*posData[i][j]*forceData[i][k];
+}
+
 /**
  * Compute the kinetic energy of the system, possibly shifting the velocities in time to account
  * for a leapfrog integrator.
@@ -217,6 +231,32 @@ CpuCalcForcesAndEnergyKernel::CpuCalcForcesAndEnergyKernel(std::string name, con
 
 void CpuCalcForcesAndEnergyKernel::initialize(const System& system) {
     referenceKernel.getAs<ReferenceCalcForcesAndEnergyKernel>().initialize(system);
+    
+    // The virial can only be computed if every force either is a non-periodic bonded force, whose
+    // contribution follows from the particle positions and forces, or computes its own contribution.
+    
+    supportsVirial = true;
+    for (int i = 0; i < system.getNumForces(); i++) {
+        const Force& force = system.getForce(i);
+        if (dynamic_cast<const HarmonicBondForce*>(&force) == NULL &&
+                dynamic_cast<const HarmonicAngleForce*>(&force) == NULL &&
+                dynamic_cast<const PeriodicTorsionForce*>(&force) == NULL &&
+                dynamic_cast<const RBTorsionForce*>(&force) == NULL &&
+                dynamic_cast<const CMAPTorsionForce*>(&force) == NULL &&
+                dynamic_cast<const CustomBondForce*>(&force) == NULL &&
+                dynamic_cast<const CustomAngleForce*>(&force) == NULL &&
+                dynamic_cast<const CustomTorsionForce*>(&force) == NULL &&
+                dynamic_cast<const NonbondedForce*>(&force) == NULL &&
+                dynamic_cast<const CMMotionRemover*>(&force) == NULL &&
+                dynamic_cast<const AndersenThermostat*>(&force) == NULL &&
+                dynamic_cast<const MonteCarloBarostat*>(&force) == NULL &&
+                dynamic_cast<const MonteCarloAnisotropicBarostat*>(&force) == NULL &&
+                dynamic_cast<const MonteCarloMembraneBarostat*>(&force) == NULL)
+            supportsVirial = false;
+    }
+    for (int i = 0; i < system.getNumParticles(); i++)
+        if (system.isVirtualSite(i))
+            virtualSites.push_back(i);
 }
 
 void CpuCalcForcesAndEnergyKernel::beginComputation(ContextImpl& context, bool includeForce, bool includeEnergy, int groups) {
@@ -229,15 +269,179 @@ void CpuCalcForcesAndEnergyKernel::beginComputation(ContextImpl& context, bool i
     data.threads.waitForThreads();
     if (!task.positionsValid)
         throw OpenMMException("Particle coordinate is nan");
+    data.computation++;
+    if (data.includeVirial)
+        for (int i = 0; i < 9; i++)
+            data.virial[i] = 0.0;
 }
 
 double CpuCalcForcesAndEnergyKernel::finishComputation(ContextImpl& context, bool includeForce, bool includeEnergy, int groups, bool& valid) {
-    // Sum the forces from all the threads.
+    // The forces that were added directly to the force array come from bonded interactions, which do not
+    // use periodic boundary conditions, so their virial follows from the positions.  Forces in the thread
+    // buffers come from kernels that have already recorded their own contributions to the virial.
     
-    SumForceTask task(context.getSystem().getNumParticles(), extractForces(context), data);
-    data.threads.execute(task);
-    data.threads.waitForThreads();
-    return referenceKernel.getAs<ReferenceCalcForcesAndEnergyKernel>().finishComputation(context, includeForce, includeEnergy, groups, valid);
+    if (data.includeVirial)
+        addPositionForceVirial(extractPositions(context), extractForces(context), 1.0, data.virial);
+
+    // Sum the forces from all the threads.  This can be skipped when only the energy was requested,
+    // since the forces will be discarded.
+    
+    if (includeForce) {
+        SumForceTask task(context.getSystem().getNumParticles(), extractForces(context), data);
+        data.threads.execute(task);
+        data.threads.waitForThreads();
+    }
+
+    // Distribute forces from virtual sites.  If forces were not requested, the Reference kernel
+    // restores the saved forces instead.
+
+    if (!includeForce)
+        return referenceKernel.getAs<ReferenceCalcForcesAndEnergyKernel>().finishComputation(context, includeForce, includeEnergy, groups, valid);
+    
+    // The energy depends on the positions of virtual sites only through their parent atoms, so the virial
+    // should be sum(r f^T) over the real atoms after the forces have been distributed.  This differs from
+    // what was accumulated above unless the sites are linear combinations of their parents.  The forces
+    // on the sites themselves are left in place, so they must be removed explicitly.
+    
+    vector<RealVec>& posData = extractPositions(context);
+    vector<RealVec>& forceData = extractForces(context);
+    bool correctVirial = (data.includeVirial && virtualSites.size() > 0);
+    if (correctVirial)
+        addPositionForceVirial(posData, forceData, -1.0, data.virial);
+    data.vsites.distributeForces(posData, forceData);
+    if (correctVirial) {
+        addPositionForceVirial(posData, forceData, 1.0, data.virial);
+        for (int i = 0; i < (int) virtualSites.size(); i++)
+            for (int j = 0; j < 3; j++)
+                for (int k = 0; k < 3; k++)
+                    data.virial[3*j+k] -= posData[virtualSites[i]][j]*forceData[virtualSites[i]][k];
+    }
+    return 0.0;
+}
+
+void CpuCalcForcesAndEnergyKernel::setIncludeVirial(bool include) {
+    if (include && !supportsVirial)
+        throw OpenMMException("Computing the virial is not supported for all forces in this System");
+    data.includeVirial = include;
+}
+
+void CpuCalcForcesAndEnergyKernel::getVirial(ContextImpl& context, Vec3* virial) {
+    for (int i = 0; i < 3; i++)
+        virial[i] = Vec3(data.virial[3*i], data.virial[3*i+1], data.virial[3*i+2]);
+}
+
+void CpuVirtualSitesKernel::initialize(const System& system) {
+}
+
+void CpuVirtualSitesKernel::computePositions(ContextImpl& context) {
+    data.vsites.computePositions(extractPositions(context));
+}
+
+CpuCalcHarmonicBondForceKernel::~CpuCalcHarmonicBondForceKernel() {
+    if (bondIndexArray != NULL) {
+        for (int i = 0; i < numBonds; i++)
+            delete[] bondIndexArray[i];
+        delete[] bondIndexArray;
+    }
+}
+
+void CpuCalcHarmonicBondForceKernel::initialize(const System& system, const HarmonicBondForce& force) {
+    numBonds = force.getNumBonds();
+    bondIndexArray = new int*[numBonds];
+    for (int i = 0; i < numBonds; i++)
+        bondIndexArray[i] = new int[2];
+    for (int i = 0; i < numBonds; ++i) {
+        int particle1, particle2;
+        double length, k;
+        force.getBondParameters(i, particle1, particle2, length, k);
+        bondIndexArray[i][0] = particle1;
+        bondIndexArray[i][1] = particle2;
+    }
+    bondForce.initialize(system.getNumParticles(), numBonds, bondIndexArray, data.threads);
+    for (int i = 0; i < numBonds; ++i) {
+        int particle1, particle2;
+        double length, k;
+        force.getBondParameters(i, particle1, particle2, length, k);
+        bondForce.setBondParameters(i, (RealOpenMM) length, (RealOpenMM) k);
+    }
+}
+
+double CpuCalcHarmonicBondForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<RealVec>& posData = extractPositions(context);
+    vector<RealVec>& forceData = extractForces(context);
+    RealOpenMM energy = 0;
+    bondForce.calculateForce(posData, forceData, includeEnergy ? &energy : NULL);
+    return energy;
+}
+
+void CpuCalcHarmonicBondForceKernel::copyParametersToContext(ContextImpl& context, const HarmonicBondForce& force) {
+    if (numBonds != force.getNumBonds())
+        throw OpenMMException("updateParametersInContext: The number of bonds has changed");
+
+    // Record the values.
+
+    for (int i = 0; i < numBonds; ++i) {
+        int particle1, particle2;
+        double length, k;
+        force.getBondParameters(i, particle1, particle2, length, k);
+        if (particle1 != bondIndexArray[i][0] || particle2 != bondIndexArray[i][1])
+            throw OpenMMException("updateParametersInContext: The set of particles in a bond has changed");
+        bondForce.setBondParameters(i, (RealOpenMM) length, (RealOpenMM) k);
+    }
+}
+
+CpuCalcHarmonicAngleForceKernel::~CpuCalcHarmonicAngleForceKernel() {
+    if (angleIndexArray != NULL) {
+        for (int i = 0; i < numAngles; i++)
+            delete[] angleIndexArray[i];
+        delete[] angleIndexArray;
+    }
+}
+
+void CpuCalcHarmonicAngleForceKernel::initialize(const System& system, const HarmonicAngleForce& force) {
+    numAngles = force.getNumAngles();
+    angleIndexArray = new int*[numAngles];
+    for (int i = 0; i < numAngles; i++)
+        angleIndexArray[i] = new int[3];
+    for (int i = 0; i < numAngles; ++i) {
+        int particle1, particle2, particle3;
+        double angle, k;
+        force.getAngleParameters(i, particle1, particle2, particle3, angle, k);
+        angleIndexArray[i][0] = particle1;
+        angleIndexArray[i][1] = particle2;
+        angleIndexArray[i][2] = particle3;
+    }
+    angleForce.initialize(system.getNumParticles(), numAngles, angleIndexArray, data.threads);
+    for (int i = 0; i < numAngles; ++i) {
+        int particle1, particle2, particle3;
+        double angle, k;
+        force.getAngleParameters(i, particle1, particle2, particle3, angle, k);
+        angleForce.setAngleParameters(i, (RealOpenMM) angle, (RealOpenMM) k);
+    }
+}
+
+double CpuCalcHarmonicAngleForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<RealVec>& posData = extractPositions(context);
+    vector<RealVec>& forceData = extractForces(context);
+    RealOpenMM energy = 0;
+    angleForce.calculateForce(posData, forceData, includeEnergy ? &energy : NULL);
+    return energy;
+}
+
+void CpuCalcHarmonicAngleForceKernel::copyParametersToContext(ContextImpl& context, const HarmonicAngleForce& force) {
+    if (numAngles != force.getNumAngles())
+        throw OpenMMException("updateParametersInContext: The number of angles has changed");
+
+    // Record the values.
+
+    for (int i = 0; i < numAngles; ++i) {
+        int particle1, particle2, particle3;
+        double angle, k;
+        force.getAngleParameters(i, particle1, particle2, particle3, angle, k);
+        if (particle1 != angleIndexArray[i][0] || particle2 != angleIndexArray[i][1] || particle3 != angleIndexArray[i][2])
+            throw OpenMMException("updateParametersInContext: The set of particles in an angle has changed");
+        angleForce.setAngleParameters(i, (RealOpenMM) angle, (RealOpenMM) k);
+    }
 }
 
 CpuCalcPeriodicTorsionForceKernel::~CpuCalcPeriodicTorsionForceKernel() {
@@ -368,6 +572,326 @@ void CpuCalcRBTorsionForceKernel::copyParametersToContext(ContextImpl& context,
     }
 }
 
+CpuCalcCMAPTorsionForceKernel::~CpuCalcCMAPTorsionForceKernel() {
+    if (torsionIndexArray != NULL) {
+        for (int i = 0; i < numTorsions; i++)
+            delete[] torsionIndexArray[i];
+        delete[] torsionIndexArray;
+    }
+}
+
+void CpuCalcCMAPTorsionForceKernel::initialize(const System& system, const CMAPTorsionForce& force) {
+    numTorsions = force.getNumTorsions();
+    torsionIndexArray = new int*[numTorsions];
+    for (int i = 0; i < numTorsions; i++)
+        torsionIndexArray[i] = new int[8];
+    vector<int> torsionMaps(numTorsions);
+    for (int i = 0; i < numTorsions; i++) {
+        int* index = torsionIndexArray[i];
+        force.getTorsionParameters(i, torsionMaps[i], index[0], index[1], index[2], index[3], index[4], index[5], index[6], index[7]);
+    }
+    torsionForce.initialize(system.getNumParticles(), numTorsions, torsionIndexArray, data.threads);
+    for (int i = 0; i < numTorsions; i++)
+        torsionForce.setTorsionMap(i, torsionMaps[i]);
+    mapSizes.resize(force.getNumMaps());
+    computeMapCoefficients(force);
+}
+
+void CpuCalcCMAPTorsionForceKernel::computeMapCoefficients(const CMAPTorsionForce& force) {
+    int numMaps = force.getNumMaps();
+    vector<vector<vector<double> > > coeff(numMaps);
+    vector<double> energy;
+    for (int i = 0; i < numMaps; i++) {
+        force.getMapParameters(i, mapSizes[i], energy);
+        CMAPTorsionForceImpl::calcMapDerivatives(mapSizes[i], energy, coeff[i]);
+    }
+    torsionForce.setMaps(coeff);
+}
+
+double CpuCalcCMAPTorsionForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<RealVec>& posData = extractPositions(context);
+    vector<RealVec>& forceData = extractForces(context);
+    RealOpenMM energy = 0;
+    torsionForce.calculateForce(posData, forceData, includeEnergy ? &energy : NULL);
+    return energy;
+}
+
+void CpuCalcCMAPTorsionForceKernel::copyParametersToContext(ContextImpl& context, const CMAPTorsionForce& force) {
+    int numMaps = force.getNumMaps();
+    if (mapSizes.size() != numMaps)
+        throw OpenMMException("updateParametersInContext: The number of maps has changed");
+    if (numTorsions != force.getNumTorsions())
+        throw OpenMMException("updateParametersInContext: The number of CMAP torsions has changed");
+    vector<double> energy;
+    for (int i = 0; i < numMaps; i++) {
+        int size;
+        force.getMapParameters(i, size, energy);
+        if (size != mapSizes[i])
+            throw OpenMMException("updateParametersInContext: The size of a map has changed");
+    }
+
+    // Update the maps and the torsions that use them.
+
+    computeMapCoefficients(force);
+    for (int i = 0; i < numTorsions; i++) {
+        int map, index[8];
+        force.getTorsionParameters(i, map, index[0], index[1], index[2], index[3], index[4], index[5], index[6], index[7]);
+        for (int j = 0; j < 8; j++)
+            if (index[j] != torsionIndexArray[i][j])
+                throw OpenMMException("updateParametersInContext: The set of particles in a CMAP torsion has changed");
+        torsionForce.setTorsionMap(i, map);
+    }
+}
+
+CpuCalcCustomBondForceKernel::~CpuCalcCustomBondForceKernel() {
+    if (bondIndexArray != NULL) {
+        for (int i = 0; i < numBonds; i++) {
+            delete[] bondIndexArray[i];
+            delete[] bondParamArray[i];
+        }
+        delete[] bondIndexArray;
+        delete[] bondParamArray;
+    }
+    for (int i = 0; i < (int) ixn.size(); i++)
+        delete ixn[i];
+}
+
+void CpuCalcCustomBondForceKernel::initialize(const System& system, const CustomBondForce& force) {
+    numBonds = force.getNumBonds();
+    int numParameters = force.getNumPerBondParameters();
+
+    // Build the arrays.
+
+    bondIndexArray = new int*[numBonds];
+    for (int i = 0; i < numBonds; i++)
+        bondIndexArray[i] = new int[2];
+    bondParamArray = new RealOpenMM*[numBonds];
+    for (int i = 0; i < numBonds; i++)
+        bondParamArray[i] = new RealOpenMM[numParameters];
+    vector<double> params;
+    for (int i = 0; i < numBonds; ++i) {
+        int particle1, particle2;
+        force.getBondParameters(i, particle1, particle2, params);
+        bondIndexArray[i][0] = particle1;
+        bondIndexArray[i][1] = particle2;
+        for (int j = 0; j < numParameters; j++)
+            bondParamArray[i][j] = (RealOpenMM) params[j];
+    }
+    bondForce.initialize(system.getNumParticles(), numBonds, 2, bondIndexArray, data.threads);
+
+    // Parse the expression used to calculate the force, and create a copy of it for each thread.
+
+    Lepton::ParsedExpression expression = Lepton::Parser::parse(force.getEnergyFunction()).optimize();
+    Lepton::CompiledExpression energyExpression = expression.createCompiledExpression();
+    Lepton::CompiledExpression forceExpression = expression.differentiate("r").createCompiledExpression();
+    vector<string> parameterNames;
+    for (int i = 0; i < numParameters; i++)
+        parameterNames.push_back(force.getPerBondParameterName(i));
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        globalParameterNames.push_back(force.getGlobalParameterName(i));
+    for (int i = 0; i < data.threads.getNumThreads(); i++)
+        ixn.push_back(new CpuCustomBondIxn(energyExpression, forceExpression, parameterNames, globalParameterNames));
+}
+
+double CpuCalcCustomBondForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<RealVec>& posData = extractPositions(context);
+    vector<RealVec>& forceData = extractForces(context);
+    RealOpenMM energy = 0;
+    for (int i = 0; i < (int) globalParameterNames.size(); i++) {
+        double value = context.getParameter(globalParameterNames[i]);
+        for (int j = 0; j < (int) ixn.size(); j++)
+            ixn[j]->setGlobalParameter(i, value);
+    }
+    vector<ReferenceBondIxn*> threadIxn(ixn.begin(), ixn.end());
+    bondForce.calculateForce(posData, bondParamArray, forceData, includeEnergy ? &energy : NULL, threadIxn);
+    return energy;
+}
+
+void CpuCalcCustomBondForceKernel::copyParametersToContext(ContextImpl& context, const CustomBondForce& force) {
+    if (numBonds != force.getNumBonds())
+        throw OpenMMException("updateParametersInContext: The number of bonds has changed");
+
+    // Record the values.
+
+    int numParameters = force.getNumPerBondParameters();
+    vector<double> params;
+    for (int i = 0; i < numBonds; ++i) {
+        int particle1, particle2;
+        force.getBondParameters(i, particle1, particle2, params);
+        if (particle1 != bondIndexArray[i][0] || particle2 != bondIndexArray[i][1])
+            throw OpenMMException("updateParametersInContext: The set of particles in a bond has changed");
+        for (int j = 0; j < numParameters; j++)
+            bondParamArray[i][j] = (RealOpenMM) params[j];
+    }
+}
+
+CpuCalcCustomAngleForceKernel::~CpuCalcCustomAngleForceKernel() {
+    if (angleIndexArray != NULL) {
+        for (int i = 0; i < numAngles; i++) {
+            delete[] angleIndexArray[i];
+            delete[] angleParamArray[i];
+        }
+        delete[] angleIndexArray;
+        delete[] angleParamArray;
+    }
+    for (int i = 0; i < (int) ixn.size(); i++)
+        delete ixn[i];
+}
+
+void CpuCalcCustomAngleForceKernel::initialize(const System& system, const CustomAngleForce& force) {
+    numAngles = force.getNumAngles();
+    int numParameters = force.getNumPerAngleParameters();
+
+    // Build the arrays.
+
+    angleIndexArray = new int*[numAngles];
+    for (int i = 0; i < numAngles; i++)
+        angleIndexArray[i] = new int[3];
+    angleParamArray = new RealOpenMM*[numAngles];
+    for (int i = 0; i < numAngles; i++)
+        angleParamArray[i] = new RealOpenMM[numParameters];
+    vector<double> params;
+    for (int i = 0; i < numAngles; ++i) {
+        int particle1, particle2, particle3;
+        force.getAngleParameters(i, particle1, particle2, particle3, params);
+        angleIndexArray[i][0] = particle1;
+        angleIndexArray[i][1] = particle2;
+        angleIndexArray[i][2] = particle3;
+        for (int j = 0; j < numParameters; j++)
+            angleParamArray[i][j] = (RealOpenMM) params[j];
+    }
+    bondForce.initialize(system.getNumParticles(), numAngles, 3, angleIndexArray, data.threads);
+
+    // Parse the expression used to calculate the force, and create a copy of it for each thread.
+
+    Lepton::ParsedExpression expression = Lepton::Parser::parse(force.getEnergyFunction()).optimize();
+    Lepton::CompiledExpression energyExpression = expression.createCompiledExpression();
+    Lepton::CompiledExpression forceExpression = expression.differentiate("theta").createCompiledExpression();
+    vector<string> parameterNames;
+    for (int i = 0; i < numParameters; i++)
+        parameterNames.push_back(force.getPerAngleParameterName(i));
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        globalParameterNames.push_back(force.getGlobalParameterName(i));
+    for (int i = 0; i < data.threads.getNumThreads(); i++)
+        ixn.push_back(new CpuCustomAngleIxn(energyExpression, forceExpression, parameterNames, globalParameterNames));
+}
+
+double CpuCalcCustomAngleForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<RealVec>& posData = extractPositions(context);
+    vector<RealVec>& forceData = extractForces(context);
+    RealOpenMM energy = 0;
+    for (int i = 0; i < (int) globalParameterNames.size(); i++) {
+        double value = context.getParameter(globalParameterNames[i]);
+        for (int j = 0; j < (int) ixn.size(); j++)
+            ixn[j]->setGlobalParameter(i, value);
+    }
+    vector<ReferenceBondIxn*> threadIxn(ixn.begin(), ixn.end());
+    bondForce.calculateForce(posData, angleParamArray, forceData, includeEnergy ? &energy : NULL, threadIxn);
+    return energy;
+}
+
+void CpuCalcCustomAngleForceKernel::copyParametersToContext(ContextImpl& context, const CustomAngleForce& force) {
+    if (numAngles != force.getNumAngles())
+        throw OpenMMException("updateParametersInContext: The number of angles has changed");
+
+    // Record the values.
+
+    int numParameters = force.getNumPerAngleParameters();
+    vector<double> params;
+    for (int i = 0; i < numAngles; ++i) {
+        int particle1, particle2, particle3;
+        force.getAngleParameters(i, particle1, particle2, particle3, params);
+        if (particle1 != angleIndexArray[i][0] || particle2 != angleIndexArray[i][1] || particle3 != angleIndexArray[i][2])
+            throw OpenMMException("updateParametersInContext: The set of particles in an angle has changed");
+        for (int j = 0; j < numParameters; j++)
+            angleParamArray[i][j] = (RealOpenMM) params[j];
+    }
+}
+
+CpuCalcCustomTorsionForceKernel::~CpuCalcCustomTorsionForceKernel() {
+    if (torsionIndexArray != NULL) {
+        for (int i = 0; i < numTorsions; i++) {
+            delete[] torsionIndexArray[i];
+            delete[] torsionParamArray[i];
+        }
+        delete[] torsionIndexArray;
+        delete[] torsionParamArray;
+    }
+    for (int i = 0; i < (int) ixn.size(); i++)
+        delete ixn[i];
+}
+
+void CpuCalcCustomTorsionForceKernel::initialize(const System& system, const CustomTorsionForce& force) {
+    numTorsions = force.getNumTorsions();
+    int numParameters = force.getNumPerTorsionParameters();
+
+    // Build the arrays.
+
+    torsionIndexArray = new int*[numTorsions];
+    for (int i = 0; i < numTorsions; i++)
+        torsionIndexArray[i] = new int[4];
+    torsionParamArray = new RealOpenMM*[numTorsions];
+    for (int i = 0; i < numTorsions; i++)
+        torsionParamArray[i] = new RealOpenMM[numParameters];
+    vector<double> params;
+    for (int i = 0; i < numTorsions; ++i) {
+        int particle1, particle2, particle3, particle4;
+        force.getTorsionParameters(i, particle1, particle2, particle3, particle4, params);
+        torsionIndexArray[i][0] = particle1;
+        torsionIndexArray[i][1] = particle2;
+        torsionIndexArray[i][2] = particle3;
+        torsionIndexArray[i][3] = particle4;
+        for (int j = 0; j < numParameters; j++)
+            torsionParamArray[i][j] = (RealOpenMM) params[j];
+    }
+    bondForce.initialize(system.getNumParticles(), numTorsions, 4, torsionIndexArray, data.threads);
+
+    // Parse the expression used to calculate the force, and create a copy of it for each thread.
+
+    Lepton::ParsedExpression expression = Lepton::Parser::parse(force.getEnergyFunction()).optimize();
+    Lepton::CompiledExpression energyExpression = expression.createCompiledExpression();
+    Lepton::CompiledExpression forceExpression = expression.differentiate("theta").createCompiledExpression();
+    vector<string> parameterNames;
+    for (int i = 0; i < numParameters; i++)
+        parameterNames.push_back(force.getPerTorsionParameterName(i));
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        globalParameterNames.push_back(force.getGlobalParameterName(i));
+    for (int i = 0; i < data.threads.getNumThreads(); i++)
+        ixn.push_back(new CpuCustomTorsionIxn(energyExpression, forceExpression, parameterNames, globalParameterNames));
+}
+
+double CpuCalcCustomTorsionForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<RealVec>& posData = extractPositions(context);
+    vector<RealVec>& forceData = extractForces(context);
+    RealOpenMM energy = 0;
+    for (int i = 0; i < (int) globalParameterNames.size(); i++) {
+        double value = context.getParameter(globalParameterNames[i]);
+        for (int j = 0; j < (int) ixn.size(); j++)
+            ixn[j]->setGlobalParameter(i, value);
+    }
+    vector<ReferenceBondIxn*> threadIxn(ixn.begin(), ixn.end());
+    bondForce.calculateForce(posData, torsionParamArray, forceData, includeEnergy ? &energy : NULL, threadIxn);
+    return energy;
+}
+
+void CpuCalcCustomTorsionForceKernel::copyParametersToContext(ContextImpl& context, const CustomTorsionForce& force) {
+    if (numTorsions != force.getNumTorsions())
+        throw OpenMMException("updateParametersInContext: The number of torsions has changed");
+
+    // Record the values.
+
+    int numParameters = force.getNumPerTorsionParameters();
+    vector<double> params;
+    for (int i = 0; i < numTorsions; ++i) {
+        int particle1, particle2, particle3, particle4;
+        force.getTorsionParameters(i, particle1, particle2, particle3, particle4, params);
+        if (particle1 != torsionIndexArray[i][0] || particle2 != torsionIndexArray[i][1] || particle3 != torsionIndexArray[i][2] || particle4 != torsionIndexArray[i][3])
+            throw OpenMMException("updateParametersInContext: The set of particles in a torsion has changed");
+        for (int j = 0; j < numParameters; j++)
+            torsionParamArray[i][j] = (RealOpenMM) params[j];
+    }
+}
+
 class CpuCalcNonbondedForceKernel::PmeIO : public CalcPmeReciprocalForceKernel::IO {
 public:
     PmeIO(float* posq, float* force, int numParticles) : posq(posq), force(force), numParticles(numParticles) {
@@ -388,20 +912,45 @@ private:
     int numParticles;
 };
 
+#ifdef _MSC_VER
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <Windows.h>
+    static long long getTime() {
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft); // 100-nanoseconds since 1-1-1601
+        ULARGE_INTEGER result;
+        result.LowPart = ft.dwLowDateTime;
+        result.HighPart = ft.dwHighDateTime;
+        return result.QuadPart/10;
+    }
+#else
+    #include <sys/time.h> 
+    static long long getTime() {
+        struct timeval tod;
+        gettimeofday(&tod, 0);
+        return 1000000*tod.tv_sec+tod.tv_usec;
+    }
+#endif
+
 bool isVec8Supported();
 CpuNonbondedForce* createCpuNonbondedForceVec4();
 CpuNonbondedForce* createCpuNonbondedForceVec8();
 
+/**
+ * Select the block size for neighbor lists.  All forces use the same one so they can share lists.
+ */
+static int getNeighborListBlockSize() {
+    return (isVec8Supported() ? 8 : 4);
+}
+
 CpuCalcNonbondedForceKernel::CpuCalcNonbondedForceKernel(string name, const Platform& platform, CpuPlatform::PlatformData& data) : CalcNonbondedForceKernel(name, platform),
         data(data), bonded14IndexArray(NULL), bonded14ParamArray(NULL), hasInitializedPme(false), neighborList(NULL), nonbonded(NULL) {
-    if (isVec8Supported()) {
-        neighborList = new CpuNeighborList(8);
+    if (isVec8Supported())
         nonbonded = createCpuNonbondedForceVec8();
-    }
-    else {
-        neighborList = new CpuNeighborList(4);
+    else
         nonbonded = createCpuNonbondedForceVec4();
-    }
 }
 
 CpuCalcNonbondedForceKernel::~CpuCalcNonbondedForceKernel() {
@@ -416,7 +965,7 @@ CpuCalcNonbondedForceKernel::~CpuCalcNonbondedForceKernel() {
     if (nonbonded != NULL)
         delete nonbonded;
     if (neighborList != NULL)
-        delete neighborList;
+        data.releaseNeighborList(neighborList);
 }
 
 void CpuCalcNonbondedForceKernel::initialize(const System& system, const NonbondedForce& force) {
@@ -446,13 +995,16 @@ void CpuCalcNonbondedForceKernel::initialize(const System& system, const Nonbond
     for (int i = 0; i < num14; i++)
         bonded14ParamArray[i] = new double[3];
     particleParams.resize(numParticles);
-    double sumSquaredCharges = 0.0;
+    sumSquaredCharges = 0.0;
+    bool anyLJ = false;
     for (int i = 0; i < numParticles; ++i) {
         double charge, radius, depth;
         force.getParticleParameters(i, charge, radius, depth);
         data.posq[4*i+3] = (float) charge;
         particleParams[i] = make_pair((float) (0.5*radius), (float) (2.0*sqrt(depth)));
         sumSquaredCharges += charge*charge;
+        if (depth != 0.0)
+            anyLJ = true;
     }
     
     // Recorded exception parameters.
@@ -485,8 +1037,19 @@ void CpuCalcNonbondedForceKernel::initialize(const System& system, const Nonbond
     }
     else if (nonbondedMethod == PME) {
         double alpha;
-        NonbondedForceImpl::calcPMEParameters(system, force, alpha, gridSize[0], gridSize[1], gridSize[2]);
+        pmeOrder = data.pmeOrder;
+        NonbondedForceImpl::calcPMEParameters(system, force, alpha, gridSize[0], gridSize[1], gridSize[2], pmeOrder);
         ewaldAlpha = alpha;
+        ewaldErrorTolerance = force.getEwaldErrorTolerance();
+        
+        // Only tune the parameters if the user has not specified them explicitly.  The cutoff may only be changed
+        // if that does not affect the Lennard-Jones interaction.
+        
+        int nx, ny, nz;
+        force.getPMEParameters(alpha, nx, ny, nz);
+        tunePme = (data.tunePme && alpha == 0.0);
+        canTuneCutoff = (!anyLJ && !useSwitchingFunction);
+        reportPmeParameters();
     }
     if (nonbondedMethod == Ewald || nonbondedMethod == PME)
         ewaldSelfEnergy = -ONE_4PI_EPS0*ewaldAlpha*sumSquaredCharges/sqrt(M_PI);
@@ -497,7 +1060,6 @@ void CpuCalcNonbondedForceKernel::initialize(const System& system, const Nonbond
         dispersionCoefficient = NonbondedForceImpl::calcDispersionCorrection(system, force);
     else
         dispersionCoefficient = 0.0;
-    lastPositions.resize(numParticles, Vec3(1e10, 1e10, 1e10));
     data.isPeriodic = (nonbondedMethod == CutoffPeriodic || nonbondedMethod == Ewald || nonbondedMethod == PME);
 }
 
@@ -506,15 +1068,10 @@ double CpuCalcNonbondedForceKernel::execute(ContextImpl& context, bool includeFo
         hasInitializedPme = true;
         useOptimizedPme = false;
         if (nonbondedMethod == PME) {
-            // If available, use the optimized PME implementation.
-
-            vector<string> kernelNames;
-            kernelNames.push_back("CalcPmeReciprocalForce");
-            useOptimizedPme = getPlatform().supportsKernels(kernelNames);
-            if (useOptimizedPme) {
-                optimizedPme = getPlatform().createKernel(CalcPmeReciprocalForceKernel::Name(), context);
-                optimizedPme.getAs<CalcPmeReciprocalForceKernel>().initialize(gridSize[0], gridSize[1], gridSize[2], numParticles, ewaldAlpha);
-            }
+            if (tunePme)
+                tunePmeParameters(context);
+            else
+                createPmeKernel(context);
         }
     }
     AlignedArray<float>& posq = data.posq;
@@ -525,51 +1082,17 @@ double CpuCalcNonbondedForceKernel::execute(ContextImpl& context, bool includeFo
     bool ewald  = (nonbondedMethod == Ewald);
     bool pme  = (nonbondedMethod == PME);
     if (nonbondedMethod != NoCutoff) {
-        // Determine whether we need to recompute the neighbor list.
-        
-        double padding = 0.15*nonbondedCutoff;
-        bool needRecompute = false;
-        double closeCutoff2 = 0.25*padding*padding;
-        double farCutoff2 = 0.5*padding*padding;
-        int maxNumMoved = numParticles/10;
-        vector<int> moved;
-        for (int i = 0; i < numParticles; i++) {
-            RealVec delta = posData[i]-lastPositions[i];
-            double dist2 = delta.dot(delta);
-            if (dist2 > closeCutoff2) {
-                moved.push_back(i);
-                if (dist2 > farCutoff2 || moved.size() > maxNumMoved) {
-                    needRecompute = true;
-                    break;
-                }
-            }
-        }
-        if (!needRecompute && moved.size() > 0) {
-            // Some particles have moved further than half the padding distance.  Look for pairs
-            // that are missing from the neighbor list.
-
-            int numMoved = moved.size();
-            double cutoff2 = nonbondedCutoff*nonbondedCutoff;
-            double paddedCutoff2 = (nonbondedCutoff+padding)*(nonbondedCutoff+padding);
-            for (int i = 1; i < numMoved && !needRecompute; i++)
-                for (int j = 0; j < i; j++) {
-                    RealVec delta = posData[moved[i]]-posData[moved[j]];
-                    if (delta.dot(delta) < cutoff2) {
-                        // These particles should interact.  See if they are in the neighbor list.
-                        
-                        RealVec oldDelta = lastPositions[moved[i]]-lastPositions[moved[j]];
-                        if (oldDelta.dot(oldDelta) > paddedCutoff2) {
-                            needRecompute = true;
-                            break;
-                        }
-                    }
-                }
-        }
-        if (needRecompute) {
-            neighborList->computeNeighborList(numParticles, posq, exclusions, boxVectors, data.isPeriodic, nonbondedCutoff+padding, data.threads);
-            lastPositions = posData;
+        // The PME tuner changes the cutoff, so check that the neighbor list still matches it.
+
+        if (neighborList == NULL || neighborList->getCutoff() != nonbondedCutoff) {
+            if (neighborList != NULL)
+                data.releaseNeighborList(neighborList);
+            neighborList = data.requestNeighborList(getNeighborListBlockSize(), nonbondedCutoff, 0.15*nonbondedCutoff, data.isPeriodic, exclusions);
+            if (isVec8Supported())
+                neighborList->requestClusters();
         }
-        nonbonded->setUseCutoff(nonbondedCutoff, *neighborList, rfDielectric);
+        neighborList->update(data.computation, posq, posData, boxVectors, data.threads);
+        nonbonded->setUseCutoff(nonbondedCutoff, neighborList->getNeighborList(), rfDielectric);
     }
     if (data.isPeriodic) {
         RealVec* boxVectors = extractBoxVectors(context);
@@ -581,33 +1104,162 @@ double CpuCalcNonbondedForceKernel::execute(ContextImpl& context, bool includeFo
     if (ewald)
         nonbonded->setUseEwald(ewaldAlpha, kmax[0], kmax[1], kmax[2]);
     if (pme)
-        nonbonded->setUsePME(ewaldAlpha, gridSize);
+        nonbonded->setUsePME(ewaldAlpha, gridSize, pmeOrder);
     if (useSwitchingFunction)
         nonbonded->setUseSwitchingFunction(switchingDistance);
     double nonbondedEnergy = 0;
-    if (includeDirect)
-        nonbonded->calculateDirectIxn(numParticles, &posq[0], posData, particleParams, exclusions, data.threadForce, includeEnergy ? &nonbondedEnergy : NULL, data.threads);
+    double* virial = (data.includeVirial ? data.virial : NULL);
+    PmeIO io(&posq[0], &data.threadForce[0][0], numParticles);
+    Vec3 periodicBoxVectors[3] = {boxVectors[0], boxVectors[1], boxVectors[2]};
+    if (includeReciprocal && useOptimizedPme)
+        optimizedPme.getAs<CalcPmeReciprocalForceKernel>().setIncludeVirial(data.includeVirial);
+    bool pmeIsRunning = false;
+    if (includeReciprocal && useOptimizedPme && data.pmeThreads != NULL) {
+        // PME has its own threads, so let it run while we compute direct space.
+        
+        optimizedPme.getAs<CalcPmeReciprocalForceKernel>().beginComputation(io, periodicBoxVectors, includeEnergy);
+        pmeIsRunning = true;
+    }
+    if (includeDirect) {
+        long long startTime = getTime();
+        nonbonded->calculateDirectIxn(numParticles, &posq[0], posData, particleParams, exclusions, data.threadForce, includeEnergy ? &nonbondedEnergy : NULL, virial, data.threads);
+        if (neighborList != NULL && data.adaptivePadding)
+            neighborList->recordInteractionTime(getTime()-startTime);
+    }
     if (includeReciprocal) {
         if (useOptimizedPme) {
-            PmeIO io(&posq[0], &data.threadForce[0][0], numParticles);
-            Vec3 periodicBoxVectors[3] = {boxVectors[0], boxVectors[1], boxVectors[2]};
-            optimizedPme.getAs<CalcPmeReciprocalForceKernel>().beginComputation(io, periodicBoxVectors, includeEnergy);
+            if (!pmeIsRunning)
+                optimizedPme.getAs<CalcPmeReciprocalForceKernel>().beginComputation(io, periodicBoxVectors, includeEnergy);
             nonbondedEnergy += optimizedPme.getAs<CalcPmeReciprocalForceKernel>().finishComputation(io);
+            if (virial != NULL) {
+                Vec3 recipVirial[3];
+                optimizedPme.getAs<CalcPmeReciprocalForceKernel>().getVirial(recipVirial);
+                for (int i = 0; i < 3; i++)
+                    for (int j = 0; j < 3; j++)
+                        virial[3*i+j] += recipVirial[i][j];
+            }
+        }
+        else if (virial == NULL)
+            nonbonded->calculateReciprocalIxn(numParticles, &posq[0], posData, particleParams, exclusions, forceData, includeEnergy ? &nonbondedEnergy : NULL, NULL);
+        else {
+            // The reciprocal space virial is computed analytically, so keep these forces out of the
+            // virial that finishComputation() computes from the force array.
+            
+            vector<RealVec> recipForces(numParticles, RealVec());
+            nonbonded->calculateReciprocalIxn(numParticles, &posq[0], posData, particleParams, exclusions, recipForces, includeEnergy ? &nonbondedEnergy : NULL, virial);
+            for (int i = 0; i < numParticles; i++) {
+                forceData[i] += recipForces[i];
+                for (int j = 0; j < 3; j++)
+                    for (int k = 0; k < 3; k++)
+                        virial[3*j+k] -= posData[i][j]*recipForces[i][k];
+            }
         }
-        else
-            nonbonded->calculateReciprocalIxn(numParticles, &posq[0], posData, particleParams, exclusions, forceData, includeEnergy ? &nonbondedEnergy : NULL);
     }
     energy += nonbondedEnergy;
     if (includeDirect) {
         ReferenceBondForce refBondForce;
         ReferenceLJCoulomb14 nonbonded14;
         refBondForce.calculateForce(num14, bonded14IndexArray, posData, bonded14ParamArray, forceData, includeEnergy ? &energy : NULL, nonbonded14);
-        if (data.isPeriodic)
-            energy += dispersionCoefficient/(boxVectors[0][0]*boxVectors[1][1]*boxVectors[2][2]);
+        if (data.isPeriodic) {
+            double dispersionEnergy = dispersionCoefficient/(boxVectors[0][0]*boxVectors[1][1]*boxVectors[2][2]);
+            energy += dispersionEnergy;
+            if (virial != NULL)
+                for (int i = 0; i < 3; i++)
+                    virial[4*i] += dispersionEnergy;
+        }
     }
     return energy;
 }
 
+void CpuCalcNonbondedForceKernel::createPmeKernel(ContextImpl& context) {
+    // If available, use the optimized PME implementation.
+
+    vector<string> kernelNames;
+    kernelNames.push_back("CalcPmeReciprocalForce");
+    useOptimizedPme = getPlatform().supportsKernels(kernelNames);
+    if (useOptimizedPme) {
+        // Run it on the threads set aside for PME if there are any, or otherwise share the
+        // context's threads with the direct space calculation.
+
+        optimizedPme = getPlatform().createKernel(CalcPmeReciprocalForceKernel::Name(), context);
+        optimizedPme.getAs<CalcPmeReciprocalForceKernel>().setThreadPool(data.pmeThreads != NULL ? *data.pmeThreads : data.threads);
+        optimizedPme.getAs<CalcPmeReciprocalForceKernel>().setInterpolationOrder(pmeOrder);
+        optimizedPme.getAs<CalcPmeReciprocalForceKernel>().initialize(gridSize[0], gridSize[1], gridSize[2], numParticles, ewaldAlpha);
+    }
+}
+
+void CpuCalcNonbondedForceKernel::tunePmeParameters(ContextImpl& context) {
+    // The trial evaluations add to the force buffers and the virial, so save their contents to restore afterward.
+
+    vector<RealVec>& forceData = extractForces(context);
+    vector<RealVec> savedForces = forceData;
+    vector<vector<float> > savedThreadForce(data.threadForce.size());
+    for (int i = 0; i < (int) savedThreadForce.size(); i++)
+        savedThreadForce[i].assign(&data.threadForce[i][0], &data.threadForce[i][0]+data.threadForce[i].size());
+    vector<double> savedVirial(data.virial, data.virial+9);
+
+    // Select the cutoffs to try.  Each one must still fit in the periodic box.
+
+    RealVec* boxVectors = extractBoxVectors(context);
+    Vec3 periodicBoxVectors[3] = {boxVectors[0], boxVectors[1], boxVectors[2]};
+    double maxCutoff = 0.5*min(periodicBoxVectors[0][0], min(periodicBoxVectors[1][1], periodicBoxVectors[2][2]));
+    vector<double> cutoffs;
+    cutoffs.push_back(nonbondedCutoff);
+    if (canTuneCutoff) {
+        const double scales[] = {0.8, 0.9, 1.1, 1.2, 1.3};
+        for (int i = 0; i < 5; i++)
+            if (scales[i]*nonbondedCutoff <= maxCutoff)
+                cutoffs.push_back(scales[i]*nonbondedCutoff);
+    }
+
+    // Time a few evaluations with each combination of cutoff and interpolation order.  The first
+    // evaluation builds the neighbor list and is not included.
+
+    const int numTimedSteps = 3;
+    double bestCutoff = nonbondedCutoff;
+    int bestOrder = pmeOrder;
+    long long bestTime = -1;
+    for (int i = 0; i < (int) cutoffs.size(); i++)
+        for (int order = 4; order <= 6; order++) {
+            nonbondedCutoff = cutoffs[i];
+            pmeOrder = order;
+            NonbondedForceImpl::calcPMEParameters(nonbondedCutoff, ewaldErrorTolerance, periodicBoxVectors, pmeOrder, ewaldAlpha, gridSize[0], gridSize[1], gridSize[2]);
+            createPmeKernel(context);
+            execute(context, true, false, true, true);
+            long long startTime = getTime();
+            for (int step = 0; step < numTimedSteps; step++)
+                execute(context, true, false, true, true);
+            long long time = getTime()-startTime;
+            if (bestTime < 0 || time < bestTime) {
+                bestTime = time;
+                bestCutoff = nonbondedCutoff;
+                bestOrder = pmeOrder;
+            }
+        }
+
+    // Switch to the fastest parameters and restore the forces.
+
+    nonbondedCutoff = bestCutoff;
+    pmeOrder = bestOrder;
+    NonbondedForceImpl::calcPMEParameters(nonbondedCutoff, ewaldErrorTolerance, periodicBoxVectors, pmeOrder, ewaldAlpha, gridSize[0], gridSize[1], gridSize[2]);
+    ewaldSelfEnergy = -ONE_4PI_EPS0*ewaldAlpha*sumSquaredCharges/sqrt(M_PI);
+    createPmeKernel(context);
+    forceData = savedForces;
+    for (int i = 0; i < (int) savedThreadForce.size(); i++)
+        for (int j = 0; j < (int) savedThreadForce[i].size(); j++)
+            data.threadForce[i][j] = savedThreadForce[i][j];
+    for (int i = 0; i < 9; i++)
+        data.virial[i] = savedVirial[i];
+    reportPmeParameters();
+}
+
+void CpuCalcNonbondedForceKernel::reportPmeParameters() {
+    stringstream parameters;
+    parameters.precision(10);
+    parameters << "cutoff=" << nonbondedCutoff << " alpha=" << ewaldAlpha << " grid=" << gridSize[0] << "x" << gridSize[1] << "x" << gridSize[2] << " order=" << pmeOrder;
+    data.propertyValues[CpuPlatform::CpuPmeParameters()] = parameters.str();
+}
+
 void CpuCalcNonbondedForceKernel::copyParametersToContext(ContextImpl& context, const NonbondedForce& force) {
     if (force.getNumParticles() != numParticles)
         throw OpenMMException("updateParametersInContext: The number of particles has changed");
@@ -624,7 +1276,7 @@ void CpuCalcNonbondedForceKernel::copyParametersToContext(ContextImpl& context,
 
     // Record the values.
 
-    double sumSquaredCharges = 0.0;
+    sumSquaredCharges = 0.0;
     for (int i = 0; i < numParticles; ++i) {
         double charge, radius, depth;
         force.getParticleParameters(i, charge, radius, depth);
@@ -665,7 +1317,7 @@ CpuCalcCustomNonbondedForceKernel::~CpuCalcCustomNonbondedForceKernel() {
         delete[] particleParamArray;
     }
     if (neighborList != NULL)
-        delete neighborList;
+        data.releaseNeighborList(neighborList);
     if (nonbonded != NULL)
         delete nonbonded;
     if (forceCopy != NULL)
@@ -702,7 +1354,6 @@ void CpuCalcCustomNonbondedForceKernel::initialize(const System& system, const C
     if (nonbondedMethod == NoCutoff)
         useSwitchingFunction = false;
     else {
-        neighborList = new CpuNeighborList(4);
         useSwitchingFunction = force.getUseSwitchingFunction();
         switchingDistance = force.getSwitchingDistance();
     }
@@ -761,8 +1412,10 @@ double CpuCalcCustomNonbondedForceKernel::execute(ContextImpl& context, bool inc
     double energy = 0;
     bool periodic = (nonbondedMethod == CutoffPeriodic);
     if (nonbondedMethod != NoCutoff) {
-        neighborList->computeNeighborList(numParticles, data.posq, exclusions, boxVectors, data.isPeriodic, nonbondedCutoff, data.threads);
-        nonbonded->setUseCutoff(nonbondedCutoff, *neighborList);
+        if (neighborList == NULL)
+            neighborList = data.requestNeighborList(getNeighborListBlockSize(), nonbondedCutoff, 0.15*nonbondedCutoff, data.isPeriodic, exclusions);
+        neighborList->update(data.computation, data.posq, posData, boxVectors, data.threads);
+        nonbonded->setUseCutoff(nonbondedCutoff, neighborList->getNeighborList());
     }
     if (periodic) {
         double minAllowedSize = 2*nonbondedCutoff;
@@ -815,7 +1468,21 @@ void CpuCalcCustomNonbondedForceKernel::copyParametersToContext(ContextImpl& con
     }
 }
 
+CpuGBSAOBCForce* createCpuGBSAOBCForceVec8();
+
+CpuCalcGBSAOBCForceKernel::CpuCalcGBSAOBCForceKernel(string name, const Platform& platform, CpuPlatform::PlatformData& data) : CalcGBSAOBCForceKernel(name, platform),
+        data(data), neighborList(NULL), obc(NULL) {
+    if (isVec8Supported())
+        obc = createCpuGBSAOBCForceVec8();
+    else
+        obc = new CpuGBSAOBCForce();
+}
+
 CpuCalcGBSAOBCForceKernel::~CpuCalcGBSAOBCForceKernel() {
+    if (obc != NULL)
+        delete obc;
+    if (neighborList != NULL)
+        data.releaseNeighborList(neighborList);
 }
 
 void CpuCalcGBSAOBCForceKernel::initialize(const System& system, const GBSAOBCForce& force) {
@@ -828,12 +1495,13 @@ void CpuCalcGBSAOBCForceKernel::initialize(const System& system, const GBSAOBCFo
         radius -= 0.009;
         particleParams[i] = make_pair((float) radius, (float) (scalingFactor*radius));
     }
-    obc.setParticleParameters(particleParams);
-    obc.setSolventDielectric((float) force.getSolventDielectric());
-    obc.setSoluteDielectric((float) force.getSoluteDielectric());
-    obc.setSurfaceAreaEnergy((float) force.getSurfaceAreaEnergy());
-    if (force.getNonbondedMethod() != GBSAOBCForce::NoCutoff)
-        obc.setUseCutoff((float) force.getCutoffDistance());
+    obc->setParticleParameters(particleParams);
+    obc->setSolventDielectric((float) force.getSolventDielectric());
+    obc->setSoluteDielectric((float) force.getSoluteDielectric());
+    obc->setSurfaceAreaEnergy((float) force.getSurfaceAreaEnergy());
+    nonbondedMethod = force.getNonbondedMethod();
+    nonbondedCutoff = (float) force.getCutoffDistance();
+    noExclusions.resize(numParticles);
     data.isPeriodic = (force.getNonbondedMethod() == GBSAOBCForce::CutoffPeriodic);
 }
 
@@ -841,16 +1509,24 @@ double CpuCalcGBSAOBCForceKernel::execute(ContextImpl& context, bool includeForc
     if (data.isPeriodic) {
         RealVec& boxSize = extractBoxSize(context);
         float floatBoxSize[3] = {(float) boxSize[0], (float) boxSize[1], (float) boxSize[2]};
-        obc.setPeriodic(floatBoxSize);
+        obc->setPeriodic(floatBoxSize);
+    }
+    if (nonbondedMethod != GBSAOBCForce::NoCutoff) {
+        // A single neighbor list is shared by all the passes over atom pairs.
+
+        if (neighborList == NULL)
+            neighborList = data.requestNeighborList(getNeighborListBlockSize(), nonbondedCutoff, 0.15*nonbondedCutoff, data.isPeriodic, noExclusions);
+        neighborList->update(data.computation, data.posq, extractPositions(context), extractBoxVectors(context), data.threads);
+        obc->setUseCutoff(nonbondedCutoff, neighborList->getNeighborList());
     }
     double energy = 0.0;
-    obc.computeForce(data.posq, data.threadForce, includeEnergy ? &energy : NULL, data.threads);
+    obc->computeForce(data.posq, data.threadForce, includeEnergy ? &energy : NULL, data.threads);
     return energy;
 }
 
 void CpuCalcGBSAOBCForceKernel::copyParametersToContext(ContextImpl& context, const GBSAOBCForce& force) {
     int numParticles = force.getNumParticles();
-    if (numParticles != obc.getParticleParameters().size())
+    if (numParticles != obc->getParticleParameters().size())
         throw OpenMMException("updateParametersInContext: The number of particles has changed");
 
     // Record the values.
@@ -862,7 +1538,7 @@ void CpuCalcGBSAOBCForceKernel::copyParametersToContext(ContextImpl& context, co
         radius -= 0.009;
         particleParams[i] = make_pair((float) radius, (float) (scalingFactor*radius));
     }
-    obc.setParticleParameters(particleParams);
+    obc->setParticleParameters(particleParams);
 }
 
 CpuCalcCustomGBForceKernel::~CpuCalcCustomGBForceKernel() {
@@ -872,7 +1548,7 @@ CpuCalcCustomGBForceKernel::~CpuCalcCustomGBForceKernel() {
         delete[] particleParamArray;
     }
     if (neighborList != NULL)
-        delete neighborList;
+        data.releaseNeighborList(neighborList);
     if (ixn != NULL)
         delete ixn;
 }
@@ -920,10 +1596,6 @@ void CpuCalcCustomGBForceKernel::initialize(const System& system, const CustomGB
         globalParameterNames.push_back(force.getGlobalParameterName(i));
     nonbondedMethod = CalcCustomGBForceKernel::NonbondedMethod(force.getNonbondedMethod());
     nonbondedCutoff = (RealOpenMM) force.getCutoffDistance();
-    if (nonbondedMethod == NoCutoff)
-        neighborList = NULL;
-    else
-        neighborList = new CpuNeighborList(4);
 
     // Create custom functions for the tabulated functions.
 
@@ -999,9 +1671,10 @@ double CpuCalcCustomGBForceKernel::execute(ContextImpl& context, bool includeFor
     if (data.isPeriodic)
         ixn->setPeriodic(extractBoxSize(context));
     if (nonbondedMethod != NoCutoff) {
-        vector<set<int> > noExclusions(numParticles);
-        neighborList->computeNeighborList(numParticles, data.posq, exclusions, boxVectors, data.isPeriodic, nonbondedCutoff, data.threads);
-        ixn->setUseCutoff(nonbondedCutoff, *neighborList);
+        if (neighborList == NULL)
+            neighborList = data.requestNeighborList(getNeighborListBlockSize(), nonbondedCutoff, 0.15*nonbondedCutoff, data.isPeriodic, exclusions);
+        neighborList->update(data.computation, data.posq, extractPositions(context), boxVectors, data.threads);
+        ixn->setUseCutoff(nonbondedCutoff, neighborList->getNeighborList());
     }
     map<string, double> globalParameters;
     for (int i = 0; i < (int) globalParameterNames.size(); i++)
@@ -1026,6 +1699,101 @@ void CpuCalcCustomGBForceKernel::copyParametersToContext(ContextImpl& context, c
     }
 }
 
+CpuCalcCustomHbondForceKernel::~CpuCalcCustomHbondForceKernel() {
+    if (donorParamArray != NULL) {
+        for (int i = 0; i < numDonors; i++)
+            delete[] donorParamArray[i];
+        delete[] donorParamArray;
+    }
+    if (acceptorParamArray != NULL) {
+        for (int i = 0; i < numAcceptors; i++)
+            delete[] acceptorParamArray[i];
+        delete[] acceptorParamArray;
+    }
+    if (ixn != NULL)
+        delete ixn;
+}
+
+void CpuCalcCustomHbondForceKernel::initialize(const System& system, const CustomHbondForce& force) {
+
+    // Build the arrays.
+
+    numDonors = force.getNumDonors();
+    numAcceptors = force.getNumAcceptors();
+    int numDonorParameters = force.getNumPerDonorParameters();
+    donorParamArray = new RealOpenMM*[numDonors];
+    for (int i = 0; i < numDonors; i++) {
+        donorParamArray[i] = new RealOpenMM[numDonorParameters];
+        vector<double> parameters;
+        int d1, d2, d3;
+        force.getDonorParameters(i, d1, d2, d3, parameters);
+        for (int j = 0; j < numDonorParameters; j++)
+            donorParamArray[i][j] = (RealOpenMM) parameters[j];
+    }
+    int numAcceptorParameters = force.getNumPerAcceptorParameters();
+    acceptorParamArray = new RealOpenMM*[numAcceptors];
+    for (int i = 0; i < numAcceptors; i++) {
+        acceptorParamArray[i] = new RealOpenMM[numAcceptorParameters];
+        vector<double> parameters;
+        int a1, a2, a3;
+        force.getAcceptorParameters(i, a1, a2, a3, parameters);
+        for (int j = 0; j < numAcceptorParameters; j++)
+            acceptorParamArray[i][j] = (RealOpenMM) parameters[j];
+    }
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        globalParameterNames.push_back(force.getGlobalParameterName(i));
+    ixn = new CpuCustomHbondForce(force, data.threads);
+    nonbondedMethod = CalcCustomHbondForceKernel::NonbondedMethod(force.getNonbondedMethod());
+    cutoffDistance = force.getCutoffDistance();
+}
+
+double CpuCalcCustomHbondForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    map<string, double> globalParameters;
+    for (int i = 0; i < (int) globalParameterNames.size(); i++)
+        globalParameters[globalParameterNames[i]] = context.getParameter(globalParameterNames[i]);
+    if (nonbondedMethod == CutoffPeriodic) {
+        RealVec* boxVectors = extractBoxVectors(context);
+        double minAllowedSize = 2*cutoffDistance;
+        if (boxVectors[0][0] < minAllowedSize || boxVectors[1][1] < minAllowedSize || boxVectors[2][2] < minAllowedSize)
+            throw OpenMMException("The periodic box size has decreased to less than twice the nonbonded cutoff.");
+        ixn->setPeriodic(boxVectors);
+    }
+    double energy = 0;
+    ixn->calculateIxn(extractPositions(context), donorParamArray, acceptorParamArray, globalParameters, data.threadForce, includeForces, includeEnergy, energy);
+    return energy;
+}
+
+void CpuCalcCustomHbondForceKernel::copyParametersToContext(ContextImpl& context, const CustomHbondForce& force) {
+    if (numDonors != force.getNumDonors())
+        throw OpenMMException("updateParametersInContext: The number of donors has changed");
+    if (numAcceptors != force.getNumAcceptors())
+        throw OpenMMException("updateParametersInContext: The number of acceptors has changed");
+
+    // Record the values.
+
+    vector<double> parameters;
+    int numDonorParameters = force.getNumPerDonorParameters();
+    const vector<vector<int> >& donorAtoms = ixn->getDonorAtoms();
+    for (int i = 0; i < numDonors; ++i) {
+        int d1, d2, d3;
+        force.getDonorParameters(i, d1, d2, d3, parameters);
+        if (d1 != donorAtoms[i][0] || d2 != donorAtoms[i][1] || d3 != donorAtoms[i][2])
+            throw OpenMMException("updateParametersInContext: The set of particles in a donor group has changed");
+        for (int j = 0; j < numDonorParameters; j++)
+            donorParamArray[i][j] = (RealOpenMM) parameters[j];
+    }
+    int numAcceptorParameters = force.getNumPerAcceptorParameters();
+    const vector<vector<int> >& acceptorAtoms = ixn->getAcceptorAtoms();
+    for (int i = 0; i < numAcceptors; ++i) {
+        int a1, a2, a3;
+        force.getAcceptorParameters(i, a1, a2, a3, parameters);
+        if (a1 != acceptorAtoms[i][0] || a2 != acceptorAtoms[i][1] || a3 != acceptorAtoms[i][2])
+            throw OpenMMException("updateParametersInContext: The set of particles in an acceptor group has changed");
+        for (int j = 0; j < numAcceptorParameters; j++)
+            acceptorParamArray[i][j] = (RealOpenMM) parameters[j];
+    }
+}
+
 CpuCalcCustomManyParticleForceKernel::~CpuCalcCustomManyParticleForceKernel() {
     if (particleParamArray != NULL) {
         for (int i = 0; i < numParticles; i++)
@@ -1034,6 +1802,8 @@ CpuCalcCustomManyParticleForceKernel::~CpuCalcCustomManyParticleForceKernel() {
     }
     if (ixn != NULL)
         delete ixn;
+    if (neighborList != NULL)
+        data.releaseNeighborList(neighborList);
 }
 
 void CpuCalcCustomManyParticleForceKernel::initialize(const System& system, const CustomManyParticleForce& force) {
@@ -1064,13 +1834,19 @@ double CpuCalcCustomManyParticleForceKernel::execute(ContextImpl& context, bool
     map<string, double> globalParameters;
     for (int i = 0; i < (int) globalParameterNames.size(); i++)
         globalParameters[globalParameterNames[i]] = context.getParameter(globalParameterNames[i]);
+    RealVec* boxVectors = extractBoxVectors(context);
     if (nonbondedMethod == CutoffPeriodic) {
-        RealVec* boxVectors = extractBoxVectors(context);
         double minAllowedSize = 2*cutoffDistance;
         if (boxVectors[0][0] < minAllowedSize || boxVectors[1][1] < minAllowedSize || boxVectors[2][2] < minAllowedSize)
             throw OpenMMException("The periodic box size has decreased to less than twice the nonbonded cutoff.");
         ixn->setPeriodic(boxVectors);
     }
+    if (nonbondedMethod != NoCutoff) {
+        if (neighborList == NULL)
+            neighborList = data.requestNeighborList(getNeighborListBlockSize(), cutoffDistance, 0.15*cutoffDistance, data.isPeriodic, ixn->getExclusions());
+        neighborList->update(data.computation, data.posq, extractPositions(context), boxVectors, data.threads);
+        ixn->setUseCutoff(cutoffDistance, neighborList->getNeighborList());
+    }
     double energy = 0;
     ixn->calculateIxn(data.posq, particleParamArray, globalParameters, data.threadForce, includeForces, includeEnergy, energy);
     return energy;
@@ -1093,6 +1869,42 @@ void CpuCalcCustomManyParticleForceKernel::copyParametersToContext(ContextImpl&
     }
 }
 
+CpuIntegrateVerletStepKernel::~CpuIntegrateVerletStepKernel() {
+    if (dynamics)
+        delete dynamics;
+}
+
+void CpuIntegrateVerletStepKernel::initialize(const System& system, const VerletIntegrator& integrator) {
+    int numParticles = system.getNumParticles();
+    masses.resize(numParticles);
+    for (int i = 0; i < numParticles; ++i)
+        masses[i] = static_cast<RealOpenMM>(system.getParticleMass(i));
+}
+
+void CpuIntegrateVerletStepKernel::execute(ContextImpl& context, const VerletIntegrator& integrator) {
+    double stepSize = integrator.getStepSize();
+    vector<RealVec>& posData = extractPositions(context);
+    vector<RealVec>& velData = extractVelocities(context);
+    vector<RealVec>& forceData = extractForces(context);
+    if (dynamics == 0 || stepSize != prevStepSize) {
+        // Recreate the computation objects with the new parameters.
+        
+        if (dynamics)
+            delete dynamics;
+        dynamics = new CpuVerletDynamics(context.getSystem().getNumParticles(), stepSize, data.threads, data.vsites);
+        dynamics->setReferenceConstraintAlgorithm(&extractConstraints(context));
+        prevStepSize = stepSize;
+    }
+    dynamics->update(context.getSystem(), posData, velData, forceData, masses, integrator.getConstraintTolerance());
+    ReferencePlatform::PlatformData* refData = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+    refData->time += stepSize;
+    refData->stepCount++;
+}
+
+double CpuIntegrateVerletStepKernel::computeKineticEnergy(ContextImpl& context, const VerletIntegrator& integrator) {
+    return computeShiftedKineticEnergy(context, masses, 0.5*integrator.getStepSize());
+}
+
 CpuIntegrateLangevinStepKernel::~CpuIntegrateLangevinStepKernel() {
     if (dynamics)
         delete dynamics;
@@ -1119,7 +1931,7 @@ void CpuIntegrateLangevinStepKernel::execute(ContextImpl& context, const Langevi
         if (dynamics)
             delete dynamics;
         RealOpenMM tau = (friction == 0.0 ? 0.0 : 1.0/friction);
-        dynamics = new CpuLangevinDynamics(context.getSystem().getNumParticles(), stepSize, tau, temperature, data.threads, data.random);
+        dynamics = new CpuLangevinDynamics(context.getSystem().getNumParticles(), stepSize, tau, temperature, data.threads, data.vsites, data.random);
         dynamics->setReferenceConstraintAlgorithm(&extractConstraints(context));
         prevTemp = temperature;
         prevFriction = friction;
@@ -1134,3 +1946,44 @@ void CpuIntegrateLangevinStepKernel::execute(ContextImpl& context, const Langevi
 double CpuIntegrateLangevinStepKernel::computeKineticEnergy(ContextImpl& context, const LangevinIntegrator& integrator) {
     return computeShiftedKineticEnergy(context, masses, 0.5*integrator.getStepSize());
 }
+
+CpuIntegrateBrownianStepKernel::~CpuIntegrateBrownianStepKernel() {
+    if (dynamics)
+        delete dynamics;
+}
+
+void CpuIntegrateBrownianStepKernel::initialize(const System& system, const BrownianIntegrator& integrator) {
+    int numParticles = system.getNumParticles();
+    masses.resize(numParticles);
+    for (int i = 0; i < numParticles; ++i)
+        masses[i] = static_cast<RealOpenMM>(system.getParticleMass(i));
+    data.random.initialize(integrator.getRandomNumberSeed(), data.threads.getNumThreads());
+}
+
+void CpuIntegrateBrownianStepKernel::execute(ContextImpl& context, const BrownianIntegrator& integrator) {
+    double temperature = integrator.getTemperature();
+    double friction = integrator.getFriction();
+    double stepSize = integrator.getStepSize();
+    vector<RealVec>& posData = extractPositions(context);
+    vector<RealVec>& velData = extractVelocities(context);
+    vector<RealVec>& forceData = extractForces(context);
+    if (dynamics == 0 || temperature != prevTemp || friction != prevFriction || stepSize != prevStepSize) {
+        // Recreate the computation objects with the new parameters.
+        
+        if (dynamics)
+            delete dynamics;
+        dynamics = new CpuBrownianDynamics(context.getSystem().getNumParticles(), stepSize, friction, temperature, data.threads, data.vsites, data.random);
+        dynamics->setReferenceConstraintAlgorithm(&extractConstraints(context));
+        prevTemp = temperature;
+        prevFriction = friction;
+        prevStepSize = stepSize;
+    }
+    dynamics->update(context.getSystem(), posData, velData, forceData, masses, integrator.getConstraintTolerance());
+    ReferencePlatform::PlatformData* refData = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+    refData->time += stepSize;
+    refData->stepCount++;
+}
+
+double CpuIntegrateBrownianStepKernel::computeKineticEnergy(ContextImpl& context, const BrownianIntegrator& integrator) {
+    return computeShiftedKineticEnergy(context, masses, 0);
+}
@@ -49,8 +49,8 @@ public:
     CpuLangevinDynamics& owner;
 };
 
-CpuLangevinDynamics::CpuLangevinDynamics(int numberOfAtoms, RealOpenMM deltaT, RealOpenMM tau, RealOpenMM temperature, ThreadPool& threads, CpuRandom& random) : 
-           ReferenceStochasticDynamics(numberOfAtoms, deltaT, tau, temperature), threads(threads), random(random) {
+CpuLangevinDynamics::CpuLangevinDynamics(int numberOfAtoms, RealOpenMM deltaT, RealOpenMM tau, RealOpenMM temperature, ThreadPool& threads, CpuVirtualSites& vsites, CpuRandom& random) : 
+           ReferenceStochasticDynamics(numberOfAtoms, deltaT, tau, temperature), threads(threads), vsites(vsites), random(random) {
 }
 
 CpuLangevinDynamics::~CpuLangevinDynamics() {
@@ -122,3 +122,7 @@ void CpuLangevinDynamics::threadUpdate2(int threadIndex) {
         }
    }
 }
+
+void CpuLangevinDynamics::computeVirtualSites(const System& system, vector<RealVec>& atomCoordinates) {
+    vsites.computePositions(atomCoordinates);
+}
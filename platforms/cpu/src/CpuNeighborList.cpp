@@ -42,6 +42,12 @@ using namespace std;
 
 namespace OpenMM {
 
+// The Hilbert curve index has 24 bits.  It is sorted with a radix sort, 8 bits per pass.
+
+static const int RADIX_BITS = 8;
+static const int RADIX_BUCKETS = 1<<RADIX_BITS;
+static const int RADIX_PASSES = 3;
+
 class VoxelIndex 
 {
 public:
@@ -54,13 +60,17 @@ public:
 };
 
 /**
- * This data structure organizes the particles spatially.  It divides them into bins along the x and y axes,
- * then sorts each bin along the z axis so ranges can be identified quickly with a binary search.
+ * This data structure organizes the particles spatially.  It divides them into bins along the y and z axes,
+ * then sorts each bin along the x axis so ranges can be identified quickly with a binary search.  The bins
+ * are stored in a single flat array: the particles in bin b are items binStart[b] to binStart[b+1]-1.  The
+ * CpuNeighborList fills in the arrays in parallel.
  */
 class CpuNeighborList::Voxels {
 public:
-    Voxels(int blockSize, float vsy, float vsz, float miny, float maxy, float minz, float maxz, const RealVec* periodicBoxVectors, bool usePeriodic) :
-            blockSize(blockSize), voxelSizeY(vsy), voxelSizeZ(vsz), miny(miny), maxy(maxy), minz(minz), maxz(maxz), periodicBoxVectors(periodicBoxVectors), usePeriodic(usePeriodic) {
+    Voxels(int blockSize, float vsy, float vsz, float miny, float maxy, float minz, float maxz, const RealVec* periodicBoxVectors, bool usePeriodic,
+            const vector<int>& binStart, const vector<pair<float, int> >& items) :
+            blockSize(blockSize), voxelSizeY(vsy), voxelSizeZ(vsz), miny(miny), maxy(maxy), minz(minz), maxz(maxz), periodicBoxVectors(periodicBoxVectors),
+            usePeriodic(usePeriodic), binStart(binStart), items(items) {
         periodicBoxSize[0] = (float) periodicBoxVectors[0][0];
         periodicBoxSize[1] = (float) periodicBoxVectors[1][1];
         periodicBoxSize[2] = (float) periodicBoxVectors[2][2];
@@ -84,41 +94,32 @@ public:
             if (maxz > minz)
                 voxelSizeZ = (maxz-minz)/nz;
         }
-        bins.resize(ny);
-        for (int i = 0; i < ny; i++) {
-            bins[i].resize(nz);
-            for (int j = 0; j < nz; j++)
-                bins[i][j].resize(0);
-        }
     }
 
     /**
-     * Insert a particle into the voxel data structure.
+     * Get the total number of bins.
      */
-    void insert(const int& atom, const float* location) {
-        VoxelIndex voxelIndex = getVoxelIndex(location);
-        bins[voxelIndex.y][voxelIndex.z].push_back(make_pair(location[0], atom));
+    int getNumBins() const {
+        return ny*nz;
     }
-    
+
     /**
-     * Sort the particles in each voxel by x coordinate.
+     * Get the index of the bin containing a particular location.
      */
-    void sortItems() {
-        for (int i = 0; i < ny; i++)
-            for (int j = 0; j < nz; j++)
-                sort(bins[i][j].begin(), bins[i][j].end());
+    int getBin(const float* location) const {
+        VoxelIndex voxelIndex = getVoxelIndex(location);
+        return voxelIndex.y*nz+voxelIndex.z;
     }
     
     /**
-     * Find the index of the first particle in voxel (y,z) whose x coordinate in >= the specified value.
+     * Find the index of the first item in a bin whose x coordinate in >= the specified value.
      */
-    int findLowerBound(int y, int z, double x) const {
-        const vector<pair<float, int> >& bin = bins[y][z];
-        int lower = 0;
-        int upper = bin.size();
+    int findLowerBound(int bin, double x) const {
+        int lower = binStart[bin];
+        int upper = binStart[bin+1];
         while (lower < upper) {
             int middle = (lower+upper)/2;
-            if (bin[middle].first < x)
+            if (items[middle].first < x)
                 lower = middle+1;
             else
                 upper = middle;
@@ -127,15 +128,14 @@ public:
     }
     
     /**
-     * Find the index of the first particle in voxel (y,z) whose x coordinate in greater than the specified value.
+     * Find the index of the first item in a bin whose x coordinate in greater than the specified value.
      */
-    int findUpperBound(int y, int z, double x) const {
-        const vector<pair<float, int> >& bin = bins[y][z];
-        int lower = 0;
-        int upper = bin.size();
+    int findUpperBound(int bin, double x) const {
+        int lower = binStart[bin];
+        int upper = binStart[bin+1];
         while (lower < upper) {
             int middle = (lower+upper)/2;
-            if (bin[middle].first > x)
+            if (items[middle].first > x)
                 upper = middle;
             else
                 lower = middle+1;
@@ -165,7 +165,7 @@ public:
         return VoxelIndex(y, z);
     }
         
-    void getNeighbors(vector<int>& neighbors, int blockIndex, const fvec4& blockCenter, const fvec4& blockWidth, const vector<int>& sortedAtoms, vector<char>& exclusions, float maxDistance, const vector<int>& blockAtoms, const vector<float>& blockAtomX, const vector<float>& blockAtomY, const vector<float>& blockAtomZ, const vector<float>& sortedPositions, const vector<VoxelIndex>& atomVoxelIndex) const {
+    void getNeighbors(vector<int>& neighbors, int blockIndex, const fvec4& blockCenter, const fvec4& blockWidth, const vector<int>& sortedAtoms, vector<char>& exclusions, float maxDistance, const vector<int>& blockAtoms, const vector<float>& blockAtomX, const vector<float>& blockAtomY, const vector<float>& blockAtomZ, const vector<float>& sortedPositions) const {
         neighbors.resize(0);
         exclusions.resize(0);
         fvec4 boxSize(periodicBoxSize[0], periodicBoxSize[1], periodicBoxSize[2], 0);
@@ -235,27 +235,19 @@ public:
                 float maxx = centerPos[0];
                 float offset[3] = {-xoffset, -yoffset+voxelSizeY*y+(usePeriodic ? 0.0f : miny), voxelSizeZ*z+(usePeriodic ? 0.0f : minz)};
                 for (int k = 0; k < (int) blockAtoms.size(); k += 4) {
+                    // Find the distance from each atom to this voxel along the y and z axes.  Atoms
+                    // inside the voxel have a distance of zero.
+
                     fvec4 dist2 = maxDistanceSquared;
-                    if (y != atomVoxelIndex[k].y) {
-                        fvec4 dy1 = offset[1]-fvec4(&blockAtomY[k]);
-                        fvec4 dy2 = dy1+voxelSizeY;
-                        if (usePeriodic) {
-                            dy1 -= round(dy1*invBoxSize[1])*boxSize[1];
-                            dy2 -= round(dy2*invBoxSize[1])*boxSize[1];
-                        }
-                        fvec4 dy = min(abs(dy1), abs(dy2));
-                        dist2 -= dy*dy;
-                    }
-                    if (z != atomVoxelIndex[k].z) {
-                        fvec4 dz1 = offset[2]-fvec4(&blockAtomZ[k]);
-                        fvec4 dz2 = dz1+voxelSizeZ;
-                        if (usePeriodic) {
-                            dz1 -= round(dz1*invBoxSize[2])*boxSize[2];
-                            dz2 -= round(dz2*invBoxSize[2])*boxSize[2];
-                        }
-                        fvec4 dz = min(abs(dz1), abs(dz2));
-                        dist2 -= dz*dz;
+                    fvec4 dy = fvec4(&blockAtomY[k])-offset[1]-0.5f*voxelSizeY;
+                    fvec4 dz = fvec4(&blockAtomZ[k])-offset[2]-0.5f*voxelSizeZ;
+                    if (usePeriodic) {
+                        dy -= round(dy*invBoxSize[1])*boxSize[1];
+                        dz -= round(dz*invBoxSize[2])*boxSize[2];
                     }
+                    dy = max(0.0f, abs(dy)-0.5f*voxelSizeY);
+                    dz = max(0.0f, abs(dz)-0.5f*voxelSizeZ);
+                    dist2 -= dy*dy + dz*dz;
                     fvec4 dist = sqrt(dist2);
                     int numToCheck = min(4, (int) (blockAtoms.size()-k));
                     for (int m = 0; m < numToCheck; m++) {
@@ -265,28 +257,30 @@ public:
                 }
                 if (minx == maxx)
                     continue;
-                bool needPeriodic = (centerPos[1]-blockWidth[1] < maxDistance || centerPos[1]+blockWidth[1] > periodicBoxSize[1]-maxDistance ||
-                                     centerPos[2]-blockWidth[2] < maxDistance || centerPos[2]+blockWidth[2] > periodicBoxSize[2]-maxDistance ||
-                                     minx < 0.0f || maxx > periodicBoxVectors[0][0]);
+                bool needPeriodic = usePeriodic &&
+                        (centerPos[1]-blockWidth[1] < maxDistance || centerPos[1]+blockWidth[1] > periodicBoxSize[1]-maxDistance ||
+                         centerPos[2]-blockWidth[2] < maxDistance || centerPos[2]+blockWidth[2] > periodicBoxSize[2]-maxDistance ||
+                         minx < 0.0f || maxx > periodicBoxVectors[0][0]);
+                int bin = voxelIndex.y*nz+voxelIndex.z;
                 int numRanges;
                 int rangeStart[2];
                 int rangeEnd[2];
-                rangeStart[0] = findLowerBound(voxelIndex.y, voxelIndex.z, minx);
+                rangeStart[0] = findLowerBound(bin, minx);
                 if (needPeriodic) {
                     numRanges = 2;
-                    rangeEnd[0] = findUpperBound(voxelIndex.y, voxelIndex.z, maxx);
-                    if (rangeStart[0] > 0) {
-                        rangeStart[1] = 0;
-                        rangeEnd[1] = min(findUpperBound(voxelIndex.y, voxelIndex.z, maxx-periodicBoxSize[0]), rangeStart[0]);
+                    rangeEnd[0] = findUpperBound(bin, maxx);
+                    if (rangeStart[0] > binStart[bin]) {
+                        rangeStart[1] = binStart[bin];
+                        rangeEnd[1] = min(findUpperBound(bin, maxx-periodicBoxSize[0]), rangeStart[0]);
                     }
                     else {
-                        rangeStart[1] = max(findLowerBound(voxelIndex.y, voxelIndex.z, minx+periodicBoxSize[0]), rangeEnd[0]);
-                        rangeEnd[1] = bins[voxelIndex.y][voxelIndex.z].size();
+                        rangeStart[1] = max(findLowerBound(bin, minx+periodicBoxSize[0]), rangeEnd[0]);
+                        rangeEnd[1] = binStart[bin+1];
                     }
                 }
                 else {
                     numRanges = 1;
-                    rangeEnd[0] = findUpperBound(voxelIndex.y, voxelIndex.z, maxx);
+                    rangeEnd[0] = findUpperBound(bin, maxx);
                 }
                 bool periodicRectangular = (needPeriodic && !triclinic);
                 
@@ -294,7 +288,7 @@ public:
                 
                 for (int range = 0; range < numRanges; range++) {
                     for (int item = rangeStart[range]; item < rangeEnd[range]; item++) {
-                        const int sortedIndex = bins[voxelIndex.y][voxelIndex.z][item].second;
+                        const int sortedIndex = items[item].second;
 
                         // Avoid duplicate entries.
                         if (sortedIndex >= lastSortedIndex)
@@ -373,7 +367,8 @@ private:
     bool triclinic;
     const RealVec* periodicBoxVectors;
     const bool usePeriodic;
-    vector<vector<vector<pair<float, int> > > > bins;
+    const vector<int>& binStart;
+    const vector<pair<float, int> >& items;
 };
 
 class CpuNeighborList::ThreadTask : public ThreadPool::Task {
@@ -381,12 +376,43 @@ public:
     ThreadTask(CpuNeighborList& owner) : owner(owner) {
     }
     void execute(ThreadPool& threads, int threadIndex) {
-        owner.threadComputeNeighborList(threads, threadIndex);
+        owner.threadBuildVoxels(threads, threadIndex);
+    }
+    CpuNeighborList& owner;
+};
+
+/**
+ * Convert per-thread counts of the items of each kind into the positions where each thread should write its
+ * items.  Items are ordered first by kind, then by thread, so scattering them preserves their order within
+ * each kind.  On entry counts[thread*numKinds+kind] holds a count, and on exit it holds the first position.
+ * If start is not NULL, it is set to the first position of each kind, followed by the total number of items.
+ */
+static void computeOffsets(vector<int>& counts, int numThreads, int numKinds, vector<int>* start) {
+    int total = 0;
+    for (int kind = 0; kind < numKinds; kind++) {
+        if (start != NULL)
+            (*start)[kind] = total;
+        for (int thread = 0; thread < numThreads; thread++) {
+            int count = counts[thread*numKinds+kind];
+            counts[thread*numKinds+kind] = total;
+            total += count;
+        }
+    }
+    if (start != NULL)
+        (*start)[numKinds] = total;
+}
+
+class CpuNeighborList::BlockTask : public ThreadPool::RangeTask {
+public:
+    BlockTask(CpuNeighborList& owner) : owner(owner) {
+    }
+    void execute(ThreadPool& threads, int threadIndex, int start, int end) {
+        owner.computeBlockNeighbors(start, end);
     }
     CpuNeighborList& owner;
 };
 
-CpuNeighborList::CpuNeighborList(int blockSize) : blockSize(blockSize) {
+CpuNeighborList::CpuNeighborList(int blockSize) : blockSize(blockSize), useClusters(false) {
 }
 
 void CpuNeighborList::computeNeighborList(int numAtoms, const AlignedArray<float>& atomLocations, const vector<set<int> >& exclusions,
@@ -394,7 +420,12 @@ void CpuNeighborList::computeNeighborList(int numAtoms, const AlignedArray<float
     int numBlocks = (numAtoms+blockSize-1)/blockSize;
     blockNeighbors.resize(numBlocks);
     blockExclusions.resize(numBlocks);
+    if (useClusters) {
+        blockClusters.resize(numBlocks);
+        blockClusterExclusions.resize(numBlocks);
+    }
     sortedAtoms.resize(numAtoms);
+    atomSortedIndex.resize(numAtoms);
     sortedPositions.resize(4*numAtoms);
     
     // Record the parameters for the threads.
@@ -408,14 +439,18 @@ void CpuNeighborList::computeNeighborList(int numAtoms, const AlignedArray<float
     this->usePeriodic = usePeriodic;
     this->maxDistance = maxDistance;
     
-    // Identify the range of atom positions along each axis.
+    // The threads find the range of atom positions along each axis.  Combine their results.
     
-    fvec4 minPos(&atomLocations[0]);
-    fvec4 maxPos = minPos;
-    for (int i = 0; i < numAtoms; i++) {
-        fvec4 pos(&atomLocations[4*i]);
-        minPos = min(minPos, pos);
-        maxPos = max(maxPos, pos);
+    int numThreads = threads.getNumThreads();
+    threadBounds.resize(8*numThreads);
+    ThreadTask task(*this);
+    threads.execute(task);
+    threads.waitForThreads();
+    fvec4 minPos(&threadBounds[0]);
+    fvec4 maxPos(&threadBounds[4]);
+    for (int i = 1; i < numThreads; i++) {
+        minPos = min(minPos, fvec4(&threadBounds[8*i]));
+        maxPos = max(maxPos, fvec4(&threadBounds[8*i+4]));
     }
     minx = minPos[0];
     maxx = maxPos[0];
@@ -423,16 +458,8 @@ void CpuNeighborList::computeNeighborList(int numAtoms, const AlignedArray<float
     maxy = maxPos[1];
     minz = minPos[2];
     maxz = maxPos[2];
-    
-    // Sort the atoms based on a Hilbert curve.
-    
-    atomBins.resize(numAtoms);
-    ThreadTask task(*this);
-    threads.execute(task);
-    threads.waitForThreads();
-    sort(atomBins.begin(), atomBins.end());
 
-    // Build the voxel hash.
+    // Create the voxel hash, and make room for the threads to fill it in.
 
     float edgeSizeY, edgeSizeZ;
     if (!usePeriodic)
@@ -441,21 +468,47 @@ void CpuNeighborList::computeNeighborList(int numAtoms, const AlignedArray<float
         edgeSizeY = 0.6f*periodicBoxVectors[1][1]/floorf(periodicBoxVectors[1][1]/maxDistance);
         edgeSizeZ = 0.6f*periodicBoxVectors[2][2]/floorf(periodicBoxVectors[2][2]/maxDistance);
     }
-    Voxels voxels(blockSize, edgeSizeY, edgeSizeZ, miny, maxy, minz, maxz, periodicBoxVectors, usePeriodic);
-    for (int i = 0; i < numAtoms; i++) {
-        int atomIndex = atomBins[i].second;
-        sortedAtoms[i] = atomIndex;
-        fvec4 atomPos(&atomLocations[4*atomIndex]);
-        atomPos.store(&sortedPositions[4*i]);
-        voxels.insert(i, &atomLocations[4*atomIndex]);
-    }
-    voxels.sortItems();
+    Voxels voxels(blockSize, edgeSizeY, edgeSizeZ, miny, maxy, minz, maxz, periodicBoxVectors, usePeriodic, voxelStart, voxelItems);
     this->voxels = &voxels;
+    int numVoxels = voxels.getNumBins();
+    atomBins.resize(numAtoms);
+    sortedAtomBins.resize(numAtoms);
+    atomVoxel.resize(numAtoms);
+    voxelStart.resize(numVoxels+1);
+    voxelItems.resize(numAtoms);
+    threadCounts.resize(numThreads*max(RADIX_BUCKETS, numVoxels));
+
+    // Sort the atoms based on a Hilbert curve.  The threads compute the position of each atom along the
+    // curve, then sort them with a radix sort.  Between passes, work out where each thread writes its atoms.
+    
+    threads.resumeThreads();
+    threads.waitForThreads();
+    for (int pass = 0; pass < RADIX_PASSES; pass++) {
+        computeOffsets(threadCounts, numThreads, RADIX_BUCKETS, NULL);
+        threads.resumeThreads();
+        threads.waitForThreads(); // Move the atoms to their new positions
+        if (pass < RADIX_PASSES-1) {
+            threads.resumeThreads();
+            threads.waitForThreads(); // Count the digits for the next pass
+        }
+    }
 
-    // Signal the threads to start running and wait for them to finish.
+    // Build the voxel hash.  The threads count the atoms in each voxel, copy them to their positions in the
+    // flat array, and sort each voxel.
     
     threads.resumeThreads();
     threads.waitForThreads();
+    computeOffsets(threadCounts, numThreads, numVoxels, &voxelStart);
+    threads.resumeThreads();
+    threads.waitForThreads();
+    threads.resumeThreads();
+    threads.waitForThreads();
+
+    // Find the neighbors of each block.  Work in chunks small enough that the threads can balance
+    // the load between them.
+    
+    BlockTask blockTask(*this);
+    threads.parallelFor(blockTask, 0, numBlocks, max(1, numBlocks/(16*threads.getNumThreads())));
     
     // Add padding atoms to fill up the last block.
     
@@ -467,9 +520,18 @@ void CpuNeighborList::computeNeighborList(int numAtoms, const AlignedArray<float
         vector<char>& exc = blockExclusions[blockExclusions.size()-1];
         for (int i = 0; i < (int) exc.size(); i++)
             exc[i] |= mask;
+        if (useClusters) {
+            vector<char>& clusterExc = blockClusterExclusions[blockClusterExclusions.size()-1];
+            for (int i = 0; i < (int) clusterExc.size(); i++)
+                clusterExc[i] |= mask;
+        }
     }
 }
 
+int CpuNeighborList::getBlockSize() const {
+    return blockSize;
+}
+
 int CpuNeighborList::getNumBlocks() const {
     return sortedAtoms.size()/blockSize;
 }
@@ -487,40 +549,126 @@ const std::vector<char>& CpuNeighborList::getBlockExclusions(int blockIndex) con
     
 }
 
-void CpuNeighborList::threadComputeNeighborList(ThreadPool& threads, int threadIndex) {
-    // Compute the positions of atoms along the Hilbert curve.
+bool CpuNeighborList::getUseClusters() const {
+    return useClusters;
+}
+
+void CpuNeighborList::setUseClusters(bool use) {
+    useClusters = use;
+    if (!use) {
+        blockClusters.clear();
+        blockClusterExclusions.clear();
+    }
+}
+
+const std::vector<int>& CpuNeighborList::getBlockClusters(int blockIndex) const {
+    return blockClusters[blockIndex];
+}
+
+const std::vector<char>& CpuNeighborList::getBlockClusterExclusions(int blockIndex) const {
+    return blockClusterExclusions[blockIndex];
+}
+
+void CpuNeighborList::threadBuildVoxels(ThreadPool& threads, int threadIndex) {
+    // Each thread processes a contiguous range of atoms.
+    
+    int numThreads = threads.getNumThreads();
+    int start = (int) (((long long) numAtoms*threadIndex)/numThreads);
+    int end = (int) (((long long) numAtoms*(threadIndex+1))/numThreads);
+
+    // Find the range of positions along each axis.  A thread with no atoms uses the first atom, so it does
+    // not affect the result.
+    
+    fvec4 minPos(&atomLocations[start < end ? 4*start : 0]);
+    fvec4 maxPos = minPos;
+    for (int i = start+1; i < end; i++) {
+        fvec4 pos(&atomLocations[4*i]);
+        minPos = min(minPos, pos);
+        maxPos = max(maxPos, pos);
+    }
+    minPos.store(&threadBounds[8*threadIndex]);
+    maxPos.store(&threadBounds[8*threadIndex+4]);
+    threads.syncThreads();
+
+    // Compute the positions of atoms along the Hilbert curve, and count the lowest digits for the radix sort.
 
     float binWidth = max(max(maxx-minx, maxy-miny), maxz-minz)/255.0f;
     float invBinWidth = 1.0f/binWidth;
     bitmask_t coords[3];
-    int numThreads = threads.getNumThreads();
-    for (int i = threadIndex; i < numAtoms; i += numThreads) {
+    int* counts = &threadCounts[RADIX_BUCKETS*threadIndex];
+    for (int i = 0; i < RADIX_BUCKETS; i++)
+        counts[i] = 0;
+    for (int i = start; i < end; i++) {
         const float* pos = &atomLocations[4*i];
         coords[0] = (bitmask_t) ((pos[0]-minx)*invBinWidth);
         coords[1] = (bitmask_t) ((pos[1]-miny)*invBinWidth);
         coords[2] = (bitmask_t) ((pos[2]-minz)*invBinWidth);
         int bin = (int) hilbert_c2i(3, 8, coords);
         atomBins[i] = pair<int, int>(bin, i);
+        counts[bin&(RADIX_BUCKETS-1)]++;
     }
     threads.syncThreads();
 
-    // Compute this thread's subset of neighbors.
+    // Sort the atoms by position along the curve.  Each pass is stable, so atoms at the same position stay
+    // in order of index.  There is an odd number of passes, so the result ends up in sortedAtomBins.
+    
+    for (int pass = 0; pass < RADIX_PASSES; pass++) {
+        int shift = RADIX_BITS*pass;
+        const vector<pair<int, int> >& source = (pass%2 == 0 ? atomBins : sortedAtomBins);
+        vector<pair<int, int> >& dest = (pass%2 == 0 ? sortedAtomBins : atomBins);
+        for (int i = start; i < end; i++)
+            dest[counts[(source[i].first>>shift)&(RADIX_BUCKETS-1)]++] = source[i];
+        threads.syncThreads();
+        if (pass < RADIX_PASSES-1) {
+            for (int i = 0; i < RADIX_BUCKETS; i++)
+                counts[i] = 0;
+            for (int i = start; i < end; i++)
+                counts[(dest[i].first>>(shift+RADIX_BITS))&(RADIX_BUCKETS-1)]++;
+            threads.syncThreads();
+        }
+    }
 
-    int numBlocks = blockNeighbors.size();
+    // Record the sorted order of the atoms, and count how many are in each voxel.
+    
+    int numVoxels = voxels->getNumBins();
+    counts = &threadCounts[numVoxels*threadIndex];
+    for (int i = 0; i < numVoxels; i++)
+        counts[i] = 0;
+    for (int i = start; i < end; i++) {
+        int atomIndex = sortedAtomBins[i].second;
+        sortedAtoms[i] = atomIndex;
+        atomSortedIndex[atomIndex] = i;
+        fvec4 atomPos(&atomLocations[4*atomIndex]);
+        atomPos.store(&sortedPositions[4*i]);
+        atomVoxel[i] = voxels->getBin(&atomLocations[4*atomIndex]);
+        counts[atomVoxel[i]]++;
+    }
+    threads.syncThreads();
+    
+    // Copy the atoms into the voxels.
+    
+    for (int i = start; i < end; i++)
+        voxelItems[counts[atomVoxel[i]]++] = make_pair(sortedPositions[4*i], i);
+    threads.syncThreads();
+    
+    // Sort the atoms in each voxel by x coordinate.
+    
+    for (int i = threadIndex; i < numVoxels; i += numThreads)
+        sort(voxelItems.begin()+voxelStart[i], voxelItems.begin()+voxelStart[i+1]);
+}
+
+void CpuNeighborList::computeBlockNeighbors(int startBlock, int endBlock) {
     vector<int> blockAtoms;
+    vector<pair<int, int> > sortedNeighbors;
     vector<float> blockAtomX(blockSize), blockAtomY(blockSize), blockAtomZ(blockSize);
-    vector<VoxelIndex> atomVoxelIndex;
-    for (int i = threadIndex; i < numBlocks; i += numThreads) {
+    for (int i = startBlock; i < endBlock; i++) {
         // Find the atoms in this block and compute their bounding box.
         
         int firstIndex = blockSize*i;
         int atomsInBlock = min(blockSize, numAtoms-firstIndex);
         blockAtoms.resize(atomsInBlock);
-        atomVoxelIndex.resize(atomsInBlock);
-        for (int j = 0; j < atomsInBlock; j++) {
+        for (int j = 0; j < atomsInBlock; j++)
             blockAtoms[j] = sortedAtoms[firstIndex+j];
-            atomVoxelIndex[j] = voxels->getVoxelIndex(&atomLocations[4*blockAtoms[j]]);
-        }
         fvec4 minPos(&sortedPositions[4*firstIndex]);
         fvec4 maxPos = minPos;
         for (int j = 1; j < atomsInBlock; j++) {
@@ -538,7 +686,7 @@ void CpuNeighborList::threadComputeNeighborList(ThreadPool& threads, int threadI
             blockAtomY[j] = 1e10;
             blockAtomZ[j] = 1e10;
         }
-        voxels->getNeighbors(blockNeighbors[i], i, (maxPos+minPos)*0.5f, (maxPos-minPos)*0.5f, sortedAtoms, blockExclusions[i], maxDistance, blockAtoms, blockAtomX, blockAtomY, blockAtomZ, sortedPositions, atomVoxelIndex);
+        voxels->getNeighbors(blockNeighbors[i], i, (maxPos+minPos)*0.5f, (maxPos-minPos)*0.5f, sortedAtoms, blockExclusions[i], maxDistance, blockAtoms, blockAtomX, blockAtomY, blockAtomZ, sortedPositions);
 
         // Record the exclusions for this block.
 
@@ -551,6 +699,29 @@ void CpuNeighborList::threadComputeNeighborList(ThreadPool& threads, int threadI
                     blockExclusions[i][k] |= mask;
             }
         }
+        
+        // Group the neighbors into clusters.  Slots for atoms that are not neighbors are fully excluded,
+        // so the clusters cover exactly the same pairs as the neighbor list.
+        
+        if (useClusters) {
+            int numNeighbors = blockNeighbors[i].size();
+            sortedNeighbors.resize(numNeighbors);
+            for (int k = 0; k < numNeighbors; k++)
+                sortedNeighbors[k] = make_pair(atomSortedIndex[blockNeighbors[i][k]], k);
+            sort(sortedNeighbors.begin(), sortedNeighbors.end());
+            vector<int>& clusters = blockClusters[i];
+            vector<char>& clusterExclusions = blockClusterExclusions[i];
+            clusters.clear();
+            clusterExclusions.clear();
+            for (int k = 0; k < numNeighbors; k++) {
+                int cluster = sortedNeighbors[k].first/ClusterSize;
+                if (clusters.size() == 0 || clusters.back() != cluster) {
+                    clusters.push_back(cluster);
+                    clusterExclusions.resize(clusterExclusions.size()+ClusterSize, (char) 0xFF);
+                }
+                clusterExclusions[clusterExclusions.size()-ClusterSize+sortedNeighbors[k].first%ClusterSize] = blockExclusions[i][sortedNeighbors[k].second];
+            }
+        }
     }
 }
 
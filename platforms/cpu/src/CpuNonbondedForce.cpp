@@ -28,7 +28,6 @@
 #include "CpuNonbondedForce.h"
 #include "ReferenceForce.h"
 #include "ReferencePME.h"
-#include "gmx_atomic.h"
 #include <algorithm>
 
 // In case we're using some primitive version of Visual Studio this will
@@ -41,12 +40,22 @@ using namespace OpenMM;
 const float CpuNonbondedForce::TWO_OVER_SQRT_PI = (float) (2/sqrt(PI_M));
 const int CpuNonbondedForce::NUM_TABLE_POINTS = 2048;
 
-class CpuNonbondedForce::ComputeDirectTask : public ThreadPool::Task {
+class CpuNonbondedForce::ComputeDirectTask : public ThreadPool::RangeTask {
 public:
     ComputeDirectTask(CpuNonbondedForce& owner) : owner(owner) {
     }
-    void execute(ThreadPool& threads, int threadIndex) {
-        owner.threadComputeDirect(threads, threadIndex);
+    void execute(ThreadPool& threads, int threadIndex, int start, int end) {
+        owner.computeDirectRange(threadIndex, start, end);
+    }
+    CpuNonbondedForce& owner;
+};
+
+class CpuNonbondedForce::SortAtomsTask : public ThreadPool::RangeTask {
+public:
+    SortAtomsTask(CpuNonbondedForce& owner) : owner(owner) {
+    }
+    void execute(ThreadPool& threads, int threadIndex, int start, int end) {
+        owner.sortAtomRange(start, end);
     }
     CpuNonbondedForce& owner;
 };
@@ -159,13 +168,14 @@ void CpuNonbondedForce::setUseSwitchingFunction(float distance) {
 
      --------------------------------------------------------------------------------------- */
 
-  void CpuNonbondedForce::setUsePME(float alpha, int meshSize[3]) {
+  void CpuNonbondedForce::setUsePME(float alpha, int meshSize[3], int order) {
       if (alpha != alphaEwald)
           tableIsValid = false;
       alphaEwald = alpha;
       meshDim[0] = meshSize[0];
       meshDim[1] = meshSize[1];
       meshDim[2] = meshSize[2];
+      pmeOrder = order;
       pme = true;
       tabulateEwaldScaleFactor();
   }
@@ -190,7 +200,7 @@ void CpuNonbondedForce::setUseSwitchingFunction(float distance) {
   
 void CpuNonbondedForce::calculateReciprocalIxn(int numberOfAtoms, float* posq, const vector<RealVec>& atomCoordinates,
                                              const vector<pair<float, float> >& atomParameters, const vector<set<int> >& exclusions,
-                                             vector<RealVec>& forces, double* totalEnergy) const {
+                                             vector<RealVec>& forces, double* totalEnergy, double* virial) const {
     typedef std::complex<float> d_complex;
 
     static const float epsilon     =  1.0;
@@ -202,14 +212,19 @@ void CpuNonbondedForce::calculateReciprocalIxn(int numberOfAtoms, float* posq, c
 
     if (pme) {
         pme_t pmedata;
-        pme_init(&pmedata, alphaEwald, numberOfAtoms, meshDim, 5, 1);
+        pme_init(&pmedata, alphaEwald, numberOfAtoms, meshDim, pmeOrder, 1);
         vector<RealOpenMM> charges(numberOfAtoms);
         for (int i = 0; i < numberOfAtoms; i++)
             charges[i] = posq[4*i+3];
         RealOpenMM recipEnergy = 0.0;
-        pme_exec(pmedata, atomCoordinates, forces, charges, periodicBoxVectors, &recipEnergy);
+        RealOpenMM recipVirial[3][3];
+        pme_exec(pmedata, atomCoordinates, forces, charges, periodicBoxVectors, &recipEnergy, virial ? recipVirial : NULL);
         if (totalEnergy)
             *totalEnergy += recipEnergy;
+        if (virial)
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                    virial[3*i+j] += recipVirial[i][j];
         pme_destroy(pmedata);
     }
 
@@ -291,6 +306,17 @@ void CpuNonbondedForce::calculateReciprocalIxn(int numberOfAtoms, float* posq, c
                     if (totalEnergy)
                         *totalEnergy += recipCoeff * ak * (cs * cs + ss * ss);
 
+                    // The derivative of this term with respect to a strain of the box gives its virial.
+
+                    if (virial) {
+                        float k[3] = {kx, ky, kz};
+                        float energy = recipCoeff * ak * (cs * cs + ss * ss);
+                        float scale = 2 * (1 - k2*factorEwald) / k2;
+                        for (int i = 0; i < 3; i++)
+                            for (int j = 0; j < 3; j++)
+                                virial[3*i+j] += energy * ((i == j ? 1 : 0) - scale*k[i]*k[j]);
+                    }
+
                     lowrz = 1 - numRz;
                 }
                 lowry = 1 - numRy;
@@ -301,7 +327,7 @@ void CpuNonbondedForce::calculateReciprocalIxn(int numberOfAtoms, float* posq, c
 
 
 void CpuNonbondedForce::calculateDirectIxn(int numberOfAtoms, float* posq, const vector<RealVec>& atomCoordinates, const vector<pair<float, float> >& atomParameters,
-                const vector<set<int> >& exclusions, vector<AlignedArray<float> >& threadForce, double* totalEnergy, ThreadPool& threads) {
+                const vector<set<int> >& exclusions, vector<AlignedArray<float> >& threadForce, double* totalEnergy, double* virial, ThreadPool& threads) {
     // Record the parameters for the threads.
     
     this->numberOfAtoms = numberOfAtoms;
@@ -311,50 +337,91 @@ void CpuNonbondedForce::calculateDirectIxn(int numberOfAtoms, float* posq, const
     this->exclusions = &exclusions[0];
     this->threadForce = &threadForce;
     includeEnergy = (totalEnergy != NULL);
-    threadEnergy.resize(threads.getNumThreads());
-    gmx_atomic_t counter;
-    gmx_atomic_set(&counter, 0);
-    this->atomicCounter = &counter;
+    includeVirial = (virial != NULL);
+    int numThreads = threads.getNumThreads();
+    threadEnergy.resize(numThreads);
+    threadVirial.resize(6*numThreads);
+    for (int i = 0; i < numThreads; i++)
+        threadEnergy[i] = 0;
+    for (int i = 0; i < 6*numThreads; i++)
+        threadVirial[i] = 0;
     
-    // Signal the threads to start running and wait for them to finish.
+    // Have the threads process the atom blocks, or the individual atoms if there is no neighbor list.
+    // The cost of each one varies, so use small chunks to let the threads balance the load.
     
+    int numItems = (cutoff ? neighborList->getNumBlocks() : numberOfAtoms);
+    if (cutoff && neighborList->getUseClusters()) {
+        int numSorted = neighborList->getSortedAtoms().size();
+        if (sortedPosq.size() < 4*numSorted)
+            sortedPosq.resize(4*numSorted);
+        sortedParameters.resize(numSorted);
+        SortAtomsTask sortTask(*this);
+        threads.parallelFor(sortTask, 0, numSorted, max(256, numSorted/numThreads));
+    }
     ComputeDirectTask task(*this);
-    threads.execute(task);
-    threads.waitForThreads();
+    threads.parallelFor(task, 0, numItems, max(1, numItems/(16*numThreads)));
     
     // Combine the energies from all the threads.
     
     if (totalEnergy != NULL) {
         double directEnergy = 0;
-        int numThreads = threads.getNumThreads();
         for (int i = 0; i < numThreads; i++)
             directEnergy += threadEnergy[i];
         *totalEnergy += directEnergy;
     }
+    
+    // Combine the virials from all the threads.  Each one holds the six independent components of the
+    // symmetric tensor.
+    
+    if (virial != NULL) {
+        double v[6] = {0, 0, 0, 0, 0, 0};
+        for (int i = 0; i < numThreads; i++)
+            for (int j = 0; j < 6; j++)
+                v[j] += threadVirial[6*i+j];
+        virial[0] += v[0];
+        virial[1] += v[3];
+        virial[2] += v[4];
+        virial[3] += v[3];
+        virial[4] += v[1];
+        virial[5] += v[5];
+        virial[6] += v[4];
+        virial[7] += v[5];
+        virial[8] += v[2];
+    }
 }
 
-void CpuNonbondedForce::threadComputeDirect(ThreadPool& threads, int threadIndex) {
-    // Compute this thread's subset of interactions.
+void CpuNonbondedForce::sortAtomRange(int start, int end) {
+    const int* sortedAtoms = &neighborList->getSortedAtoms()[0];
+    for (int i = start; i < end; i++) {
+        int atom = sortedAtoms[i];
+        fvec4(posq+4*atom).store(&sortedPosq[4*i]);
+        sortedParameters[i] = atomParameters[atom];
+    }
+    
+    // Padding atoms at the end of the last block must not contribute any charge.
+    
+    for (int i = max(start, numberOfAtoms); i < end; i++)
+        sortedPosq[4*i+3] = 0.0f;
+}
 
-    int numThreads = threads.getNumThreads();
-    threadEnergy[threadIndex] = 0;
+void CpuNonbondedForce::computeDirectRange(int threadIndex, int start, int end) {
     double* energyPtr = (includeEnergy ? &threadEnergy[threadIndex] : NULL);
+    double* virialPtr = (includeVirial ? &threadVirial[6*threadIndex] : NULL);
     float* forces = &(*threadForce)[threadIndex][0];
     fvec4 boxSize(periodicBoxVectors[0][0], periodicBoxVectors[1][1], periodicBoxVectors[2][2], 0);
     fvec4 invBoxSize(recipBoxSize[0], recipBoxSize[1], recipBoxSize[2], 0);
     if (ewald || pme) {
         // Compute the interactions from the neighbor list.
 
-        while (true) {
-            int nextBlock = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
-            if (nextBlock >= neighborList->getNumBlocks())
-                break;
-            calculateBlockEwaldIxn(nextBlock, forces, energyPtr, boxSize, invBoxSize);
-        }
+        for (int block = start; block < end; block++)
+            calculateBlockEwaldIxn(block, forces, energyPtr, virialPtr, boxSize, invBoxSize);
 
-        // Now subtract off the exclusions, since they were implicitly included in the reciprocal space sum.
+        // Now subtract off the exclusions of the atoms in these blocks, since they were implicitly included
+        // in the reciprocal space sum.
 
-        for (int i = threadIndex; i < numberOfAtoms; i += numThreads) {
+        const int blockSize = neighborList->getSortedAtoms().size()/neighborList->getNumBlocks();
+        for (int index = start*blockSize; index < end*blockSize && index < numberOfAtoms; index++) {
+            int i = neighborList->getSortedAtoms()[index];
             fvec4 posI((float) atomCoordinates[i][0], (float) atomCoordinates[i][1], (float) atomCoordinates[i][2], 0.0f);
             for (set<int>::const_iterator iter = exclusions[i].begin(); iter != exclusions[i].end(); ++iter) {
                 if (*iter > i) {
@@ -376,6 +443,8 @@ void CpuNonbondedForce::threadComputeDirect(ThreadPool& threads, int threadIndex
                         (fvec4(forces+4*j)+result).store(forces+4*j);
                         if (includeEnergy)
                             threadEnergy[threadIndex] -= chargeProd*inverseR*erfAlphaR;
+                        if (includeVirial)
+                            addPairVirial(virialPtr, deltaR, -dEdR);
                     }
                 }
             }
@@ -384,28 +453,20 @@ void CpuNonbondedForce::threadComputeDirect(ThreadPool& threads, int threadIndex
     else if (cutoff) {
         // Compute the interactions from the neighbor list.
 
-        while (true) {
-            int nextBlock = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
-            if (nextBlock >= neighborList->getNumBlocks())
-                break;
-            calculateBlockIxn(nextBlock, forces, energyPtr, boxSize, invBoxSize);
-        }
+        for (int block = start; block < end; block++)
+            calculateBlockIxn(block, forces, energyPtr, virialPtr, boxSize, invBoxSize);
     }
     else {
         // Loop over all atom pairs
 
-        while (true) {
-            int i = gmx_atomic_fetch_add(reinterpret_cast<gmx_atomic_t*>(atomicCounter), 1);
-            if (i >= numberOfAtoms)
-                break;
+        for (int i = start; i < end; i++)
             for (int j = i+1; j < numberOfAtoms; j++)
                 if (exclusions[j].find(i) == exclusions[j].end())
-                    calculateOneIxn(i, j, forces, energyPtr, boxSize, invBoxSize);
-        }
+                    calculateOneIxn(i, j, forces, energyPtr, virialPtr, boxSize, invBoxSize);
     }
 }
 
-void CpuNonbondedForce::calculateOneIxn(int ii, int jj, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
+void CpuNonbondedForce::calculateOneIxn(int ii, int jj, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize) {
     // get deltaR, R2, and R between 2 atoms
 
     fvec4 deltaR;
@@ -457,8 +518,19 @@ void CpuNonbondedForce::calculateOneIxn(int ii, int jj, float* forces, double* t
     fvec4 result = deltaR*dEdR;
     (fvec4(forces+4*ii)+result).store(forces+4*ii);
     (fvec4(forces+4*jj)-result).store(forces+4*jj);
+    if (virial)
+        addPairVirial(virial, deltaR, dEdR);
   }
 
+void CpuNonbondedForce::addPairVirial(double* virial, const fvec4& deltaR, float dEdR) {
+    virial[0] += dEdR*deltaR[0]*deltaR[0];
+    virial[1] += dEdR*deltaR[1]*deltaR[1];
+    virial[2] += dEdR*deltaR[2]*deltaR[2];
+    virial[3] += dEdR*deltaR[0]*deltaR[1];
+    virial[4] += dEdR*deltaR[0]*deltaR[2];
+    virial[5] += dEdR*deltaR[1]*deltaR[2];
+}
+
 void CpuNonbondedForce::getDeltaR(const fvec4& posI, const fvec4& posJ, fvec4& deltaR, float& r2, bool periodic, const fvec4& boxSize, const fvec4& invBoxSize) const {
     deltaR = posJ-posI;
     if (periodic) {
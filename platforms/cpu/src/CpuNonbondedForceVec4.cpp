@@ -46,7 +46,7 @@ CpuNonbondedForceVec4::CpuNonbondedForceVec4() {
 
 enum PeriodicType {NoPeriodic, PeriodicPerAtom, PeriodicPerInteraction, PeriodicTriclinic};
 
-void CpuNonbondedForceVec4::calculateBlockIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
+void CpuNonbondedForceVec4::calculateBlockIxn(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize) {
     // Determine whether we need to apply periodic boundary conditions.
     
     PeriodicType periodicType;
@@ -86,22 +86,23 @@ void CpuNonbondedForceVec4::calculateBlockIxn(int blockIndex, float* forces, dou
     // Call the appropriate version depending on what calculation is required for periodic boundary conditions.
     
     if (periodicType == NoPeriodic)
-        calculateBlockIxnImpl<NoPeriodic>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockIxnImpl<NoPeriodic>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicPerAtom)
-        calculateBlockIxnImpl<PeriodicPerAtom>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockIxnImpl<PeriodicPerAtom>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicPerInteraction)
-        calculateBlockIxnImpl<PeriodicPerInteraction>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockIxnImpl<PeriodicPerInteraction>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicTriclinic)
-        calculateBlockIxnImpl<PeriodicTriclinic>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockIxnImpl<PeriodicTriclinic>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
 }
 
 template <int PERIODIC_TYPE>
-void CpuNonbondedForceVec4::calculateBlockIxnImpl(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter) {
+void CpuNonbondedForceVec4::calculateBlockIxnImpl(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter) {
     // Load the positions and parameters of the atoms in the block.
     
     const int* blockAtom = &neighborList->getSortedAtoms()[4*blockIndex];
     fvec4 blockAtomPosq[4];
     fvec4 blockAtomForceX(0.0f), blockAtomForceY(0.0f), blockAtomForceZ(0.0f);
+    fvec4 virXX(0.0f), virYY(0.0f), virZZ(0.0f), virXY(0.0f), virXZ(0.0f), virYZ(0.0f);
     for (int i = 0; i < 4; i++) {
         blockAtomPosq[i] = fvec4(posq+4*blockAtom[i]);
         if (PERIODIC_TYPE == PeriodicPerAtom)
@@ -196,12 +197,32 @@ void CpuNonbondedForceVec4::calculateBlockIxnImpl(int blockIndex, float* forces,
         blockAtomForceX += fx;
         blockAtomForceY += fy;
         blockAtomForceZ += fz;
+        if (virial) {
+            virXX += dx*fx;
+            virYY += dy*fy;
+            virZZ += dz*fz;
+            virXY += dx*fy;
+            virXZ += dx*fz;
+            virYZ += dy*fz;
+        }
         float* atomForce = forces+4*atom;
         atomForce[0] -= dot4(fx, one);
         atomForce[1] -= dot4(fy, one);
         atomForce[2] -= dot4(fz, one);
     }
     
+    // Record the virial.
+
+    if (virial) {
+        fvec4 one(1.0f);
+        virial[0] += dot4(virXX, one);
+        virial[1] += dot4(virYY, one);
+        virial[2] += dot4(virZZ, one);
+        virial[3] += dot4(virXY, one);
+        virial[4] += dot4(virXZ, one);
+        virial[5] += dot4(virYZ, one);
+    }
+
     // Record the forces on the block atoms.
 
     fvec4 f[4] = {blockAtomForceX, blockAtomForceY, blockAtomForceZ, 0.0f};
@@ -210,7 +231,7 @@ void CpuNonbondedForceVec4::calculateBlockIxnImpl(int blockIndex, float* forces,
         (fvec4(forces+4*blockAtom[j])+f[j]).store(forces+4*blockAtom[j]);
   }
 
-void CpuNonbondedForceVec4::calculateBlockEwaldIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
+void CpuNonbondedForceVec4::calculateBlockEwaldIxn(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize) {
     // Determine whether we need to apply periodic boundary conditions.
     
     PeriodicType periodicType;
@@ -250,22 +271,23 @@ void CpuNonbondedForceVec4::calculateBlockEwaldIxn(int blockIndex, float* forces
     // Call the appropriate version depending on what calculation is required for periodic boundary conditions.
     
     if (periodicType == NoPeriodic)
-        calculateBlockEwaldIxnImpl<NoPeriodic>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockEwaldIxnImpl<NoPeriodic>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicPerAtom)
-        calculateBlockEwaldIxnImpl<PeriodicPerAtom>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockEwaldIxnImpl<PeriodicPerAtom>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicPerInteraction)
-        calculateBlockEwaldIxnImpl<PeriodicPerInteraction>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockEwaldIxnImpl<PeriodicPerInteraction>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicTriclinic)
-        calculateBlockEwaldIxnImpl<PeriodicTriclinic>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockEwaldIxnImpl<PeriodicTriclinic>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
 }
 
 template <int PERIODIC_TYPE>
-void CpuNonbondedForceVec4::calculateBlockEwaldIxnImpl(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter) {
+void CpuNonbondedForceVec4::calculateBlockEwaldIxnImpl(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter) {
     // Load the positions and parameters of the atoms in the block.
     
     const int* blockAtom = &neighborList->getSortedAtoms()[4*blockIndex];
     fvec4 blockAtomPosq[4];
     fvec4 blockAtomForceX(0.0f), blockAtomForceY(0.0f), blockAtomForceZ(0.0f);
+    fvec4 virXX(0.0f), virYY(0.0f), virZZ(0.0f), virXY(0.0f), virXZ(0.0f), virYZ(0.0f);
     for (int i = 0; i < 4; i++) {
         blockAtomPosq[i] = fvec4(posq+4*blockAtom[i]);
         if (PERIODIC_TYPE == PeriodicPerAtom)
@@ -354,13 +376,31 @@ void CpuNonbondedForceVec4::calculateBlockEwaldIxnImpl(int blockIndex, float* fo
         blockAtomForceX += fx;
         blockAtomForceY += fy;
         blockAtomForceZ += fz;
+        if (virial) {
+            virXX += dx*fx;
+            virYY += dy*fy;
+            virZZ += dz*fz;
+            virXY += dx*fy;
+            virXZ += dx*fz;
+            virYZ += dy*fz;
+        }
         float* atomForce = forces+4*atom;
         atomForce[0] -= dot4(fx, one);
         atomForce[1] -= dot4(fy, one);
         atomForce[2] -= dot4(fz, one);
     }
     
-    // Record the forces on the block atoms.
+    // Record the virial.
+
+    if (virial) {
+        fvec4 one(1.0f);
+        virial[0] += dot4(virXX, one);
+        virial[1] += dot4(virYY, one);
+        virial[2] += dot4(virZZ, one);
+        virial[3] += dot4(virXY, one);
+        virial[4] += dot4(virXZ, one);
+        virial[5] += dot4(virYZ, one);
+    }
     
     fvec4 f[4] = {blockAtomForceX, blockAtomForceY, blockAtomForceZ, 0.0f};
     transpose(f[0], f[1], f[2], f[3]);
@@ -26,6 +26,7 @@
 #include "CpuNonbondedForceVec8.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/internal/hardware.h"
+#include <cassert>
 
 using namespace std;
 using namespace OpenMM;
@@ -78,7 +79,11 @@ CpuNonbondedForceVec8::CpuNonbondedForceVec8() {
 
 enum PeriodicType {NoPeriodic, PeriodicPerAtom, PeriodicPerInteraction, PeriodicTriclinic};
 
-void CpuNonbondedForceVec8::calculateBlockIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
+void CpuNonbondedForceVec8::calculateBlockIxn(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize) {
+    // This kernel reads neighbors from the cluster lists, which are only built if they were requested.
+    
+    assert(neighborList->getUseClusters());
+    
     // Determine whether we need to apply periodic boundary conditions.
     
     PeriodicType periodicType;
@@ -118,121 +123,169 @@ void CpuNonbondedForceVec8::calculateBlockIxn(int blockIndex, float* forces, dou
     // Call the appropriate version depending on what calculation is required for periodic boundary conditions.
     
     if (periodicType == NoPeriodic)
-        calculateBlockIxnImpl<NoPeriodic>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockIxnImpl<NoPeriodic>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicPerAtom)
-        calculateBlockIxnImpl<PeriodicPerAtom>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockIxnImpl<PeriodicPerAtom>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicPerInteraction)
-        calculateBlockIxnImpl<PeriodicPerInteraction>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockIxnImpl<PeriodicPerInteraction>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicTriclinic)
-        calculateBlockIxnImpl<PeriodicTriclinic>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockIxnImpl<PeriodicTriclinic>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
 }
 
 template <int PERIODIC_TYPE>
-void CpuNonbondedForceVec8::calculateBlockIxnImpl(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter) {
-    // Load the positions and parameters of the atoms in the block.
+void CpuNonbondedForceVec8::calculateBlockIxnImpl(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter) {
+    // Load the positions and parameters of the atoms in the block.  They are stored consecutively in the
+    // sorted arrays.
     
     const int* blockAtom = &neighborList->getSortedAtoms()[8*blockIndex];
+    const pair<float, float>* blockParameters = &sortedParameters[8*blockIndex];
     fvec4 blockAtomPosq[8];
     fvec8 blockAtomForceX(0.0f), blockAtomForceY(0.0f), blockAtomForceZ(0.0f);
+    fvec8 virXX(0.0f), virYY(0.0f), virZZ(0.0f), virXY(0.0f), virXZ(0.0f), virYZ(0.0f);
     fvec8 blockAtomX, blockAtomY, blockAtomZ, blockAtomCharge;
     for (int i = 0; i < 8; i++) {
-        blockAtomPosq[i] = fvec4(posq+4*blockAtom[i]);
+        blockAtomPosq[i] = fvec4(&sortedPosq[4*(8*blockIndex+i)]);
         if (PERIODIC_TYPE == PeriodicPerAtom)
             blockAtomPosq[i] -= floor((blockAtomPosq[i]-blockCenter)*invBoxSize+0.5f)*boxSize;
     }
     transpose(blockAtomPosq[0], blockAtomPosq[1], blockAtomPosq[2], blockAtomPosq[3], blockAtomPosq[4], blockAtomPosq[5], blockAtomPosq[6], blockAtomPosq[7], blockAtomX, blockAtomY, blockAtomZ, blockAtomCharge);
     blockAtomCharge *= ONE_4PI_EPS0;
-    fvec8 blockAtomSigma(atomParameters[blockAtom[0]].first, atomParameters[blockAtom[1]].first, atomParameters[blockAtom[2]].first, atomParameters[blockAtom[3]].first, atomParameters[blockAtom[4]].first, atomParameters[blockAtom[5]].first, atomParameters[blockAtom[6]].first, atomParameters[blockAtom[7]].first);
-    fvec8 blockAtomEpsilon(atomParameters[blockAtom[0]].second, atomParameters[blockAtom[1]].second, atomParameters[blockAtom[2]].second, atomParameters[blockAtom[3]].second, atomParameters[blockAtom[4]].second, atomParameters[blockAtom[5]].second, atomParameters[blockAtom[6]].second, atomParameters[blockAtom[7]].second);
+    fvec8 blockAtomSigma(blockParameters[0].first, blockParameters[1].first, blockParameters[2].first, blockParameters[3].first, blockParameters[4].first, blockParameters[5].first, blockParameters[6].first, blockParameters[7].first);
+    fvec8 blockAtomEpsilon(blockParameters[0].second, blockParameters[1].second, blockParameters[2].second, blockParameters[3].second, blockParameters[4].second, blockParameters[5].second, blockParameters[6].second, blockParameters[7].second);
     const bool needPeriodic = (PERIODIC_TYPE == PeriodicPerInteraction || PERIODIC_TYPE == PeriodicTriclinic);
     const float invSwitchingInterval = 1/(cutoffDistance-switchingDistance);
     
-    // Loop over neighbors for this block.
+    // Loop over the clusters of neighbors for this block.  Each one forms an 8x4 tile of atom pairs with the
+    // block, which is computed as four passes over the block atoms.
     
-    const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
-    const vector<char>& exclusions = neighborList->getBlockExclusions(blockIndex);
-    for (int i = 0; i < (int) neighbors.size(); i++) {
-        // Load the next neighbor.
+    const int ClusterSize = CpuNeighborList::ClusterSize;
+    const int* sortedAtoms = &neighborList->getSortedAtoms()[0];
+    const vector<int>& clusters = neighborList->getBlockClusters(blockIndex);
+    const vector<char>& clusterExclusions = neighborList->getBlockClusterExclusions(blockIndex);
+    for (int cluster = 0; cluster < (int) clusters.size(); cluster++) {
+        // Load the positions and parameters of the cluster's atoms, which are stored next to each other.
         
-        int atom = neighbors[i];
+        const int firstIndex = ClusterSize*clusters[cluster];
+        const char* exclusions = &clusterExclusions[ClusterSize*cluster];
+        fvec4 clusterPos[ClusterSize], clusterForce[ClusterSize];
+        float clusterSigma[ClusterSize], clusterEpsilon[ClusterSize];
+        for (int i = 0; i < ClusterSize; i++) {
+            clusterPos[i] = fvec4(&sortedPosq[4*(firstIndex+i)]);
+            if (PERIODIC_TYPE == PeriodicPerAtom)
+                clusterPos[i] -= floor((clusterPos[i]-blockCenter)*invBoxSize+0.5f)*boxSize;
+            clusterSigma[i] = sortedParameters[firstIndex+i].first;
+            clusterEpsilon[i] = sortedParameters[firstIndex+i].second;
+            clusterForce[i] = 0.0f;
+        }
         
-        // Compute the distances to the block atoms.
+        // Compute the tile.  Slots that are excluded from every block atom include the ones for atoms that
+        // are not neighbors at all.
         
-        fvec8 dx, dy, dz, r2;
-        fvec4 atomPos(posq+4*atom);
-        if (PERIODIC_TYPE == PeriodicPerAtom)
-            atomPos -= floor((atomPos-blockCenter)*invBoxSize+0.5f)*boxSize;
-        getDeltaR<PERIODIC_TYPE>(atomPos, blockAtomX, blockAtomY, blockAtomZ, dx, dy, dz, r2, needPeriodic, boxSize, invBoxSize);
-        ivec8 include;
-        char excl = exclusions[i];
-        if (excl == 0)
-            include = -1;
-        else
-            include = ivec8(excl&1 ? 0 : -1, excl&2 ? 0 : -1, excl&4 ? 0 : -1, excl&8 ? 0 : -1, excl&16 ? 0 : -1, excl&32 ? 0 : -1, excl&64 ? 0 : -1, excl&128 ? 0 : -1);
-        include = include & (r2 < cutoffDistance*cutoffDistance);
-        if (!any(include))
-            continue; // No interactions to compute.
+        for (int i = 0; i < ClusterSize; i++) {
+            if (exclusions[i] == (char) 0xFF)
+                continue;
+            
+            // Compute the distances to the block atoms.
+        
+            fvec8 dx, dy, dz, r2;
+            const fvec4& atomPos = clusterPos[i];
+            getDeltaR<PERIODIC_TYPE>(atomPos, blockAtomX, blockAtomY, blockAtomZ, dx, dy, dz, r2, needPeriodic, boxSize, invBoxSize);
+            ivec8 include;
+            char excl = exclusions[i];
+            if (excl == 0)
+                include = -1;
+            else
+                include = ivec8(excl&1 ? 0 : -1, excl&2 ? 0 : -1, excl&4 ? 0 : -1, excl&8 ? 0 : -1, excl&16 ? 0 : -1, excl&32 ? 0 : -1, excl&64 ? 0 : -1, excl&128 ? 0 : -1);
+            include = include & (r2 < cutoffDistance*cutoffDistance);
+            if (!any(include))
+                continue; // No interactions to compute.
         
-        // Compute the interactions.
+            // Compute the interactions.
         
-        fvec8 inverseR = rsqrt(r2);
-        fvec8 energy, dEdR;
-        float atomEpsilon = atomParameters[atom].second;
-        if (atomEpsilon != 0.0f) {
-            fvec8 sig = blockAtomSigma+atomParameters[atom].first;
-            fvec8 sig2 = inverseR*sig;
-            sig2 *= sig2;
-            fvec8 sig6 = sig2*sig2*sig2;
-            fvec8 epsSig6 = blockAtomEpsilon*atomEpsilon*sig6;
-            dEdR = epsSig6*(12.0f*sig6 - 6.0f);
-            energy = epsSig6*(sig6-1.0f);
-            if (useSwitch) {
-                fvec8 r = r2*inverseR;
-                fvec8 t = (r>switchingDistance) & ((r-switchingDistance)*invSwitchingInterval);
-                fvec8 switchValue = 1+t*t*t*(-10.0f+t*(15.0f-t*6.0f));
-                fvec8 switchDeriv = t*t*(-30.0f+t*(60.0f-t*30.0f))*invSwitchingInterval;
-                dEdR = switchValue*dEdR - energy*switchDeriv*r;
-                energy *= switchValue;
+            fvec8 inverseR = rsqrt(r2);
+            fvec8 energy, dEdR;
+            float atomEpsilon = clusterEpsilon[i];
+            if (atomEpsilon != 0.0f) {
+                fvec8 sig = blockAtomSigma+clusterSigma[i];
+                fvec8 sig2 = inverseR*sig;
+                sig2 *= sig2;
+                fvec8 sig6 = sig2*sig2*sig2;
+                fvec8 epsSig6 = blockAtomEpsilon*atomEpsilon*sig6;
+                dEdR = epsSig6*(12.0f*sig6 - 6.0f);
+                energy = epsSig6*(sig6-1.0f);
+                if (useSwitch) {
+                    fvec8 r = r2*inverseR;
+                    fvec8 t = (r>switchingDistance) & ((r-switchingDistance)*invSwitchingInterval);
+                    fvec8 switchValue = 1+t*t*t*(-10.0f+t*(15.0f-t*6.0f));
+                    fvec8 switchDeriv = t*t*(-30.0f+t*(60.0f-t*30.0f))*invSwitchingInterval;
+                    dEdR = switchValue*dEdR - energy*switchDeriv*r;
+                    energy *= switchValue;
+                }
             }
-        }
-        else {
-            energy = 0.0f;
-            dEdR = 0.0f;
-        }
-        fvec8 chargeProd = blockAtomCharge*posq[4*atom+3];
-        if (cutoff)
-            dEdR += chargeProd*(inverseR-2.0f*krf*r2);
-        else
-            dEdR += chargeProd*inverseR;
-        dEdR *= inverseR*inverseR;
-
-        // Accumulate energies.
-
-        fvec8 one(1.0f);
-        if (totalEnergy) {
+            else {
+                energy = 0.0f;
+                dEdR = 0.0f;
+            }
+            fvec8 chargeProd = blockAtomCharge*atomPos[3];
             if (cutoff)
-                energy += chargeProd*(inverseR+krf*r2-crf);
+                dEdR += chargeProd*(inverseR-2.0f*krf*r2);
             else
-                energy += chargeProd*inverseR;
-            energy = blend(0.0f, energy, include);
-            *totalEnergy += dot8(energy, one);
-        }
+                dEdR += chargeProd*inverseR;
+            dEdR *= inverseR*inverseR;
 
-        // Accumulate forces.
-
-        dEdR = blend(0.0f, dEdR, include);
-        fvec8 fx = dx*dEdR;
-        fvec8 fy = dy*dEdR;
-        fvec8 fz = dz*dEdR;
-        blockAtomForceX += fx;
-        blockAtomForceY += fy;
-        blockAtomForceZ += fz;
-        float* atomForce = forces+4*atom;
-        atomForce[0] -= dot8(fx, one);
-        atomForce[1] -= dot8(fy, one);
-        atomForce[2] -= dot8(fz, one);
+            // Accumulate energies.
+
+            fvec8 one(1.0f);
+            if (totalEnergy) {
+                if (cutoff)
+                    energy += chargeProd*(inverseR+krf*r2-crf);
+                else
+                    energy += chargeProd*inverseR;
+                energy = blend(0.0f, energy, include);
+                *totalEnergy += dot8(energy, one);
+            }
+
+            // Accumulate forces.
+
+            dEdR = blend(0.0f, dEdR, include);
+            fvec8 fx = dx*dEdR;
+            fvec8 fy = dy*dEdR;
+            fvec8 fz = dz*dEdR;
+            blockAtomForceX += fx;
+            blockAtomForceY += fy;
+            blockAtomForceZ += fz;
+            if (virial) {
+                virXX += dx*fx;
+                virYY += dy*fy;
+                virZZ += dz*fz;
+                virXY += dx*fy;
+                virXZ += dx*fz;
+                virYZ += dy*fz;
+            }
+            clusterForce[i] += fvec4(dot8(fx, one), dot8(fy, one), dot8(fz, one), 0.0f);
+        }
+        
+        // Record the forces on the cluster's atoms.
+        
+        for (int i = 0; i < ClusterSize; i++)
+            if (exclusions[i] != (char) 0xFF) {
+                float* atomForce = forces+4*sortedAtoms[firstIndex+i];
+                (fvec4(atomForce)-clusterForce[i]).store(atomForce);
+            }
     }
     
+    // Record the virial.
+
+    if (virial) {
+        fvec8 one(1.0f);
+        virial[0] += dot8(virXX, one);
+        virial[1] += dot8(virYY, one);
+        virial[2] += dot8(virZZ, one);
+        virial[3] += dot8(virXY, one);
+        virial[4] += dot8(virXZ, one);
+        virial[5] += dot8(virYZ, one);
+    }
+
     // Record the forces on the block atoms.
 
     fvec4 f[8];
@@ -241,7 +294,11 @@ void CpuNonbondedForceVec8::calculateBlockIxnImpl(int blockIndex, float* forces,
         (fvec4(forces+4*blockAtom[j])+f[j]).store(forces+4*blockAtom[j]);
   }
 
-void CpuNonbondedForceVec8::calculateBlockEwaldIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
+void CpuNonbondedForceVec8::calculateBlockEwaldIxn(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize) {
+    // This kernel reads neighbors from the cluster lists, which are only built if they were requested.
+    
+    assert(neighborList->getUseClusters());
+    
     // Determine whether we need to apply periodic boundary conditions.
     
     PeriodicType periodicType;
@@ -281,116 +338,162 @@ void CpuNonbondedForceVec8::calculateBlockEwaldIxn(int blockIndex, float* forces
     // Call the appropriate version depending on what calculation is required for periodic boundary conditions.
     
     if (periodicType == NoPeriodic)
-        calculateBlockEwaldIxnImpl<NoPeriodic>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockEwaldIxnImpl<NoPeriodic>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicPerAtom)
-        calculateBlockEwaldIxnImpl<PeriodicPerAtom>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockEwaldIxnImpl<PeriodicPerAtom>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicPerInteraction)
-        calculateBlockEwaldIxnImpl<PeriodicPerInteraction>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockEwaldIxnImpl<PeriodicPerInteraction>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicTriclinic)
-        calculateBlockEwaldIxnImpl<PeriodicTriclinic>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        calculateBlockEwaldIxnImpl<PeriodicTriclinic>(blockIndex, forces, totalEnergy, virial, boxSize, invBoxSize, blockCenter);
 }
 
 template <int PERIODIC_TYPE>
-void CpuNonbondedForceVec8::calculateBlockEwaldIxnImpl(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter) {
-    // Load the positions and parameters of the atoms in the block.
+void CpuNonbondedForceVec8::calculateBlockEwaldIxnImpl(int blockIndex, float* forces, double* totalEnergy, double* virial, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter) {
+    // Load the positions and parameters of the atoms in the block.  They are stored consecutively in the
+    // sorted arrays.
     
     const int* blockAtom = &neighborList->getSortedAtoms()[8*blockIndex];
+    const pair<float, float>* blockParameters = &sortedParameters[8*blockIndex];
     fvec4 blockAtomPosq[8];
     fvec8 blockAtomForceX(0.0f), blockAtomForceY(0.0f), blockAtomForceZ(0.0f);
+    fvec8 virXX(0.0f), virYY(0.0f), virZZ(0.0f), virXY(0.0f), virXZ(0.0f), virYZ(0.0f);
     fvec8 blockAtomX, blockAtomY, blockAtomZ, blockAtomCharge;
     for (int i = 0; i < 8; i++) {
-        blockAtomPosq[i] = fvec4(posq+4*blockAtom[i]);
+        blockAtomPosq[i] = fvec4(&sortedPosq[4*(8*blockIndex+i)]);
         if (PERIODIC_TYPE == PeriodicPerAtom)
             blockAtomPosq[i] -= floor((blockAtomPosq[i]-blockCenter)*invBoxSize+0.5f)*boxSize;
     }
     transpose(blockAtomPosq[0], blockAtomPosq[1], blockAtomPosq[2], blockAtomPosq[3], blockAtomPosq[4], blockAtomPosq[5], blockAtomPosq[6], blockAtomPosq[7], blockAtomX, blockAtomY, blockAtomZ, blockAtomCharge);
     blockAtomCharge *= ONE_4PI_EPS0;
-    fvec8 blockAtomSigma(atomParameters[blockAtom[0]].first, atomParameters[blockAtom[1]].first, atomParameters[blockAtom[2]].first, atomParameters[blockAtom[3]].first, atomParameters[blockAtom[4]].first, atomParameters[blockAtom[5]].first, atomParameters[blockAtom[6]].first, atomParameters[blockAtom[7]].first);
-    fvec8 blockAtomEpsilon(atomParameters[blockAtom[0]].second, atomParameters[blockAtom[1]].second, atomParameters[blockAtom[2]].second, atomParameters[blockAtom[3]].second, atomParameters[blockAtom[4]].second, atomParameters[blockAtom[5]].second, atomParameters[blockAtom[6]].second, atomParameters[blockAtom[7]].second);
+    fvec8 blockAtomSigma(blockParameters[0].first, blockParameters[1].first, blockParameters[2].first, blockParameters[3].first, blockParameters[4].first, blockParameters[5].first, blockParameters[6].first, blockParameters[7].first);
+    fvec8 blockAtomEpsilon(blockParameters[0].second, blockParameters[1].second, blockParameters[2].second, blockParameters[3].second, blockParameters[4].second, blockParameters[5].second, blockParameters[6].second, blockParameters[7].second);
     const bool needPeriodic = (PERIODIC_TYPE == PeriodicPerInteraction || PERIODIC_TYPE == PeriodicTriclinic);
     const float invSwitchingInterval = 1/(cutoffDistance-switchingDistance);
     
-    // Loop over neighbors for this block.
+    // Loop over the clusters of neighbors for this block.  Each one forms an 8x4 tile of atom pairs with the
+    // block, which is computed as four passes over the block atoms.
     
-    const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
-    const vector<char>& exclusions = neighborList->getBlockExclusions(blockIndex);
-    for (int i = 0; i < (int) neighbors.size(); i++) {
-        // Load the next neighbor.
+    const int ClusterSize = CpuNeighborList::ClusterSize;
+    const int* sortedAtoms = &neighborList->getSortedAtoms()[0];
+    const vector<int>& clusters = neighborList->getBlockClusters(blockIndex);
+    const vector<char>& clusterExclusions = neighborList->getBlockClusterExclusions(blockIndex);
+    for (int cluster = 0; cluster < (int) clusters.size(); cluster++) {
+        // Load the positions and parameters of the cluster's atoms, which are stored next to each other.
         
-        int atom = neighbors[i];
+        const int firstIndex = ClusterSize*clusters[cluster];
+        const char* exclusions = &clusterExclusions[ClusterSize*cluster];
+        fvec4 clusterPos[ClusterSize], clusterForce[ClusterSize];
+        float clusterSigma[ClusterSize], clusterEpsilon[ClusterSize];
+        for (int i = 0; i < ClusterSize; i++) {
+            clusterPos[i] = fvec4(&sortedPosq[4*(firstIndex+i)]);
+            if (PERIODIC_TYPE == PeriodicPerAtom)
+                clusterPos[i] -= floor((clusterPos[i]-blockCenter)*invBoxSize+0.5f)*boxSize;
+            clusterSigma[i] = sortedParameters[firstIndex+i].first;
+            clusterEpsilon[i] = sortedParameters[firstIndex+i].second;
+            clusterForce[i] = 0.0f;
+        }
         
-        // Compute the distances to the block atoms.
+        // Compute the tile.  Slots that are excluded from every block atom include the ones for atoms that
+        // are not neighbors at all.
         
-        fvec8 dx, dy, dz, r2;
-        fvec4 atomPos(posq+4*atom);
-        if (PERIODIC_TYPE == PeriodicPerAtom)
-            atomPos -= floor((atomPos-blockCenter)*invBoxSize+0.5f)*boxSize;
-        getDeltaR<PERIODIC_TYPE>(atomPos, blockAtomX, blockAtomY, blockAtomZ, dx, dy, dz, r2, needPeriodic, boxSize, invBoxSize);
-        ivec8 include;
-        char excl = exclusions[i];
-        if (excl == 0)
-            include = -1;
-        else
-            include = ivec8(excl&1 ? 0 : -1, excl&2 ? 0 : -1, excl&4 ? 0 : -1, excl&8 ? 0 : -1, excl&16 ? 0 : -1, excl&32 ? 0 : -1, excl&64 ? 0 : -1, excl&128 ? 0 : -1);
-        include = include & (r2 < cutoffDistance*cutoffDistance);
-        if (!any(include))
-            continue; // No interactions to compute.
+        for (int i = 0; i < ClusterSize; i++) {
+            if (exclusions[i] == (char) 0xFF)
+                continue;
+            
+            // Compute the distances to the block atoms.
         
-        // Compute the interactions.
+            fvec8 dx, dy, dz, r2;
+            const fvec4& atomPos = clusterPos[i];
+            getDeltaR<PERIODIC_TYPE>(atomPos, blockAtomX, blockAtomY, blockAtomZ, dx, dy, dz, r2, needPeriodic, boxSize, invBoxSize);
+            ivec8 include;
+            char excl = exclusions[i];
+            if (excl == 0)
+                include = -1;
+            else
+                include = ivec8(excl&1 ? 0 : -1, excl&2 ? 0 : -1, excl&4 ? 0 : -1, excl&8 ? 0 : -1, excl&16 ? 0 : -1, excl&32 ? 0 : -1, excl&64 ? 0 : -1, excl&128 ? 0 : -1);
+            include = include & (r2 < cutoffDistance*cutoffDistance);
+            if (!any(include))
+                continue; // No interactions to compute.
+        
+            // Compute the interactions.
         
-        fvec8 inverseR = rsqrt(r2);
-        fvec8 r = r2*inverseR;
-        fvec8 energy, dEdR;
-        float atomEpsilon = atomParameters[atom].second;
-        if (atomEpsilon != 0.0f) {
-            fvec8 sig = blockAtomSigma+atomParameters[atom].first;
-            fvec8 sig2 = inverseR*sig;
-            sig2 *= sig2;
-            fvec8 sig6 = sig2*sig2*sig2;
-            fvec8 epsSig6 = blockAtomEpsilon*atomEpsilon*sig6;
-            dEdR = epsSig6*(12.0f*sig6 - 6.0f);
-            energy = epsSig6*(sig6-1.0f);
-            if (useSwitch) {
-                fvec8 t = (r>switchingDistance) & ((r-switchingDistance)*invSwitchingInterval);
-                fvec8 switchValue = 1+t*t*t*(-10.0f+t*(15.0f-t*6.0f));
-                fvec8 switchDeriv = t*t*(-30.0f+t*(60.0f-t*30.0f))*invSwitchingInterval;
-                dEdR = switchValue*dEdR - energy*switchDeriv*r;
-                energy *= switchValue;
+            fvec8 inverseR = rsqrt(r2);
+            fvec8 r = r2*inverseR;
+            fvec8 energy, dEdR;
+            float atomEpsilon = clusterEpsilon[i];
+            if (atomEpsilon != 0.0f) {
+                fvec8 sig = blockAtomSigma+clusterSigma[i];
+                fvec8 sig2 = inverseR*sig;
+                sig2 *= sig2;
+                fvec8 sig6 = sig2*sig2*sig2;
+                fvec8 epsSig6 = blockAtomEpsilon*atomEpsilon*sig6;
+                dEdR = epsSig6*(12.0f*sig6 - 6.0f);
+                energy = epsSig6*(sig6-1.0f);
+                if (useSwitch) {
+                    fvec8 t = (r>switchingDistance) & ((r-switchingDistance)*invSwitchingInterval);
+                    fvec8 switchValue = 1+t*t*t*(-10.0f+t*(15.0f-t*6.0f));
+                    fvec8 switchDeriv = t*t*(-30.0f+t*(60.0f-t*30.0f))*invSwitchingInterval;
+                    dEdR = switchValue*dEdR - energy*switchDeriv*r;
+                    energy *= switchValue;
+                }
             }
-        }
-        else {
-            energy = 0.0f;
-            dEdR = 0.0f;
-        }
-        fvec8 chargeProd = blockAtomCharge*posq[4*atom+3];
-        dEdR += chargeProd*inverseR*ewaldScaleFunction(r);
-        dEdR *= inverseR*inverseR;
+            else {
+                energy = 0.0f;
+                dEdR = 0.0f;
+            }
+            fvec8 chargeProd = blockAtomCharge*atomPos[3];
+            dEdR += chargeProd*inverseR*ewaldScaleFunction(r);
+            dEdR *= inverseR*inverseR;
 
-        // Accumulate energies.
+            // Accumulate energies.
 
-        fvec8 one(1.0f);
-        if (totalEnergy) {
-            energy += chargeProd*inverseR*erfcApprox(alphaEwald*r);
-            energy = blend(0.0f, energy, include);
-            *totalEnergy += dot8(energy, one);
-        }
+            fvec8 one(1.0f);
+            if (totalEnergy) {
+                energy += chargeProd*inverseR*erfcApprox(alphaEwald*r);
+                energy = blend(0.0f, energy, include);
+                *totalEnergy += dot8(energy, one);
+            }
+
+            // Accumulate forces.
 
-        // Accumulate forces.
-
-        dEdR = blend(0.0f, dEdR, include);
-        fvec8 fx = dx*dEdR;
-        fvec8 fy = dy*dEdR;
-        fvec8 fz = dz*dEdR;
-        blockAtomForceX += fx;
-        blockAtomForceY += fy;
-        blockAtomForceZ += fz;
-        float* atomForce = forces+4*atom;
-        atomForce[0] -= dot8(fx, one);
-        atomForce[1] -= dot8(fy, one);
-        atomForce[2] -= dot8(fz, one);
+            dEdR = blend(0.0f, dEdR, include);
+            fvec8 fx = dx*dEdR;
+            fvec8 fy = dy*dEdR;
+            fvec8 fz = dz*dEdR;
+            blockAtomForceX += fx;
+            blockAtomForceY += fy;
+            blockAtomForceZ += fz;
+            if (virial) {
+                virXX += dx*fx;
+                virYY += dy*fy;
+                virZZ += dz*fz;
+                virXY += dx*fy;
+                virXZ += dx*fz;
+                virYZ += dy*fz;
+            }
+            clusterForce[i] += fvec4(dot8(fx, one), dot8(fy, one), dot8(fz, one), 0.0f);
+        }
+        
+        // Record the forces on the cluster's atoms.
+        
+        for (int i = 0; i < ClusterSize; i++)
+            if (exclusions[i] != (char) 0xFF) {
+                float* atomForce = forces+4*sortedAtoms[firstIndex+i];
+                (fvec4(atomForce)-clusterForce[i]).store(atomForce);
+            }
     }
     
-    // Record the forces on the block atoms.
+    // Record the virial.
+
+    if (virial) {
+        fvec8 one(1.0f);
+        virial[0] += dot8(virXX, one);
+        virial[1] += dot8(virYY, one);
+        virial[2] += dot8(virZZ, one);
+        virial[3] += dot8(virXY, one);
+        virial[4] += dot8(virXZ, one);
+        virial[5] += dot8(virYZ, one);
+    }
     
     fvec4 f[8];
     transpose(blockAtomForceX, blockAtomForceY, blockAtomForceZ, 0.0f, f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7]);
@@ -32,16 +32,158 @@
 #include "CpuPlatform.h"
 #include "CpuKernelFactory.h"
 #include "CpuKernels.h"
+#include "CpuCCMA.h"
 #include "CpuSETTLE.h"
 #include "ReferenceConstraints.h"
+#include "openmm/NonbondedForce.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/internal/hardware.h"
 #include "openmm/internal/vectorize.h"
+#include <algorithm>
 #include <sstream>
 #include <stdlib.h>
 
 using namespace OpenMM;
 using namespace std;
 
+/**
+ * The number of times a thread polls before blocking when CpuSpinWait is enabled.  This is long enough
+ * to cover the gap between consecutive tasks within a step, but short enough that idle threads soon
+ * stop using CPU time.
+ */
+static const int SPIN_COUNT = 20000;
+
+/**
+ * Parse a list of cores such as "0-15,32-47".  If there are more threads than cores in the list, the
+ * list is repeated, so several threads may be pinned to the same core.
+ */
+static vector<int> parseCoreList(const string& list) {
+    vector<int> cores;
+    stringstream stream(list);
+    string item;
+    while (getline(stream, item, ',')) {
+        int first, last;
+        char dash, extra;
+        stringstream itemStream(item);
+        if (!(itemStream >> first))
+            throw OpenMMException("Illegal value for CpuAffinity: "+list);
+        last = first;
+        if (itemStream >> dash && (dash != '-' || !(itemStream >> last)))
+            throw OpenMMException("Illegal value for CpuAffinity: "+list);
+        if (itemStream >> extra || first < 0 || last < first)
+            throw OpenMMException("Illegal value for CpuAffinity: "+list);
+        for (int i = first; i <= last; i++)
+            cores.push_back(i);
+    }
+    return cores;
+}
+
+/**
+ * A thread pool shared between Contexts, the number of Contexts using it, and the value of CpuAffinity
+ * it was created with.
+ */
+struct SharedThreadPool {
+    ThreadPool* pool;
+    int numContexts;
+    string affinity;
+};
+
+/**
+ * The thread pools shared between Contexts, indexed by the number of threads.
+ */
+static map<int, SharedThreadPool> sharedThreadPools;
+static pthread_mutex_t sharedThreadPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get the shared thread pool with a specified number of threads, creating it if necessary.  The
+ * spin count and affinity are only applied when a new pool is created.
+ */
+static ThreadPool& acquireSharedThreadPool(int numThreads, bool spinWait, const string& affinity) {
+    pthread_mutex_lock(&sharedThreadPoolLock);
+    map<int, SharedThreadPool>::iterator entry = sharedThreadPools.find(numThreads);
+    if (entry == sharedThreadPools.end()) {
+        ThreadPool* pool = new ThreadPool(numThreads);
+        vector<int> cores = parseCoreList(affinity);
+        if (cores.size() > 0 && !pool->setAffinity(cores)) {
+            delete pool;
+            pthread_mutex_unlock(&sharedThreadPoolLock);
+            throw OpenMMException("Failed to set the CPU affinity of the threads");
+        }
+        if (spinWait)
+            pool->setSpinCount(SPIN_COUNT);
+        SharedThreadPool shared;
+        shared.pool = pool;
+        shared.numContexts = 0;
+        shared.affinity = affinity;
+        entry = sharedThreadPools.insert(make_pair(numThreads, shared)).first;
+    }
+    entry->second.numContexts++;
+    ThreadPool& pool = *entry->second.pool;
+    pthread_mutex_unlock(&sharedThreadPoolLock);
+    return pool;
+}
+
+/**
+ * Release a shared thread pool, deleting it once no Context uses it.
+ */
+static void releaseSharedThreadPool(ThreadPool& pool) {
+    pthread_mutex_lock(&sharedThreadPoolLock);
+    map<int, SharedThreadPool>::iterator entry = sharedThreadPools.find(pool.getNumThreads());
+    if (--entry->second.numContexts == 0) {
+        delete entry->second.pool;
+        sharedThreadPools.erase(entry);
+    }
+    pthread_mutex_unlock(&sharedThreadPoolLock);
+}
+
+/**
+ * Get the value of CpuAffinity a shared thread pool was created with.
+ */
+static string getSharedThreadPoolAffinity(ThreadPool& pool) {
+    pthread_mutex_lock(&sharedThreadPoolLock);
+    string affinity = sharedThreadPools[pool.getNumThreads()].affinity;
+    pthread_mutex_unlock(&sharedThreadPoolLock);
+    return affinity;
+}
+
+/**
+ * Create a thread pool owned by a single Context.
+ */
+static ThreadPool& createThreadPool(int numThreads, bool spinWait, const vector<int>& affinity) {
+    ThreadPool* pool = new ThreadPool(numThreads);
+    if (affinity.size() > 0 && !pool->setAffinity(affinity)) {
+        delete pool;
+        throw OpenMMException("Failed to set the CPU affinity of the threads");
+    }
+    if (spinWait)
+        pool->setSpinCount(SPIN_COUNT);
+    return *pool;
+}
+
+/**
+ * This task allocates and clears the per-thread force buffers and each thread's share of the position
+ * array.  Doing this on the worker threads means the operating system places the memory on the NUMA
+ * node of the thread that will use it.
+ */
+class FirstTouchTask : public ThreadPool::Task {
+public:
+    FirstTouchTask(CpuPlatform::PlatformData& data, int numParticles) : data(data), numParticles(numParticles) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        AlignedArray<float>& force = data.threadForce[threadIndex];
+        force.resize(4*numParticles);
+        for (int i = 0; i < 4*numParticles; i++)
+            force[i] = 0.0f;
+        int numThreads = threads.getNumThreads();
+        int start = threadIndex*numParticles/numThreads;
+        int end = (threadIndex+1)*numParticles/numThreads;
+        for (int i = 4*start; i < 4*end; i++)
+            data.posq[i] = 0.0f;
+    }
+    CpuPlatform::PlatformData& data;
+    int numParticles;
+};
+
 #ifdef OPENMM_CPU_BUILDING_STATIC_LIBRARY
 extern "C" void registerCpuPlatform() {
     if (CpuPlatform::isProcessorSupported())
@@ -61,14 +203,24 @@ map<const ContextImpl*, CpuPlatform::PlatformData*> CpuPlatform::contextData;
 CpuPlatform::CpuPlatform() {
     CpuKernelFactory* factory = new CpuKernelFactory();
     registerKernelFactory(CalcForcesAndEnergyKernel::Name(), factory);
+    registerKernelFactory(VirtualSitesKernel::Name(), factory);
+    registerKernelFactory(CalcHarmonicBondForceKernel::Name(), factory);
+    registerKernelFactory(CalcHarmonicAngleForceKernel::Name(), factory);
     registerKernelFactory(CalcPeriodicTorsionForceKernel::Name(), factory);
     registerKernelFactory(CalcRBTorsionForceKernel::Name(), factory);
+    registerKernelFactory(CalcCMAPTorsionForceKernel::Name(), factory);
+    registerKernelFactory(CalcCustomBondForceKernel::Name(), factory);
+    registerKernelFactory(CalcCustomAngleForceKernel::Name(), factory);
+    registerKernelFactory(CalcCustomTorsionForceKernel::Name(), factory);
     registerKernelFactory(CalcNonbondedForceKernel::Name(), factory);
     registerKernelFactory(CalcCustomNonbondedForceKernel::Name(), factory);
+    registerKernelFactory(CalcCustomHbondForceKernel::Name(), factory);
     registerKernelFactory(CalcCustomManyParticleForceKernel::Name(), factory);
     registerKernelFactory(CalcGBSAOBCForceKernel::Name(), factory);
     registerKernelFactory(CalcCustomGBForceKernel::Name(), factory);
+    registerKernelFactory(IntegrateVerletStepKernel::Name(), factory);
     registerKernelFactory(IntegrateLangevinStepKernel::Name(), factory);
+    registerKernelFactory(IntegrateBrownianStepKernel::Name(), factory);
     platformProperties.push_back(CpuThreads());
     int threads = getNumProcessors();
     char* threadsEnv = getenv("OPENMM_CPU_THREADS");
@@ -77,6 +229,27 @@ CpuPlatform::CpuPlatform() {
     stringstream defaultThreads;
     defaultThreads << threads;
     setPropertyDefaultValue(CpuThreads(), defaultThreads.str());
+    platformProperties.push_back(CpuPmeThreads());
+    char* pmeThreadsEnv = getenv("OPENMM_CPU_PME_THREADS");
+    setPropertyDefaultValue(CpuPmeThreads(), pmeThreadsEnv == NULL ? "0" : pmeThreadsEnv);
+    platformProperties.push_back(CpuPmeOrder());
+    setPropertyDefaultValue(CpuPmeOrder(), "5");
+    platformProperties.push_back(CpuPmeTuning());
+    setPropertyDefaultValue(CpuPmeTuning(), "false");
+    platformProperties.push_back(CpuPmeParameters());
+    setPropertyDefaultValue(CpuPmeParameters(), "");
+    platformProperties.push_back(CpuSpinWait());
+    setPropertyDefaultValue(CpuSpinWait(), "false");
+    platformProperties.push_back(CpuAffinity());
+    setPropertyDefaultValue(CpuAffinity(), "");
+    platformProperties.push_back(CpuNumaPolicy());
+    setPropertyDefaultValue(CpuNumaPolicy(), "default");
+    platformProperties.push_back(CpuSharedThreads());
+    setPropertyDefaultValue(CpuSharedThreads(), "false");
+    platformProperties.push_back(CpuAdaptivePadding());
+    setPropertyDefaultValue(CpuAdaptivePadding(), "false");
+    platformProperties.push_back(CpuTargetRebuildInterval());
+    setPropertyDefaultValue(CpuTargetRebuildInterval(), "0");
 }
 
 const string& CpuPlatform::getPropertyValue(const Context& context, const string& property) const {
@@ -101,19 +274,112 @@ bool CpuPlatform::isProcessorSupported() {
 }
 
 void CpuPlatform::contextCreated(ContextImpl& context, const map<string, string>& properties) const {
+    const string& pmeOrderPropValue = (properties.find(CpuPmeOrder()) == properties.end() ?
+            getPropertyDefaultValue(CpuPmeOrder()) : properties.find(CpuPmeOrder())->second);
+    int pmeOrder = 0;
+    stringstream(pmeOrderPropValue) >> pmeOrder;
+    if (pmeOrder < 4 || pmeOrder > 8)
+        throw OpenMMException("Illegal value for CpuPmeOrder: "+pmeOrderPropValue);
+    const string& pmeTuningPropValue = (properties.find(CpuPmeTuning()) == properties.end() ?
+            getPropertyDefaultValue(CpuPmeTuning()) : properties.find(CpuPmeTuning())->second);
+    bool tunePme;
+    if (pmeTuningPropValue == "true")
+        tunePme = true;
+    else if (pmeTuningPropValue == "false")
+        tunePme = false;
+    else
+        throw OpenMMException("Illegal value for CpuPmeTuning: "+pmeTuningPropValue);
+    const string& spinWaitPropValue = (properties.find(CpuSpinWait()) == properties.end() ?
+            getPropertyDefaultValue(CpuSpinWait()) : properties.find(CpuSpinWait())->second);
+    bool spinWait;
+    if (spinWaitPropValue == "true")
+        spinWait = true;
+    else if (spinWaitPropValue == "false")
+        spinWait = false;
+    else
+        throw OpenMMException("Illegal value for CpuSpinWait: "+spinWaitPropValue);
+    const string& affinityPropValue = (properties.find(CpuAffinity()) == properties.end() ?
+            getPropertyDefaultValue(CpuAffinity()) : properties.find(CpuAffinity())->second);
+    parseCoreList(affinityPropValue);
+    const string& numaPolicyPropValue = (properties.find(CpuNumaPolicy()) == properties.end() ?
+            getPropertyDefaultValue(CpuNumaPolicy()) : properties.find(CpuNumaPolicy())->second);
+    bool numaLocal;
+    if (numaPolicyPropValue == "local")
+        numaLocal = true;
+    else if (numaPolicyPropValue == "default")
+        numaLocal = false;
+    else
+        throw OpenMMException("Illegal value for CpuNumaPolicy: "+numaPolicyPropValue);
+    const string& sharedThreadsPropValue = (properties.find(CpuSharedThreads()) == properties.end() ?
+            getPropertyDefaultValue(CpuSharedThreads()) : properties.find(CpuSharedThreads())->second);
+    bool sharedThreads;
+    if (sharedThreadsPropValue == "true")
+        sharedThreads = true;
+    else if (sharedThreadsPropValue == "false")
+        sharedThreads = false;
+    else
+        throw OpenMMException("Illegal value for CpuSharedThreads: "+sharedThreadsPropValue);
+    const string& adaptivePaddingPropValue = (properties.find(CpuAdaptivePadding()) == properties.end() ?
+            getPropertyDefaultValue(CpuAdaptivePadding()) : properties.find(CpuAdaptivePadding())->second);
+    bool adaptivePadding;
+    if (adaptivePaddingPropValue == "true")
+        adaptivePadding = true;
+    else if (adaptivePaddingPropValue == "false")
+        adaptivePadding = false;
+    else
+        throw OpenMMException("Illegal value for CpuAdaptivePadding: "+adaptivePaddingPropValue);
+    const string& targetIntervalPropValue = (properties.find(CpuTargetRebuildInterval()) == properties.end() ?
+            getPropertyDefaultValue(CpuTargetRebuildInterval()) : properties.find(CpuTargetRebuildInterval())->second);
+    int targetRebuildInterval = -1;
+    char extra;
+    stringstream targetIntervalStream(targetIntervalPropValue);
+    if (!(targetIntervalStream >> targetRebuildInterval) || targetIntervalStream >> extra || targetRebuildInterval < 0)
+        throw OpenMMException("Illegal value for CpuTargetRebuildInterval: "+targetIntervalPropValue);
     ReferencePlatform::contextCreated(context, properties);
     const string& threadsPropValue = (properties.find(CpuThreads()) == properties.end() ?
             getPropertyDefaultValue(CpuThreads()) : properties.find(CpuThreads())->second);
     int numThreads;
     stringstream(threadsPropValue) >> numThreads;
-    PlatformData* data = new PlatformData(context.getSystem().getNumParticles(), numThreads);
+    const string& pmeThreadsPropValue = (properties.find(CpuPmeThreads()) == properties.end() ?
+            getPropertyDefaultValue(CpuPmeThreads()) : properties.find(CpuPmeThreads())->second);
+    int numPmeThreads = 0;
+    stringstream(pmeThreadsPropValue) >> numPmeThreads;
+    if (numThreads <= 0)
+        numThreads = getNumProcessors();
+    numPmeThreads = max(0, min(numPmeThreads, numThreads-1));
+    
+    // Only set threads aside for PME if the System actually uses it.
+    
+    bool usesPme = false;
+    for (int i = 0; i < context.getSystem().getNumForces(); i++) {
+        const NonbondedForce* nonbonded = dynamic_cast<const NonbondedForce*>(&context.getSystem().getForce(i));
+        if (nonbonded != NULL && nonbonded->getNonbondedMethod() == NonbondedForce::PME)
+            usesPme = true;
+    }
+    if (!usesPme || sharedThreads)
+        numPmeThreads = 0;
+    PlatformData* data;
+    try {
+        data = new PlatformData(context.getSystem().getNumParticles(), numThreads, numPmeThreads, pmeOrder, tunePme, spinWait, affinityPropValue, numaLocal, sharedThreads,
+                adaptivePadding, targetRebuildInterval);
+    }
+    catch (...) {
+        ReferencePlatform::contextDestroyed(context);
+        throw;
+    }
     contextData[&context] = data;
+    data->vsites.initialize(context.getSystem(), data->threads);
     ReferenceConstraints& constraints = *(ReferenceConstraints*) reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData())->constraints;
     if (constraints.settle != NULL) {
         CpuSETTLE* parallelSettle = new CpuSETTLE(context.getSystem(), *(ReferenceSETTLEAlgorithm*) constraints.settle, data->threads);
         delete constraints.settle;
         constraints.settle = parallelSettle;
     }
+    if (constraints.ccma != NULL) {
+        CpuCCMA* parallelCCMA = new CpuCCMA(context.getSystem(), *(ReferenceCCMAAlgorithm*) constraints.ccma, data->threads);
+        delete constraints.ccma;
+        constraints.ccma = parallelCCMA;
+    }
 }
 
 void CpuPlatform::contextDestroyed(ContextImpl& context) const {
@@ -130,13 +396,94 @@ const CpuPlatform::PlatformData& CpuPlatform::getPlatformData(const ContextImpl&
     return *contextData[&context];
 }
 
-CpuPlatform::PlatformData::PlatformData(int numParticles, int numThreads) : posq(4*numParticles), threads(numThreads) {
+CpuPlatform::PlatformData::PlatformData(int numParticles, int numThreads, int numPmeThreads, int pmeOrder, bool tunePme, bool spinWait,
+            const string& affinity, bool numaLocal, bool sharedThreads, bool adaptivePadding, int targetRebuildInterval) : posq(4*numParticles),
+            threads(sharedThreads ? acquireSharedThreadPool(numThreads, spinWait, affinity) : createThreadPool(numThreads-numPmeThreads, spinWait, parseCoreList(affinity))),
+            pmeThreads(NULL), pmeOrder(pmeOrder), computation(0), targetRebuildInterval(targetRebuildInterval), tunePme(tunePme),
+            sharedThreads(sharedThreads), adaptivePadding(adaptivePadding) {
+    // The PME threads get the cores following the ones used by the main threads.
+
+    if (numPmeThreads > 0) {
+        vector<int> cores = parseCoreList(affinity), pmeAffinity;
+        for (int i = 0; i < numPmeThreads && cores.size() > 0; i++)
+            pmeAffinity.push_back(cores[(threads.getNumThreads()+i)%cores.size()]);
+        try {
+            pmeThreads = &createThreadPool(numPmeThreads, spinWait, pmeAffinity);
+        }
+        catch (...) {
+            delete &threads;
+            throw;
+        }
+    }
     numThreads = threads.getNumThreads();
     threadForce.resize(numThreads);
-    for (int i = 0; i < numThreads; i++)
-        threadForce[i].resize(4*numParticles);
+    if (numaLocal) {
+        FirstTouchTask task(*this, numParticles);
+        threads.execute(task);
+        threads.waitForThreads();
+    }
+    else {
+        for (int i = 0; i < numThreads; i++)
+            threadForce[i].resize(4*numParticles);
+    }
     isPeriodic = false;
+    includeVirial = false;
     stringstream threadsProperty;
-    threadsProperty << numThreads;
+    threadsProperty << numThreads+numPmeThreads;
     propertyValues[CpuThreads()] = threadsProperty.str();
+    stringstream pmeThreadsProperty;
+    pmeThreadsProperty << numPmeThreads;
+    propertyValues[CpuPmeThreads()] = pmeThreadsProperty.str();
+    stringstream pmeOrderProperty;
+    pmeOrderProperty << pmeOrder;
+    propertyValues[CpuPmeOrder()] = pmeOrderProperty.str();
+    propertyValues[CpuPmeTuning()] = (tunePme ? "true" : "false");
+    propertyValues[CpuPmeParameters()] = "";
+    
+    // A shared thread pool may have been created by another Context with different settings, so report
+    // the ones it actually uses.
+    
+    propertyValues[CpuSpinWait()] = (threads.getSpinCount() > 0 ? "true" : "false");
+    propertyValues[CpuAffinity()] = (sharedThreads ? getSharedThreadPoolAffinity(threads) : affinity);
+    propertyValues[CpuNumaPolicy()] = (numaLocal ? "local" : "default");
+    propertyValues[CpuSharedThreads()] = (sharedThreads ? "true" : "false");
+    propertyValues[CpuAdaptivePadding()] = (adaptivePadding ? "true" : "false");
+    stringstream targetIntervalProperty;
+    targetIntervalProperty << targetRebuildInterval;
+    propertyValues[CpuTargetRebuildInterval()] = targetIntervalProperty.str();
+}
+
+CpuPlatform::PlatformData::~PlatformData() {
+    if (sharedThreads)
+        releaseSharedThreadPool(threads);
+    else
+        delete &threads;
+    if (pmeThreads != NULL)
+        delete pmeThreads;
+    for (int i = 0; i < (int) neighborLists.size(); i++)
+        delete neighborLists[i].first;
+}
+
+CpuSharedNeighborList* CpuPlatform::PlatformData::requestNeighborList(int blockSize, double cutoff, double padding, bool periodic, const vector<set<int> >& exclusions) {
+    for (int i = 0; i < (int) neighborLists.size(); i++)
+        if (neighborLists[i].first->isCompatible(blockSize, cutoff, padding, periodic, exclusions)) {
+            neighborLists[i].second++;
+            return neighborLists[i].first;
+        }
+    CpuSharedNeighborList* neighborList = new CpuSharedNeighborList(blockSize, cutoff, padding, periodic, exclusions);
+    if (adaptivePadding)
+        neighborList->setAdaptivePadding(targetRebuildInterval);
+    neighborLists.push_back(make_pair(neighborList, 1));
+    return neighborList;
+}
+
+void CpuPlatform::PlatformData::releaseNeighborList(CpuSharedNeighborList* neighborList) {
+    for (int i = 0; i < (int) neighborLists.size(); i++)
+        if (neighborLists[i].first == neighborList) {
+            if (--neighborLists[i].second == 0) {
+                delete neighborList;
+                neighborLists.erase(neighborLists.begin()+i);
+            }
+            return;
+        }
 }
@@ -0,0 +1,381 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2016 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuSharedNeighborList.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace OpenMM;
+using namespace std;
+
+#ifdef _MSC_VER
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <Windows.h>
+    static long long getTime() {
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft); // 100-nanoseconds since 1-1-1601
+        ULARGE_INTEGER result;
+        result.LowPart = ft.dwLowDateTime;
+        result.HighPart = ft.dwHighDateTime;
+        return result.QuadPart/10;
+    }
+#else
+    #include <sys/time.h> 
+    static long long getTime() {
+        struct timeval tod;
+        gettimeofday(&tod, 0);
+        return 1000000*tod.tv_sec+tod.tv_usec;
+    }
+#endif
+
+/**
+ * Apply periodic boundary conditions to the displacement between two positions.
+ */
+static RealVec getPeriodicDelta(RealVec delta, const RealVec* boxVectors) {
+    delta -= boxVectors[2]*floor(delta[2]/boxVectors[2][2]+0.5);
+    delta -= boxVectors[1]*floor(delta[1]/boxVectors[1][1]+0.5);
+    delta -= boxVectors[0]*floor(delta[0]/boxVectors[0][0]+0.5);
+    return delta;
+}
+
+class CpuSharedNeighborList::CheckTask : public ThreadPool::Task {
+public:
+    CheckTask(CpuSharedNeighborList& owner) : owner(owner) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        owner.threadCheckDisplacements(threadIndex, threads.getNumThreads());
+    }
+    CpuSharedNeighborList& owner;
+};
+
+class CpuSharedNeighborList::SavePositionsTask : public ThreadPool::RangeTask {
+public:
+    SavePositionsTask(CpuSharedNeighborList& owner) : owner(owner) {
+    }
+    void execute(ThreadPool& threads, int threadIndex, int start, int end) {
+        owner.savePositions(start, end);
+    }
+    CpuSharedNeighborList& owner;
+};
+
+CpuSharedNeighborList::CpuSharedNeighborList(int blockSize, double cutoff, double padding, bool periodic, const vector<set<int> >& exclusions) :
+        neighborList(blockSize), blockSize(blockSize), lastComputation(-1), cutoff(cutoff), padding(padding), initialPadding(padding), periodic(periodic),
+        exclusions(exclusions), numChecks(0), numRebuilds(0), adaptive(false), targetInterval(0), checksAtLastRebuild(0), lastBuildTime(0),
+        intervalInteractionTime(0) {
+}
+
+bool CpuSharedNeighborList::isCompatible(int blockSize, double cutoff, double padding, bool periodic, const vector<set<int> >& exclusions) const {
+    return (blockSize == this->blockSize && cutoff == this->cutoff && padding == initialPadding && periodic == this->periodic && exclusions == this->exclusions);
+}
+
+void CpuSharedNeighborList::update(int computation, const AlignedArray<float>& posq, const vector<RealVec>& positions, const RealVec* boxVectors, ThreadPool& threads) {
+    if (computation == lastComputation && lastPositions.size() > 0)
+        return;
+    lastComputation = computation;
+    numChecks++;
+    if (!needsRebuild(positions, boxVectors, threads))
+        return;
+    tunePadding(boxVectors);
+    numRebuilds++;
+    checksAtLastRebuild = numChecks;
+    intervalInteractionTime = 0;
+    long long startTime = getTime();
+    int numParticles = positions.size();
+    neighborList.computeNeighborList(numParticles, posq, exclusions, boxVectors, periodic, cutoff+padding, threads);
+    this->positions = &positions[0];
+    lastPositions.resize(numParticles);
+    SavePositionsTask task(*this);
+    threads.parallelFor(task, 0, numParticles, max(1024, numParticles/threads.getNumThreads()));
+    for (int i = 0; i < 3; i++)
+        lastBoxVectors[i] = boxVectors[i];
+    lastBuildTime = getTime()-startTime;
+}
+
+void CpuSharedNeighborList::invalidate() {
+    lastPositions.clear();
+}
+
+void CpuSharedNeighborList::requestClusters() {
+    if (!neighborList.getUseClusters()) {
+        neighborList.setUseClusters(true);
+        invalidate();
+    }
+}
+
+void CpuSharedNeighborList::setAdaptivePadding(int targetInterval) {
+    adaptive = true;
+    this->targetInterval = targetInterval;
+}
+
+void CpuSharedNeighborList::recordInteractionTime(long long time) {
+    intervalInteractionTime += time;
+}
+
+void CpuSharedNeighborList::tunePadding(const RealVec* boxVectors) {
+    // Only tune based on a list that was actually used until it became invalid.
+
+    if (!adaptive || lastPositions.size() == 0)
+        return;
+    double interval = (double) (numChecks-checksAtLastRebuild);
+    if (interval <= 0)
+        return;
+
+    // Keep the padded cutoff within half the periodic box, unless the initial padding was already larger.
+
+    double minPadding = 0.05*cutoff;
+    double maxPadding = 0.5*cutoff;
+    if (periodic) {
+        double halfWidth = 0.5*min(boxVectors[0][0], min(boxVectors[1][1], boxVectors[2][2]));
+        maxPadding = max(min(maxPadding, halfWidth-cutoff), initialPadding);
+        minPadding = min(minPadding, maxPadding);
+    }
+    double optimalPadding;
+    if (targetInterval > 0) {
+        // Over the life of a list, particles move roughly in straight lines, so the number of force evaluations
+        // until one of them has moved too far is roughly proportional to the padding.
+
+        optimalPadding = padding*targetInterval/interval;
+    }
+    else {
+        // Estimate the time per force evaluation as a function of the padding.  The build time is spread over
+        // an interval proportional to the padding, and the interaction time is treated as proportional to the
+        // number of pairs in the list.  Only part of it really is, so this errs on the side of a small padding.
+
+        if (intervalInteractionTime == 0)
+            return;
+        double buildTime = lastBuildTime/interval;
+        double interactionTime = intervalInteractionTime/interval;
+        double bestTime = 0;
+        optimalPadding = padding;
+        const int numTrials = 50;
+        for (int i = 0; i <= numTrials; i++) {
+            double trialPadding = minPadding+(maxPadding-minPadding)*i/numTrials;
+            double volumeRatio = pow((cutoff+trialPadding)/(cutoff+padding), 3.0);
+            double time = buildTime*padding/trialPadding + interactionTime*volumeRatio;
+            if (i == 0 || time < bestTime) {
+                bestTime = time;
+                optimalPadding = trialPadding;
+            }
+        }
+    }
+
+    // The statistics from a single interval are noisy, so only move part of the way toward the estimate.
+
+    optimalPadding = max(minPadding, min(maxPadding, optimalPadding));
+    padding = sqrt(padding*optimalPadding);
+}
+
+void CpuSharedNeighborList::savePositions(int start, int end) {
+    for (int i = start; i < end; i++)
+        lastPositions[i] = positions[i];
+}
+
+bool CpuSharedNeighborList::needsRebuild(const vector<RealVec>& positions, const RealVec* boxVectors, ThreadPool& threads) {
+    if (lastPositions.size() == 0)
+        return true;
+
+    // If the periodic box has been scaled uniformly since the list was built (as MonteCarloBarostat does),
+    // compare positions in scaled coordinates.  Compressing the box brings pairs closer together, which
+    // uses up part of the padding.
+
+    scale = 1.0;
+    if (periodic) {
+        scale = boxVectors[0][0]/lastBoxVectors[0][0];
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                if (fabs(boxVectors[i][j]-scale*lastBoxVectors[i][j]) > 1e-6*boxVectors[i][i])
+                    return true;
+    }
+    double scaledPadding = min(padding, scale*(cutoff+padding)-cutoff);
+    if (scaledPadding <= 0)
+        return true;
+
+    // Have the threads find the particles that have moved more than half the padding distance.
+
+    closeCutoff2 = 0.25*scaledPadding*scaledPadding;
+    farCutoff2 = 0.5*scaledPadding*scaledPadding;
+    maxNumMoved = positions.size()/10;
+    this->positions = &positions[0];
+    for (int i = 0; i < 3; i++)
+        this->boxVectors[i] = boxVectors[i];
+    int numThreads = threads.getNumThreads();
+    threadMoved.resize(numThreads);
+    threadTooFar.resize(numThreads);
+    CheckTask task(*this);
+    threads.execute(task);
+    threads.waitForThreads();
+    moved.clear();
+    for (int i = 0; i < numThreads; i++) {
+        if (threadTooFar[i])
+            return true;
+        moved.insert(moved.end(), threadMoved[i].begin(), threadMoved[i].end());
+    }
+    if (moved.size() > maxNumMoved)
+        return true;
+
+    // Some particles may have moved further than half the padding distance.  Look for pairs
+    // that are missing from the neighbor list.
+
+    return findMissingPair(boxVectors);
+}
+
+void CpuSharedNeighborList::threadCheckDisplacements(int threadIndex, int numThreads) {
+    int numParticles = lastPositions.size();
+    int start = (int) ((threadIndex*(long long) numParticles)/numThreads);
+    int end = (int) (((threadIndex+1)*(long long) numParticles)/numThreads);
+    vector<int>& moved = threadMoved[threadIndex];
+    moved.clear();
+    threadTooFar[threadIndex] = false;
+    for (int i = start; i < end; i++) {
+        RealVec delta = positions[i]-lastPositions[i]*scale;
+        if (periodic)
+            delta = getPeriodicDelta(delta, boxVectors);
+        double dist2 = delta.dot(delta);
+        if (dist2 > closeCutoff2) {
+            moved.push_back(i);
+            if (dist2 > farCutoff2 || moved.size() > maxNumMoved) {
+                threadTooFar[threadIndex] = true;
+                return;
+            }
+        }
+    }
+}
+
+bool CpuSharedNeighborList::findMissingPair(const RealVec* boxVectors) {
+    int numMoved = moved.size();
+    if (numMoved < 2)
+        return false;
+
+    // Sort the moved particles into cells in fractional coordinates.  A displacement r shorter than the cutoff
+    // changes fractional coordinate k by at most cutoff*|row k of the inverse box matrix|, so making each cell
+    // at least that wide means every pair within the cutoff is in the same or adjacent cells.  Without periodic
+    // boundary conditions, the bounding box of the moved particles takes the place of the periodic box.
+
+    RealVec origin, invBox[3];
+    if (periodic) {
+        double ax = boxVectors[0][0], bx = boxVectors[1][0], by = boxVectors[1][1];
+        double cx = boxVectors[2][0], cy = boxVectors[2][1], cz = boxVectors[2][2];
+        invBox[0] = RealVec(1/ax, -bx/(ax*by), (bx*cy-by*cx)/(ax*by*cz));
+        invBox[1] = RealVec(0, 1/by, -cy/(by*cz));
+        invBox[2] = RealVec(0, 0, 1/cz);
+    }
+    else {
+        RealVec minPos = positions[moved[0]], maxPos = minPos;
+        for (int i = 1; i < numMoved; i++)
+            for (int k = 0; k < 3; k++) {
+                minPos[k] = min(minPos[k], positions[moved[i]][k]);
+                maxPos[k] = max(maxPos[k], positions[moved[i]][k]);
+            }
+        origin = minPos;
+        for (int k = 0; k < 3; k++) {
+            invBox[k] = RealVec();
+            invBox[k][k] = 1/max(maxPos[k]-minPos[k]+cutoff, cutoff);
+        }
+    }
+    const int maxCellsPerAxis = 64;
+    int numCells[3];
+    for (int k = 0; k < 3; k++) {
+        double width = cutoff*sqrt(invBox[k].dot(invBox[k]));
+        numCells[k] = max(1, min(maxCellsPerAxis, (int) floor(1/width)));
+    }
+    int totalCells = numCells[0]*numCells[1]*numCells[2];
+    movedCell.resize(3*numMoved);
+    cellStart.resize(totalCells+1);
+    cellMoved.resize(numMoved);
+    for (int i = 0; i <= totalCells; i++)
+        cellStart[i] = 0;
+    for (int i = 0; i < numMoved; i++) {
+        RealVec pos = positions[moved[i]]-origin;
+        for (int k = 0; k < 3; k++) {
+            double frac = invBox[k].dot(pos);
+            frac -= floor(frac);
+            movedCell[3*i+k] = min(numCells[k]-1, (int) (frac*numCells[k]));
+        }
+        cellStart[movedCell[3*i]+numCells[0]*(movedCell[3*i+1]+numCells[1]*movedCell[3*i+2])+1]++;
+    }
+    for (int i = 0; i < totalCells; i++)
+        cellStart[i+1] += cellStart[i];
+    for (int i = 0; i < numMoved; i++) {
+        int cell = movedCell[3*i]+numCells[0]*(movedCell[3*i+1]+numCells[1]*movedCell[3*i+2]);
+        cellMoved[cellStart[cell]++] = i;
+    }
+    for (int i = totalCells; i > 0; i--)
+        cellStart[i] = cellStart[i-1];
+    cellStart[0] = 0;
+
+    // Check each pair of moved particles in neighboring cells.  When an axis has fewer than three cells,
+    // the neighboring cells along it are all of them.
+
+    double cutoff2 = cutoff*cutoff;
+    double paddedCutoff2 = (cutoff+padding)*(cutoff+padding);
+    for (int i = 0; i < numMoved; i++) {
+        int first[3], last[3];
+        for (int k = 0; k < 3; k++) {
+            if (numCells[k] < 3) {
+                first[k] = 0;
+                last[k] = numCells[k]-1;
+            }
+            else if (periodic) {
+                first[k] = movedCell[3*i+k]-1;
+                last[k] = movedCell[3*i+k]+1;
+            }
+            else {
+                first[k] = max(0, movedCell[3*i+k]-1);
+                last[k] = min(numCells[k]-1, movedCell[3*i+k]+1);
+            }
+        }
+        for (int z = first[2]; z <= last[2]; z++)
+            for (int y = first[1]; y <= last[1]; y++)
+                for (int x = first[0]; x <= last[0]; x++) {
+                    int cell = (x+numCells[0])%numCells[0] + numCells[0]*((y+numCells[1])%numCells[1] + numCells[1]*((z+numCells[2])%numCells[2]));
+                    for (int index = cellStart[cell]; index < cellStart[cell+1]; index++) {
+                        int j = cellMoved[index];
+                        if (j >= i)
+                            continue;
+                        RealVec delta = positions[moved[i]]-positions[moved[j]];
+                        if (periodic)
+                            delta = getPeriodicDelta(delta, boxVectors);
+                        if (delta.dot(delta) < cutoff2) {
+                            // These particles should interact.  See if they are in the neighbor list.
+
+                            RealVec oldDelta = lastPositions[moved[i]]-lastPositions[moved[j]];
+                            if (periodic)
+                                oldDelta = getPeriodicDelta(oldDelta, lastBoxVectors);
+                            if (oldDelta.dot(oldDelta) > paddedCutoff2)
+                                return true;
+                        }
+                    }
+                }
+    }
+    return false;
+}
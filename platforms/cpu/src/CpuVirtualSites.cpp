@@ -0,0 +1,250 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuVirtualSites.h"
+#include "ReferenceVirtualSites.h"
+#include "openmm/VirtualSite.h"
+
+using namespace OpenMM;
+using namespace std;
+
+class CpuVirtualSites::ComputePositionsTask : public ThreadPool::Task {
+public:
+    ComputePositionsTask(CpuVirtualSites& owner, vector<RealVec>& atomCoordinates) : owner(owner), atomCoordinates(atomCoordinates) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        owner.threadComputePositions(threadIndex, atomCoordinates);
+    }
+    CpuVirtualSites& owner;
+    vector<RealVec>& atomCoordinates;
+};
+
+class CpuVirtualSites::DistributeForcesTask : public ThreadPool::Task {
+public:
+    DistributeForcesTask(CpuVirtualSites& owner, const vector<RealVec>& atomCoordinates, vector<RealVec>& forces) :
+            owner(owner), atomCoordinates(atomCoordinates), forces(forces) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        owner.threadDistributeForces(threadIndex, atomCoordinates, forces);
+    }
+    CpuVirtualSites& owner;
+    const vector<RealVec>& atomCoordinates;
+    vector<RealVec>& forces;
+};
+
+static int findRoot(vector<int>& parent, int atom) {
+    while (parent[atom] != atom) {
+        parent[atom] = parent[parent[atom]];
+        atom = parent[atom];
+    }
+    return atom;
+}
+
+CpuVirtualSites::CpuVirtualSites() : system(NULL), threads(NULL) {
+}
+
+void CpuVirtualSites::initialize(const System& system, ThreadPool& threads) {
+    this->system = &system;
+    this->threads = &threads;
+    int numParticles = system.getNumParticles();
+    int numThreads = threads.getNumThreads();
+    threadSites.clear();
+    threadSites.resize(numThreads);
+    serialSites.clear();
+
+    // Decide which sites can be processed in parallel, and join their parent atoms into groups
+    // so that sites with a common parent end up on the same thread.
+
+    vector<int> parallelSites;
+    vector<int> groupParent(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        groupParent[i] = i;
+    for (int i = 0; i < numParticles; i++) {
+        if (!system.isVirtualSite(i))
+            continue;
+        const VirtualSite& site = system.getVirtualSite(i);
+        bool isParallel = (dynamic_cast<const TwoParticleAverageSite*>(&site) != NULL ||
+                           dynamic_cast<const ThreeParticleAverageSite*>(&site) != NULL ||
+                           dynamic_cast<const OutOfPlaneSite*>(&site) != NULL);
+        for (int j = 0; j < site.getNumParticles(); j++)
+            if (system.isVirtualSite(site.getParticle(j)))
+                isParallel = false;
+        if (!isParallel) {
+            serialSites.push_back(i);
+            continue;
+        }
+        parallelSites.push_back(i);
+        int root = findRoot(groupParent, site.getParticle(0));
+        for (int j = 1; j < site.getNumParticles(); j++) {
+            int other = findRoot(groupParent, site.getParticle(j));
+            if (other != root)
+                groupParent[other] = root;
+        }
+    }
+
+    // Collect the sites in each group, then divide the groups between threads so each one gets
+    // about the same number of sites.
+
+    vector<int> groupIndex(numParticles, -1);
+    vector<vector<int> > groups;
+    for (int i = 0; i < (int) parallelSites.size(); i++) {
+        int root = findRoot(groupParent, system.getVirtualSite(parallelSites[i]).getParticle(0));
+        if (groupIndex[root] == -1) {
+            groupIndex[root] = groups.size();
+            groups.push_back(vector<int>());
+        }
+        groups[groupIndex[root]].push_back(parallelSites[i]);
+    }
+    int thread = 0, numAssigned = 0;
+    for (int i = 0; i < (int) groups.size(); i++) {
+        while (thread < numThreads-1 && numAssigned >= (thread+1)*(int) parallelSites.size()/numThreads)
+            thread++;
+        ThreadSites& sites = threadSites[thread];
+        for (int j = 0; j < (int) groups[i].size(); j++) {
+            int index = groups[i][j];
+            const VirtualSite& site = system.getVirtualSite(index);
+            if (dynamic_cast<const TwoParticleAverageSite*>(&site) != NULL) {
+                const TwoParticleAverageSite& s = dynamic_cast<const TwoParticleAverageSite&>(site);
+                sites.twoSite.push_back(index);
+                sites.twoAtom1.push_back(s.getParticle(0));
+                sites.twoAtom2.push_back(s.getParticle(1));
+                sites.twoWeight1.push_back(s.getWeight(0));
+                sites.twoWeight2.push_back(s.getWeight(1));
+            }
+            else if (dynamic_cast<const ThreeParticleAverageSite*>(&site) != NULL) {
+                const ThreeParticleAverageSite& s = dynamic_cast<const ThreeParticleAverageSite&>(site);
+                sites.threeSite.push_back(index);
+                sites.threeAtom1.push_back(s.getParticle(0));
+                sites.threeAtom2.push_back(s.getParticle(1));
+                sites.threeAtom3.push_back(s.getParticle(2));
+                sites.threeWeight1.push_back(s.getWeight(0));
+                sites.threeWeight2.push_back(s.getWeight(1));
+                sites.threeWeight3.push_back(s.getWeight(2));
+            }
+            else {
+                const OutOfPlaneSite& s = dynamic_cast<const OutOfPlaneSite&>(site);
+                sites.outOfPlaneSite.push_back(index);
+                sites.outOfPlaneAtom1.push_back(s.getParticle(0));
+                sites.outOfPlaneAtom2.push_back(s.getParticle(1));
+                sites.outOfPlaneAtom3.push_back(s.getParticle(2));
+                sites.outOfPlaneWeight12.push_back(s.getWeight12());
+                sites.outOfPlaneWeight13.push_back(s.getWeight13());
+                sites.outOfPlaneWeightCross.push_back(s.getWeightCross());
+            }
+        }
+        numAssigned += groups[i].size();
+    }
+}
+
+void CpuVirtualSites::computePositions(vector<RealVec>& atomCoordinates) {
+    if (system == NULL)
+        return;
+    
+    // Compute the sites that only depend on real atoms in parallel, then the others serially
+    // since they may depend on the ones computed in parallel.
+
+    ComputePositionsTask task(*this, atomCoordinates);
+    threads->execute(task);
+    threads->waitForThreads();
+    for (int i = 0; i < (int) serialSites.size(); i++)
+        ReferenceVirtualSites::computePosition(*system, serialSites[i], atomCoordinates);
+}
+
+void CpuVirtualSites::distributeForces(const vector<RealVec>& atomCoordinates, vector<RealVec>& forces) {
+    if (system == NULL)
+        return;
+
+    // Distribute forces from the serial sites first, since they may be based on the parallel ones.
+
+    for (int i = 0; i < (int) serialSites.size(); i++)
+        ReferenceVirtualSites::distributeForce(*system, serialSites[i], atomCoordinates, forces);
+    DistributeForcesTask task(*this, atomCoordinates, forces);
+    threads->execute(task);
+    threads->waitForThreads();
+}
+
+void CpuVirtualSites::threadComputePositions(int threadIndex, vector<RealVec>& atomCoordinates) {
+    const ThreadSites& sites = threadSites[threadIndex];
+    RealVec* pos = &atomCoordinates[0];
+    int numTwo = sites.twoSite.size();
+    for (int i = 0; i < numTwo; i++)
+        pos[sites.twoSite[i]] = pos[sites.twoAtom1[i]]*sites.twoWeight1[i] + pos[sites.twoAtom2[i]]*sites.twoWeight2[i];
+    int numThree = sites.threeSite.size();
+    for (int i = 0; i < numThree; i++)
+        pos[sites.threeSite[i]] = pos[sites.threeAtom1[i]]*sites.threeWeight1[i] + pos[sites.threeAtom2[i]]*sites.threeWeight2[i] +
+                                  pos[sites.threeAtom3[i]]*sites.threeWeight3[i];
+    int numOutOfPlane = sites.outOfPlaneSite.size();
+    for (int i = 0; i < numOutOfPlane; i++) {
+        RealVec p1 = pos[sites.outOfPlaneAtom1[i]];
+        RealVec v12 = pos[sites.outOfPlaneAtom2[i]]-p1;
+        RealVec v13 = pos[sites.outOfPlaneAtom3[i]]-p1;
+        RealVec cross = v12.cross(v13);
+        pos[sites.outOfPlaneSite[i]] = p1 + v12*sites.outOfPlaneWeight12[i] + v13*sites.outOfPlaneWeight13[i] + cross*sites.outOfPlaneWeightCross[i];
+    }
+}
+
+void CpuVirtualSites::threadDistributeForces(int threadIndex, const vector<RealVec>& atomCoordinates, vector<RealVec>& forces) {
+    const ThreadSites& sites = threadSites[threadIndex];
+    const RealVec* pos = &atomCoordinates[0];
+    RealVec* force = &forces[0];
+    int numTwo = sites.twoSite.size();
+    for (int i = 0; i < numTwo; i++) {
+        RealVec f = force[sites.twoSite[i]];
+        force[sites.twoAtom1[i]] += f*sites.twoWeight1[i];
+        force[sites.twoAtom2[i]] += f*sites.twoWeight2[i];
+    }
+    int numThree = sites.threeSite.size();
+    for (int i = 0; i < numThree; i++) {
+        RealVec f = force[sites.threeSite[i]];
+        force[sites.threeAtom1[i]] += f*sites.threeWeight1[i];
+        force[sites.threeAtom2[i]] += f*sites.threeWeight2[i];
+        force[sites.threeAtom3[i]] += f*sites.threeWeight3[i];
+    }
+    int numOutOfPlane = sites.outOfPlaneSite.size();
+    for (int i = 0; i < numOutOfPlane; i++) {
+        RealVec f = force[sites.outOfPlaneSite[i]];
+        double w12 = sites.outOfPlaneWeight12[i];
+        double w13 = sites.outOfPlaneWeight13[i];
+        double wcross = sites.outOfPlaneWeightCross[i];
+        RealVec p1 = pos[sites.outOfPlaneAtom1[i]];
+        RealVec v12 = pos[sites.outOfPlaneAtom2[i]]-p1;
+        RealVec v13 = pos[sites.outOfPlaneAtom3[i]]-p1;
+        RealVec f2(w12*f[0] - wcross*v13[2]*f[1] + wcross*v13[1]*f[2],
+                   wcross*v13[2]*f[0] + w12*f[1] - wcross*v13[0]*f[2],
+                  -wcross*v13[1]*f[0] + wcross*v13[0]*f[1] + w12*f[2]);
+        RealVec f3(w13*f[0] + wcross*v12[2]*f[1] - wcross*v12[1]*f[2],
+                  -wcross*v12[2]*f[0] + w13*f[1] + wcross*v12[0]*f[2],
+                   wcross*v12[1]*f[0] - wcross*v12[0]*f[1] + w13*f[2]);
+        force[sites.outOfPlaneAtom1[i]] += f-f2-f3;
+        force[sites.outOfPlaneAtom2[i]] += f2;
+        force[sites.outOfPlaneAtom3[i]] += f3;
+    }
+}
@@ -0,0 +1,167 @@
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2008-2013 Stanford University and the Authors.      *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This tests the CPU implementation of the CCMA algorithm.
+ */
+
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/Context.h"
+#include "CpuPlatform.h"
+#include "ReferencePlatform.h"
+#include "openmm/HarmonicAngleForce.h"
+#include "openmm/HarmonicBondForce.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include "sfmt/SFMT.h"
+#include <iostream>
+#include <vector>
+
+using namespace OpenMM;
+using namespace std;
+
+/**
+ * Build a System of branched molecules.  Each one has a central atom bonded to three others, and
+ * one of those bonded to a fifth atom, so the constraints are coupled through shared atoms and
+ * through angles.
+ */
+void createSystem(System& system, vector<Vec3>& positions, vector<Vec3>& velocities, int numMolecules) {
+    HarmonicAngleForce* angles = new HarmonicAngleForce();
+    HarmonicBondForce* bonds = new HarmonicBondForce();
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numMolecules; i++) {
+        int first = system.getNumParticles();
+        system.addParticle(12.0);
+        system.addParticle(1.0);
+        system.addParticle(1.0);
+        system.addParticle(14.0);
+        system.addParticle(1.0);
+        system.addConstraint(first, first+1, 0.11);
+        system.addConstraint(first, first+2, 0.11);
+        system.addConstraint(first, first+3, 0.15);
+        system.addConstraint(first+3, first+4, 0.1);
+        angles->addAngle(first+1, first, first+2, 1.9, 300.0);
+        angles->addAngle(first+1, first, first+3, 1.9, 300.0);
+        angles->addAngle(first+2, first, first+3, 1.9, 300.0);
+        angles->addAngle(first, first+3, first+4, 1.9, 300.0);
+        if (i > 0)
+            bonds->addBond(first-5, first, 0.5, 100.0);
+        Vec3 center(0.5*i, 0, 0);
+        positions.push_back(center);
+        positions.push_back(center+Vec3(0.11, 0, 0));
+        positions.push_back(center+Vec3(-0.0376, 0.1034, 0));
+        positions.push_back(center+Vec3(-0.0513, -0.0517, 0.1302));
+        positions.push_back(center+Vec3(-0.0513, -0.1517, 0.1302));
+        for (int j = 0; j < 5; j++)
+            velocities.push_back(Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5));
+    }
+    system.addForce(angles);
+    system.addForce(bonds);
+}
+
+void testConstraints() {
+    System system;
+    vector<Vec3> positions, velocities;
+    createSystem(system, positions, velocities, 20);
+    CpuPlatform platform;
+    VerletIntegrator integrator(0.001);
+    integrator.setConstraintTolerance(1e-5);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    context.setVelocities(velocities);
+    context.applyConstraints(1e-5);
+
+    // Simulate it and see whether the constraints remain satisfied.
+
+    for (int i = 0; i < 500; ++i) {
+        integrator.step(1);
+        State state = context.getState(State::Positions);
+        for (int j = 0; j < system.getNumConstraints(); ++j) {
+            int particle1, particle2;
+            double distance;
+            system.getConstraintParameters(j, particle1, particle2, distance);
+            Vec3 delta = state.getPositions()[particle1]-state.getPositions()[particle2];
+            ASSERT_EQUAL_TOL(distance, sqrt(delta.dot(delta)), 2e-5);
+        }
+    }
+}
+
+void testParallelComputation() {
+    // Integrate with both the CPU and Reference platforms and make sure they agree.  The kinetic
+    // energy is computed from velocities that have had constraints applied to them, so that checks
+    // applyToVelocities().
+
+    System system;
+    vector<Vec3> positions, velocities;
+    createSystem(system, positions, velocities, 50);
+    CpuPlatform platform;
+    ReferencePlatform reference;
+    VerletIntegrator integrator1(0.001);
+    VerletIntegrator integrator2(0.001);
+    integrator1.setConstraintTolerance(1e-6);
+    integrator2.setConstraintTolerance(1e-6);
+    Context context1(system, integrator1, reference);
+    Context context2(system, integrator2, platform);
+    context1.setPositions(positions);
+    context2.setPositions(positions);
+    context1.setVelocities(velocities);
+    context2.setVelocities(velocities);
+    context1.applyConstraints(1e-6);
+    context2.applyConstraints(1e-6);
+    integrator1.step(10);
+    integrator2.step(10);
+    State state1 = context1.getState(State::Positions | State::Velocities | State::Energy);
+    State state2 = context2.getState(State::Positions | State::Velocities | State::Energy);
+    ASSERT_EQUAL_TOL(state1.getKineticEnergy(), state2.getKineticEnergy(), 1e-5);
+    for (int i = 0; i < system.getNumParticles(); i++) {
+        ASSERT_EQUAL_VEC(state1.getPositions()[i], state2.getPositions()[i], 1e-5);
+        ASSERT_EQUAL_VEC(state1.getVelocities()[i], state2.getVelocities()[i], 1e-3);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        if (!CpuPlatform::isProcessorSupported()) {
+            cout << "CPU is not supported.  Exiting." << endl;
+            return 0;
+        }
+        testConstraints();
+        testParallelComputation();
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
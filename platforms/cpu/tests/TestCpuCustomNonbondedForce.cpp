@@ -42,6 +42,7 @@
 #include "openmm/Context.h"
 #include "openmm/CustomNonbondedForce.h"
 #include "openmm/NonbondedForce.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/System.h"
 #include "openmm/VerletIntegrator.h"
 #include "sfmt/SFMT.h"
@@ -900,6 +901,98 @@ void testInteractionGroupLongRangeCorrection() {
     ASSERT_EQUAL_TOL(expected, energy2-energy1, 1e-4);
 }
 
+void testSharedNeighborList(bool adaptivePadding) {
+    // Create a system with a NonbondedForce and two CustomNonbondedForces.  One of them has the same cutoff and
+    // exclusions as the NonbondedForce, so they share a neighbor list, while the other has a different cutoff.
+    // Optionally let the padding of the lists be tuned as the simulation runs.
+
+    const int gridSize = 8;
+    const int numParticles = gridSize*gridSize*gridSize;
+    const double boxSize = 3.0;
+    const double cutoff = 1.0;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    NonbondedForce* nonbonded = new NonbondedForce();
+    CustomNonbondedForce* custom1 = new CustomNonbondedForce("4*eps*((sigma/r)^12-(sigma/r)^6); sigma=0.3; eps=sqrt(eps1*eps2)");
+    CustomNonbondedForce* custom2 = new CustomNonbondedForce("a*(r-0.8)^2; a=a1*a2");
+    custom1->addPerParticleParameter("eps");
+    custom2->addPerParticleParameter("a");
+    vector<Vec3> positions(numParticles);
+    vector<Vec3> velocities(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<double> params(1);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        nonbonded->addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 0.0);
+        params[0] = 0.5+0.1*(i%3);
+        custom1->addParticle(params);
+        custom2->addParticle(params);
+        int x = i%gridSize, y = (i/gridSize)%gridSize, z = i/(gridSize*gridSize);
+        double spacing = boxSize/gridSize;
+        positions[i] = Vec3(spacing*(x+0.2*genrand_real2(sfmt)), spacing*(y+0.2*genrand_real2(sfmt)), spacing*(z+0.2*genrand_real2(sfmt)));
+        velocities[i] = Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5);
+    }
+    for (int i = 1; i < numParticles; i += 2) {
+        nonbonded->addException(i-1, i, 0.0, 1.0, 0.0);
+        custom1->addExclusion(i-1, i);
+        custom2->addExclusion(i-1, i);
+    }
+    nonbonded->setNonbondedMethod(NonbondedForce::CutoffPeriodic);
+    custom1->setNonbondedMethod(CustomNonbondedForce::CutoffPeriodic);
+    custom2->setNonbondedMethod(CustomNonbondedForce::CutoffPeriodic);
+    nonbonded->setCutoffDistance(cutoff);
+    custom1->setCutoffDistance(cutoff);
+    custom2->setCutoffDistance(0.8*cutoff);
+    system.addForce(nonbonded);
+    system.addForce(custom1);
+    system.addForce(custom2);
+
+    // Take steps on the CPU platform, and check that the forces match a newly created Context as the neighbor
+    // lists are reused and rebuilt.  The new Context builds its lists from scratch but makes the same single
+    // precision cutoff decisions, so pairs very close to the cutoff cannot make the results differ.
+
+    VerletIntegrator integrator1(0.002);
+    map<string, string> properties;
+    if (adaptivePadding) {
+        properties[CpuPlatform::CpuAdaptivePadding()] = "true";
+        properties[CpuPlatform::CpuTargetRebuildInterval()] = "3";
+    }
+    Context context1(system, integrator1, platform, properties);
+    ASSERT_EQUAL(adaptivePadding ? "true" : "false", platform.getPropertyValue(context1, CpuPlatform::CpuAdaptivePadding()));
+    context1.setPositions(positions);
+    context1.setVelocities(velocities);
+    for (int i = 0; i < 10; i++) {
+        integrator1.step(5);
+        State state1 = context1.getState(State::Positions | State::Forces | State::Energy);
+        VerletIntegrator integrator2(0.002);
+        Context context2(system, integrator2, platform);
+        context2.setPositions(state1.getPositions());
+        State state2 = context2.getState(State::Forces | State::Energy);
+        ASSERT_EQUAL_TOL(state2.getPotentialEnergy(), state1.getPotentialEnergy(), 1e-4);
+        for (int j = 0; j < numParticles; j++)
+            ASSERT_EQUAL_VEC(state2.getForces()[j], state1.getForces()[j], 1e-4);
+    }
+    
+    // Illegal values for the target interval should be rejected.
+    
+    if (adaptivePadding) {
+        const char* illegalValues[] = {"-1", "x", "20abc"};
+        for (int i = 0; i < 3; i++) {
+            properties[CpuPlatform::CpuTargetRebuildInterval()] = illegalValues[i];
+            VerletIntegrator integrator3(0.002);
+            bool threwException = false;
+            try {
+                Context context3(system, integrator3, platform, properties);
+            }
+            catch (const OpenMMException& ex) {
+                threwException = true;
+            }
+            ASSERT(threwException);
+        }
+    }
+}
+
 int main() {
     try {
         if (!CpuPlatform::isProcessorSupported()) {
@@ -924,6 +1017,8 @@ int main() {
         testInteractionGroups();
         testLargeInteractionGroup();
         testInteractionGroupLongRangeCorrection();
+        testSharedNeighborList(false);
+        testSharedNeighborList(true);
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;
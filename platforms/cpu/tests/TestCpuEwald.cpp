@@ -37,14 +37,18 @@
 #include "openmm/Context.h"
 #include "CpuPlatform.h"
 #include "ReferencePlatform.h"
+#include "openmm/HarmonicBondForce.h"
 #include "openmm/NonbondedForce.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/System.h"
 #include "openmm/LangevinIntegrator.h"
 #include "openmm/VerletIntegrator.h"
 #include "openmm/internal/ContextImpl.h"
 #include "SimTKOpenMMRealType.h"
 #include "sfmt/SFMT.h"
+#include <cstdio>
 #include <iostream>
+#include <sstream>
 #include <vector>
 
 using namespace OpenMM;
@@ -303,6 +307,165 @@ void testErrorTolerance(NonbondedForce::NonbondedMethod method) {
     }
 }
 
+void testPmeThreads() {
+    // Dedicating threads to reciprocal space should not change the result.
+
+    const int numParticles = 51;
+    const double boxWidth = 5.0;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(boxWidth, 0, 0), Vec3(0, boxWidth, 0), Vec3(0, 0, boxWidth));
+    NonbondedForce* force = new NonbondedForce();
+    system.addForce(force);
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(-1.0+i*2.0/(numParticles-1), 1.0, 0.0);
+        positions[i] = Vec3(boxWidth*genrand_real2(sfmt), boxWidth*genrand_real2(sfmt), boxWidth*genrand_real2(sfmt));
+    }
+    force->setNonbondedMethod(NonbondedForce::PME);
+    VerletIntegrator integrator1(0.01);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    map<string, string> properties;
+    properties[CpuPlatform::CpuThreads()] = "3";
+    properties[CpuPlatform::CpuPmeThreads()] = "2";
+    VerletIntegrator integrator2(0.01);
+    Context context2(system, integrator2, platform, properties);
+    context2.setPositions(positions);
+    ASSERT_EQUAL("3", platform.getPropertyValue(context2, CpuPlatform::CpuThreads()));
+    ASSERT_EQUAL("2", platform.getPropertyValue(context2, CpuPlatform::CpuPmeThreads()));
+    for (int i = 0; i < 2; i++) {
+        State state2 = context2.getState(State::Forces | State::Energy);
+        ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+        for (int j = 0; j < numParticles; j++)
+            ASSERT_EQUAL_VEC(state1.getForces()[j], state2.getForces()[j], 1e-5);
+    }
+
+    // If the System does not use PME, no threads should be set aside for it.
+
+    force->setNonbondedMethod(NonbondedForce::CutoffPeriodic);
+    VerletIntegrator integrator3(0.01);
+    Context context3(system, integrator3, platform, properties);
+    ASSERT_EQUAL("0", platform.getPropertyValue(context3, CpuPlatform::CpuPmeThreads()));
+}
+
+void testPmeOrder() {
+    // Every supported interpolation order should give a result of similar accuracy.  The reference
+    // platform always uses order 5, so use a tight tolerance to make sure both are close to the exact value.
+
+    const int numParticles = 51;
+    const double boxWidth = 5.0;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(boxWidth, 0, 0), Vec3(0, boxWidth, 0), Vec3(0, 0, boxWidth));
+    NonbondedForce* force = new NonbondedForce();
+    system.addForce(force);
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(-1.0+i*2.0/(numParticles-1), 1.0, 0.0);
+        positions[i] = Vec3(boxWidth*genrand_real2(sfmt), boxWidth*genrand_real2(sfmt), boxWidth*genrand_real2(sfmt));
+    }
+    force->setNonbondedMethod(NonbondedForce::PME);
+    force->setEwaldErrorTolerance(1e-5);
+    ReferencePlatform reference;
+    VerletIntegrator integrator1(0.01);
+    Context context1(system, integrator1, reference);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    for (int order = 4; order <= 8; order++) {
+        map<string, string> properties;
+        stringstream orderString;
+        orderString << order;
+        properties[CpuPlatform::CpuPmeOrder()] = orderString.str();
+        VerletIntegrator integrator2(0.01);
+        Context context2(system, integrator2, platform, properties);
+        context2.setPositions(positions);
+        ASSERT_EQUAL(orderString.str(), platform.getPropertyValue(context2, CpuPlatform::CpuPmeOrder()));
+        State state2 = context2.getState(State::Forces | State::Energy);
+        ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-3);
+        for (int i = 0; i < numParticles; i++)
+            ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-3);
+    }
+
+    // An unsupported order should be rejected.
+
+    map<string, string> properties;
+    properties[CpuPlatform::CpuPmeOrder()] = "3";
+    VerletIntegrator integrator3(0.01);
+    bool threwException = false;
+    try {
+        Context context3(system, integrator3, platform, properties);
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+}
+
+void testPmeTuning() {
+    // Tuning should select parameters that still give the requested accuracy.  Include another force
+    // to make sure its contribution survives the trial evaluations.
+
+    const int numParticles = 51;
+    const double boxWidth = 5.0;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(boxWidth, 0, 0), Vec3(0, boxWidth, 0), Vec3(0, 0, boxWidth));
+    NonbondedForce* force = new NonbondedForce();
+    system.addForce(force);
+    HarmonicBondForce* bonds = new HarmonicBondForce();
+    bonds->addBond(0, 1, 1.0, 100.0);
+    system.addForce(bonds);
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(-1.0+i*2.0/(numParticles-1), 1.0, 0.0);
+        positions[i] = Vec3(boxWidth*genrand_real2(sfmt), boxWidth*genrand_real2(sfmt), boxWidth*genrand_real2(sfmt));
+    }
+    force->setNonbondedMethod(NonbondedForce::PME);
+    force->setEwaldErrorTolerance(1e-5);
+    ReferencePlatform reference;
+    VerletIntegrator integrator1(0.01);
+    Context context1(system, integrator1, reference);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    map<string, string> properties;
+    properties[CpuPlatform::CpuPmeTuning()] = "true";
+    VerletIntegrator integrator2(0.01);
+    Context context2(system, integrator2, platform, properties);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-3);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-3);
+
+    // Setting the reported parameters explicitly should reproduce the same result.
+
+    string tunedParameters = platform.getPropertyValue(context2, CpuPlatform::CpuPmeParameters());
+    double cutoff, alpha;
+    int nx, ny, nz, order;
+    ASSERT_EQUAL(6, sscanf(tunedParameters.c_str(), "cutoff=%lf alpha=%lf grid=%dx%dx%d order=%d", &cutoff, &alpha, &nx, &ny, &nz, &order));
+    force->setCutoffDistance(cutoff);
+    force->setPMEParameters(alpha, nx, ny, nz);
+    stringstream orderString;
+    orderString << order;
+    properties[CpuPlatform::CpuPmeOrder()] = orderString.str();
+    VerletIntegrator integrator3(0.01);
+    Context context3(system, integrator3, platform, properties);
+    context3.setPositions(positions);
+    State state3 = context3.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL(tunedParameters, platform.getPropertyValue(context3, CpuPlatform::CpuPmeParameters()));
+    ASSERT_EQUAL_TOL(state2.getPotentialEnergy(), state3.getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state2.getForces()[i], state3.getForces()[i], 1e-5);
+}
+
 int main(int argc, char* argv[]) {
     try {
         if (!CpuPlatform::isProcessorSupported()) {
@@ -315,6 +478,9 @@ int main(int argc, char* argv[]) {
         testTriclinic();
         testErrorTolerance(NonbondedForce::Ewald);
         testErrorTolerance(NonbondedForce::PME);
+        testPmeThreads();
+        testPmeOrder();
+        testPmeTuning();
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;
@@ -40,6 +40,7 @@
 #include "openmm/System.h"
 #include "openmm/LangevinIntegrator.h"
 #include "openmm/NonbondedForce.h"
+#include "openmm/VerletIntegrator.h"
 #include "SimTKOpenMMRealType.h"
 #include "sfmt/SFMT.h"
 #include <iostream>
@@ -248,6 +249,45 @@ void testForce(int numParticles, NonbondedForce::NonbondedMethod method, GBSAOBC
     }
 }
 
+/**
+ * Use a cutoff that is much smaller than the system, so most atom pairs are absent from the neighbor list.
+ */
+void testShortCutoff(GBSAOBCForce::NonbondedMethod method) {
+    CpuPlatform platform;
+    ReferencePlatform reference;
+    System system;
+    GBSAOBCForce* gbsa = new GBSAOBCForce();
+    const int gridSize = 14;
+    const int numParticles = gridSize*gridSize*gridSize;
+    const double spacing = 0.3;
+    const double boxSize = gridSize*spacing;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions;
+    for (int i = 0; i < gridSize; i++)
+        for (int j = 0; j < gridSize; j++)
+            for (int k = 0; k < gridSize; k++) {
+                system.addParticle(1.0);
+                gbsa->addParticle(i%2 == 0 ? -0.5 : 0.5, 0.12+0.04*genrand_real2(sfmt), 0.8);
+                positions.push_back(Vec3(i*spacing, j*spacing, k*spacing)+Vec3(0.1*genrand_real2(sfmt), 0.1*genrand_real2(sfmt), 0.1*genrand_real2(sfmt)));
+            }
+    gbsa->setNonbondedMethod(method);
+    gbsa->setCutoffDistance(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    system.addForce(gbsa);
+    VerletIntegrator integrator1(0.001);
+    VerletIntegrator integrator2(0.001);
+    Context context(system, integrator1, platform);
+    Context refContext(system, integrator2, reference);
+    context.setPositions(positions);
+    refContext.setPositions(positions);
+    State state = context.getState(State::Forces | State::Energy);
+    State refState = refContext.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(refState.getPotentialEnergy(), state.getPotentialEnergy(), 1e-4);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(refState.getForces()[i], state.getForces()[i], 1e-3);
+}
+
 int main() {
     try {
         if (!CpuPlatform::isProcessorSupported()) {
@@ -257,6 +297,8 @@ int main() {
         testSingleParticle();
         testGlobalSettings();
         testCutoffAndPeriodic();
+        testShortCutoff(GBSAOBCForce::CutoffNonPeriodic);
+        testShortCutoff(GBSAOBCForce::CutoffPeriodic);
         for (int i = 5; i < 11; i++) {
             testForce(i*i*i, NonbondedForce::NoCutoff, GBSAOBCForce::NoCutoff);
             testForce(i*i*i, NonbondedForce::CutoffNonPeriodic, GBSAOBCForce::CutoffNonPeriodic);
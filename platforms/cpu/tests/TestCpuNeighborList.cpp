@@ -38,6 +38,7 @@
 #include "AlignedArray.h"
 #include "CpuNeighborList.h"
 #include "CpuPlatform.h"
+#include "CpuSharedNeighborList.h"
 #include "sfmt/SFMT.h"
 #include <iostream>
 #include <set>
@@ -48,7 +49,7 @@
 using namespace OpenMM;
 using namespace std;
 
-void testNeighborList(bool periodic, bool triclinic) {
+void testNeighborList(bool periodic, bool triclinic, int numThreads) {
     const int numParticles = 500;
     const float cutoff = 2.0f;
     RealVec boxVectors[3];
@@ -78,7 +79,7 @@ void testNeighborList(bool periodic, bool triclinic) {
             exclusions[i-j].insert(i);
         }
     }
-    ThreadPool threads;
+    ThreadPool threads(numThreads);
     CpuNeighborList neighborList(blockSize);
     neighborList.computeNeighborList(numParticles, positions, exclusions, boxVectors, periodic, cutoff, threads);
     
@@ -119,15 +120,206 @@ void testNeighborList(bool periodic, bool triclinic) {
         }
 }
 
+void testThreadCountIndependence() {
+    // The atoms should be sorted the same way and get the same neighbors no matter how many threads build the list.
+
+    const int numParticles = 1000;
+    const float boxSize = 5.0f;
+    RealVec boxVectors[3] = {RealVec(boxSize, 0, 0), RealVec(0, boxSize, 0), RealVec(0, 0, boxSize)};
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    AlignedArray<float> positions(4*numParticles);
+    for (int i = 0; i < 4*numParticles; i++)
+        positions[i] = (i%4 < 3 ? boxSize*genrand_real2(sfmt) : 0.0f);
+    vector<set<int> > exclusions(numParticles);
+    ThreadPool threads1(1);
+    ThreadPool threads2(7);
+    CpuNeighborList neighborList1(4);
+    CpuNeighborList neighborList2(4);
+    neighborList1.computeNeighborList(numParticles, positions, exclusions, boxVectors, true, 1.0f, threads1);
+    neighborList2.computeNeighborList(numParticles, positions, exclusions, boxVectors, true, 1.0f, threads2);
+    ASSERT(neighborList1.getSortedAtoms() == neighborList2.getSortedAtoms());
+    ASSERT_EQUAL(neighborList1.getNumBlocks(), neighborList2.getNumBlocks());
+    for (int i = 0; i < neighborList1.getNumBlocks(); i++) {
+        vector<int> neighbors1 = neighborList1.getBlockNeighbors(i);
+        vector<int> neighbors2 = neighborList2.getBlockNeighbors(i);
+        sort(neighbors1.begin(), neighbors1.end());
+        sort(neighbors2.begin(), neighbors2.end());
+        ASSERT(neighbors1 == neighbors2);
+    }
+}
+
+void testClusters() {
+    // The clusters should cover exactly the same pairs as the list of neighbors for each block.
+
+    const int numParticles = 997;
+    const int blockSize = 8;
+    const float boxSize = 5.0f;
+    RealVec boxVectors[3] = {RealVec(boxSize, 0, 0), RealVec(0, boxSize, 0), RealVec(0, 0, boxSize)};
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    AlignedArray<float> positions(4*numParticles);
+    for (int i = 0; i < 4*numParticles; i++)
+        positions[i] = (i%4 < 3 ? boxSize*genrand_real2(sfmt) : 0.0f);
+    vector<set<int> > exclusions(numParticles);
+    for (int i = 1; i < numParticles; i++) {
+        exclusions[i].insert(i-1);
+        exclusions[i-1].insert(i);
+    }
+    ThreadPool threads(3);
+    CpuNeighborList neighborList(blockSize);
+    neighborList.setUseClusters(true);
+    neighborList.computeNeighborList(numParticles, positions, exclusions, boxVectors, true, 1.0f, threads);
+    const vector<int>& sortedAtoms = neighborList.getSortedAtoms();
+    for (int block = 0; block < neighborList.getNumBlocks(); block++) {
+        set<pair<int, char> > atomPairs, clusterPairs;
+        const vector<int>& neighbors = neighborList.getBlockNeighbors(block);
+        const vector<char>& exc = neighborList.getBlockExclusions(block);
+        for (int i = 0; i < (int) neighbors.size(); i++)
+            if (exc[i] != (char) 0xFF)
+                atomPairs.insert(make_pair(neighbors[i], exc[i]));
+        const vector<int>& clusters = neighborList.getBlockClusters(block);
+        const vector<char>& clusterExc = neighborList.getBlockClusterExclusions(block);
+        ASSERT_EQUAL(clusters.size()*CpuNeighborList::ClusterSize, clusterExc.size());
+        for (int i = 0; i < (int) clusters.size(); i++) {
+            ASSERT(i == 0 || clusters[i] > clusters[i-1]);
+            for (int j = 0; j < CpuNeighborList::ClusterSize; j++) {
+                char mask = clusterExc[i*CpuNeighborList::ClusterSize+j];
+                if (mask != (char) 0xFF)
+                    clusterPairs.insert(make_pair(sortedAtoms[clusters[i]*CpuNeighborList::ClusterSize+j], mask));
+            }
+        }
+        ASSERT(atomPairs == clusterPairs);
+    }
+}
+
+void testSharedListRebuilds() {
+    // Let particles wander through a triclinic box, and make sure the shared list always contains every pair
+    // within the cutoff, while being rebuilt only occasionally.
+
+    const int numParticles = 500;
+    const int numSteps = 30;
+    const double cutoff = 2.0;
+    RealVec boxVectors[3] = {RealVec(20, 0, 0), RealVec(5, 15, 0), RealVec(-3, -7, 22)};
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<RealVec> positions(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = RealVec(20*genrand_real2(sfmt), 15*genrand_real2(sfmt), 22*genrand_real2(sfmt));
+    vector<set<int> > exclusions(numParticles);
+    ThreadPool threads(3);
+    CpuSharedNeighborList list(8, cutoff, 0.5, true, exclusions);
+    AlignedArray<float> posq(4*numParticles);
+    for (int step = 0; step < numSteps; step++) {
+        for (int i = 0; i < numParticles; i++) {
+            for (int j = 0; j < 3; j++)
+                positions[i][j] += 0.1*(genrand_real2(sfmt)-0.5);
+            
+            // The list expects positions to be wrapped into the periodic box, as the CPU platform does.
+            
+            RealVec pos = positions[i];
+            pos -= boxVectors[2]*floor(pos[2]/boxVectors[2][2]);
+            pos -= boxVectors[1]*floor(pos[1]/boxVectors[1][1]);
+            pos -= boxVectors[0]*floor(pos[0]/boxVectors[0][0]);
+            posq[4*i] = (float) pos[0];
+            posq[4*i+1] = (float) pos[1];
+            posq[4*i+2] = (float) pos[2];
+            posq[4*i+3] = 0.0f;
+        }
+        list.update(step, posq, positions, boxVectors, threads);
+        const CpuNeighborList& neighborList = list.getNeighborList();
+        set<pair<int, int> > neighbors;
+        for (int i = 0; i < numParticles; i++) {
+            int blockIndex = i/8;
+            char mask = 1<<(i-blockIndex*8);
+            const vector<int>& blockNeighbors = neighborList.getBlockNeighbors(blockIndex);
+            for (int j = 0; j < (int) blockNeighbors.size(); j++)
+                if ((neighborList.getBlockExclusions(blockIndex)[j] & mask) == 0) {
+                    int atom1 = neighborList.getSortedAtoms()[i];
+                    neighbors.insert(make_pair(min(atom1, blockNeighbors[j]), max(atom1, blockNeighbors[j])));
+                }
+        }
+        for (int i = 0; i < numParticles; i++)
+            for (int j = 0; j < i; j++) {
+                RealVec diff = positions[i]-positions[j];
+                diff -= boxVectors[2]*floor(diff[2]/boxVectors[2][2]+0.5);
+                diff -= boxVectors[1]*floor(diff[1]/boxVectors[1][1]+0.5);
+                diff -= boxVectors[0]*floor(diff[0]/boxVectors[0][0]+0.5);
+                if (diff.dot(diff) < cutoff*cutoff)
+                    ASSERT(neighbors.find(make_pair(j, i)) != neighbors.end());
+            }
+    }
+    ASSERT_EQUAL(numSteps, list.getNumChecks());
+    ASSERT(list.getNumRebuilds() > 1);
+    ASSERT(list.getNumRebuilds() < numSteps/2);
+    ASSERT(list.getAverageRebuildInterval() > 2.0);
+}
+
+void testAdaptivePadding() {
+    // Let particles wander through a periodic box with the padding being tuned, and make sure the rebuild
+    // interval approaches the target.  Then report a very large interaction time, which should make it shrink
+    // the padding to reduce the number of pairs.
+
+    const int numParticles = 500;
+    const int targetInterval = 8;
+    const double cutoff = 2.0;
+    const double initialPadding = 0.3;
+    RealVec boxVectors[3] = {RealVec(20, 0, 0), RealVec(0, 15, 0), RealVec(0, 0, 22)};
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<RealVec> positions(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = RealVec(20*genrand_real2(sfmt), 15*genrand_real2(sfmt), 22*genrand_real2(sfmt));
+    vector<set<int> > exclusions(numParticles);
+    ThreadPool threads(2);
+    CpuSharedNeighborList list(8, cutoff, initialPadding, true, exclusions);
+    list.setAdaptivePadding(targetInterval);
+    ASSERT(list.isCompatible(8, cutoff, initialPadding, true, exclusions));
+    AlignedArray<float> posq(4*numParticles);
+    int step = 0;
+    long long rebuildsBefore = 0;
+    for (int phase = 0; phase < 2; phase++) {
+        for (int i = 0; i < 300; i++, step++) {
+            for (int j = 0; j < numParticles; j++) {
+                for (int k = 0; k < 3; k++) {
+                    positions[j][k] += 0.1*(genrand_real2(sfmt)-0.5);
+                    posq[4*j+k] = (float) (positions[j][k]-boxVectors[k][k]*floor(positions[j][k]/boxVectors[k][k]));
+                }
+                posq[4*j+3] = 0.0f;
+            }
+            list.update(step, posq, positions, boxVectors, threads);
+            if (phase == 1)
+                list.recordInteractionTime(1000000000);
+            if (phase == 0 && i == 199)
+                rebuildsBefore = list.getNumRebuilds();
+        }
+        if (phase == 0) {
+            double interval = 100.0/(list.getNumRebuilds()-rebuildsBefore);
+            ASSERT(interval > 0.5*targetInterval && interval < 2.0*targetInterval);
+            ASSERT(list.getPadding() != initialPadding);
+            ASSERT(list.isCompatible(8, cutoff, initialPadding, true, exclusions));
+            list.setAdaptivePadding(0);
+        }
+    }
+    ASSERT_EQUAL_TOL(0.05*cutoff, list.getPadding(), 0.1);
+}
+
 int main() {
     try {
         if (!CpuPlatform::isProcessorSupported()) {
             cout << "CPU is not supported.  Exiting." << endl;
             return 0;
         }
-        testNeighborList(false, false);
-        testNeighborList(true, false);
-        testNeighborList(true, true);
+        testNeighborList(false, false, 1);
+        testNeighborList(true, false, 1);
+        testNeighborList(true, true, 1);
+        testNeighborList(false, false, 3);
+        testNeighborList(true, false, 3);
+        testNeighborList(true, true, 3);
+        testThreadCountIndependence();
+        testClusters();
+        testSharedListRebuilds();
+        testAdaptivePadding();
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;
@@ -37,11 +37,15 @@
 #include "openmm/Context.h"
 #include "CpuPlatform.h"
 #include "ReferencePlatform.h"
+#include "openmm/CustomExternalForce.h"
 #include "openmm/HarmonicBondForce.h"
+#include "openmm/MonteCarloBarostat.h"
 #include "openmm/NonbondedForce.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/System.h"
 #include "openmm/LangevinIntegrator.h"
 #include "openmm/VerletIntegrator.h"
+#include "openmm/VirtualSite.h"
 #include "openmm/internal/ContextImpl.h"
 #include "SimTKOpenMMRealType.h"
 #include "sfmt/SFMT.h"
@@ -684,6 +688,172 @@ void testSwitchingFunction(NonbondedForce::NonbondedMethod method) {
     }
 }
 
+void testBarostat() {
+    // Let a barostat rescale the box, and make sure the neighbor list stays valid.  Use a high pressure so
+    // the box is compressed, and start some molecules outside the box so they get wrapped when scaled.
+
+    const int numMolecules = 300;
+    const int numParticles = numMolecules*2;
+    const double boxSize = 6.0;
+    ReferencePlatform reference;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    NonbondedForce* nonbonded = new NonbondedForce();
+    HarmonicBondForce* bonds = new HarmonicBondForce();
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numMolecules; i++) {
+        system.addParticle(1.0);
+        system.addParticle(1.0);
+        nonbonded->addParticle(-1.0, 0.2, 0.1);
+        nonbonded->addParticle(1.0, 0.1, 0.1);
+        positions[2*i] = Vec3(boxSize*(2*genrand_real2(sfmt)-0.5), boxSize*(2*genrand_real2(sfmt)-0.5), boxSize*(2*genrand_real2(sfmt)-0.5));
+        positions[2*i+1] = Vec3(positions[2*i][0]+0.2, positions[2*i][1], positions[2*i][2]);
+        bonds->addBond(2*i, 2*i+1, 0.2, 100.0);
+        nonbonded->addException(2*i, 2*i+1, 0.0, 0.15, 0.0);
+    }
+    nonbonded->setNonbondedMethod(NonbondedForce::CutoffPeriodic);
+    nonbonded->setCutoffDistance(1.0);
+    system.addForce(nonbonded);
+    system.addForce(bonds);
+    system.addForce(new MonteCarloBarostat(1000.0, 300.0, 1));
+    VerletIntegrator integrator1(0.0001);
+    VerletIntegrator integrator2(0.0001);
+    Context cpuContext(system, integrator1, platform);
+    Context referenceContext(system, integrator2, reference);
+    cpuContext.setPositions(positions);
+    for (int step = 0; step < 20; step++) {
+        integrator1.step(1);
+        State cpuState = cpuContext.getState(State::Positions | State::Forces | State::Energy);
+        Vec3 a, b, c;
+        cpuState.getPeriodicBoxVectors(a, b, c);
+        referenceContext.setPeriodicBoxVectors(a, b, c);
+        referenceContext.setPositions(cpuState.getPositions());
+        State referenceState = referenceContext.getState(State::Forces | State::Energy);
+        for (int i = 0; i < numParticles; i++)
+            ASSERT_EQUAL_VEC(referenceState.getForces()[i], cpuState.getForces()[i], 2e-3);
+        ASSERT_EQUAL_TOL(referenceState.getPotentialEnergy(), cpuState.getPotentialEnergy(), 2e-3);
+    }
+}
+
+void testVirial(NonbondedForce::NonbondedMethod method, bool useVirtualSites) {
+    // Compare the virial to the derivative of the energy with respect to a strain of the system, computed
+    // by finite differences in double precision with the Reference platform.  If virtual sites are used,
+    // each molecule gets a charged out of plane site, whose position is not a linear function of the
+    // other atoms.
+
+    const int numMolecules = 30;
+    const int atomsPerMolecule = (useVirtualSites ? 4 : 2);
+    const int numParticles = numMolecules*atomsPerMolecule;
+    const double boxSize = 3.0;
+    ReferencePlatform reference;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    NonbondedForce* nonbonded = new NonbondedForce();
+    HarmonicBondForce* bonds = new HarmonicBondForce();
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numMolecules; i++) {
+        int first = atomsPerMolecule*i;
+        system.addParticle(1.0);
+        system.addParticle(1.0);
+        nonbonded->addParticle(-0.5, 0.2, 0.2);
+        nonbonded->addParticle(0.5, 0.1, 0.2);
+        positions[first] = Vec3(boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt));
+        positions[first+1] = positions[first]+Vec3(0.1, 0.05, -0.05);
+        bonds->addBond(first, first+1, 0.1, 1000.0);
+        nonbonded->addException(first, first+1, 0.1, 0.15, 0.05);
+        if (useVirtualSites) {
+            system.addParticle(1.0);
+            system.addParticle(0.0);
+            nonbonded->addParticle(0.3, 0.1, 0.2);
+            nonbonded->addParticle(-0.3, 1.0, 0.0);
+            positions[first+2] = positions[first]+Vec3(-0.05, 0.1, 0.02);
+            bonds->addBond(first, first+2, 0.1, 1000.0);
+            system.setVirtualSite(first+3, new OutOfPlaneSite(first, first+1, first+2, 0.3, 0.2, 5.0));
+            for (int j = 0; j < 3; j++)
+                for (int k = j+1; k < 4; k++)
+                    if (j != 0 || k != 1)
+                        nonbonded->addException(first+j, first+k, 0.0, 1.0, 0.0);
+        }
+    }
+    nonbonded->setNonbondedMethod(method);
+    nonbonded->setCutoffDistance(1.0);
+    nonbonded->setUseSwitchingFunction(true);
+    nonbonded->setSwitchingDistance(0.8);
+    nonbonded->setEwaldErrorTolerance(1e-5);
+    system.addForce(nonbonded);
+    system.addForce(bonds);
+    VerletIntegrator integrator1(0.001);
+    VerletIntegrator integrator2(0.001);
+    Context context(system, integrator1, platform);
+    Context referenceContext(system, integrator2, reference);
+    context.setPositions(positions);
+    context.computeVirtualSites();
+    State state = context.getState(State::Virial);
+    Vec3 virial[3];
+    state.getVirial(virial[0], virial[1], virial[2]);
+    double scale = max(fabs(virial[0][0]), max(fabs(virial[1][1]), fabs(virial[2][2])));
+    const int components[6][2] = {{0, 0}, {1, 1}, {2, 2}, {0, 1}, {0, 2}, {1, 2}};
+    const double delta = 1e-4;
+    int numComponents = (method == NonbondedForce::Ewald ? 3 : 6); // Ewald does not support the triclinic boxes produced by a shear.
+    for (int c = 0; c < numComponents; c++) {
+        int a = components[c][0];
+        int b = components[c][1];
+        ASSERT_EQUAL_TOL(virial[a][b], virial[b][a], 1e-5);
+        double energy[2];
+        for (int sign = 0; sign < 2; sign++) {
+            double strain = (sign == 0 ? delta : -delta);
+            Vec3 box[3] = {Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize)};
+            for (int i = 0; i < 3; i++)
+                box[i][a] += strain*box[i][b];
+            vector<Vec3> strained(positions);
+            for (int i = 0; i < numParticles; i++)
+                strained[i][a] += strain*positions[i][b];
+            referenceContext.setPeriodicBoxVectors(box[0], box[1], box[2]);
+            referenceContext.setPositions(strained);
+            referenceContext.computeVirtualSites();
+            energy[sign] = referenceContext.getState(State::Energy).getPotentialEnergy();
+        }
+        double expected = -(energy[0]-energy[1])/(2*delta);
+        ASSERT_EQUAL_TOL(expected/scale, virial[a][b]/scale, 5e-3);
+    }
+}
+
+void testVirialUnsupported() {
+    // A force that cannot compute its contribution to the virial should cause an exception.
+
+    System system;
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    NonbondedForce* nonbonded = new NonbondedForce();
+    nonbonded->addParticle(1.0, 0.1, 0.1);
+    nonbonded->addParticle(-1.0, 0.1, 0.1);
+    system.addForce(nonbonded);
+    CustomExternalForce* external = new CustomExternalForce("x^2");
+    external->addParticle(0, vector<double>());
+    system.addForce(external);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    vector<Vec3> positions(2);
+    positions[1] = Vec3(0.5, 0, 0);
+    context.setPositions(positions);
+    bool threw = false;
+    try {
+        context.getState(State::Virial);
+    }
+    catch (const OpenMMException& ex) {
+        threw = true;
+    }
+    ASSERT(threw);
+    
+    // Other kinds of data can still be computed.
+    
+    context.getState(State::Forces | State::Energy);
+}
+
 int main(int argc, char* argv[]) {
     try {
         if (!CpuPlatform::isProcessorSupported()) {
@@ -702,6 +872,13 @@ int main(int argc, char* argv[]) {
         testChangingParameters();
         testSwitchingFunction(NonbondedForce::CutoffNonPeriodic);
         testSwitchingFunction(NonbondedForce::PME);
+        testBarostat();
+        testVirial(NonbondedForce::NoCutoff, false);
+        testVirial(NonbondedForce::CutoffPeriodic, false);
+        testVirial(NonbondedForce::Ewald, false);
+        testVirial(NonbondedForce::PME, false);
+        testVirial(NonbondedForce::PME, true);
+        testVirialUnsupported();
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;
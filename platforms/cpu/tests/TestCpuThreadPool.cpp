@@ -0,0 +1,456 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2015 Stanford University and the Authors.          *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+
+/**
+ * This tests the synchronization performed by ThreadPool, with and without spin waiting and with several
+ * parent threads sharing one pool, and the platform properties that control how threads are run.  If it
+ * is run with the argument "benchmark", it instead measures the cost of a synchronization point for
+ * different numbers of threads.
+ */
+
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/internal/ThreadPool.h"
+#include "openmm/internal/hardware.h"
+#include "CpuPlatform.h"
+#include "openmm/Context.h"
+#include "openmm/NonbondedForce.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include "sfmt/SFMT.h"
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#ifdef _MSC_VER
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <Windows.h>
+    static long long getTime() {
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft); // 100-nanoseconds since 1-1-1601
+        ULARGE_INTEGER result;
+        result.LowPart = ft.dwLowDateTime;
+        result.HighPart = ft.dwHighDateTime;
+        return result.QuadPart/10;
+    }
+#else
+    #include <sys/time.h> 
+    static long long getTime() {
+        struct timeval tod;
+        gettimeofday(&tod, 0);
+        return 1000000*tod.tv_sec+tod.tv_usec;
+    }
+#endif
+
+using namespace OpenMM;
+using namespace std;
+
+/**
+ * Each thread adds to its own counter, then synchronizes and checks that every other thread
+ * has reached the same point.
+ */
+class CountingTask : public ThreadPool::Task {
+public:
+    CountingTask(int numThreads, int numSteps) : counts(numThreads, 0), numSteps(numSteps), failed(false) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        for (int step = 0; step < numSteps; step++) {
+            counts[threadIndex]++;
+            threads.syncThreads();
+            for (int i = 0; i < (int) counts.size(); i++)
+                if (counts[i] != step+1)
+                    failed = true;
+            threads.syncThreads();
+        }
+    }
+    vector<int> counts;
+    int numSteps;
+    volatile bool failed;
+};
+
+/**
+ * This task does nothing except synchronize.  It is used to measure the cost of a synchronization point.
+ */
+class EmptyTask : public ThreadPool::Task {
+public:
+    EmptyTask(int numSteps) : numSteps(numSteps) {
+    }
+    void execute(ThreadPool& threads, int threadIndex) {
+        for (int step = 0; step < numSteps; step++)
+            threads.syncThreads();
+    }
+    int numSteps;
+};
+
+/**
+ * Count how many times each index is processed.  Optionally, indices owned by thread 0 are made much
+ * slower than the others, so the remaining threads must steal chunks from it.
+ */
+class MarkingTask : public ThreadPool::RangeTask {
+public:
+    MarkingTask(int size, bool unbalanced=false) : marks(size, 0), threadForIndex(size, -1), unbalanced(unbalanced) {
+    }
+    void execute(ThreadPool& threads, int threadIndex, int start, int end) {
+        for (int i = start; i < end; i++) {
+            marks[i]++;
+            threadForIndex[i] = threadIndex;
+            if (unbalanced && i < (int) marks.size()/threads.getNumThreads()) {
+                volatile double sum = 0;
+                for (int j = 0; j < 200000; j++)
+                    sum += j;
+            }
+        }
+    }
+    vector<int> marks, threadForIndex;
+    bool unbalanced;
+};
+
+void runSteps(ThreadPool& threads, ThreadPool::Task& task, int numSteps) {
+    threads.execute(task);
+    for (int step = 0; step < numSteps; step++) {
+        threads.waitForThreads();
+        threads.resumeThreads();
+    }
+    threads.waitForThreads();
+}
+
+void testSynchronization(int spinCount) {
+    const int numThreads = 4;
+    const int numSteps = 200;
+    ThreadPool threads(numThreads);
+    threads.setSpinCount(spinCount);
+    ASSERT_EQUAL(spinCount, threads.getSpinCount());
+    CountingTask task(numThreads, numSteps);
+    runSteps(threads, task, 2*numSteps);
+    ASSERT(!task.failed);
+    for (int i = 0; i < numThreads; i++)
+        ASSERT_EQUAL(numSteps, task.counts[i]);
+}
+
+void testParallelFor() {
+    // Make sure every index in the range is processed exactly once, including when the chunk size does
+    // not divide the range evenly, and that indices outside the range are not touched.
+    
+    const int numThreads = 4;
+    ThreadPool threads(numThreads);
+    for (int chunkSize = 1; chunkSize < 10; chunkSize += 4) {
+        MarkingTask marking(1001);
+        threads.parallelFor(marking, 0, 1001, chunkSize);
+        for (int i = 0; i < 1001; i++)
+            ASSERT_EQUAL(1, marking.marks[i]);
+    }
+    MarkingTask partial(100);
+    threads.parallelFor(partial, 10, 90, 7);
+    for (int i = 0; i < 100; i++)
+        ASSERT_EQUAL(i >= 10 && i < 90 ? 1 : 0, partial.marks[i]);
+    MarkingTask empty(10);
+    threads.parallelFor(empty, 5, 5, 1);
+    for (int i = 0; i < 10; i++)
+        ASSERT_EQUAL(0, empty.marks[i]);
+    
+    // When the first thread's share is much slower than the others, the other threads should steal some
+    // of it.
+    
+    MarkingTask unbalanced(400, true);
+    threads.parallelFor(unbalanced, 0, 400, 1);
+    int stolen = 0;
+    for (int i = 0; i < 400; i++) {
+        ASSERT_EQUAL(1, unbalanced.marks[i]);
+        if (i < 100 && unbalanced.threadForIndex[i] != 0)
+            stolen++;
+    }
+    ASSERT(stolen > 0);
+}
+
+/**
+ * Create a small periodic system for testing.
+ */
+System* createSystem(vector<Vec3>& positions) {
+    const int numParticles = 512;
+    const double boxSize = 3.0;
+    System* system = new System();
+    system->setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    NonbondedForce* nonbonded = new NonbondedForce();
+    nonbonded->setNonbondedMethod(NonbondedForce::CutoffPeriodic);
+    nonbonded->setCutoffDistance(1.0);
+    system->addForce(nonbonded);
+    positions.resize(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; i++) {
+        system->addParticle(1.0);
+        nonbonded->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.2, 0.5);
+        positions[i] = Vec3((i%8)+0.2*genrand_real2(sfmt), ((i/8)%8)+0.2*genrand_real2(sfmt), (i/64)+0.2*genrand_real2(sfmt))*(boxSize/8);
+    }
+    return system;
+}
+
+/**
+ * Compute forces with two sets of properties and make sure they agree.
+ */
+void compareProperties(const map<string, string>& properties1, const map<string, string>& properties2) {
+    vector<Vec3> positions;
+    System* system = createSystem(positions);
+    CpuPlatform platform;
+    VerletIntegrator integrator1(0.001);
+    Context context1(*system, integrator1, platform, properties1);
+    VerletIntegrator integrator2(0.001);
+    Context context2(*system, integrator2, platform, properties2);
+    context1.setPositions(positions);
+    context2.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < system->getNumParticles(); i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-5);
+    for (map<string, string>::const_iterator iter = properties2.begin(); iter != properties2.end(); ++iter)
+        ASSERT_EQUAL(iter->second, platform.getPropertyValue(context2, iter->first));
+    delete system;
+}
+
+/**
+ * Verify that creating a Context with an illegal property value throws an exception.
+ */
+void checkIllegalProperty(const string& name, const string& value) {
+    vector<Vec3> positions;
+    System* system = createSystem(positions);
+    CpuPlatform platform;
+    map<string, string> properties;
+    properties[name] = value;
+    VerletIntegrator integrator(0.001);
+    bool threwException = false;
+    try {
+        Context context(*system, integrator, platform, properties);
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    delete system;
+    ASSERT(threwException);
+}
+
+void testSpinWaitProperty() {
+    map<string, string> properties1, properties2;
+    properties1[CpuPlatform::CpuThreads()] = "4";
+    properties2[CpuPlatform::CpuThreads()] = "4";
+    properties2[CpuPlatform::CpuSpinWait()] = "true";
+    compareProperties(properties1, properties2);
+    checkIllegalProperty(CpuPlatform::CpuSpinWait(), "sometimes");
+}
+
+void testAffinityProperties() {
+    // Every thread is pinned to core 0, since that is the only one we know exists.  The list is shorter
+    // than the number of threads, so it gets repeated, but the property should report the value we set.
+    
+    map<string, string> properties1, properties2;
+    properties1[CpuPlatform::CpuThreads()] = "3";
+    properties2[CpuPlatform::CpuThreads()] = "3";
+    properties2[CpuPlatform::CpuNumaPolicy()] = "local";
+#if defined(__linux__) && defined(__GLIBC__)
+    properties2[CpuPlatform::CpuAffinity()] = "0-0";
+#endif
+    compareProperties(properties1, properties2);
+    checkIllegalProperty(CpuPlatform::CpuNumaPolicy(), "remote");
+    checkIllegalProperty(CpuPlatform::CpuAffinity(), "0-");
+    checkIllegalProperty(CpuPlatform::CpuAffinity(), "3-1");
+    checkIllegalProperty(CpuPlatform::CpuAffinity(), "x");
+}
+
+struct SharedPoolArgs {
+    ThreadPool* threads;
+    bool failed;
+};
+
+/**
+ * This is run by each parent thread in testSharedPool().  Assertions cannot be thrown from here,
+ * so failures are recorded and checked after the thread has been joined.
+ */
+static void* runCountingTasks(void* args) {
+    SharedPoolArgs& shared = *reinterpret_cast<SharedPoolArgs*>(args);
+    ThreadPool& threads = *shared.threads;
+    for (int repeat = 0; repeat < 20; repeat++) {
+        CountingTask task(threads.getNumThreads(), 5);
+        runSteps(threads, task, 10);
+        if (task.failed)
+            shared.failed = true;
+    }
+    return 0;
+}
+
+void testSharedPool() {
+    // Several parent threads run tasks on the same pool at once.  They should take turns.
+    
+    ThreadPool threads(3);
+    const int numParents = 4;
+    vector<pthread_t> parents(numParents);
+    vector<SharedPoolArgs> args(numParents);
+    for (int i = 0; i < numParents; i++) {
+        args[i].threads = &threads;
+        args[i].failed = false;
+        pthread_create(&parents[i], NULL, runCountingTasks, &args[i]);
+    }
+    for (int i = 0; i < numParents; i++)
+        pthread_join(parents[i], NULL);
+    for (int i = 0; i < numParents; i++)
+        ASSERT(!args[i].failed);
+}
+
+struct SimulationArgs {
+    Context* context;
+    int numSteps;
+    bool failed;
+};
+
+/**
+ * This is run by each parent thread in testSharedThreadsProperty().  An exception must not escape
+ * the thread, so it is recorded and checked after the thread has been joined.
+ */
+static void* runSimulation(void* args) {
+    SimulationArgs& simulation = *reinterpret_cast<SimulationArgs*>(args);
+    try {
+        simulation.context->getIntegrator().step(simulation.numSteps);
+    }
+    catch (const exception& ex) {
+        simulation.failed = true;
+    }
+    return 0;
+}
+
+void testSharedThreadsProperty() {
+    // Simulate several Contexts at once using shared threads, and make sure the results match
+    // simulating them one at a time with their own threads.
+    
+    const int numContexts = 3;
+    const int numSteps = 10;
+    vector<Vec3> positions;
+    System* system = createSystem(positions);
+    CpuPlatform platform;
+    map<string, string> properties;
+    properties[CpuPlatform::CpuThreads()] = "2";
+    VerletIntegrator referenceIntegrator(0.001);
+    Context referenceContext(*system, referenceIntegrator, platform, properties);
+    referenceContext.setPositions(positions);
+    referenceIntegrator.step(numSteps);
+    State referenceState = referenceContext.getState(State::Positions);
+    properties[CpuPlatform::CpuSharedThreads()] = "true";
+    vector<VerletIntegrator*> integrators(numContexts);
+    vector<Context*> contexts(numContexts);
+    vector<SimulationArgs> args(numContexts);
+    vector<pthread_t> parents(numContexts);
+    for (int i = 0; i < numContexts; i++) {
+        integrators[i] = new VerletIntegrator(0.001);
+        contexts[i] = new Context(*system, *integrators[i], platform, properties);
+        contexts[i]->setPositions(positions);
+        ASSERT_EQUAL("true", platform.getPropertyValue(*contexts[i], CpuPlatform::CpuSharedThreads()));
+        args[i].context = contexts[i];
+        args[i].numSteps = numSteps;
+        args[i].failed = false;
+    }
+    for (int i = 0; i < numContexts; i++)
+        pthread_create(&parents[i], NULL, runSimulation, &args[i]);
+    for (int i = 0; i < numContexts; i++)
+        pthread_join(parents[i], NULL);
+    for (int i = 0; i < numContexts; i++) {
+        ASSERT(!args[i].failed);
+        State state = contexts[i]->getState(State::Positions);
+        for (int j = 0; j < system->getNumParticles(); j++)
+            ASSERT_EQUAL_VEC(referenceState.getPositions()[j], state.getPositions()[j], 1e-5);
+        delete contexts[i];
+        delete integrators[i];
+    }
+    
+    // A Context that reuses existing shared threads should report the settings they were created with.
+    
+    map<string, string> properties1, properties2;
+    properties1[CpuPlatform::CpuThreads()] = "5";
+    properties1[CpuPlatform::CpuSharedThreads()] = "true";
+    properties1[CpuPlatform::CpuSpinWait()] = "true";
+    properties2[CpuPlatform::CpuThreads()] = "5";
+    properties2[CpuPlatform::CpuSharedThreads()] = "true";
+    VerletIntegrator integrator1(0.001), integrator2(0.001);
+    Context context1(*system, integrator1, platform, properties1);
+    Context context2(*system, integrator2, platform, properties2);
+    ASSERT_EQUAL("true", platform.getPropertyValue(context2, CpuPlatform::CpuSpinWait()));
+    checkIllegalProperty(CpuPlatform::CpuSharedThreads(), "maybe");
+    delete system;
+}
+
+void benchmarkSynchronization() {
+    const int numSteps = 20000;
+    int maxThreads = getNumProcessors();
+    cout << "Threads\tBlocking (us)\tSpinning (us)" << endl;
+    for (int numThreads = 1; ; numThreads = min(2*numThreads, maxThreads)) {
+        cout << numThreads;
+        for (int mode = 0; mode < 2; mode++) {
+            ThreadPool threads(numThreads);
+            threads.setSpinCount(mode == 0 ? 0 : 20000);
+            EmptyTask warmup(100);
+            runSteps(threads, warmup, 100);
+            EmptyTask task(numSteps);
+            long long startTime = getTime();
+            runSteps(threads, task, numSteps);
+            long long endTime = getTime();
+            cout << "\t" << (endTime-startTime)/(double) numSteps;
+        }
+        cout << endl;
+        if (numThreads == maxThreads)
+            break;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        if (!CpuPlatform::isProcessorSupported()) {
+            cout << "CPU is not supported.  Exiting." << endl;
+            return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+            benchmarkSynchronization();
+            return 0;
+        }
+        testSynchronization(0);
+        testSynchronization(20000);
+        testParallelFor();
+        testSpinWaitProperty();
+        testAffinityProperties();
+        testSharedPool();
+        testSharedThreadsProperty();
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -51,7 +51,7 @@ class OPENMM_EXPORT ReferenceBondIxn {
       
          --------------------------------------------------------------------------------------- */
 
-       ~ReferenceBondIxn();
+       virtual ~ReferenceBondIxn();
 
       /**---------------------------------------------------------------------------------------
       
@@ -110,6 +110,16 @@ public:
     void applyToVelocities(std::vector<OpenMM::RealVec>& atomCoordinates,
                      std::vector<OpenMM::RealVec>& velocities, std::vector<RealOpenMM>& inverseMasses, RealOpenMM tolerance);
 
+    /**
+     * Get the parameters describing one constraint.
+     * 
+     * @param index       the index of the constraint to get
+     * @param atom1       the index of the first atom in the constraint
+     * @param atom2       the index of the second atom in the constraint
+     * @param distance    the constrained distance between the two atoms
+     */
+    void getConstraintParameters(int index, int& atom1, int& atom2, RealOpenMM& distance) const;
+
     /**
      * Get the inverse constraint matrix.  Each element represents one column, and contains a list
      * of all non-zero elements in the form (index, value).
@@ -170,6 +170,18 @@ class OPENMM_EXPORT ReferenceDynamics {
          --------------------------------------------------------------------------------------- */
       
       void setReferenceConstraintAlgorithm(ReferenceConstraintAlgorithm* referenceConstraint);
+
+      /**---------------------------------------------------------------------------------------
+      
+         Compute the positions of all virtual sites.  This is called at the end of every step.
+         Subclasses may override it to compute them differently.
+      
+         @param system              the System being integrated
+         @param atomCoordinates     atom coordinates
+      
+         --------------------------------------------------------------------------------------- */
+      
+      virtual void computeVirtualSites(const OpenMM::System& system, std::vector<OpenMM::RealVec>& atomCoordinates);
 };
 
 } // namespace OpenMM
@@ -77,6 +77,7 @@ pme_init(pme_t *       ppme,
  * charge      Array of charges (units of e)
  * box         Simulation cell dimensions (nm)
  * energy      Total energy (will be written in units of kJ/mol)
+ * virial      If not NULL, the virial tensor (will be written in units of kJ/mol)
  */
 int OPENMM_EXPORT
 pme_exec(pme_t       pme,
@@ -84,7 +85,8 @@ pme_exec(pme_t       pme,
          std::vector<OpenMM::RealVec>& forces,
          const std::vector<RealOpenMM>& charges,
          const OpenMM::RealVec  periodicBoxVectors[3],
-         RealOpenMM *    energy);
+         RealOpenMM *    energy,
+         RealOpenMM      virial[3][3] = NULL);
 
 
 
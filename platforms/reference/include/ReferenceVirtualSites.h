@@ -48,6 +48,14 @@ public:
      * Distribute forces from virtual sites to the atoms they are based on.
      */
     static void distributeForces(const OpenMM::System& system, const std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& forces);
+    /**
+     * Compute the position of a single virtual site.
+     */
+    static void computePosition(const OpenMM::System& system, int index, std::vector<OpenMM::RealVec>& atomCoordinates);
+    /**
+     * Distribute the force on a single virtual site to the atoms it is based on.
+     */
+    static void distributeForce(const OpenMM::System& system, int index, const std::vector<OpenMM::RealVec>& atomCoordinates, std::vector<OpenMM::RealVec>& forces);
 };
 
 } // namespace OpenMM
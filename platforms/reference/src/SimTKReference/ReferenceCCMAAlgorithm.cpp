@@ -32,48 +32,79 @@
 #include "openmm/OpenMMException.h"
 #include "openmm/Vec3.h"
 #include "openmm/internal/ThreadPool.h"
+#include <algorithm>
 #include <map>
 
 using std::map;
 using std::pair;
 using std::vector;
 using std::set;
+using std::sort;
+using std::unique;
 using namespace OpenMM;
 
-// This class extracts columns from the inverse matrix one at a time.  It is done in parallel,
-// since this can be very slow.
+// This class inverts the constraint matrix one cluster at a time.  Constraints in different clusters
+// are not coupled, so the matrix is block diagonal and each block can be inverted independently.
+// This is done in parallel, since it can be slow for large systems.
 
-class ExtractMatrixTask : public ThreadPool::Task {
+class InvertClustersTask : public ThreadPool::Task {
 public:
-    ExtractMatrixTask(int numConstraints, vector<vector<pair<int, RealOpenMM> > >& matrix, const vector<RealOpenMM>& distance, RealOpenMM elementCutoff,
-                      const int* qRowStart, const int* qColIndex, const int* rRowStart, const int* rColIndex, const double* qValue, const double* rValue) :
-                numConstraints(numConstraints), matrix(matrix), distance(distance), elementCutoff(elementCutoff), qRowStart(qRowStart), qColIndex(qColIndex),
-                rRowStart(rRowStart), rColIndex(rColIndex), qValue(qValue), rValue(rValue) {
+    InvertClustersTask(const vector<vector<int> >& clusters, const vector<int>& localIndex, const vector<vector<pair<int, double> > >& matrix,
+                       vector<vector<pair<int, RealOpenMM> > >& inverse, const vector<RealOpenMM>& distance, RealOpenMM elementCutoff) :
+                clusters(clusters), localIndex(localIndex), matrix(matrix), inverse(inverse), distance(distance), elementCutoff(elementCutoff) {
     }
     
     void execute(ThreadPool& pool, int threadIndex) {
-        vector<double> rhs(numConstraints);
-        for (int i = threadIndex; i < numConstraints; i += pool.getNumThreads()) {
-            // Extract column i of the inverse matrix.
-
-            for (int j = 0; j < numConstraints; j++)
-                rhs[j] = (i == j ? 1.0 : 0.0);
-            QUERN_multiply_with_q_transpose(numConstraints, qRowStart, qColIndex, qValue, &rhs[0]);
-            QUERN_solve_with_r(numConstraints, rRowStart, rColIndex, rValue, &rhs[0], &rhs[0]);
-            for (int j = 0; j < numConstraints; j++) {
-                double value = rhs[j]*distance[j]/distance[i];
-                if (FABS((RealOpenMM) value) > elementCutoff)
-                    matrix[i].push_back(pair<int, RealOpenMM>(j, (RealOpenMM) value));
+        for (int cluster = threadIndex; cluster < (int) clusters.size(); cluster += pool.getNumThreads()) {
+            // Build the block of the matrix for this cluster, using local constraint indices.
+
+            const vector<int>& constraints = clusters[cluster];
+            int size = constraints.size();
+            vector<int> rowStart, colIndex;
+            vector<double> value;
+            for (int i = 0; i < size; i++) {
+                rowStart.push_back(value.size());
+                const vector<pair<int, double> >& row = matrix[constraints[i]];
+                for (int j = 0; j < (int) row.size(); j++) {
+                    colIndex.push_back(localIndex[row[j].first]);
+                    value.push_back(row[j].second);
+                }
+            }
+            rowStart.push_back(value.size());
+
+            // Invert it using QR, extracting one column of the inverse at a time.  The inverse of a sparse
+            // matrix is generally dense, so each column costs time proportional to the cluster size, and
+            // only the elements above the cutoff are stored.  The total cost is therefore quadratic in the
+            // size of the largest cluster, but linear in the number of clusters.
+
+            int *qRowStart, *qColIndex, *rRowStart, *rColIndex;
+            double *qValue, *rValue;
+            QUERN_compute_qr(size, size, &rowStart[0], &colIndex[0], &value[0], NULL,
+                    &qRowStart, &qColIndex, &qValue, &rRowStart, &rColIndex, &rValue);
+            vector<double> rhs(size);
+            for (int i = 0; i < size; i++) {
+                for (int j = 0; j < size; j++)
+                    rhs[j] = (i == j ? 1.0 : 0.0);
+                QUERN_multiply_with_q_transpose(size, qRowStart, qColIndex, qValue, &rhs[0]);
+                QUERN_solve_with_r(size, rRowStart, rColIndex, rValue, &rhs[0], &rhs[0]);
+                int column = constraints[i];
+                for (int j = 0; j < size; j++) {
+                    double value = rhs[j]*distance[constraints[j]]/distance[column];
+                    if (FABS((RealOpenMM) value) > elementCutoff)
+                        inverse[column].push_back(pair<int, RealOpenMM>(constraints[j], (RealOpenMM) value));
+                }
             }
+            QUERN_free_result(qRowStart, qColIndex, qValue);
+            QUERN_free_result(rRowStart, rColIndex, rValue);
         }
     }
 private:
-    int numConstraints;
-    vector<vector<pair<int, RealOpenMM> > >& matrix;
+    const vector<vector<int> >& clusters;
+    const vector<int>& localIndex;
+    const vector<vector<pair<int, double> > >& matrix;
+    vector<vector<pair<int, RealOpenMM> > >& inverse;
     const vector<RealOpenMM>& distance;
     RealOpenMM elementCutoff;
-    const int *qRowStart, *qColIndex, *rRowStart, *rColIndex;
-    const double *qValue, *rValue;
 };
 
 ReferenceCCMAAlgorithm::ReferenceCCMAAlgorithm(int numberOfAtoms,
@@ -101,14 +132,28 @@ ReferenceCCMAAlgorithm::ReferenceCCMAAlgorithm(int numberOfAtoms,
     }
     if (numberOfConstraints > 0)
     {
-        // Compute the constraint coupling matrix
+        // Record which constraints each atom is involved in.
+
+        vector<vector<int> > atomConstraints(numberOfAtoms);
+        for (int i = 0; i < numberOfConstraints; i++) {
+            atomConstraints[_atomIndices[i].first].push_back(i);
+            atomConstraints[_atomIndices[i].second].push_back(i);
+        }
+
+        // Compute the constraint coupling matrix.  Only constraints that share an atom are coupled,
+        // so the candidates for each row are found from the atoms' constraint lists.
 
         vector<vector<int> > atomAngles(numberOfAtoms);
         for (int i = 0; i < (int) angles.size(); i++)
             atomAngles[angles[i].atom2].push_back(i);
         vector<vector<pair<int, double> > > matrix(numberOfConstraints);
         for (int j = 0; j < numberOfConstraints; j++) {
-            for (int k = 0; k < numberOfConstraints; k++) {
+            vector<int> candidates = atomConstraints[_atomIndices[j].first];
+            candidates.insert(candidates.end(), atomConstraints[_atomIndices[j].second].begin(), atomConstraints[_atomIndices[j].second].end());
+            sort(candidates.begin(), candidates.end());
+            candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+            for (int c = 0; c < (int) candidates.size(); c++) {
+                int k = candidates[c];
                 if (j == k) {
                     matrix[j].push_back(pair<int, double>(j, 1.0));
                     continue;
@@ -139,19 +184,19 @@ ReferenceCCMAAlgorithm::ReferenceCCMAAlgorithm(int numberOfAtoms,
                     atomc = atomk0;
                     scale = invMass0/(invMass0+invMass1);
                 }
-                else if (atomj1 == atomk0) {
+                else {
                     atoma = atomj0;
                     atomb = atomj1;
                     atomc = atomk1;
                     scale = invMass1/(invMass0+invMass1);
                 }
-                else
-                    continue; // These constraints are not connected.
 
                 // Look for a third constraint forming a triangle with these two.
 
                 bool foundConstraint = false;
-                for (int other = 0; other < numberOfConstraints; other++) {
+                const vector<int>& triangleCandidates = atomConstraints[atoma];
+                for (int t = 0; t < (int) triangleCandidates.size(); t++) {
+                    int other = triangleCandidates[t];
                     if ((_atomIndices[other].first == atoma && _atomIndices[other].second == atomc) || (_atomIndices[other].first == atomc && _atomIndices[other].second == atoma)) {
                         double d1 = _distance[j];
                         double d2 = _distance[k];
@@ -176,32 +221,47 @@ ReferenceCCMAAlgorithm::ReferenceCCMAAlgorithm(int numberOfAtoms,
             }
         }
 
-        // Invert it using QR.
+        // Divide the constraints into clusters that are coupled to each other.
 
-        vector<int> matrixRowStart;
-        vector<int> matrixColIndex;
-        vector<double> matrixValue;
+        vector<int> clusterIndex(numberOfConstraints, -1);
+        vector<int> localIndex(numberOfConstraints);
+        vector<vector<int> > clusters;
         for (int i = 0; i < numberOfConstraints; i++) {
-            matrixRowStart.push_back(matrixValue.size());
-            for (int j = 0; j < (int) matrix[i].size(); j++) {
-                pair<int, double> element = matrix[i][j];
-                matrixColIndex.push_back(element.first);
-                matrixValue.push_back(element.second);
+            if (clusterIndex[i] != -1)
+                continue;
+            int cluster = clusters.size();
+            clusters.push_back(vector<int>());
+            vector<int> stack(1, i);
+            clusterIndex[i] = cluster;
+            while (stack.size() > 0) {
+                int constraint = stack.back();
+                stack.pop_back();
+                clusters[cluster].push_back(constraint);
+                for (int j = 0; j < (int) matrix[constraint].size(); j++) {
+                    int other = matrix[constraint][j].first;
+                    if (clusterIndex[other] == -1) {
+                        clusterIndex[other] = cluster;
+                        stack.push_back(other);
+                    }
+                }
             }
+
+            // QUERN requires the columns in each row to be sorted, so keep the constraints in their original order.
+
+            sort(clusters[cluster].begin(), clusters[cluster].end());
+            for (int j = 0; j < (int) clusters[cluster].size(); j++)
+                localIndex[clusters[cluster][j]] = j;
         }
-        matrixRowStart.push_back(matrixValue.size());
-        int *qRowStart, *qColIndex, *rRowStart, *rColIndex;
-        double *qValue, *rValue;
-        QUERN_compute_qr(numberOfConstraints, numberOfConstraints, &matrixRowStart[0], &matrixColIndex[0], &matrixValue[0], NULL,
-                &qRowStart, &qColIndex, &qValue, &rRowStart, &rColIndex, &rValue);
-        vector<double> rhs(numberOfConstraints);
+
+        // Invert each cluster's block of the matrix.
+
         _matrix.resize(numberOfConstraints);
         ThreadPool threads;
-        ExtractMatrixTask task(numberOfConstraints, _matrix, _distance, _elementCutoff, qRowStart, qColIndex, rRowStart, rColIndex, qValue, rValue);
+        InvertClustersTask task(clusters, localIndex, matrix, _matrix, _distance, _elementCutoff);
         threads.execute(task);
         threads.waitForThreads();
-        QUERN_free_result(qRowStart, qColIndex, qValue);
-        QUERN_free_result(rRowStart, rColIndex, rValue);
+        for (int i = 0; i < numberOfConstraints; i++)
+            sort(_matrix[i].begin(), _matrix[i].end());
     }
 }
 
@@ -225,6 +285,12 @@ void ReferenceCCMAAlgorithm::setMaximumNumberOfIterations(int maximumNumberOfIte
     _maximumNumberOfIterations = maximumNumberOfIterations;
 }
 
+void ReferenceCCMAAlgorithm::getConstraintParameters(int index, int& atom1, int& atom2, RealOpenMM& distance) const {
+    atom1 = _atomIndices[index].first;
+    atom2 = _atomIndices[index].second;
+    distance = _distance[index];
+}
+
 void ReferenceCCMAAlgorithm::apply(vector<RealVec>& atomCoordinates,
                                          vector<RealVec>& atomCoordinatesP,
                                          vector<RealOpenMM>& inverseMasses, RealOpenMM tolerance) {
@@ -116,6 +116,10 @@ pme_calculate_bsplines_moduli(pme_t pme)
 
     order = pme->order;
 
+    /* the spline values occupy elements 1 to order, which may be past the end of a small grid */
+    if (nmax < order+1)
+        nmax = order+1;
+
     /* temp storage in this routine */
     data          = (RealOpenMM *) malloc(sizeof(RealOpenMM)*order);
     ddata         = (RealOpenMM *) malloc(sizeof(RealOpenMM)*order);
@@ -168,7 +172,8 @@ pme_calculate_bsplines_moduli(pme_t pme)
         for (i=0;i<ndata;i++)
         {
             sc=ss=0;
-            for (j=0;j<ndata;j++)
+            /* values past the end of the grid wrap around to the start */
+            for (j=0;j<ndata || j<=order;j++)
             {
                 arg=(RealOpenMM) ((2.0*M_PI*i*j)/ndata);
                 sc+=bsplines_data[j]*cos(arg);
@@ -409,7 +414,8 @@ static void
 pme_reciprocal_convolution(pme_t     pme,
                            const RealVec periodicBoxVectors[3],
                            const RealVec recipBoxVectors[3],
-                           RealOpenMM *  energy)
+                           RealOpenMM *  energy,
+                           RealOpenMM    virial[3][3])
 {
     int kx,ky,kz;
     int nx,ny,nz;
@@ -504,12 +510,30 @@ pme_reciprocal_convolution(pme_t     pme,
                 /* Long-range PME contribution to the energy for this frequency */
                 ets2      = eterm*struct2;
                 esum     += ets2;
+
+                /* Contribution to the virial, from the derivative of the energy with respect to a strain of the box */
+                vfactor   = (factor*m2+1)*2/m2;
+                virxx    += ets2*(1-vfactor*mhx*mhx);
+                virxy    -= ets2*vfactor*mhx*mhy;
+                virxz    -= ets2*vfactor*mhx*mhz;
+                viryy    += ets2*(1-vfactor*mhy*mhy);
+                viryz    -= ets2*vfactor*mhy*mhz;
+                virzz    += ets2*(1-vfactor*mhz*mhz);
             }
         }
     }
 
     /* The factor 0.5 is nothing special, but it is better to have it here than inside the loop :-) */
     *energy = (RealOpenMM) (0.5*esum);
+    if (virial != NULL)
+    {
+        virial[0][0] = (RealOpenMM) (0.5*virxx);
+        virial[0][1] = virial[1][0] = (RealOpenMM) (0.5*virxy);
+        virial[0][2] = virial[2][0] = (RealOpenMM) (0.5*virxz);
+        virial[1][1] = (RealOpenMM) (0.5*viryy);
+        virial[1][2] = virial[2][1] = (RealOpenMM) (0.5*viryz);
+        virial[2][2] = (RealOpenMM) (0.5*virzz);
+    }
 }
 
 
@@ -665,7 +689,8 @@ int pme_exec(pme_t       pme,
              vector<RealVec>& forces,
              const vector<RealOpenMM>& charges,
              const RealVec periodicBoxVectors[3],
-             RealOpenMM* energy)
+             RealOpenMM* energy,
+             RealOpenMM virial[3][3])
 {
     /* Routine is called with coordinates in x, a box, and charges in q */
 
@@ -692,7 +717,7 @@ int pme_exec(pme_t       pme,
     fftpack_exec_3d(pme->fftplan,FFTPACK_FORWARD,pme->grid,pme->grid);
 
     /* solve in k-space */
-    pme_reciprocal_convolution(pme,periodicBoxVectors,recipBoxVectors,energy);
+    pme_reciprocal_convolution(pme,periodicBoxVectors,recipBoxVectors,energy,virial);
 
     /* do 3d-invfft */
     fftpack_exec_3d(pme->fftplan,FFTPACK_BACKWARD,pme->grid,pme->grid);
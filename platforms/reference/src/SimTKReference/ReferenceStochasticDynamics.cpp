@@ -27,7 +27,6 @@
 
 #include "SimTKOpenMMUtilities.h"
 #include "ReferenceStochasticDynamics.h"
-#include "ReferenceVirtualSites.h"
 #include "openmm/OpenMMException.h"
 
 #include <cstdio>
@@ -229,6 +228,6 @@ void ReferenceStochasticDynamics::update(const OpenMM::System& system, vector<Re
                atomCoordinates[i][j] = xPrime[i][j];
            }
 
-   ReferenceVirtualSites::computePositions(system, atomCoordinates);
+   computeVirtualSites(system, atomCoordinates);
    incrementTimeStep();
 }
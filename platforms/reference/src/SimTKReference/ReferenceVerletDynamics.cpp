@@ -27,7 +27,6 @@
 
 #include "SimTKOpenMMUtilities.h"
 #include "ReferenceVerletDynamics.h"
-#include "ReferenceVirtualSites.h"
 
 #include <cstdio>
 
@@ -119,28 +118,64 @@ void ReferenceVerletDynamics::update(const OpenMM::System& system, vector<RealVe
    
    // Perform the integration.
    
-   for (int i = 0; i < numberOfAtoms; ++i) {
-       if (masses[i] != zero)
-           for (int j = 0; j < 3; ++j) {
-               velocities[i][j] += inverseMasses[i]*forces[i][j]*getDeltaT();
-               xPrime[i][j] = atomCoordinates[i][j] + velocities[i][j]*getDeltaT();
-           }
-   }
+   updatePart1(numberOfAtoms, atomCoordinates, velocities, forces, inverseMasses, xPrime);
    ReferenceConstraintAlgorithm* referenceConstraintAlgorithm = getReferenceConstraintAlgorithm();
    if (referenceConstraintAlgorithm)
       referenceConstraintAlgorithm->apply(atomCoordinates, xPrime, inverseMasses, tolerance);
    
    // Update the positions and velocities.
    
+   updatePart2(numberOfAtoms, atomCoordinates, velocities, forces, inverseMasses, xPrime);
+
+   computeVirtualSites(system, atomCoordinates);
+   incrementTimeStep();
+}
+
+/**---------------------------------------------------------------------------------------
+
+   First update: compute the unconstrained velocities and positions
+
+   @param numberOfAtoms       number of atoms
+   @param atomCoordinates     atom coordinates
+   @param velocities          velocities
+   @param forces              forces
+   @param inverseMasses       inverse atom masses
+   @param xPrime              xPrime
+
+   --------------------------------------------------------------------------------------- */
+
+void ReferenceVerletDynamics::updatePart1(int numberOfAtoms, vector<RealVec>& atomCoordinates, vector<RealVec>& velocities,
+                                          vector<RealVec>& forces, vector<RealOpenMM>& inverseMasses, vector<RealVec>& xPrime) {
+   for (int i = 0; i < numberOfAtoms; ++i) {
+       if (inverseMasses[i] != 0.0)
+           for (int j = 0; j < 3; ++j) {
+               velocities[i][j] += inverseMasses[i]*forces[i][j]*getDeltaT();
+               xPrime[i][j] = atomCoordinates[i][j] + velocities[i][j]*getDeltaT();
+           }
+   }
+}
+
+/**---------------------------------------------------------------------------------------
+
+   Second update: compute the final velocities and positions from the constrained positions
+
+   @param numberOfAtoms       number of atoms
+   @param atomCoordinates     atom coordinates
+   @param velocities          velocities
+   @param forces              forces
+   @param inverseMasses       inverse atom masses
+   @param xPrime              xPrime
+
+   --------------------------------------------------------------------------------------- */
+
+void ReferenceVerletDynamics::updatePart2(int numberOfAtoms, vector<RealVec>& atomCoordinates, vector<RealVec>& velocities,
+                                          vector<RealVec>& forces, vector<RealOpenMM>& inverseMasses, vector<RealVec>& xPrime) {
    RealOpenMM velocityScale = static_cast<RealOpenMM>(1.0/getDeltaT());
    for (int i = 0; i < numberOfAtoms; ++i) {
-       if (masses[i] != zero)
+       if (inverseMasses[i] != 0.0)
            for (int j = 0; j < 3; ++j) {
                velocities[i][j] = velocityScale*(xPrime[i][j] - atomCoordinates[i][j]);
                atomCoordinates[i][j] = xPrime[i][j];
            }
    }
-
-   ReferenceVirtualSites::computePositions(system, atomCoordinates);
-   incrementTimeStep();
 }
@@ -37,166 +37,171 @@ using namespace std;
 
 void ReferenceVirtualSites::computePositions(const OpenMM::System& system, vector<OpenMM::RealVec>& atomCoordinates) {
     for (int i = 0; i < system.getNumParticles(); i++)
-        if (system.isVirtualSite(i)) {
-            if (dynamic_cast<const TwoParticleAverageSite*>(&system.getVirtualSite(i)) != NULL) {
-                // A two particle average.
-                
-                const TwoParticleAverageSite& site = dynamic_cast<const TwoParticleAverageSite&>(system.getVirtualSite(i));
-                int p1 = site.getParticle(0), p2 = site.getParticle(1);
-                RealOpenMM w1 = site.getWeight(0), w2 = site.getWeight(1);
-                atomCoordinates[i] = atomCoordinates[p1]*w1 + atomCoordinates[p2]*w2;
-            }
-            else if (dynamic_cast<const ThreeParticleAverageSite*>(&system.getVirtualSite(i)) != NULL) {
-                // A three particle average.
-                
-                const ThreeParticleAverageSite& site = dynamic_cast<const ThreeParticleAverageSite&>(system.getVirtualSite(i));
-                int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
-                RealOpenMM w1 = site.getWeight(0), w2 = site.getWeight(1), w3 = site.getWeight(2);
-                atomCoordinates[i] = atomCoordinates[p1]*w1 + atomCoordinates[p2]*w2 + atomCoordinates[p3]*w3;
-            }
-            else if (dynamic_cast<const OutOfPlaneSite*>(&system.getVirtualSite(i)) != NULL) {
-                // An out of plane site.
-                
-                const OutOfPlaneSite& site = dynamic_cast<const OutOfPlaneSite&>(system.getVirtualSite(i));
-                int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
-                RealOpenMM w12 = site.getWeight12(), w13 = site.getWeight13(), wcross = site.getWeightCross();
-                RealVec v12 = atomCoordinates[p2]-atomCoordinates[p1];
-                RealVec v13 = atomCoordinates[p3]-atomCoordinates[p1];
-                RealVec cross = v12.cross(v13);
-                atomCoordinates[i] = atomCoordinates[p1] + v12*w12 + v13*w13 + cross*wcross;
-            }
-            else if (dynamic_cast<const LocalCoordinatesSite*>(&system.getVirtualSite(i)) != NULL) {
-                // A local coordinates site.
-                
-                const LocalCoordinatesSite& site = dynamic_cast<const LocalCoordinatesSite&>(system.getVirtualSite(i));
-                int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
-                RealVec originWeights = site.getOriginWeights();
-                RealVec xWeights = site.getXWeights();
-                RealVec yWeights = site.getYWeights();
-                RealVec localPosition = site.getLocalPosition();
-                RealVec origin = atomCoordinates[p1]*originWeights[0] + atomCoordinates[p2]*originWeights[1] + atomCoordinates[p3]*originWeights[2];
-                RealVec xdir = atomCoordinates[p1]*xWeights[0] + atomCoordinates[p2]*xWeights[1] + atomCoordinates[p3]*xWeights[2];
-                RealVec ydir = atomCoordinates[p1]*yWeights[0] + atomCoordinates[p2]*yWeights[1] + atomCoordinates[p3]*yWeights[2];
-                RealVec zdir = xdir.cross(ydir);
-                xdir /= sqrt(xdir.dot(xdir));
-                zdir /= sqrt(zdir.dot(zdir));
-                ydir = zdir.cross(xdir);
-                atomCoordinates[i] = origin + xdir*localPosition[0] + ydir*localPosition[1] + zdir*localPosition[2];
-            }
-        }
+        if (system.isVirtualSite(i))
+            computePosition(system, i, atomCoordinates);
+}
 
+void ReferenceVirtualSites::computePosition(const OpenMM::System& system, int i, vector<OpenMM::RealVec>& atomCoordinates) {
+    if (dynamic_cast<const TwoParticleAverageSite*>(&system.getVirtualSite(i)) != NULL) {
+        // A two particle average.
+        
+        const TwoParticleAverageSite& site = dynamic_cast<const TwoParticleAverageSite&>(system.getVirtualSite(i));
+        int p1 = site.getParticle(0), p2 = site.getParticle(1);
+        RealOpenMM w1 = site.getWeight(0), w2 = site.getWeight(1);
+        atomCoordinates[i] = atomCoordinates[p1]*w1 + atomCoordinates[p2]*w2;
+    }
+    else if (dynamic_cast<const ThreeParticleAverageSite*>(&system.getVirtualSite(i)) != NULL) {
+        // A three particle average.
+        
+        const ThreeParticleAverageSite& site = dynamic_cast<const ThreeParticleAverageSite&>(system.getVirtualSite(i));
+        int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
+        RealOpenMM w1 = site.getWeight(0), w2 = site.getWeight(1), w3 = site.getWeight(2);
+        atomCoordinates[i] = atomCoordinates[p1]*w1 + atomCoordinates[p2]*w2 + atomCoordinates[p3]*w3;
+    }
+    else if (dynamic_cast<const OutOfPlaneSite*>(&system.getVirtualSite(i)) != NULL) {
+        // An out of plane site.
+        
+        const OutOfPlaneSite& site = dynamic_cast<const OutOfPlaneSite&>(system.getVirtualSite(i));
+        int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
+        RealOpenMM w12 = site.getWeight12(), w13 = site.getWeight13(), wcross = site.getWeightCross();
+        RealVec v12 = atomCoordinates[p2]-atomCoordinates[p1];
+        RealVec v13 = atomCoordinates[p3]-atomCoordinates[p1];
+        RealVec cross = v12.cross(v13);
+        atomCoordinates[i] = atomCoordinates[p1] + v12*w12 + v13*w13 + cross*wcross;
+    }
+    else if (dynamic_cast<const LocalCoordinatesSite*>(&system.getVirtualSite(i)) != NULL) {
+        // A local coordinates site.
+        
+        const LocalCoordinatesSite& site = dynamic_cast<const LocalCoordinatesSite&>(system.getVirtualSite(i));
+        int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
+        RealVec originWeights = site.getOriginWeights();
+        RealVec xWeights = site.getXWeights();
+        RealVec yWeights = site.getYWeights();
+        RealVec localPosition = site.getLocalPosition();
+        RealVec origin = atomCoordinates[p1]*originWeights[0] + atomCoordinates[p2]*originWeights[1] + atomCoordinates[p3]*originWeights[2];
+        RealVec xdir = atomCoordinates[p1]*xWeights[0] + atomCoordinates[p2]*xWeights[1] + atomCoordinates[p3]*xWeights[2];
+        RealVec ydir = atomCoordinates[p1]*yWeights[0] + atomCoordinates[p2]*yWeights[1] + atomCoordinates[p3]*yWeights[2];
+        RealVec zdir = xdir.cross(ydir);
+        xdir /= sqrt(xdir.dot(xdir));
+        zdir /= sqrt(zdir.dot(zdir));
+        ydir = zdir.cross(xdir);
+        atomCoordinates[i] = origin + xdir*localPosition[0] + ydir*localPosition[1] + zdir*localPosition[2];
+    }
 }
 
 void ReferenceVirtualSites::distributeForces(const OpenMM::System& system, const vector<OpenMM::RealVec>& atomCoordinates, vector<OpenMM::RealVec>& forces) {
     for (int i = 0; i < system.getNumParticles(); i++)
-        if (system.isVirtualSite(i)) {
-            RealVec f = forces[i];
-            if (dynamic_cast<const TwoParticleAverageSite*>(&system.getVirtualSite(i)) != NULL) {
-                // A two particle average.
-                
-                const TwoParticleAverageSite& site = dynamic_cast<const TwoParticleAverageSite&>(system.getVirtualSite(i));
-                int p1 = site.getParticle(0), p2 = site.getParticle(1);
-                RealOpenMM w1 = site.getWeight(0), w2 = site.getWeight(1);
-                forces[p1] += f*w1;
-                forces[p2] += f*w2;
-            }
-            else if (dynamic_cast<const ThreeParticleAverageSite*>(&system.getVirtualSite(i)) != NULL) {
-                // A three particle average.
-                
-                const ThreeParticleAverageSite& site = dynamic_cast<const ThreeParticleAverageSite&>(system.getVirtualSite(i));
-                int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
-                RealOpenMM w1 = site.getWeight(0), w2 = site.getWeight(1), w3 = site.getWeight(2);
-                forces[p1] += f*w1;
-                forces[p2] += f*w2;
-                forces[p3] += f*w3;
-            }
-            else if (dynamic_cast<const OutOfPlaneSite*>(&system.getVirtualSite(i)) != NULL) {
-                // An out of plane site.
-                
-                const OutOfPlaneSite& site = dynamic_cast<const OutOfPlaneSite&>(system.getVirtualSite(i));
-                int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
-                RealOpenMM w12 = site.getWeight12(), w13 = site.getWeight13(), wcross = site.getWeightCross();
-                RealVec v12 = atomCoordinates[p2]-atomCoordinates[p1];
-                RealVec v13 = atomCoordinates[p3]-atomCoordinates[p1];
-                RealVec f2(w12*f[0] - wcross*v13[2]*f[1] + wcross*v13[1]*f[2],
-                           wcross*v13[2]*f[0] + w12*f[1] - wcross*v13[0]*f[2],
-                          -wcross*v13[1]*f[0] + wcross*v13[0]*f[1] + w12*f[2]);
-                RealVec f3(w13*f[0] + wcross*v12[2]*f[1] - wcross*v12[1]*f[2],
-                          -wcross*v12[2]*f[0] + w13*f[1] + wcross*v12[0]*f[2],
-                           wcross*v12[1]*f[0] - wcross*v12[0]*f[1] + w13*f[2]);
-                forces[p1] += f-f2-f3;
-                forces[p2] += f2;
-                forces[p3] += f3;
-            }
-            else if (dynamic_cast<const LocalCoordinatesSite*>(&system.getVirtualSite(i)) != NULL) {
-                // A local coordinates site.
-                
-                const LocalCoordinatesSite& site = dynamic_cast<const LocalCoordinatesSite&>(system.getVirtualSite(i));
-                int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
-                RealVec originWeights = site.getOriginWeights();
-                RealVec wx = site.getXWeights();
-                RealVec wy = site.getYWeights();
-                RealVec localPosition = site.getLocalPosition();
-                RealVec xdir = atomCoordinates[p1]*wx[0] + atomCoordinates[p2]*wx[1] + atomCoordinates[p3]*wx[2];
-                RealVec ydir = atomCoordinates[p1]*wy[0] + atomCoordinates[p2]*wy[1] + atomCoordinates[p3]*wy[2];
-                RealVec zdir = xdir.cross(ydir);
-                RealOpenMM invNormXdir = 1.0/SQRT(xdir.dot(xdir));
-                RealOpenMM invNormZdir = 1.0/SQRT(zdir.dot(zdir));
-                RealVec dx = xdir*invNormXdir;
-                RealVec dz = zdir*invNormZdir;
-                RealVec dy = dz.cross(dx);
-                
-                // The derivatives for this case are very complicated.  They were computed with SymPy then simplified by hand.
-                
-                RealOpenMM t11 = (wx[0]*ydir[0]-wy[0]*xdir[0])*invNormZdir;
-                RealOpenMM t12 = (wx[0]*ydir[1]-wy[0]*xdir[1])*invNormZdir;
-                RealOpenMM t13 = (wx[0]*ydir[2]-wy[0]*xdir[2])*invNormZdir;
-                RealOpenMM t21 = (wx[1]*ydir[0]-wy[1]*xdir[0])*invNormZdir;
-                RealOpenMM t22 = (wx[1]*ydir[1]-wy[1]*xdir[1])*invNormZdir;
-                RealOpenMM t23 = (wx[1]*ydir[2]-wy[1]*xdir[2])*invNormZdir;
-                RealOpenMM t31 = (wx[2]*ydir[0]-wy[2]*xdir[0])*invNormZdir;
-                RealOpenMM t32 = (wx[2]*ydir[1]-wy[2]*xdir[1])*invNormZdir;
-                RealOpenMM t33 = (wx[2]*ydir[2]-wy[2]*xdir[2])*invNormZdir;
-                RealOpenMM sx1 = t13*dz[1]-t12*dz[2];
-                RealOpenMM sy1 = t11*dz[2]-t13*dz[0];
-                RealOpenMM sz1 = t12*dz[0]-t11*dz[1];
-                RealOpenMM sx2 = t23*dz[1]-t22*dz[2];
-                RealOpenMM sy2 = t21*dz[2]-t23*dz[0];
-                RealOpenMM sz2 = t22*dz[0]-t21*dz[1];
-                RealOpenMM sx3 = t33*dz[1]-t32*dz[2];
-                RealOpenMM sy3 = t31*dz[2]-t33*dz[0];
-                RealOpenMM sz3 = t32*dz[0]-t31*dz[1];
-                RealVec wxScaled = wx*invNormXdir;
-                RealVec fp1 = localPosition*f[0];
-                RealVec fp2 = localPosition*f[1];
-                RealVec fp3 = localPosition*f[2];
-                forces[p1][0] += fp1[0]*wxScaled[0]*(1-dx[0]*dx[0]) + fp1[2]*(dz[0]*sx1    ) + fp1[1]*((-dx[0]*dy[0]      )*wxScaled[0] + dy[0]*sx1 - dx[1]*t12 - dx[2]*t13) + f[0]*originWeights[0];
-                forces[p1][1] += fp1[0]*wxScaled[0]*( -dx[0]*dx[1]) + fp1[2]*(dz[0]*sy1+t13) + fp1[1]*((-dx[1]*dy[0]-dz[2])*wxScaled[0] + dy[0]*sy1 + dx[1]*t11);
-                forces[p1][2] += fp1[0]*wxScaled[0]*( -dx[0]*dx[2]) + fp1[2]*(dz[0]*sz1-t12) + fp1[1]*((-dx[2]*dy[0]+dz[1])*wxScaled[0] + dy[0]*sz1 + dx[2]*t11);
-                forces[p2][0] += fp1[0]*wxScaled[1]*(1-dx[0]*dx[0]) + fp1[2]*(dz[0]*sx2    ) + fp1[1]*((-dx[0]*dy[0]      )*wxScaled[1] + dy[0]*sx2 - dx[1]*t22 - dx[2]*t23) + f[0]*originWeights[1];
-                forces[p2][1] += fp1[0]*wxScaled[1]*( -dx[0]*dx[1]) + fp1[2]*(dz[0]*sy2+t23) + fp1[1]*((-dx[1]*dy[0]-dz[2])*wxScaled[1] + dy[0]*sy2 + dx[1]*t21);
-                forces[p2][2] += fp1[0]*wxScaled[1]*( -dx[0]*dx[2]) + fp1[2]*(dz[0]*sz2-t22) + fp1[1]*((-dx[2]*dy[0]+dz[1])*wxScaled[1] + dy[0]*sz2 + dx[2]*t21);
-                forces[p3][0] += fp1[0]*wxScaled[2]*(1-dx[0]*dx[0]) + fp1[2]*(dz[0]*sx3    ) + fp1[1]*((-dx[0]*dy[0]      )*wxScaled[2] + dy[0]*sx3 - dx[1]*t32 - dx[2]*t33) + f[0]*originWeights[2];
-                forces[p3][1] += fp1[0]*wxScaled[2]*( -dx[0]*dx[1]) + fp1[2]*(dz[0]*sy3+t33) + fp1[1]*((-dx[1]*dy[0]-dz[2])*wxScaled[2] + dy[0]*sy3 + dx[1]*t31);
-                forces[p3][2] += fp1[0]*wxScaled[2]*( -dx[0]*dx[2]) + fp1[2]*(dz[0]*sz3-t32) + fp1[1]*((-dx[2]*dy[0]+dz[1])*wxScaled[2] + dy[0]*sz3 + dx[2]*t31);
-                forces[p1][0] += fp2[0]*wxScaled[0]*( -dx[1]*dx[0]) + fp2[2]*(dz[1]*sx1-t13) - fp2[1]*(( dx[0]*dy[1]-dz[2])*wxScaled[0] - dy[1]*sx1 - dx[0]*t12);
-                forces[p1][1] += fp2[0]*wxScaled[0]*(1-dx[1]*dx[1]) + fp2[2]*(dz[1]*sy1    ) - fp2[1]*(( dx[1]*dy[1]      )*wxScaled[0] - dy[1]*sy1 + dx[0]*t11 + dx[2]*t13) + f[1]*originWeights[0];
-                forces[p1][2] += fp2[0]*wxScaled[0]*( -dx[1]*dx[2]) + fp2[2]*(dz[1]*sz1+t11) - fp2[1]*(( dx[2]*dy[1]+dz[0])*wxScaled[0] - dy[1]*sz1 - dx[2]*t12);
-                forces[p2][0] += fp2[0]*wxScaled[1]*( -dx[1]*dx[0]) + fp2[2]*(dz[1]*sx2-t23) - fp2[1]*(( dx[0]*dy[1]-dz[2])*wxScaled[1] - dy[1]*sx2 - dx[0]*t22);
-                forces[p2][1] += fp2[0]*wxScaled[1]*(1-dx[1]*dx[1]) + fp2[2]*(dz[1]*sy2    ) - fp2[1]*(( dx[1]*dy[1]      )*wxScaled[1] - dy[1]*sy2 + dx[0]*t21 + dx[2]*t23) + f[1]*originWeights[1];
-                forces[p2][2] += fp2[0]*wxScaled[1]*( -dx[1]*dx[2]) + fp2[2]*(dz[1]*sz2+t21) - fp2[1]*(( dx[2]*dy[1]+dz[0])*wxScaled[1] - dy[1]*sz2 - dx[2]*t22);
-                forces[p3][0] += fp2[0]*wxScaled[2]*( -dx[1]*dx[0]) + fp2[2]*(dz[1]*sx3-t33) - fp2[1]*(( dx[0]*dy[1]-dz[2])*wxScaled[2] - dy[1]*sx3 - dx[0]*t32);
-                forces[p3][1] += fp2[0]*wxScaled[2]*(1-dx[1]*dx[1]) + fp2[2]*(dz[1]*sy3    ) - fp2[1]*(( dx[1]*dy[1]      )*wxScaled[2] - dy[1]*sy3 + dx[0]*t31 + dx[2]*t33) + f[1]*originWeights[2];
-                forces[p3][2] += fp2[0]*wxScaled[2]*( -dx[1]*dx[2]) + fp2[2]*(dz[1]*sz3+t31) - fp2[1]*(( dx[2]*dy[1]+dz[0])*wxScaled[2] - dy[1]*sz3 - dx[2]*t32);
-                forces[p1][0] += fp3[0]*wxScaled[0]*( -dx[2]*dx[0]) + fp3[2]*(dz[2]*sx1+t12) + fp3[1]*((-dx[0]*dy[2]-dz[1])*wxScaled[0] + dy[2]*sx1 + dx[0]*t13);
-                forces[p1][1] += fp3[0]*wxScaled[0]*( -dx[2]*dx[1]) + fp3[2]*(dz[2]*sy1-t11) + fp3[1]*((-dx[1]*dy[2]+dz[0])*wxScaled[0] + dy[2]*sy1 + dx[1]*t13);
-                forces[p1][2] += fp3[0]*wxScaled[0]*(1-dx[2]*dx[2]) + fp3[2]*(dz[2]*sz1    ) + fp3[1]*((-dx[2]*dy[2]      )*wxScaled[0] + dy[2]*sz1 - dx[0]*t11 - dx[1]*t12) + f[2]*originWeights[0];
-                forces[p2][0] += fp3[0]*wxScaled[1]*( -dx[2]*dx[0]) + fp3[2]*(dz[2]*sx2+t22) + fp3[1]*((-dx[0]*dy[2]-dz[1])*wxScaled[1] + dy[2]*sx2 + dx[0]*t23);
-                forces[p2][1] += fp3[0]*wxScaled[1]*( -dx[2]*dx[1]) + fp3[2]*(dz[2]*sy2-t21) + fp3[1]*((-dx[1]*dy[2]+dz[0])*wxScaled[1] + dy[2]*sy2 + dx[1]*t23);
-                forces[p2][2] += fp3[0]*wxScaled[1]*(1-dx[2]*dx[2]) + fp3[2]*(dz[2]*sz2    ) + fp3[1]*((-dx[2]*dy[2]      )*wxScaled[1] + dy[2]*sz2 - dx[0]*t21 - dx[1]*t22) + f[2]*originWeights[1];
-                forces[p3][0] += fp3[0]*wxScaled[2]*( -dx[2]*dx[0]) + fp3[2]*(dz[2]*sx3+t32) + fp3[1]*((-dx[0]*dy[2]-dz[1])*wxScaled[2] + dy[2]*sx3 + dx[0]*t33);
-                forces[p3][1] += fp3[0]*wxScaled[2]*( -dx[2]*dx[1]) + fp3[2]*(dz[2]*sy3-t31) + fp3[1]*((-dx[1]*dy[2]+dz[0])*wxScaled[2] + dy[2]*sy3 + dx[1]*t33);
-                forces[p3][2] += fp3[0]*wxScaled[2]*(1-dx[2]*dx[2]) + fp3[2]*(dz[2]*sz3    ) + fp3[1]*((-dx[2]*dy[2]      )*wxScaled[2] + dy[2]*sz3 - dx[0]*t31 - dx[1]*t32) + f[2]*originWeights[2];
-           }
-        }
+        if (system.isVirtualSite(i))
+            distributeForce(system, i, atomCoordinates, forces);
+}
+
+void ReferenceVirtualSites::distributeForce(const OpenMM::System& system, int i, const vector<OpenMM::RealVec>& atomCoordinates, vector<OpenMM::RealVec>& forces) {
+    RealVec f = forces[i];
+    if (dynamic_cast<const TwoParticleAverageSite*>(&system.getVirtualSite(i)) != NULL) {
+        // A two particle average.
+        
+        const TwoParticleAverageSite& site = dynamic_cast<const TwoParticleAverageSite&>(system.getVirtualSite(i));
+        int p1 = site.getParticle(0), p2 = site.getParticle(1);
+        RealOpenMM w1 = site.getWeight(0), w2 = site.getWeight(1);
+        forces[p1] += f*w1;
+        forces[p2] += f*w2;
+    }
+    else if (dynamic_cast<const ThreeParticleAverageSite*>(&system.getVirtualSite(i)) != NULL) {
+        // A three particle average.
+        
+        const ThreeParticleAverageSite& site = dynamic_cast<const ThreeParticleAverageSite&>(system.getVirtualSite(i));
+        int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
+        RealOpenMM w1 = site.getWeight(0), w2 = site.getWeight(1), w3 = site.getWeight(2);
+        forces[p1] += f*w1;
+        forces[p2] += f*w2;
+        forces[p3] += f*w3;
+    }
+    else if (dynamic_cast<const OutOfPlaneSite*>(&system.getVirtualSite(i)) != NULL) {
+        // An out of plane site.
+        
+        const OutOfPlaneSite& site = dynamic_cast<const OutOfPlaneSite&>(system.getVirtualSite(i));
+        int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
+        RealOpenMM w12 = site.getWeight12(), w13 = site.getWeight13(), wcross = site.getWeightCross();
+        RealVec v12 = atomCoordinates[p2]-atomCoordinates[p1];
+        RealVec v13 = atomCoordinates[p3]-atomCoordinates[p1];
+        RealVec f2(w12*f[0] - wcross*v13[2]*f[1] + wcross*v13[1]*f[2],
+                   wcross*v13[2]*f[0] + w12*f[1] - wcross*v13[0]*f[2],
+                  -wcross*v13[1]*f[0] + wcross*v13[0]*f[1] + w12*f[2]);
+        RealVec f3(w13*f[0] + wcross*v12[2]*f[1] - wcross*v12[1]*f[2],
+                  -wcross*v12[2]*f[0] + w13*f[1] + wcross*v12[0]*f[2],
+                   wcross*v12[1]*f[0] - wcross*v12[0]*f[1] + w13*f[2]);
+        forces[p1] += f-f2-f3;
+        forces[p2] += f2;
+        forces[p3] += f3;
+    }
+    else if (dynamic_cast<const LocalCoordinatesSite*>(&system.getVirtualSite(i)) != NULL) {
+        // A local coordinates site.
+        
+        const LocalCoordinatesSite& site = dynamic_cast<const LocalCoordinatesSite&>(system.getVirtualSite(i));
+        int p1 = site.getParticle(0), p2 = site.getParticle(1), p3 = site.getParticle(2);
+        RealVec originWeights = site.getOriginWeights();
+        RealVec wx = site.getXWeights();
+        RealVec wy = site.getYWeights();
+        RealVec localPosition = site.getLocalPosition();
+        RealVec xdir = atomCoordinates[p1]*wx[0] + atomCoordinates[p2]*wx[1] + atomCoordinates[p3]*wx[2];
+        RealVec ydir = atomCoordinates[p1]*wy[0] + atomCoordinates[p2]*wy[1] + atomCoordinates[p3]*wy[2];
+        RealVec zdir = xdir.cross(ydir);
+        RealOpenMM invNormXdir = 1.0/SQRT(xdir.dot(xdir));
+        RealOpenMM invNormZdir = 1.0/SQRT(zdir.dot(zdir));
+        RealVec dx = xdir*invNormXdir;
+        RealVec dz = zdir*invNormZdir;
+        RealVec dy = dz.cross(dx);
+        
+        // The derivatives for this case are very complicated.  They were computed with SymPy then simplified by hand.
+        
+        RealOpenMM t11 = (wx[0]*ydir[0]-wy[0]*xdir[0])*invNormZdir;
+        RealOpenMM t12 = (wx[0]*ydir[1]-wy[0]*xdir[1])*invNormZdir;
+        RealOpenMM t13 = (wx[0]*ydir[2]-wy[0]*xdir[2])*invNormZdir;
+        RealOpenMM t21 = (wx[1]*ydir[0]-wy[1]*xdir[0])*invNormZdir;
+        RealOpenMM t22 = (wx[1]*ydir[1]-wy[1]*xdir[1])*invNormZdir;
+        RealOpenMM t23 = (wx[1]*ydir[2]-wy[1]*xdir[2])*invNormZdir;
+        RealOpenMM t31 = (wx[2]*ydir[0]-wy[2]*xdir[0])*invNormZdir;
+        RealOpenMM t32 = (wx[2]*ydir[1]-wy[2]*xdir[1])*invNormZdir;
+        RealOpenMM t33 = (wx[2]*ydir[2]-wy[2]*xdir[2])*invNormZdir;
+        RealOpenMM sx1 = t13*dz[1]-t12*dz[2];
+        RealOpenMM sy1 = t11*dz[2]-t13*dz[0];
+        RealOpenMM sz1 = t12*dz[0]-t11*dz[1];
+        RealOpenMM sx2 = t23*dz[1]-t22*dz[2];
+        RealOpenMM sy2 = t21*dz[2]-t23*dz[0];
+        RealOpenMM sz2 = t22*dz[0]-t21*dz[1];
+        RealOpenMM sx3 = t33*dz[1]-t32*dz[2];
+        RealOpenMM sy3 = t31*dz[2]-t33*dz[0];
+        RealOpenMM sz3 = t32*dz[0]-t31*dz[1];
+        RealVec wxScaled = wx*invNormXdir;
+        RealVec fp1 = localPosition*f[0];
+        RealVec fp2 = localPosition*f[1];
+        RealVec fp3 = localPosition*f[2];
+        forces[p1][0] += fp1[0]*wxScaled[0]*(1-dx[0]*dx[0]) + fp1[2]*(dz[0]*sx1    ) + fp1[1]*((-dx[0]*dy[0]      )*wxScaled[0] + dy[0]*sx1 - dx[1]*t12 - dx[2]*t13) + f[0]*originWeights[0];
+        forces[p1][1] += fp1[0]*wxScaled[0]*( -dx[0]*dx[1]) + fp1[2]*(dz[0]*sy1+t13) + fp1[1]*((-dx[1]*dy[0]-dz[2])*wxScaled[0] + dy[0]*sy1 + dx[1]*t11);
+        forces[p1][2] += fp1[0]*wxScaled[0]*( -dx[0]*dx[2]) + fp1[2]*(dz[0]*sz1-t12) + fp1[1]*((-dx[2]*dy[0]+dz[1])*wxScaled[0] + dy[0]*sz1 + dx[2]*t11);
+        forces[p2][0] += fp1[0]*wxScaled[1]*(1-dx[0]*dx[0]) + fp1[2]*(dz[0]*sx2    ) + fp1[1]*((-dx[0]*dy[0]      )*wxScaled[1] + dy[0]*sx2 - dx[1]*t22 - dx[2]*t23) + f[0]*originWeights[1];
+        forces[p2][1] += fp1[0]*wxScaled[1]*( -dx[0]*dx[1]) + fp1[2]*(dz[0]*sy2+t23) + fp1[1]*((-dx[1]*dy[0]-dz[2])*wxScaled[1] + dy[0]*sy2 + dx[1]*t21);
+        forces[p2][2] += fp1[0]*wxScaled[1]*( -dx[0]*dx[2]) + fp1[2]*(dz[0]*sz2-t22) + fp1[1]*((-dx[2]*dy[0]+dz[1])*wxScaled[1] + dy[0]*sz2 + dx[2]*t21);
+        forces[p3][0] += fp1[0]*wxScaled[2]*(1-dx[0]*dx[0]) + fp1[2]*(dz[0]*sx3    ) + fp1[1]*((-dx[0]*dy[0]      )*wxScaled[2] + dy[0]*sx3 - dx[1]*t32 - dx[2]*t33) + f[0]*originWeights[2];
+        forces[p3][1] += fp1[0]*wxScaled[2]*( -dx[0]*dx[1]) + fp1[2]*(dz[0]*sy3+t33) + fp1[1]*((-dx[1]*dy[0]-dz[2])*wxScaled[2] + dy[0]*sy3 + dx[1]*t31);
+        forces[p3][2] += fp1[0]*wxScaled[2]*( -dx[0]*dx[2]) + fp1[2]*(dz[0]*sz3-t32) + fp1[1]*((-dx[2]*dy[0]+dz[1])*wxScaled[2] + dy[0]*sz3 + dx[2]*t31);
+        forces[p1][0] += fp2[0]*wxScaled[0]*( -dx[1]*dx[0]) + fp2[2]*(dz[1]*sx1-t13) - fp2[1]*(( dx[0]*dy[1]-dz[2])*wxScaled[0] - dy[1]*sx1 - dx[0]*t12);
+        forces[p1][1] += fp2[0]*wxScaled[0]*(1-dx[1]*dx[1]) + fp2[2]*(dz[1]*sy1    ) - fp2[1]*(( dx[1]*dy[1]      )*wxScaled[0] - dy[1]*sy1 + dx[0]*t11 + dx[2]*t13) + f[1]*originWeights[0];
+        forces[p1][2] += fp2[0]*wxScaled[0]*( -dx[1]*dx[2]) + fp2[2]*(dz[1]*sz1+t11) - fp2[1]*(( dx[2]*dy[1]+dz[0])*wxScaled[0] - dy[1]*sz1 - dx[2]*t12);
+        forces[p2][0] += fp2[0]*wxScaled[1]*( -dx[1]*dx[0]) + fp2[2]*(dz[1]*sx2-t23) - fp2[1]*(( dx[0]*dy[1]-dz[2])*wxScaled[1] - dy[1]*sx2 - dx[0]*t22);
+        forces[p2][1] += fp2[0]*wxScaled[1]*(1-dx[1]*dx[1]) + fp2[2]*(dz[1]*sy2    ) - fp2[1]*(( dx[1]*dy[1]      )*wxScaled[1] - dy[1]*sy2 + dx[0]*t21 + dx[2]*t23) + f[1]*originWeights[1];
+        forces[p2][2] += fp2[0]*wxScaled[1]*( -dx[1]*dx[2]) + fp2[2]*(dz[1]*sz2+t21) - fp2[1]*(( dx[2]*dy[1]+dz[0])*wxScaled[1] - dy[1]*sz2 - dx[2]*t22);
+        forces[p3][0] += fp2[0]*wxScaled[2]*( -dx[1]*dx[0]) + fp2[2]*(dz[1]*sx3-t33) - fp2[1]*(( dx[0]*dy[1]-dz[2])*wxScaled[2] - dy[1]*sx3 - dx[0]*t32);
+        forces[p3][1] += fp2[0]*wxScaled[2]*(1-dx[1]*dx[1]) + fp2[2]*(dz[1]*sy3    ) - fp2[1]*(( dx[1]*dy[1]      )*wxScaled[2] - dy[1]*sy3 + dx[0]*t31 + dx[2]*t33) + f[1]*originWeights[2];
+        forces[p3][2] += fp2[0]*wxScaled[2]*( -dx[1]*dx[2]) + fp2[2]*(dz[1]*sz3+t31) - fp2[1]*(( dx[2]*dy[1]+dz[0])*wxScaled[2] - dy[1]*sz3 - dx[2]*t32);
+        forces[p1][0] += fp3[0]*wxScaled[0]*( -dx[2]*dx[0]) + fp3[2]*(dz[2]*sx1+t12) + fp3[1]*((-dx[0]*dy[2]-dz[1])*wxScaled[0] + dy[2]*sx1 + dx[0]*t13);
+        forces[p1][1] += fp3[0]*wxScaled[0]*( -dx[2]*dx[1]) + fp3[2]*(dz[2]*sy1-t11) + fp3[1]*((-dx[1]*dy[2]+dz[0])*wxScaled[0] + dy[2]*sy1 + dx[1]*t13);
+        forces[p1][2] += fp3[0]*wxScaled[0]*(1-dx[2]*dx[2]) + fp3[2]*(dz[2]*sz1    ) + fp3[1]*((-dx[2]*dy[2]      )*wxScaled[0] + dy[2]*sz1 - dx[0]*t11 - dx[1]*t12) + f[2]*originWeights[0];
+        forces[p2][0] += fp3[0]*wxScaled[1]*( -dx[2]*dx[0]) + fp3[2]*(dz[2]*sx2+t22) + fp3[1]*((-dx[0]*dy[2]-dz[1])*wxScaled[1] + dy[2]*sx2 + dx[0]*t23);
+        forces[p2][1] += fp3[0]*wxScaled[1]*( -dx[2]*dx[1]) + fp3[2]*(dz[2]*sy2-t21) + fp3[1]*((-dx[1]*dy[2]+dz[0])*wxScaled[1] + dy[2]*sy2 + dx[1]*t23);
+        forces[p2][2] += fp3[0]*wxScaled[1]*(1-dx[2]*dx[2]) + fp3[2]*(dz[2]*sz2    ) + fp3[1]*((-dx[2]*dy[2]      )*wxScaled[1] + dy[2]*sz2 - dx[0]*t21 - dx[1]*t22) + f[2]*originWeights[1];
+        forces[p3][0] += fp3[0]*wxScaled[2]*( -dx[2]*dx[0]) + fp3[2]*(dz[2]*sx3+t32) + fp3[1]*((-dx[0]*dy[2]-dz[1])*wxScaled[2] + dy[2]*sx3 + dx[0]*t33);
+        forces[p3][1] += fp3[0]*wxScaled[2]*( -dx[2]*dx[1]) + fp3[2]*(dz[2]*sy3-t31) + fp3[1]*((-dx[1]*dy[2]+dz[0])*wxScaled[2] + dy[2]*sy3 + dx[1]*t33);
+        forces[p3][2] += fp3[0]*wxScaled[2]*(1-dx[2]*dx[2]) + fp3[2]*(dz[2]*sz3    ) + fp3[1]*((-dx[2]*dy[2]      )*wxScaled[2] + dy[2]*sz3 - dx[0]*t31 - dx[1]*t32) + f[2]*originWeights[2];
+    }
 }
@@ -34,21 +34,67 @@
 #endif
 #include "CpuPmeKernels.h"
 #include "SimTKOpenMMRealType.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/internal/hardware.h"
 #include "openmm/internal/vectorize.h"
 #include <cmath>
+#include <cstdio>
 #include <cstring>
 #include <sstream>
+#ifdef WIN32
+  #include <process.h>
+  #define getpid _getpid
+#else
+  #include <unistd.h>
+#endif
 
 using namespace OpenMM;
 using namespace std;
 
-static const int PME_ORDER = 5;
-
 bool CpuCalcPmeReciprocalForceKernel::hasInitializedThreads = false;
-int CpuCalcPmeReciprocalForceKernel::numThreads = 0;
+pthread_mutex_t CpuCalcPmeReciprocalForceKernel::planLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Find the grid point a particle's B-splines start from, and its fractional offset from that point.
+ */
+static inline void computeGridPosition(const float* posq, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& recipBoxVec0, const fvec4& recipBoxVec1,
+        const fvec4& recipBoxVec2, const fvec4& gridSize, const ivec4& gridSizeInt, ivec4& gridIndex, fvec4& dr) {
+    fvec4 pos(posq);
+    float posInBox[4];
+    (pos-boxSize*floor(pos*invBoxSize)).store(posInBox);
+    fvec4 t = posInBox[0]*recipBoxVec0 + posInBox[1]*recipBoxVec1 + posInBox[2]*recipBoxVec2;
+    t = (t-floor(t))*gridSize;
+    ivec4 ti = t;
+    dr = t-ti;
+    gridIndex = ti-(gridSizeInt&ti==gridSizeInt);
+}
+
+/**
+ * Record the x index of the first grid point each particle's charge is spread to.  This is used to
+ * assign particles to the grid slabs owned by the threads.
+ */
+static void findGridIndexX(int start, int end, float* posq, int* gridIndexX, int gridx, int gridy, int gridz, Vec3* periodicBoxVectors, Vec3* recipBoxVectors) {
+    fvec4 boxSize((float) periodicBoxVectors[0][0], (float) periodicBoxVectors[1][1], (float) periodicBoxVectors[2][2], 0);
+    fvec4 invBoxSize((float) recipBoxVectors[0][0], (float) recipBoxVectors[1][1], (float) recipBoxVectors[2][2], 0);
+    fvec4 recipBoxVec0((float) recipBoxVectors[0][0], (float) recipBoxVectors[0][1], (float) recipBoxVectors[0][2], 0);
+    fvec4 recipBoxVec1((float) recipBoxVectors[1][0], (float) recipBoxVectors[1][1], (float) recipBoxVectors[1][2], 0);
+    fvec4 recipBoxVec2((float) recipBoxVectors[2][0], (float) recipBoxVectors[2][1], (float) recipBoxVectors[2][2], 0);
+    fvec4 gridSize(gridx, gridy, gridz, 0);
+    ivec4 gridSizeInt(gridx, gridy, gridz, 0);
+    for (int i = start; i < end; i++) {
+        ivec4 gridIndex;
+        fvec4 dr;
+        computeGridPosition(&posq[4*i], boxSize, invBoxSize, recipBoxVec0, recipBoxVec1, recipBoxVec2, gridSize, gridSizeInt, gridIndex, dr);
+        gridIndexX[i] = gridIndex[0]; // This is negative when a simulation blows up and coordinates become NaN.
+    }
+}
 
-static void spreadCharge(int start, int end, float* posq, float* grid, int gridx, int gridy, int gridz, int numParticles, Vec3* periodicBoxVectors, Vec3* recipBoxVectors) {
+/**
+ * Spread the charges of a set of particles onto a slab of the grid.  The slab begins at x index gridxStart and contains
+ * numPlanes planes, which must be enough to hold every grid point the particles touch.
+ */
+template <int ORDER>
+static void spreadCharge(const vector<int>& particles, float* posq, float* grid, int gridxStart, int numPlanes, int gridx, int gridy, int gridz, Vec3* periodicBoxVectors, Vec3* recipBoxVectors) {
     float temp[4];
     fvec4 boxSize((float) periodicBoxVectors[0][0], (float) periodicBoxVectors[1][1], (float) periodicBoxVectors[2][2], 0);
     fvec4 invBoxSize((float) recipBoxVectors[0][0], (float) recipBoxVectors[1][1], (float) recipBoxVectors[2][2], 0);
@@ -58,78 +104,71 @@ static void spreadCharge(int start, int end, float* posq, float* grid, int gridx
     fvec4 gridSize(gridx, gridy, gridz, 0);
     ivec4 gridSizeInt(gridx, gridy, gridz, 0);
     fvec4 one(1);
-    fvec4 scale(1.0f/(PME_ORDER-1));
+    fvec4 scale(1.0f/(ORDER-1));
     const float epsilonFactor = sqrt(ONE_4PI_EPS0);
-    memset(grid, 0, sizeof(float)*gridx*gridy*gridz);
-    for (int i = start; i < end; i++) {
+    memset(grid, 0, sizeof(float)*numPlanes*gridy*gridz);
+    for (int p = 0; p < (int) particles.size(); p++) {
         // Find the position relative to the nearest grid point.
         
-        fvec4 pos(&posq[4*i]);
-        float posInBox[4];
-        (pos-boxSize*floor(pos*invBoxSize)).store(posInBox);
-        fvec4 t = posInBox[0]*recipBoxVec0 + posInBox[1]*recipBoxVec1 + posInBox[2]*recipBoxVec2;
-        t = (t-floor(t))*gridSize;
-        ivec4 ti = t;
-        fvec4 dr = t-ti;
-        ivec4 gridIndex = ti-(gridSizeInt&ti==gridSizeInt);
+        int i = particles[p];
+        ivec4 gridIndex;
+        fvec4 dr;
+        computeGridPosition(&posq[4*i], boxSize, invBoxSize, recipBoxVec0, recipBoxVec1, recipBoxVec2, gridSize, gridSizeInt, gridIndex, dr);
         
         // Compute the B-spline coefficients.
         
-        fvec4 data[PME_ORDER];
-        data[PME_ORDER-1] = 0.0f;
+        fvec4 data[ORDER];
+        data[ORDER-1] = 0.0f;
         data[1] = dr;
         data[0] = one-dr;
-        for (int j = 3; j < PME_ORDER; j++) {
+        for (int j = 3; j < ORDER; j++) {
             fvec4 div(1.0f/(j-1));
             data[j-1] = div*dr*data[j-2];
             for (int k = 1; k < j-1; k++)
                 data[j-k-1] = div*((dr+k)*data[j-k-2]+(fvec4(j-k)-dr)*data[j-k-1]);
             data[0] = div*(one-dr)*data[0];
         }
-        data[PME_ORDER-1] = scale*dr*data[PME_ORDER-2];
-        for (int j = 1; j < (PME_ORDER-1); j++)
-            data[PME_ORDER-j-1] = scale*((dr+j)*data[PME_ORDER-j-2]+(fvec4(PME_ORDER-j)-dr)*data[PME_ORDER-j-1]);
+        data[ORDER-1] = scale*dr*data[ORDER-2];
+        for (int j = 1; j < (ORDER-1); j++)
+            data[ORDER-j-1] = scale*((dr+j)*data[ORDER-j-2]+(fvec4(ORDER-j)-dr)*data[ORDER-j-1]);
         data[0] = scale*(one-dr)*data[0];
         
         // Spread the charges.
         
-        int gridIndexX = gridIndex[0];
+        int gridIndexX = gridIndex[0]-gridxStart;
         int gridIndexY = gridIndex[1];
         int gridIndexZ = gridIndex[2];
-        if (gridIndexX < 0)
-            return; // This happens when a simulation blows up and coordinates become NaN.
-        int zindex[PME_ORDER];
-        for (int j = 0; j < PME_ORDER; j++) {
+        int zindex[ORDER];
+        for (int j = 0; j < ORDER; j++) {
             zindex[j] = gridIndexZ+j;
             zindex[j] -= (zindex[j] >= gridz ? gridz : 0);
         }
         float charge = epsilonFactor*posq[4*i+3];
         fvec4 zdata0to3(data[0][2], data[1][2], data[2][2], data[3][2]);
-        float zdata4 = data[4][2];
-        if (gridIndexZ+4 < gridz) {
-            for (int ix = 0; ix < PME_ORDER; ix++) {
-                int xbase = gridIndexX+ix;
-                xbase -= (xbase >= gridx ? gridx : 0);
-                xbase = xbase*gridy*gridz;
+        float zdata[ORDER];
+        for (int j = 4; j < ORDER; j++)
+            zdata[j] = data[j][2];
+        if (gridIndexZ+ORDER-1 < gridz) {
+            for (int ix = 0; ix < ORDER; ix++) {
+                int xbase = (gridIndexX+ix)*gridy*gridz;
                 float xdata = charge*data[ix][0];
-                for (int iy = 0; iy < PME_ORDER; iy++) {
+                for (int iy = 0; iy < ORDER; iy++) {
                     int ybase = gridIndexY+iy;
                     ybase -= (ybase >= gridy ? gridy : 0);
                     ybase = xbase + ybase*gridz;
                     float multiplier = xdata*data[iy][1];
                     fvec4 add0to3 = zdata0to3*multiplier;
                     (fvec4(&grid[ybase+gridIndexZ])+add0to3).store(&grid[ybase+gridIndexZ]);
-                    grid[ybase+zindex[4]] += multiplier*zdata4;
+                    for (int iz = 4; iz < ORDER; iz++)
+                        grid[ybase+gridIndexZ+iz] += multiplier*zdata[iz];
                 }
             }
         }
         else {
-            for (int ix = 0; ix < PME_ORDER; ix++) {
-                int xbase = gridIndexX+ix;
-                xbase -= (xbase >= gridx ? gridx : 0);
-                xbase = xbase*gridy*gridz;
+            for (int ix = 0; ix < ORDER; ix++) {
+                int xbase = (gridIndexX+ix)*gridy*gridz;
                 float xdata = charge*data[ix][0];
-                for (int iy = 0; iy < PME_ORDER; iy++) {
+                for (int iy = 0; iy < ORDER; iy++) {
                     int ybase = gridIndexY+iy;
                     ybase -= (ybase >= gridy ? gridy : 0);
                     ybase = xbase + ybase*gridz;
@@ -140,13 +179,37 @@ static void spreadCharge(int start, int end, float* posq, float* grid, int gridx
                     grid[ybase+zindex[1]] += temp[1];
                     grid[ybase+zindex[2]] += temp[2];
                     grid[ybase+zindex[3]] += temp[3];
-                    grid[ybase+zindex[4]] += multiplier*zdata4;
+                    for (int iz = 4; iz < ORDER; iz++)
+                        grid[ybase+zindex[iz]] += multiplier*zdata[iz];
                 }
             }
         }
     }
 }
 
+/**
+ * Call the version of spreadCharge() that is specialized for the interpolation order.
+ */
+static void spreadCharge(int order, const vector<int>& particles, float* posq, float* grid, int gridxStart, int numPlanes, int gridx, int gridy, int gridz, Vec3* periodicBoxVectors, Vec3* recipBoxVectors) {
+    switch (order) {
+        case 4:
+            spreadCharge<4>(particles, posq, grid, gridxStart, numPlanes, gridx, gridy, gridz, periodicBoxVectors, recipBoxVectors);
+            break;
+        case 5:
+            spreadCharge<5>(particles, posq, grid, gridxStart, numPlanes, gridx, gridy, gridz, periodicBoxVectors, recipBoxVectors);
+            break;
+        case 6:
+            spreadCharge<6>(particles, posq, grid, gridxStart, numPlanes, gridx, gridy, gridz, periodicBoxVectors, recipBoxVectors);
+            break;
+        case 7:
+            spreadCharge<7>(particles, posq, grid, gridxStart, numPlanes, gridx, gridy, gridz, periodicBoxVectors, recipBoxVectors);
+            break;
+        case 8:
+            spreadCharge<8>(particles, posq, grid, gridxStart, numPlanes, gridx, gridy, gridz, periodicBoxVectors, recipBoxVectors);
+            break;
+    }
+}
+
 static void computeReciprocalEterm(int start, int end, int gridx, int gridy, int gridz, vector<float>& recipEterm, double alpha, vector<float>* bsplineModuli, Vec3* periodicBoxVectors, Vec3* recipBoxVectors) {
     const unsigned int zsize = gridz/2+1;
     const unsigned int yzsize = gridy*zsize;
@@ -177,12 +240,15 @@ static void computeReciprocalEterm(int start, int end, int gridx, int gridy, int
     }
 }
 
-static double reciprocalEnergy(int start, int end, fftwf_complex* grid, int gridx, int gridy, int gridz, double alpha, vector<float>* bsplineModuli, Vec3* periodicBoxVectors, Vec3* recipBoxVectors) {
+static double reciprocalEnergy(int start, int end, fftwf_complex* grid, int gridx, int gridy, int gridz, double alpha, vector<float>* bsplineModuli, Vec3* periodicBoxVectors, Vec3* recipBoxVectors, double* virial) {
     const unsigned int zsizeHalf = gridz/2+1;
     const unsigned int yzsizeHalf = gridy*zsizeHalf;
     const float scaleFactor = (float) (M_PI*periodicBoxVectors[0][0]*periodicBoxVectors[1][1]*periodicBoxVectors[2][2]);
     const float recipExpFactor = (float) (M_PI*M_PI/(alpha*alpha));
     double energy = 0.0;
+    if (virial != NULL)
+        for (int i = 0; i < 6; i++)
+            virial[i] = 0.0;
 
     int firstz = (start == 0 ? 1 : 0);
     for (int kx = start; kx < end; kx++) {
@@ -215,11 +281,26 @@ static double reciprocalEnergy(int start, int end, fftwf_complex* grid, int grid
                 int index = kx1*yzsizeHalf + ky1*zsizeHalf + kz1;
                 float gridReal = grid[index][0];
                 float gridImag = grid[index][1];
-                energy += eterm*(gridReal*gridReal+gridImag*gridImag);
+                float ets2 = eterm*(gridReal*gridReal+gridImag*gridImag);
+                energy += ets2;
+                if (virial != NULL) {
+                    // The derivative of this term with respect to a strain of the box gives its virial.
+                    
+                    float vfactor = 2*(recipExpFactor*m2+1)/m2;
+                    virial[0] += ets2*(1-vfactor*mhx*mhx);
+                    virial[1] += ets2*(1-vfactor*mhy*mhy);
+                    virial[2] += ets2*(1-vfactor*mhz*mhz);
+                    virial[3] -= ets2*vfactor*mhx*mhy;
+                    virial[4] -= ets2*vfactor*mhx*mhz;
+                    virial[5] -= ets2*vfactor*mhy*mhz;
+                }
             }
             firstz = 0;
         }
     }
+    if (virial != NULL)
+        for (int i = 0; i < 6; i++)
+            virial[i] *= 0.5;
     return 0.5*energy;
 }
 
@@ -241,6 +322,7 @@ static void reciprocalConvolution(int start, int end, fftwf_complex* grid, int g
     }
 }
 
+template <int ORDER>
 static void interpolateForces(int start, int end, float* posq, float* force, float* grid, int gridx, int gridy, int gridz, int numParticles, Vec3* periodicBoxVectors, Vec3* recipBoxVectors) {
     fvec4 boxSize((float) periodicBoxVectors[0][0], (float) periodicBoxVectors[1][1], (float) periodicBoxVectors[2][2], 0);
     fvec4 invBoxSize((float) recipBoxVectors[0][0], (float) recipBoxVectors[1][1], (float) recipBoxVectors[2][2], 0);
@@ -250,28 +332,23 @@ static void interpolateForces(int start, int end, float* posq, float* force, flo
     fvec4 gridSize(gridx, gridy, gridz, 0);
     ivec4 gridSizeInt(gridx, gridy, gridz, 0);
     fvec4 one(1);
-    fvec4 scale(1.0f/(PME_ORDER-1));
+    fvec4 scale(1.0f/(ORDER-1));
     const float epsilonFactor = sqrt(ONE_4PI_EPS0);
     for (int i = start; i < end; i++) {
         // Find the position relative to the nearest grid point.
         
-        fvec4 pos(&posq[4*i]);
-        float posInBox[4];
-        (pos-boxSize*floor(pos*invBoxSize)).store(posInBox);
-        fvec4 t = posInBox[0]*recipBoxVec0 + posInBox[1]*recipBoxVec1 + posInBox[2]*recipBoxVec2;
-        t = (t-floor(t))*gridSize;
-        ivec4 ti = t;
-        fvec4 dr = t-ti;
-        ivec4 gridIndex = ti-(gridSizeInt&ti==gridSizeInt);
+        ivec4 gridIndex;
+        fvec4 dr;
+        computeGridPosition(&posq[4*i], boxSize, invBoxSize, recipBoxVec0, recipBoxVec1, recipBoxVec2, gridSize, gridSizeInt, gridIndex, dr);
         
         // Compute the B-spline coefficients.
         
-        fvec4 data[PME_ORDER];
-        fvec4 ddata[PME_ORDER];
-        data[PME_ORDER-1] = 0.0f;
+        fvec4 data[ORDER];
+        fvec4 ddata[ORDER];
+        data[ORDER-1] = 0.0f;
         data[1] = dr;
         data[0] = one-dr;
-        for (int j = 3; j < PME_ORDER; j++) {
+        for (int j = 3; j < ORDER; j++) {
             fvec4 div(1.0f/(j-1));
             data[j-1] = div*dr*data[j-2];
             for (int k = 1; k < j-1; k++)
@@ -279,11 +356,11 @@ static void interpolateForces(int start, int end, float* posq, float* force, flo
             data[0] = div*(one-dr)*data[0];
         }
         ddata[0] = -data[0];
-        for (int j = 1; j < PME_ORDER; j++)
+        for (int j = 1; j < ORDER; j++)
             ddata[j] = data[j-1]-data[j];
-        data[PME_ORDER-1] = scale*dr*data[PME_ORDER-2];
-        for (int j = 1; j < (PME_ORDER-1); j++)
-            data[PME_ORDER-j-1] = scale*((dr+j)*data[PME_ORDER-j-2]+(fvec4(PME_ORDER-j)-dr)*data[PME_ORDER-j-1]);
+        data[ORDER-1] = scale*dr*data[ORDER-2];
+        for (int j = 1; j < (ORDER-1); j++)
+            data[ORDER-j-1] = scale*((dr+j)*data[ORDER-j-2]+(fvec4(ORDER-j)-dr)*data[ORDER-j-1]);
         data[0] = scale*(one-dr)*data[0];
                 
         // Compute the force on this atom.
@@ -293,16 +370,16 @@ static void interpolateForces(int start, int end, float* posq, float* force, flo
         int gridIndexZ = gridIndex[2];
         if (gridIndexX < 0)
             return; // This happens when a simulation blows up and coordinates become NaN.
-        int zindex[PME_ORDER];
-        for (int j = 0; j < PME_ORDER; j++) {
+        int zindex[ORDER];
+        for (int j = 0; j < ORDER; j++) {
             zindex[j] = gridIndexZ+j;
             zindex[j] -= (zindex[j] >= gridz ? gridz : 0);
         }
-        fvec4 zdata[PME_ORDER];
-        for (int j = 0; j < PME_ORDER; j++)
+        fvec4 zdata[ORDER];
+        for (int j = 0; j < ORDER; j++)
             zdata[j] = fvec4(data[j][2], data[j][2], ddata[j][2], 0);
         fvec4 f = 0.0f;
-        for (int ix = 0; ix < PME_ORDER; ix++) {
+        for (int ix = 0; ix < ORDER; ix++) {
             int xbase = gridIndexX+ix;
             xbase -= (xbase >= gridx ? gridx : 0);
             xbase = xbase*gridy*gridz;
@@ -310,7 +387,7 @@ static void interpolateForces(int start, int end, float* posq, float* force, flo
             float ddx = ddata[ix][0];
             fvec4 xdata(ddx, dx, dx, 0);
 
-            for (int iy = 0; iy < PME_ORDER; iy++) {
+            for (int iy = 0; iy < ORDER; iy++) {
                 int ybase = gridIndexY+iy;
                 ybase -= (ybase >= gridy ? gridy : 0);
                 ybase = xbase + ybase*gridz;
@@ -318,7 +395,7 @@ static void interpolateForces(int start, int end, float* posq, float* force, flo
                 float ddy = ddata[iy][1];
                 fvec4 xydata = xdata*fvec4(dy, ddy, dy, 0);
 
-                for (int iz = 0; iz < PME_ORDER; iz++) {
+                for (int iz = 0; iz < ORDER; iz++) {
                     fvec4 gridValue(grid[ybase+zindex[iz]]);
                     f = f+xydata*zdata[iz]*gridValue;
                 }
@@ -333,76 +410,106 @@ static void interpolateForces(int start, int end, float* posq, float* force, flo
     }
 }
 
-class CpuCalcPmeReciprocalForceKernel::ThreadData {
+/**
+ * Call the version of interpolateForces() that is specialized for the interpolation order.
+ */
+static void interpolateForces(int order, int start, int end, float* posq, float* force, float* grid, int gridx, int gridy, int gridz, int numParticles, Vec3* periodicBoxVectors, Vec3* recipBoxVectors) {
+    switch (order) {
+        case 4:
+            interpolateForces<4>(start, end, posq, force, grid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors);
+            break;
+        case 5:
+            interpolateForces<5>(start, end, posq, force, grid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors);
+            break;
+        case 6:
+            interpolateForces<6>(start, end, posq, force, grid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors);
+            break;
+        case 7:
+            interpolateForces<7>(start, end, posq, force, grid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors);
+            break;
+        case 8:
+            interpolateForces<8>(start, end, posq, force, grid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors);
+            break;
+    }
+}
+
+class CpuCalcPmeReciprocalForceKernel::ComputeTask : public ThreadPool::Task {
 public:
-    CpuCalcPmeReciprocalForceKernel& owner;
-    int index;
-    float* tempGrid;
-    ThreadData(CpuCalcPmeReciprocalForceKernel& owner, int index) : owner(owner), index(index), tempGrid(NULL) {
+    ComputeTask(CpuCalcPmeReciprocalForceKernel& owner) : owner(owner) {
     }
+    void execute(ThreadPool& threads, int threadIndex) {
+        owner.runWorkerThread(threads, threadIndex);
+    }
+    CpuCalcPmeReciprocalForceKernel& owner;
 };
 
-static void* threadBody(void* args) {
-    CpuCalcPmeReciprocalForceKernel::ThreadData& data = *reinterpret_cast<CpuCalcPmeReciprocalForceKernel::ThreadData*>(args);
-    data.owner.runThread(data.index);
-    if (data.tempGrid != NULL)
-        fftwf_free(data.tempGrid);
-    delete &data;
+static void* mainThreadBody(void* args) {
+    reinterpret_cast<CpuCalcPmeReciprocalForceKernel*>(args)->runMainThread();
     return 0;
 }
 
+void CpuCalcPmeReciprocalForceKernel::setThreadPool(ThreadPool& threads) {
+    if (this->threads != NULL)
+        throw OpenMMException("CpuCalcPmeReciprocalForceKernel: setThreadPool() must be called before initialize()");
+    this->threads = &threads;
+}
+
+void CpuCalcPmeReciprocalForceKernel::setInterpolationOrder(int order) {
+    if (order < 4 || order > 8)
+        throw OpenMMException("CpuCalcPmeReciprocalForceKernel: The interpolation order must be between 4 and 8");
+    pmeOrder = order;
+}
+
 void CpuCalcPmeReciprocalForceKernel::initialize(int xsize, int ysize, int zsize, int numParticles, double alpha) {
-    if (!hasInitializedThreads) {
-        numThreads = getNumProcessors();
+    if (threads == NULL) {
+        // No ThreadPool was provided, so create our own.
+
+        int numThreads = getNumProcessors();
         char* threadsEnv = getenv("OPENMM_CPU_THREADS");
         if (threadsEnv != NULL)
             stringstream(threadsEnv) >> numThreads;
-        fftwf_init_threads();
-        hasInitializedThreads = true;
+        threads = new ThreadPool(numThreads);
+        ownsThreads = true;
     }
+    numThreads = threads->getNumThreads();
     gridx = findFFTDimension(xsize, false);
     gridy = findFFTDimension(ysize, false);
     gridz = findFFTDimension(zsize, true);
     this->numParticles = numParticles;
     this->alpha = alpha;
     force.resize(4*numParticles);
+    particleGridIndexX.resize(numParticles);
     recipEterm.resize(gridx*gridy*gridz);
+    threadEnergy.resize(numThreads);
+    threadVirial.resize(6*numThreads);
     
-    // Initialize threads.
+    // Each thread spreads charge onto a slab of the grid containing the planes it owns, plus
+    // the pmeOrder-1 planes after them that its particles can overlap.
     
-    pthread_cond_init(&startCondition, NULL);
-    pthread_cond_init(&endCondition, NULL);
-    pthread_cond_init(&mainThreadStartCondition, NULL);
-    pthread_cond_init(&mainThreadEndCondition, NULL);
-    pthread_mutex_init(&lock, NULL);
-    thread.resize(numThreads);
+    threadGrid.resize(numThreads);
+    threadParticles.resize(numThreads);
     for (int i = 0; i < numThreads; i++) {
-        ThreadData* data = new ThreadData(*this, i);
-        threadData.push_back(data);
-        pthread_create(&thread[i], NULL, threadBody, data);
-        data->tempGrid = (float*) fftwf_malloc(sizeof(float)*(gridx*gridy*gridz+3));
+        int numPlanes = ((i+1)*gridx)/numThreads - (i*gridx)/numThreads + pmeOrder-1;
+        threadGrid[i] = (float*) fftwf_malloc(sizeof(float)*(numPlanes*gridy*gridz+3));
     }
-    pthread_create(&mainThread, NULL, threadBody, new ThreadData(*this, -1));
     
     // Initialize FFTW.
     
-    realGrid = threadData[0]->tempGrid;
+    realGrid = (float*) fftwf_malloc(sizeof(float)*(gridx*gridy*gridz+3));
     complexGrid = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*gridx*gridy*(gridz/2+1));
-    fftwf_plan_with_nthreads(numThreads);
-    forwardFFT = fftwf_plan_dft_r2c_3d(gridx, gridy, gridz, realGrid, complexGrid, FFTW_MEASURE);
-    backwardFFT = fftwf_plan_dft_c2r_3d(gridx, gridy, gridz, complexGrid, realGrid, FFTW_MEASURE);
-    hasCreatedPlan = true;
+    createPlans();
     
-    // Initialize the b-spline moduli.
+    // Initialize the b-spline moduli.  The spline values occupy elements 1 through pmeOrder, which may
+    // extend past the end of a grid dimension as small as the order itself.
 
-    int maxSize = max(max(gridx, gridy), gridz);
-    vector<double> data(PME_ORDER);
-    vector<double> ddata(PME_ORDER);
+    int maxSize = max(max(max(gridx, gridy), gridz), pmeOrder+1);
+    vector<double> data(pmeOrder);
+    vector<double> ddata(pmeOrder);
     vector<double> bsplinesData(maxSize);
-    data[PME_ORDER-1] = 0.0;
+    data[pmeOrder-1] = 0.0;
     data[1] = 0.0;
     data[0] = 1.0;
-    for (int i = 3; i < PME_ORDER; i++) {
+    for (int i = 3; i < pmeOrder; i++) {
         double div = 1.0/(i-1.0);
         data[i-1] = 0.0;
         for (int j = 1; j < (i-1); j++)
@@ -413,16 +520,16 @@ void CpuCalcPmeReciprocalForceKernel::initialize(int xsize, int ysize, int zsize
     // Differentiate.
 
     ddata[0] = -data[0];
-    for (int i = 1; i < PME_ORDER; i++)
+    for (int i = 1; i < pmeOrder; i++)
         ddata[i] = data[i-1]-data[i];
-    double div = 1.0/(PME_ORDER-1);
-    data[PME_ORDER-1] = 0.0;
-    for (int i = 1; i < (PME_ORDER-1); i++)
-        data[PME_ORDER-i-1] = div*(i*data[PME_ORDER-i-2]+(PME_ORDER-i)*data[PME_ORDER-i-1]);
+    double div = 1.0/(pmeOrder-1);
+    data[pmeOrder-1] = 0.0;
+    for (int i = 1; i < (pmeOrder-1); i++)
+        data[pmeOrder-i-1] = div*(i*data[pmeOrder-i-2]+(pmeOrder-i)*data[pmeOrder-i-1]);
     data[0] = div*data[0];
     for (int i = 0; i < maxSize; i++)
         bsplinesData[i] = 0.0;
-    for (int i = 1; i <= PME_ORDER; i++)
+    for (int i = 1; i <= pmeOrder; i++)
         bsplinesData[i] = data[i-1];
 
     // Evaluate the actual bspline moduli for X/Y/Z.
@@ -432,11 +539,12 @@ void CpuCalcPmeReciprocalForceKernel::initialize(int xsize, int ysize, int zsize
     bsplineModuli[2].resize(gridz);
     for (int dim = 0; dim < 3; dim++) {
         int ndata = bsplineModuli[dim].size();
+        int numValues = max(ndata, pmeOrder+1); // Values past the end of the grid wrap around to the start.
         vector<float>& moduli = bsplineModuli[dim];
         for (int i = 0; i < ndata; i++) {
             double sc = 0.0;
             double ss = 0.0;
-            for (int j = 0; j < ndata; j++) {
+            for (int j = 0; j < numValues; j++) {
                 double arg = (2.0*M_PI*i*j)/ndata;
                 sc += bsplinesData[j]*cos(arg);
                 ss += bsplinesData[j]*sin(arg);
@@ -447,22 +555,75 @@ void CpuCalcPmeReciprocalForceKernel::initialize(int xsize, int ysize, int zsize
             if (moduli[i] < 1.0e-7f)
                 moduli[i] = (moduli[i-1]+moduli[i+1])*0.5f;
     }
+    
+    // Start the thread that coordinates the calculation.
+    
+    isFinished = true;
+    pthread_cond_init(&startCondition, NULL);
+    pthread_cond_init(&endCondition, NULL);
+    pthread_mutex_init(&lock, NULL);
+    pthread_create(&mainThread, NULL, mainThreadBody, this);
+    hasCreatedThread = true;
+}
+
+void CpuCalcPmeReciprocalForceKernel::createPlans() {
+    // Planning the FFTs can be slow, so if a wisdom directory has been specified, save what FFTW learns
+    // to a file there and reuse it the next time a grid of the same size is planned with the same number
+    // of threads.
+    
+    string wisdomFile;
+    char* wisdomDir = getenv("OPENMM_CPU_PME_WISDOM");
+    if (wisdomDir != NULL && wisdomDir[0] != 0) {
+        stringstream name;
+        name << wisdomDir << "/pme-wisdom-" << gridx << "x" << gridy << "x" << gridz << "-" << numThreads << ".fftw";
+        wisdomFile = name.str();
+    }
+    char* patientEnv = getenv("OPENMM_CPU_PME_PATIENT");
+    unsigned int flags = (patientEnv != NULL && string(patientEnv) != "0" && string(patientEnv) != "false" ? FFTW_PATIENT : FFTW_MEASURE);
+    
+    // The FFTW planner and its wisdom are shared by all kernels in the process.
+    
+    pthread_mutex_lock(&planLock);
+    if (!hasInitializedThreads) {
+        fftwf_init_threads();
+        hasInitializedThreads = true;
+    }
+    fftwf_plan_with_nthreads(numThreads);
+    if (wisdomFile.size() > 0) {
+        fftwf_forget_wisdom();
+        hasLoadedWisdom = (fftwf_import_wisdom_from_filename(wisdomFile.c_str()) != 0);
+    }
+    forwardFFT = fftwf_plan_dft_r2c_3d(gridx, gridy, gridz, realGrid, complexGrid, flags);
+    backwardFFT = fftwf_plan_dft_c2r_3d(gridx, gridy, gridz, complexGrid, realGrid, flags);
+    hasCreatedPlan = true;
+    if (wisdomFile.size() > 0) {
+        // Write to a temporary file first so another process never sees a partially written one.
+        
+        stringstream tempFile;
+        tempFile << wisdomFile << "." << getpid() << ".tmp";
+        if (!fftwf_export_wisdom_to_filename(tempFile.str().c_str()) || rename(tempFile.str().c_str(), wisdomFile.c_str()) != 0)
+            remove(tempFile.str().c_str());
+    }
+    pthread_mutex_unlock(&planLock);
 }
 
 CpuCalcPmeReciprocalForceKernel::~CpuCalcPmeReciprocalForceKernel() {
-    isDeleted = true;
-    pthread_mutex_lock(&lock);
-    pthread_cond_broadcast(&startCondition);
-    pthread_cond_broadcast(&mainThreadStartCondition);
-    pthread_mutex_unlock(&lock);
-    for (int i = 0; i < (int) thread.size(); i++)
-        pthread_join(thread[i], NULL);
-    pthread_join(mainThread, NULL);
-    pthread_mutex_destroy(&lock);
-    pthread_cond_destroy(&startCondition);
-    pthread_cond_destroy(&endCondition);
-    pthread_cond_destroy(&mainThreadStartCondition);
-    pthread_cond_destroy(&mainThreadEndCondition);
+    if (hasCreatedThread) {
+        pthread_mutex_lock(&lock);
+        isDeleted = true;
+        pthread_cond_signal(&startCondition);
+        pthread_mutex_unlock(&lock);
+        pthread_join(mainThread, NULL);
+        pthread_mutex_destroy(&lock);
+        pthread_cond_destroy(&startCondition);
+        pthread_cond_destroy(&endCondition);
+    }
+    if (ownsThreads)
+        delete threads;
+    for (int i = 0; i < (int) threadGrid.size(); i++)
+        fftwf_free(threadGrid[i]);
+    if (realGrid != NULL)
+        fftwf_free(realGrid);
     if (complexGrid != NULL)
         fftwf_free(complexGrid);
     if (hasCreatedPlan) {
@@ -471,92 +632,117 @@ CpuCalcPmeReciprocalForceKernel::~CpuCalcPmeReciprocalForceKernel() {
     }
 }
 
-void CpuCalcPmeReciprocalForceKernel::runThread(int index) {
-    if (index == -1) {
-        // This is the main thread that coordinates all the other ones.
+void CpuCalcPmeReciprocalForceKernel::runMainThread() {
+    // This thread coordinates the worker threads, and executes the FFTs between the phases they perform.
+    
+    ComputeTask task(*this);
+    pthread_mutex_lock(&lock);
+    while (true) {
+        // Wait for the signal to start.
         
-        pthread_mutex_lock(&lock);
-        while (true) {
-            // Wait for the signal to start.
-            
-            pthread_cond_wait(&mainThreadStartCondition, &lock);
-            if (isDeleted)
-                break;
-            posq = io->getPosq();
-            advanceThreads(); // Signal threads to perform charge spreading.
-            advanceThreads(); // Signal threads to sum the charge grids.
-            fftwf_execute_dft_r2c(forwardFFT, realGrid, complexGrid);
-            if (lastBoxVectors[0] != periodicBoxVectors[0] || lastBoxVectors[1] != periodicBoxVectors[1] || lastBoxVectors[2] != periodicBoxVectors[2])
-                advanceThreads(); // Signal threads to compute the reciprocal scale factors.
-            if (includeEnergy)
-                advanceThreads(); // Signal threads to compute energy.
-            advanceThreads(); // Signal threads to perform reciprocal convolution.
-            fftwf_execute_dft_c2r(backwardFFT, complexGrid, realGrid);
-            advanceThreads(); // Signal threads to interpolate forces.
-            isFinished = true;
-            lastBoxVectors[0] = periodicBoxVectors[0];
-            lastBoxVectors[1] = periodicBoxVectors[1];
-            lastBoxVectors[2] = periodicBoxVectors[2];
-            pthread_cond_signal(&mainThreadEndCondition);
-        }
+        while (isFinished && !isDeleted)
+            pthread_cond_wait(&startCondition, &lock);
+        if (isDeleted)
+            break;
         pthread_mutex_unlock(&lock);
-    }
-    else {
-        // This is a worker thread.
-        
-        int particleStart = (index*numParticles)/numThreads;
-        int particleEnd = ((index+1)*numParticles)/numThreads;
-        int gridxStart = (index*gridx)/numThreads;
-        int gridxEnd = ((index+1)*gridx)/numThreads;
-        int gridSize = (gridx*gridy*gridz+3)/4;
-        int gridStart = 4*((index*gridSize)/numThreads);
-        int gridEnd = 4*(((index+1)*gridSize)/numThreads);
-        while (true) {
-            threadWait();
-            if (isDeleted)
-                break;
-            spreadCharge(particleStart, particleEnd, posq, threadData[index]->tempGrid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors);
-            threadWait();
-            int numGrids = threadData.size();
-            for (int i = gridStart; i < gridEnd; i += 4) {
-                fvec4 sum(&realGrid[i]);
-                for (int j = 1; j < numGrids; j++)
-                    sum += fvec4(&threadData[j]->tempGrid[i]);
-                sum.store(&realGrid[i]);
-            }
-            threadWait();
-            if (lastBoxVectors[0] != periodicBoxVectors[0] || lastBoxVectors[1] != periodicBoxVectors[1] || lastBoxVectors[2] != periodicBoxVectors[2]) {
-                computeReciprocalEterm(gridxStart, gridxEnd, gridx, gridy, gridz, recipEterm, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors);
-                threadWait();
-            }
-            if (includeEnergy) {
-                double threadEnergy = reciprocalEnergy(gridxStart, gridxEnd, complexGrid, gridx, gridy, gridz, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors);
-                pthread_mutex_lock(&lock);
-                energy += threadEnergy;
-                pthread_mutex_unlock(&lock);
-                threadWait();
+        posq = io->getPosq();
+        bool boxChanged = (lastBoxVectors[0] != periodicBoxVectors[0] || lastBoxVectors[1] != periodicBoxVectors[1] || lastBoxVectors[2] != periodicBoxVectors[2]);
+        threads->execute(task); // Find which grid slab each particle belongs to.
+        threads->waitForThreads();
+        threads->resumeThreads(); // Perform charge spreading.
+        threads->waitForThreads();
+        threads->resumeThreads(); // Sum the charge grids.
+        threads->waitForThreads();
+        fftwf_execute_dft_r2c(forwardFFT, realGrid, complexGrid);
+        if (boxChanged) {
+            threads->resumeThreads(); // Compute the reciprocal scale factors.
+            threads->waitForThreads();
+        }
+        if (includeEnergy || includeVirial) {
+            threads->resumeThreads(); // Compute energy.
+            threads->waitForThreads();
+            for (int i = 0; i < numThreads; i++)
+                energy += threadEnergy[i];
+            if (includeVirial) {
+                double v[6] = {0, 0, 0, 0, 0, 0};
+                for (int i = 0; i < numThreads; i++)
+                    for (int j = 0; j < 6; j++)
+                        v[j] += threadVirial[6*i+j];
+                virial[0] = Vec3(v[0], v[3], v[4]);
+                virial[1] = Vec3(v[3], v[1], v[5]);
+                virial[2] = Vec3(v[4], v[5], v[2]);
             }
-            reciprocalConvolution(gridxStart, gridxEnd, complexGrid, gridx, gridy, gridz, recipEterm);
-            threadWait();
-            interpolateForces(particleStart, particleEnd, posq, &force[0], realGrid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors);
         }
+        threads->resumeThreads(); // Perform reciprocal convolution.
+        threads->waitForThreads();
+        fftwf_execute_dft_c2r(backwardFFT, complexGrid, realGrid);
+        threads->resumeThreads(); // Interpolate forces.
+        threads->waitForThreads();
+        lastBoxVectors[0] = periodicBoxVectors[0];
+        lastBoxVectors[1] = periodicBoxVectors[1];
+        lastBoxVectors[2] = periodicBoxVectors[2];
+        pthread_mutex_lock(&lock);
+        isFinished = true;
+        pthread_cond_signal(&endCondition);
     }
-}
-
-void CpuCalcPmeReciprocalForceKernel::threadWait() {
-    pthread_mutex_lock(&lock);
-    waitCount++;
-    pthread_cond_signal(&endCondition);
-    pthread_cond_wait(&startCondition, &lock);
     pthread_mutex_unlock(&lock);
 }
 
-void CpuCalcPmeReciprocalForceKernel::advanceThreads() {
-    waitCount = 0;
-    pthread_cond_broadcast(&startCondition);
-    while (waitCount < numThreads) {
-        pthread_cond_wait(&endCondition, &lock);
+void CpuCalcPmeReciprocalForceKernel::runWorkerThread(ThreadPool& threads, int index) {
+    int particleStart = (index*numParticles)/numThreads;
+    int particleEnd = ((index+1)*numParticles)/numThreads;
+    int gridxStart = (index*gridx)/numThreads;
+    int gridxEnd = ((index+1)*gridx)/numThreads;
+    int planeSize = gridy*gridz;
+    vector<int>& particles = threadParticles[index];
+    findGridIndexX(particleStart, particleEnd, posq, &particleGridIndexX[0], gridx, gridy, gridz, periodicBoxVectors, recipBoxVectors);
+    threads.syncThreads();
+    
+    // Spread the charges of all particles whose first grid plane is in this thread's slab.
+    
+    particles.clear();
+    for (int i = 0; i < numParticles; i++)
+        if (particleGridIndexX[i] >= gridxStart && particleGridIndexX[i] < gridxEnd)
+            particles.push_back(i);
+    spreadCharge(pmeOrder, particles, posq, threadGrid[index], gridxStart, gridxEnd-gridxStart+pmeOrder-1, gridx, gridy, gridz, periodicBoxVectors, recipBoxVectors);
+    threads.syncThreads();
+    
+    // Copy this thread's slab into the full grid, then add in the overlapping planes from other
+    // slabs.  Only those pmeOrder-1 planes at the end of each slab need to be combined.
+    
+    if (gridxEnd > gridxStart)
+        memcpy(&realGrid[gridxStart*planeSize], threadGrid[index], sizeof(float)*(gridxEnd-gridxStart)*planeSize);
+    for (int j = 0; j < numThreads; j++) {
+        int start = (j*gridx)/numThreads;
+        int end = ((j+1)*gridx)/numThreads;
+        if (start == end)
+            continue;
+        for (int k = 0; k < pmeOrder-1; k++) {
+            int plane = (end+k)%gridx;
+            if (plane < gridxStart || plane >= gridxEnd)
+                continue;
+            float* source = &threadGrid[j][(end-start+k)*planeSize];
+            float* dest = &realGrid[plane*planeSize];
+            int i;
+            for (i = 0; i+4 <= planeSize; i += 4)
+                (fvec4(&dest[i])+fvec4(&source[i])).store(&dest[i]);
+            for (; i < planeSize; i++)
+                dest[i] += source[i];
+        }
+    }
+    threads.syncThreads();
+    if (lastBoxVectors[0] != periodicBoxVectors[0] || lastBoxVectors[1] != periodicBoxVectors[1] || lastBoxVectors[2] != periodicBoxVectors[2]) {
+        computeReciprocalEterm(gridxStart, gridxEnd, gridx, gridy, gridz, recipEterm, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors);
+        threads.syncThreads();
+    }
+    if (includeEnergy || includeVirial) {
+        threadEnergy[index] = reciprocalEnergy(gridxStart, gridxEnd, complexGrid, gridx, gridy, gridz, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors,
+                includeVirial ? &threadVirial[6*index] : NULL);
+        threads.syncThreads();
     }
+    reciprocalConvolution(gridxStart, gridxEnd, complexGrid, gridx, gridy, gridz, recipEterm);
+    threads.syncThreads();
+    interpolateForces(pmeOrder, particleStart, particleEnd, posq, &force[0], realGrid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors);
 }
 
 void CpuCalcPmeReciprocalForceKernel::beginComputation(IO& io, const Vec3* periodicBoxVectors, bool includeEnergy) {
@@ -579,18 +765,27 @@ void CpuCalcPmeReciprocalForceKernel::beginComputation(IO& io, const Vec3* perio
 
     pthread_mutex_lock(&lock);
     isFinished = false;
-    pthread_cond_signal(&mainThreadStartCondition);
+    pthread_cond_signal(&startCondition);
     pthread_mutex_unlock(&lock);
 }
 
 double CpuCalcPmeReciprocalForceKernel::finishComputation(IO& io) {
     pthread_mutex_lock(&lock);
     while (!isFinished) {
-        pthread_cond_wait(&mainThreadEndCondition, &lock);
+        pthread_cond_wait(&endCondition, &lock);
     }
     pthread_mutex_unlock(&lock);
     io.setForce(&force[0]);
-    return energy;
+    return (includeEnergy ? energy : 0.0);
+}
+
+void CpuCalcPmeReciprocalForceKernel::setIncludeVirial(bool include) {
+    includeVirial = include;
+}
+
+void CpuCalcPmeReciprocalForceKernel::getVirial(Vec3* virial) {
+    for (int i = 0; i < 3; i++)
+        virial[i] = this->virial[i];
 }
 
 bool CpuCalcPmeReciprocalForceKernel::isProcessorSupported() {
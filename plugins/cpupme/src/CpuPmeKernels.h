@@ -36,6 +36,7 @@
 #include "internal/windowsExportPme.h"
 #include "openmm/kernels.h"
 #include "openmm/Vec3.h"
+#include "openmm/internal/ThreadPool.h"
 #include <fftw3.h>
 #include <pthread.h>
 #include <vector>
@@ -45,14 +46,38 @@ namespace OpenMM {
 /**
  * This is an optimized CPU implementation of CalcPmeReciprocalForceKernel.  It is both
  * vectorized (requiring SSE 4.1) and multithreaded.  It uses FFTW to perform the FFTs.
+ * 
+ * The calculation is performed on a ThreadPool, which can be shared with the caller by
+ * calling setThreadPool().  Otherwise the kernel creates its own.
+ * 
+ * Two environment variables affect how the FFTs are planned.  If OPENMM_CPU_PME_WISDOM is set
+ * to a directory, FFTW wisdom is cached there in a file for each combination of grid size and
+ * thread count, so later kernels with the same parameters can skip the slow planning step.  If
+ * OPENMM_CPU_PME_PATIENT is set, FFTW_PATIENT planning is used instead of FFTW_MEASURE.  That
+ * takes longer but may produce faster FFTs, which usually only pays off when combined with a
+ * wisdom cache.
  */
 
 class OPENMM_EXPORT_PME CpuCalcPmeReciprocalForceKernel : public CalcPmeReciprocalForceKernel {
 public:
-    class ThreadData;
+    class ComputeTask;
     CpuCalcPmeReciprocalForceKernel(std::string name, const Platform& platform) : CalcPmeReciprocalForceKernel(name, platform),
-            hasCreatedPlan(false), isDeleted(false), realGrid(NULL), complexGrid(NULL) {
+            pmeOrder(5), hasCreatedPlan(false), hasLoadedWisdom(false), hasCreatedThread(false), isDeleted(false), ownsThreads(false), realGrid(NULL), complexGrid(NULL), threads(NULL), includeVirial(false) {
     }
+    /**
+     * Specify the ThreadPool to perform the calculation on.  This must be called before initialize().
+     * The pool must not be used for anything else between beginComputation() and finishComputation().
+     * 
+     * @param threads   the ThreadPool to use
+     */
+    void setThreadPool(ThreadPool& threads);
+    /**
+     * Set the order of the B-splines used to interpolate charges onto the grid.  This must be called
+     * before initialize().  Orders from 4 to 8 are supported.  The default is 5.
+     * 
+     * @param order    the interpolation order
+     */
+    void setInterpolationOrder(int order);
     /**
      * Initialize the kernel.
      * 
@@ -80,51 +105,70 @@ public:
      */
     double finishComputation(IO& io);
     /**
-     * This routine contains the code executed by each thread.
+     * Set whether subsequent computations should also compute the virial tensor.
+     * 
+     * @param include    true if the virial should be computed
      */
-    void runThread(int index);
+    void setIncludeVirial(bool include);
     /**
-     * Get whether the current CPU supports all features needed by this kernel.
+     * Get the virial tensor from the most recent computation.
+     * 
+     * @param virial     on exit, this contains the three rows of the virial tensor
      */
-    static bool isProcessorSupported();
-private:
+    void getVirial(Vec3* virial);
     /**
-     * This is called by the worker threads to wait until the master thread instructs them to advance.
+     * Get whether the FFT plans were created with wisdom loaded from the OPENMM_CPU_PME_WISDOM cache.
      */
-    void threadWait();
+    bool getLoadedWisdom() const {
+        return hasLoadedWisdom;
+    }
+    /**
+     * This routine contains the code executed by the thread that coordinates the calculation.
+     */
+    void runMainThread();
+    /**
+     * This routine contains the code executed by each worker thread.
+     */
+    void runWorkerThread(ThreadPool& threads, int index);
     /**
-     * This is called by the master thread to instruct all the worker threads to advance.
+     * Get whether the current CPU supports all features needed by this kernel.
      */
-    void advanceThreads();
+    static bool isProcessorSupported();
+private:
     /**
      * Select a size for one grid dimension that FFTW can handle efficiently.
      */
     int findFFTDimension(int minimum, bool isZ);
+    /**
+     * Create the FFTW plans, loading and saving wisdom if a wisdom directory has been specified.
+     */
+    void createPlans();
     static bool hasInitializedThreads;
-    static int numThreads;
-    int gridx, gridy, gridz, numParticles;
+    static pthread_mutex_t planLock;
+    int numThreads, pmeOrder, gridx, gridy, gridz, numParticles;
     double alpha;
-    bool hasCreatedPlan, isFinished, isDeleted;
+    bool hasCreatedPlan, hasLoadedWisdom, hasCreatedThread, isFinished, isDeleted, ownsThreads;
     std::vector<float> force;
+    std::vector<int> particleGridIndexX;
     std::vector<float> bsplineModuli[3];
     std::vector<float> recipEterm;
+    std::vector<double> threadEnergy, threadVirial;
+    std::vector<float*> threadGrid;
+    std::vector<std::vector<int> > threadParticles;
     Vec3 lastBoxVectors[3];
     float* realGrid;
     fftwf_complex* complexGrid;
     fftwf_plan forwardFFT, backwardFFT;
-    int waitCount;
+    ThreadPool* threads;
     pthread_cond_t startCondition, endCondition;
-    pthread_cond_t mainThreadStartCondition, mainThreadEndCondition;
     pthread_mutex_t lock;
     pthread_t mainThread;
-    std::vector<pthread_t> thread;
-    std::vector<ThreadData*> threadData;
     // The following variables are used to store information about the calculation currently being performed.
     IO* io;
     float energy;
     float* posq;
-    Vec3 periodicBoxVectors[3], recipBoxVectors[3];
-    bool includeEnergy;
+    Vec3 periodicBoxVectors[3], recipBoxVectors[3], virial[3];
+    bool includeEnergy, includeVirial;
 };
 
 } // namespace OpenMM
@@ -41,8 +41,11 @@
 #include "openmm/VerletIntegrator.h"
 #include "openmm/internal/ContextImpl.h"
 #include "../src/CpuPmeKernels.h"
+#include "ReferencePME.h"
 #include "SimTKOpenMMRealType.h"
 #include "sfmt/SFMT.h"
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <vector>
 
@@ -61,7 +64,7 @@ public:
     }
 };
 
-void testPME(bool triclinic) {
+void testPME(bool triclinic, ThreadPool* threads, int order, double errorTolerance) {
     // Create a cloud of random point charges.
 
     const int numParticles = 51;
@@ -94,7 +97,7 @@ void testPME(bool triclinic) {
     force->setNonbondedMethod(NonbondedForce::PME);
     force->setCutoffDistance(cutoff);
     force->setReciprocalSpaceForceGroup(1);
-    force->setEwaldErrorTolerance(1e-4);
+    force->setEwaldErrorTolerance(errorTolerance);
     
     // Compute the reciprocal space forces with the reference platform.
     
@@ -108,8 +111,11 @@ void testPME(bool triclinic) {
     
     double alpha;
     int gridx, gridy, gridz;
-    NonbondedForceImpl::calcPMEParameters(system, *force, alpha, gridx, gridy, gridz);
+    NonbondedForceImpl::calcPMEParameters(system, *force, alpha, gridx, gridy, gridz, order);
     CpuCalcPmeReciprocalForceKernel pme(CalcPmeReciprocalForceKernel::Name(), platform);
+    if (threads != NULL)
+        pme.setThreadPool(*threads);
+    pme.setInterpolationOrder(order);
     IO io;
     double sumSquaredCharges = 0;
     for (int i = 0; i < numParticles; i++) {
@@ -133,14 +139,164 @@ void testPME(bool triclinic) {
         ASSERT_EQUAL_VEC(refState.getForces()[i], Vec3(io.force[4*i], io.force[4*i+1], io.force[4*i+2]), 1e-3);
 }
 
+void testGridSizeEqualsOrder(int order) {
+    // Use the smallest grid allowed for the interpolation order, so the b-splines wrap all the way around
+    // the grid.  Check that the forces are consistent with the energy by comparing them to finite differences.
+
+    const int numParticles = 20;
+    const double boxWidth = 2.0;
+    const double alpha = 2.0;
+    Vec3 boxVectors[3] = {Vec3(boxWidth, 0, 0), Vec3(0, boxWidth, 0), Vec3(0, 0, boxWidth)};
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    IO io;
+    for (int i = 0; i < numParticles; i++) {
+        for (int j = 0; j < 3; j++)
+            io.posq.push_back(boxWidth*genrand_real2(sfmt));
+        io.posq.push_back(i%2 == 0 ? 1.0f : -1.0f);
+    }
+    Platform& platform = Platform::getPlatformByName("Reference");
+    CpuCalcPmeReciprocalForceKernel pme(CalcPmeReciprocalForceKernel::Name(), platform);
+    pme.setInterpolationOrder(order);
+    pme.initialize(order, order, order, numParticles, alpha);
+    pme.beginComputation(io, boxVectors, true);
+    pme.finishComputation(io);
+    vector<float> forces(io.force, io.force+4*numParticles);
+    const float delta = 1e-2f;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            float pos = io.posq[4*i+j];
+            io.posq[4*i+j] = pos+delta;
+            pme.beginComputation(io, boxVectors, true);
+            double energy1 = pme.finishComputation(io);
+            io.posq[4*i+j] = pos-delta;
+            pme.beginComputation(io, boxVectors, true);
+            double energy2 = pme.finishComputation(io);
+            io.posq[4*i+j] = pos;
+            ASSERT_EQUAL_TOL(forces[4*i+j], -(energy1-energy2)/(2*delta), 1e-2);
+        }
+    }
+}
+
+static void setWisdomDirectory(const char* dir) {
+#ifdef WIN32
+    _putenv_s("OPENMM_CPU_PME_WISDOM", dir);
+#else
+    setenv("OPENMM_CPU_PME_WISDOM", dir, 1);
+#endif
+}
+
+void testWisdomCache() {
+    // Create a set of random charges.
+
+    const int numParticles = 100;
+    const int gridSize = 24;
+    const double boxWidth = 3.0;
+    Vec3 boxVectors[3] = {Vec3(boxWidth, 0, 0), Vec3(0, boxWidth, 0), Vec3(0, 0, boxWidth)};
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    IO io;
+    for (int i = 0; i < numParticles; i++) {
+        io.posq.push_back(boxWidth*genrand_real2(sfmt));
+        io.posq.push_back(boxWidth*genrand_real2(sfmt));
+        io.posq.push_back(boxWidth*genrand_real2(sfmt));
+        io.posq.push_back(i%2 == 0 ? 1.0 : -1.0);
+    }
+
+    // The first kernel should write a wisdom file, and the second one should read it.  Both should then use
+    // the same plans, so the results should be identical.
+
+    const char* filename = "./pme-wisdom-24x24x24-2.fftw";
+    remove(filename);
+    setWisdomDirectory(".");
+    ThreadPool threads(2);
+    Platform& platform = Platform::getPlatformByName("Reference");
+    vector<float> forces;
+    double energy;
+    for (int i = 0; i < 2; i++) {
+        CpuCalcPmeReciprocalForceKernel pme(CalcPmeReciprocalForceKernel::Name(), platform);
+        pme.setThreadPool(threads);
+        pme.initialize(gridSize, gridSize, gridSize, numParticles, 3.0);
+        FILE* file = fopen(filename, "r");
+        ASSERT(file != NULL);
+        fclose(file);
+        ASSERT_EQUAL(i == 1, pme.getLoadedWisdom());
+        pme.beginComputation(io, boxVectors, true);
+        double e = pme.finishComputation(io);
+        if (i == 0) {
+            forces = vector<float>(io.force, io.force+4*numParticles);
+            energy = e;
+        }
+        else {
+            ASSERT_EQUAL(energy, e);
+            for (int j = 0; j < 4*numParticles; j++)
+                ASSERT_EQUAL(forces[j], io.force[j]);
+        }
+    }
+    setWisdomDirectory("");
+    remove(filename);
+}
+
+void testVirial() {
+    // Compare the virial to the one computed by the reference implementation of PME.
+
+    const int numParticles = 50;
+    const int gridSize[3] = {20, 21, 22};
+    const double boxWidth = 3.0;
+    const double alpha = 3.0;
+    Vec3 boxVectors[3] = {Vec3(boxWidth, 0, 0), Vec3(0.2*boxWidth, boxWidth, 0), Vec3(-0.3*boxWidth, -0.1*boxWidth, boxWidth)};
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    IO io;
+    vector<RealVec> positions(numParticles);
+    vector<RealOpenMM> charges(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        positions[i] = RealVec(boxWidth*genrand_real2(sfmt), boxWidth*genrand_real2(sfmt), boxWidth*genrand_real2(sfmt));
+        charges[i] = (i%2 == 0 ? 1.0 : -1.0);
+        io.posq.push_back(positions[i][0]);
+        io.posq.push_back(positions[i][1]);
+        io.posq.push_back(positions[i][2]);
+        io.posq.push_back(charges[i]);
+    }
+    pme_t pmedata;
+    pme_init(&pmedata, alpha, numParticles, gridSize, 5, 1);
+    vector<RealVec> refForces(numParticles, RealVec());
+    RealVec refBoxVectors[3] = {boxVectors[0], boxVectors[1], boxVectors[2]};
+    RealOpenMM refEnergy, refVirial[3][3];
+    pme_exec(pmedata, positions, refForces, charges, refBoxVectors, &refEnergy, refVirial);
+    pme_destroy(pmedata);
+    Platform& platform = Platform::getPlatformByName("Reference");
+    CpuCalcPmeReciprocalForceKernel pme(CalcPmeReciprocalForceKernel::Name(), platform);
+    pme.initialize(gridSize[0], gridSize[1], gridSize[2], numParticles, alpha);
+    pme.setIncludeVirial(true);
+    pme.beginComputation(io, boxVectors, false);
+    pme.finishComputation(io);
+    Vec3 virial[3];
+    pme.getVirial(virial);
+    for (int i = 0; i < 3; i++)
+        ASSERT_EQUAL_VEC(Vec3(refVirial[i][0], refVirial[i][1], refVirial[i][2]), virial[i], 1e-4);
+}
+
 int main(int argc, char* argv[]) {
     try {
         if (!CpuCalcPmeReciprocalForceKernel::isProcessorSupported()) {
             cout << "CPU is not supported.  Exiting." << endl;
             return 0;
         }
-        testPME(false);
-        testPME(true);
+        testPME(false, NULL, 5, 1e-4);
+        testPME(true, NULL, 5, 1e-4);
+        ThreadPool threads(3);
+        testPME(true, &threads, 5, 1e-4);
+        
+        // The reference implementation always uses order 5, so use a tighter tolerance when comparing
+        // other orders to it.
+        
+        for (int order = 4; order <= 8; order++)
+            testPME(true, NULL, order, 1e-5);
+        for (int order = 4; order <= 8; order++)
+            testGridSizeEqualsOrder(order);
+        testWisdomCache();
+        testVirial();
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;
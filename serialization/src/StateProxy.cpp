@@ -65,6 +65,13 @@ void StateProxy::serialize(const void* object, SerializationNode& node) const {
         energiesNode.setDoubleProperty("PotentialEnergy", s.getPotentialEnergy());
         energiesNode.setDoubleProperty("KineticEnergy", s.getKineticEnergy());
     }
+    if ((s.getDataTypes()&State::Virial) != 0) {
+        s.getVirial(a, b, c);
+        SerializationNode& virialNode = node.createChildNode("Virial");
+        virialNode.createChildNode("X").setDoubleProperty("x", a[0]).setDoubleProperty("y", a[1]).setDoubleProperty("z", a[2]);
+        virialNode.createChildNode("Y").setDoubleProperty("x", b[0]).setDoubleProperty("y", b[1]).setDoubleProperty("z", b[2]);
+        virialNode.createChildNode("Z").setDoubleProperty("x", c[0]).setDoubleProperty("y", c[1]).setDoubleProperty("z", c[2]);
+    }
     if ((s.getDataTypes()&State::Positions) != 0) {
         s.getPositions();
         SerializationNode& positionsNode = node.createChildNode("Positions");
@@ -123,6 +130,14 @@ void* StateProxy::deserialize(const SerializationNode& node) const {
             double kineticEnergy = child.getDoubleProperty("KineticEnergy");
             builder.setEnergy(kineticEnergy, potentialEnergy);
         }
+        else if (child.getName() == "Virial") {
+            const SerializationNode& x = child.getChildNode("X");
+            const SerializationNode& y = child.getChildNode("Y");
+            const SerializationNode& z = child.getChildNode("Z");
+            builder.setVirial(Vec3(x.getDoubleProperty("x"), x.getDoubleProperty("y"), x.getDoubleProperty("z")),
+                              Vec3(y.getDoubleProperty("x"), y.getDoubleProperty("y"), y.getDoubleProperty("z")),
+                              Vec3(z.getDoubleProperty("x"), z.getDoubleProperty("y"), z.getDoubleProperty("z")));
+        }
         else if (child.getName() == "Positions") {
             vector<Vec3> outPositions;
             for (int i = 0; i < (int) child.getChildren().size(); i++) {